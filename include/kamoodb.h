@@ -17,7 +17,56 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/file.h>
 
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#define KAMOODB_HAS_URING 1
+#endif
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/fs.h>)
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#define KAMOODB_HAS_FS_COPY 1
+#endif
+#endif
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#define KAMOODB_HAS_AFFINITY 1
+#endif
+
+#if defined(KAMOODB_WITH_ZLIB)
+#include <zlib.h>
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define KAMOODB_HAS_SSE42_CRC 1
+#endif
+
+
+// Heap hooks, define them before including this header to route or count
+// the allocations of the library. Values handed back to the caller are
+// released with free, so a replacement has to stay compatible with it.
+#ifndef KAMOODB_MALLOC
+#define KAMOODB_MALLOC(size) malloc(size)
+#endif
+#ifndef KAMOODB_CALLOC
+#define KAMOODB_CALLOC(n, size) calloc(n, size)
+#endif
+#ifndef KAMOODB_REALLOC
+#define KAMOODB_REALLOC(ptr, size) realloc(ptr, size)
+#endif
+#ifndef KAMOODB_FREE
+#define KAMOODB_FREE(ptr) free(ptr)
+#endif
 
 static int file_exists(const char* path) {
 	struct stat buffer;
@@ -34,9 +83,11 @@ static ssize_t file_size(const char* path) {
 
 static void create_init_file(const char* path, size_t size) {
 	int fd = open(path, O_RDWR | O_CREAT, (mode_t)0600);
-	lseek(fd, size-1, SEEK_SET);
-	write(fd, "", 1);
-	lseek(fd, 0, SEEK_SET);
+	if (posix_fallocate(fd, 0, size) != 0) {
+		lseek(fd, size-1, SEEK_SET);
+		write(fd, "", 1);
+		lseek(fd, 0, SEEK_SET);
+	}
 	close(fd);
 } 
 
@@ -63,9 +114,212 @@ int hash_djb2_n(const char *str, size_t n, size_t* hash) {
 	return c == 0; 
 }
 
+// crc32c (castagnoli), with the sse4.2 instruction when the cpu has it
+static uint32_t CRC32C_TABLE[256];
+static pthread_once_t CRC32C_TABLE_ONCE = PTHREAD_ONCE_INIT;
+
+static void crc32c_init_table(void) {
+	for (uint32_t i = 0; i < 256; ++i) {
+		uint32_t crc = i;
+		for (int j = 0; j < 8; ++j) {
+			crc = (crc >> 1) ^ (0x82F63B78U & (0U - (crc & 1)));
+		}
+		CRC32C_TABLE[i] = crc;
+	}
+}
+
+uint32_t crc32c_sw(uint32_t crc, const void* data, size_t size) {
+	const unsigned char* reader = data;
+	// shards are opened from several threads at once
+	pthread_once(&CRC32C_TABLE_ONCE, crc32c_init_table);
+	crc = ~crc;
+	while (size--) {
+		crc = CRC32C_TABLE[(crc ^ *reader++) & 0xff] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+#if defined(KAMOODB_HAS_SSE42_CRC)
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hw(uint32_t crc, const void* data, size_t size) {
+	const unsigned char* reader = data;
+	uint64_t crc64 = ~crc;
+	while (size >= sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, reader, sizeof(word));
+		crc64 = _mm_crc32_u64(crc64, word);
+		reader += sizeof(word);
+		size -= sizeof(word);
+	}
+	uint32_t crc32 = crc64;
+	while (size--) {
+		crc32 = _mm_crc32_u8(crc32, *reader++);
+	}
+	return ~crc32;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t size) {
+#if defined(KAMOODB_HAS_SSE42_CRC)
+	if (__builtin_cpu_supports("sse4.2")) {
+		return crc32c_hw(crc, data, size);
+	}
+#endif
+	return crc32c_sw(crc, data, size);
+}
+
+// ------- stats -------
+// Counters and latency histograms kept by each database. A database is only
+// ever used by one thread at a time, so they are plain increments with no
+// atomics. Define KAMOODB_NO_STATS to compile all of it out.
+
+// Histograms are log linear like HdrHistogram, each power of two is split in
+// 2^DBHIST_SUB_BITS buckets, so a recorded value is off by at most 1/32.
+#define DBHIST_SUB_BITS 5
+#define DBHIST_SUB_COUNT (1 << DBHIST_SUB_BITS)
+// covers up to 2^36 ns, about a minute, larger values land in the last bucket
+#define DBHIST_MAX_BITS 36
+#define DBHIST_BUCKETS ((DBHIST_MAX_BITS - DBHIST_SUB_BITS + 1) * DBHIST_SUB_COUNT)
+
+struct dbhist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[DBHIST_BUCKETS];
+};
+
+size_t dbhist_index(uint64_t val) {
+	if (val < DBHIST_SUB_COUNT) {
+		return val;
+	}
+	size_t msb = 63 - __builtin_clzll(val);
+	if (msb >= DBHIST_MAX_BITS) {
+		return DBHIST_BUCKETS - 1;
+	}
+	size_t shift = msb - DBHIST_SUB_BITS;
+	return ((shift + 1) * DBHIST_SUB_COUNT) + ((val >> shift) - DBHIST_SUB_COUNT);
+}
+
+// Smallest value that lands in bucket index
+uint64_t dbhist_bucket_low(size_t index) {
+	if (index < DBHIST_SUB_COUNT) {
+		return index;
+	}
+	size_t shift = (index / DBHIST_SUB_COUNT) - 1;
+	return (uint64_t)((index % DBHIST_SUB_COUNT) + DBHIST_SUB_COUNT) << shift;
+}
+
+void dbhist_record(struct dbhist* hist, uint64_t val) {
+	++hist->buckets[dbhist_index(val)];
+	++hist->count;
+	hist->sum += val;
+	hist->max = val > hist->max ? val : hist->max;
+}
+
+// Value at or below which the fraction p of recorded values fall
+uint64_t dbhist_percentile(const struct dbhist* hist, double p) {
+	uint64_t want = (uint64_t)(p * (double)hist->count + 0.5);
+	uint64_t seen = 0;
+	want = want > 0 ? want : 1;
+	for (size_t i = 0; i < DBHIST_BUCKETS; ++i) {
+		seen += hist->buckets[i];
+		if (seen >= want) {
+			uint64_t high = i + 1 < DBHIST_BUCKETS ? dbhist_bucket_low(i + 1) - 1 : hist->max;
+			return high < hist->max ? high : hist->max;
+		}
+	}
+	return hist->max;
+}
+
+void dbhist_merge(struct dbhist* into, const struct dbhist* from) {
+	for (size_t i = 0; i < DBHIST_BUCKETS; ++i) {
+		into->buckets[i] += from->buckets[i];
+	}
+	into->count += from->count;
+	into->sum += from->sum;
+	into->max = from->max > into->max ? from->max : into->max;
+}
+
+#if defined(KAMOODB_NO_STATS)
+#define DBSTAT_ADD(stats, field, n) ((void)0)
+#define DBSTAT_TIME(stats, hist, start) ((void)(start))
+#else
+#define DBSTAT_ADD(stats, field, n) ((stats).field += (n))
+#define DBSTAT_TIME(stats, hist, start) dbhist_record(&(stats).hist, dbstat_now() - (start))
+#endif
+
+#if !defined(KAMOODB_NO_STATS)
+static uint64_t dbstat_clock_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000) + (uint64_t)ts.tv_nsec;
+}
+#endif
+
+#if defined(__x86_64__) && !defined(KAMOODB_NO_STATS)
+// The tsc reads in about half the time of clock_gettime, its rate is
+// measured against the monotonic clock once per process.
+static double DBSTAT_NS_PER_TICK = 0.0;
+static pthread_once_t DBSTAT_CALIBRATE_ONCE = PTHREAD_ONCE_INIT;
+
+static void dbstat_calibrate(void) {
+	uint64_t ns_start = dbstat_clock_ns();
+	uint64_t tsc_start = __builtin_ia32_rdtsc();
+	uint64_t ns_end = ns_start;
+	while (ns_end - ns_start < 1000000) {
+		ns_end = dbstat_clock_ns();
+	}
+	DBSTAT_NS_PER_TICK = (double)(ns_end - ns_start) / (double)(__builtin_ia32_rdtsc() - tsc_start);
+}
+#endif
+
+static uint64_t dbstat_now(void) {
+#if defined(KAMOODB_NO_STATS)
+	return 0;
+#elif defined(__x86_64__)
+	pthread_once(&DBSTAT_CALIBRATE_ONCE, dbstat_calibrate);
+	return (uint64_t)((double)__builtin_ia32_rdtsc() * DBSTAT_NS_PER_TICK);
+#else
+	return dbstat_clock_ns();
+#endif
+}
+
+// kept by the file layer
+struct dbfile_stats {
+	// regions of a file store mapped, pages of an in memory store
+	uint64_t page_faults;
+	uint64_t grows;
+	uint64_t grow_pages;
+	// regions dropped to stay within the map budget
+	uint64_t region_drops;
+};
+
+struct dbstats {
+	struct dbfile_stats file;
+	uint64_t probes;
+	uint64_t key_compares;
+	uint64_t free_list_scans;
+	uint64_t expands;
+	uint64_t shrinks;
+	uint64_t cow_copies;
+	// overwrites that reused the extent of the old record
+	uint64_t in_place;
+	// expired records reclaimed by database_sweep
+	uint64_t swept;
+	// records dropped to keep the file under its capacity
+	uint64_t evictions;
+	// lookups the Bloom filter answered without probing the index
+	uint64_t bloom_skips;
+	// latencies in nanoseconds
+	struct dbhist put;
+	struct dbhist get;
+	struct dbhist del;
+	struct dbhist expand;
+};
+
 static char* str_dupl(const char* src) {
 	size_t src_size = strlen(src) + 1;
-	char* newstr = malloc(src_size);
+	char* newstr = KAMOODB_MALLOC(src_size);
 	memcpy(newstr, src, src_size);
 	return newstr;
 }
@@ -81,13 +335,13 @@ static const size_t PAGE_VEC_DEF_CAPAC = 50;
 void page_vec_init(struct page_vec* pvec) {
 	pvec->len = 0;
 	pvec->cap = PAGE_VEC_DEF_CAPAC;
-	pvec->pages = calloc(1, sizeof(int32_t) * pvec->cap);
+	pvec->pages = KAMOODB_CALLOC(1, sizeof(int32_t) * pvec->cap);
 }
 
 void page_vec_push(struct page_vec* pvec, int32_t page_n) {
 	if (pvec->len == pvec->cap) {
 		pvec->cap *= 2;
-		pvec->pages = realloc(pvec->pages, sizeof(int32_t) * pvec->cap);
+		pvec->pages = KAMOODB_REALLOC(pvec->pages, sizeof(int32_t) * pvec->cap);
 	}
 	pvec->pages[pvec->len++] = page_n;
 }
@@ -100,7 +354,7 @@ void page_vec_clear(struct page_vec* pvec) {
 void page_vec_deinit(struct page_vec* pvec) {
 	pvec->len = 0;
 	pvec->cap = PAGE_VEC_DEF_CAPAC;
-	free(pvec->pages);
+	KAMOODB_FREE(pvec->pages);
 	pvec->pages = NULL;
 }
 
@@ -110,10 +364,111 @@ void page_vec_move(struct page_vec* dst, struct page_vec* src) {
 	dst->cap = src->cap;
 }
 
+void page_vec_copy(struct page_vec* dst, const struct page_vec* src) {
+	dst->len = src->len;
+	dst->cap = src->cap;
+	dst->pages = KAMOODB_MALLOC(sizeof(int32_t) * src->cap);
+	memcpy(dst->pages, src->pages, sizeof(int32_t) * src->len);
+}
+
 enum dbstore_type {
-	DBSTORE_MEM_MAP
+	DBSTORE_MEM_MAP,
 	//DBSTORE_FILE, todo, in future
-	//DBSTORE_IN_MEM todo, in future
+	DBSTORE_IN_MEM
+};
+
+enum dbcodec_type {
+	DBCODEC_NONE,
+	DBCODEC_LZ,
+	DBCODEC_DEFLATE
+};
+
+// Backing memory for in memory stores. Pages are carved out of anonymous
+// chunks that are never moved, so page pointers stay valid as the store grows.
+struct dbarena_chunk {
+	struct dbarena_chunk* next;
+	size_t size;
+	char* base;
+};
+
+struct dbarena {
+	struct dbarena_chunk* chunks;
+	char* cur;
+	size_t left;
+	size_t next_size;
+};
+
+static const size_t DBARENA_HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+static const size_t DBARENA_MAX_CHUNK_SIZE = 64 * 1024 * 1024;
+
+void dbarena_init(struct dbarena* arena) {
+	arena->chunks = NULL;
+	arena->cur = NULL;
+	arena->left = 0;
+	arena->next_size = DBARENA_HUGE_PAGE_SIZE;
+}
+
+static char* dbarena_map_chunk(size_t size) {
+	char* base = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	base = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+	if (base == MAP_FAILED) {
+		base = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (base == MAP_FAILED) {
+			return NULL;
+		}
+#ifdef MADV_HUGEPAGE
+		madvise(base, size, MADV_HUGEPAGE);
+#endif
+	}
+	return base;
+}
+
+// Hands out n bytes of zeroed memory, n must be a multiple of the page size
+char* dbarena_alloc(struct dbarena* arena, size_t n) {
+	if (arena->left < n) {
+		size_t size = arena->next_size;
+		while (size < n) {
+			size += DBARENA_HUGE_PAGE_SIZE;
+		}
+		char* base = dbarena_map_chunk(size);
+		if (base == NULL) {
+			return NULL;
+		}
+		struct dbarena_chunk* chunk = KAMOODB_MALLOC(sizeof(struct dbarena_chunk));
+		chunk->next = arena->chunks;
+		chunk->size = size;
+		chunk->base = base;
+		arena->chunks = chunk;
+		arena->cur = base;
+		arena->left = size;
+		if (arena->next_size < DBARENA_MAX_CHUNK_SIZE) {
+			arena->next_size *= 2;
+		}
+	}
+	char* got = arena->cur;
+	arena->cur += n;
+	arena->left -= n;
+	return got;
+}
+
+void dbarena_deinit(struct dbarena* arena) {
+	struct dbarena_chunk* iter = arena->chunks;
+	while (iter != NULL) {
+		struct dbarena_chunk* next = iter->next;
+		munmap(iter->base, iter->size);
+		KAMOODB_FREE(iter);
+		iter = next;
+	}
+	dbarena_init(arena);
+}
+
+// a run of pages mapped on its own by dbfile_map_run
+struct dbfile_run {
+	struct dbfile_run* next;
+	char* base;
+	size_t size;
 };
 
 struct dbfile {
@@ -121,20 +476,118 @@ struct dbfile {
 	char* filepath;
 	size_t file_size;
 	size_t page_count;
+	// in memory stores keep a pointer per page
 	size_t page_cap;
 	char** pages;
+	// file stores are mapped lazily a region of 1 << region_shift pages
+	// at a time, so a huge file costs one pointer per region
+	char** regions;
+	unsigned char* region_state;
+	size_t region_cap;
+	size_t region_shift;
+	// regions counted against map_budget, and the clock hand over them
+	size_t resident;
+	size_t region_hand;
+	size_t map_budget;
+	struct dbfile_run* runs;
 	int fd;
+	enum dbstore_type ftype;
+	struct dbarena arena;
+	// bytes reserved on disk, the pages past file_size are the unused tail
+	size_t alloc_size;
+	size_t grow_chunk;
+	size_t grow_percent;
+	// where page 0 records the used page count, 0 if it is not tracked
+	size_t page_count_off;
+	// pages written since the last checkpoint, one bit each
+	uint64_t* touched;
+	size_t touched_len;
+	struct dbfile_stats stats;
+};
+
+// upper bound on the size of a mapped region
+static const size_t DBFILE_REGION_SIZE = 32 * 1024 * 1024;
+// regions are never dropped below this many
+static const size_t DBFILE_MIN_RESIDENT = 4;
+
+enum dbfile_region_state {
+	DBFILE_REGION_RESIDENT = 1,
+	DBFILE_REGION_REF = 2
 };
 
+// Files grow by at least this much, or by grow_percent of their size if larger
+static const size_t DBFILE_DEF_GROW_CHUNK = 1024 * 1024;
+static const size_t DBFILE_DEF_GROW_PERCENT = 10;
+// largest inline payload a hash slot can be configured with
+static const size_t SLOT_INLINE_MAX = 256;
+
 struct dbcfg {
 	size_t page_size;
 	enum dbstore_type ftype;
+	size_t grow_chunk;
+	size_t grow_percent;
+	// sizing hints for new databases, 0 if unknown
+	size_t expected_items;
+	size_t avg_record_size;
+	// key plus value bytes that can be stored in the hash slot itself, 0 to disable
+	size_t inline_size;
+	// keep a sorted index over the keys for range and prefix scans
+	int ordered_index;
+	// compression for values that go to storage
+	enum dbcodec_type codec;
+	// index sizing, 0 for the defaults of 0.5, 2.0 and no shrinking
+	// the index grows by growth once item_count / slots goes over max_load,
+	// and shrinks back when it drops under min_load
+	double max_load;
+	double growth;
+	double min_load;
+	// bytes of the file kept mapped in, 0 for no limit. Cold regions past
+	// the budget are dropped and fault back in from the page cache.
+	size_t map_budget;
+	// sync the transaction log on every commit, otherwise a commit is
+	// atomic but only durable once the next checkpoint is done
+	int txn_sync;
+	// give every hash slot an expiry time for database_put_ttl, fixed when
+	// the file is created
+	int expiry;
+	// bytes the file may take before puts evict cold records to reuse
+	// their storage, 0 for no limit. Growing the index is not bounded, so
+	// the index has to fit well within it.
+	size_t capacity;
+	// bits per key of a Bloom filter checked before the index is probed,
+	// 0 for none. Fixed when the file is created.
+	size_t bloom_bits;
 };
 
+static const double DB_DEF_MAX_LOAD = 0.5;
+static const double DB_DEF_GROWTH = 2.0;
+
+// A shrink has to leave the index under max_load, and the index right after
+// an expansion has to be over min_load, or the two would undo each other
+int dbload_validate(double max_load, double growth, double min_load) {
+	// the load can not go over 1, so a limit of 1 would never be reached
+	if (!(max_load > 0.0 && max_load < 1.0) || !(growth > 1.0 && growth <= 16.0)) {
+		return 0;
+	}
+	return min_load >= 0.0 && min_load < max_load / growth;
+}
+
 int dbcfg_validate(const struct dbcfg* cfg) {
 	if (cfg == NULL) {
 		return 1;
 	}
+	if (cfg->inline_size > SLOT_INLINE_MAX || cfg->bloom_bits > 64) {
+		return 0;
+	}
+	if (!dbload_validate(cfg->max_load > 0.0 ? cfg->max_load : DB_DEF_MAX_LOAD,
+	                     cfg->growth > 0.0 ? cfg->growth : DB_DEF_GROWTH, cfg->min_load)) {
+		return 0;
+	}
+#if !defined(KAMOODB_WITH_ZLIB)
+	if (cfg->codec == DBCODEC_DEFLATE) {
+		return 0;
+	}
+#endif
 	if (cfg->ftype == DBSTORE_MEM_MAP) {
 		// If using mmap, the offsets must be a multiple of the os page size
 		if (cfg->page_size > 0 && cfg->page_size % get_page_size() != 0) {
@@ -144,11 +597,36 @@ int dbcfg_validate(const struct dbcfg* cfg) {
 	return 1;
 }
 
+static int dbfile_load_in_mem(struct dbfile* dbf, const char* path);
+char* dbfile_get_page(struct dbfile* dbf, size_t n);
+
 int dbfile_open(struct dbfile* dbf, const char* path, struct dbcfg* cfg) {
 	if(!dbcfg_validate(cfg)) {
 		return 0;
 	}
-	dbf->page_size = cfg != NULL ? cfg->page_size : get_page_size();
+	dbf->page_size = cfg != NULL && cfg->page_size > 0 ? cfg->page_size : get_page_size();
+	dbf->ftype = cfg != NULL ? cfg->ftype : DBSTORE_MEM_MAP;
+	dbf->grow_chunk = cfg != NULL && cfg->grow_chunk > 0 ? cfg->grow_chunk : DBFILE_DEF_GROW_CHUNK;
+	dbf->grow_percent = cfg != NULL && cfg->grow_percent > 0 ? cfg->grow_percent : DBFILE_DEF_GROW_PERCENT;
+	dbf->page_count_off = 0;
+	dbf->touched = NULL;
+	dbf->touched_len = 0;
+	dbf->regions = NULL;
+	dbf->region_state = NULL;
+	dbf->region_cap = 0;
+	dbf->region_shift = 0;
+	while ((dbf->page_size << (dbf->region_shift + 1)) <= DBFILE_REGION_SIZE) {
+		++dbf->region_shift;
+	}
+	dbf->resident = 0;
+	dbf->region_hand = 0;
+	dbf->map_budget = cfg != NULL ? cfg->map_budget : 0;
+	dbf->runs = NULL;
+	memset(&dbf->stats, 0, sizeof(dbf->stats));
+	dbarena_init(&dbf->arena);
+	if (dbf->ftype == DBSTORE_IN_MEM) {
+		return dbfile_load_in_mem(dbf, path);
+	}
 	if (!file_exists(path)) {
 		create_init_file(path, dbf->page_size * 1); //todo
 	}
@@ -158,55 +636,312 @@ int dbfile_open(struct dbfile* dbf, const char* path, struct dbcfg* cfg) {
 		return 0;
 	}
 	dbf->filepath = str_dupl(path);
-	dbf->page_cap = 10;
+	dbf->page_cap = 0;
+	dbf->pages = NULL;
 	dbf->file_size = dbsize;
+	dbf->alloc_size = dbsize;
 	dbf->page_count = dbf->file_size / dbf->page_size;
-	dbf->page_cap += dbf->page_count;
 	dbf->fd = fd;
-	dbf->pages = calloc(1, sizeof(char*) * dbf->page_cap);
-	for (size_t i = 0; i < dbf->page_count; ++i){
-		char* pagemap = mmap(0, dbf->page_size, PROT_READ | PROT_WRITE, MAP_SHARED, dbf->fd, i * dbf->page_size);
-		dbf->pages[i] = pagemap;
+	// nothing is mapped until it is used
+	return 1;
+}
+
+// Makes sure at least min_size bytes are allocated on disk, reserving a whole
+// growth chunk at once. Running out of space fails here instead of as a
+// SIGBUS on a mapped page later on.
+int dbfile_reserve(struct dbfile* dbf, size_t min_size) {
+	if (min_size <= dbf->alloc_size) {
+		return 1;
+	}
+	size_t chunk = dbf->grow_chunk;
+	size_t pct_chunk = (dbf->alloc_size / 100) * dbf->grow_percent;
+	if (pct_chunk > chunk) {
+		chunk = pct_chunk;
+	}
+	size_t target = dbf->alloc_size + chunk;
+	if (target < min_size) {
+		target = min_size;
+	}
+	target = ((target + dbf->page_size - 1) / dbf->page_size) * dbf->page_size;
+	int err = posix_fallocate(dbf->fd, dbf->alloc_size, target - dbf->alloc_size);
+	if (err == ENOSPC && target > min_size) {
+		// the whole chunk does not fit, settle for what is needed right now
+		target = min_size;
+		err = posix_fallocate(dbf->fd, dbf->alloc_size, target - dbf->alloc_size);
+	}
+	if (err != 0) {
+		errno = err;
+		return 0;
+	}
+	dbf->alloc_size = target;
+	return 1;
+}
+
+size_t dbfile_unused_pages(struct dbfile* dbf) {
+	return (dbf->alloc_size - dbf->file_size) / dbf->page_size;
+}
+
+static void dbfile_record_page_count(struct dbfile* dbf) {
+	if (dbf->page_count_off > 0) {
+		*(int64_t*)(dbfile_get_page(dbf, 0) + dbf->page_count_off) = dbf->page_count;
+	}
+}
+
+// Starts tracking the used page count in page 0. A count already recorded
+// there wins over the file size, the rest of the file is preallocated tail.
+void dbfile_track_page_count(struct dbfile* dbf, size_t off) {
+	dbf->page_count_off = off;
+	int64_t recorded = *(int64_t*)(dbfile_get_page(dbf, 0) + off);
+	if (recorded > 0 && (size_t)recorded <= dbf->page_count) {
+		dbf->page_count = recorded;
+		dbf->file_size = recorded * dbf->page_size;
+	}
+	dbfile_record_page_count(dbf);
+}
+
+// Gives the preallocated tail back to the file system
+int dbfile_trim(struct dbfile* dbf) {
+	if (dbf->ftype == DBSTORE_IN_MEM || dbf->alloc_size == dbf->file_size) {
+		return 1;
+	}
+	if (ftruncate(dbf->fd, dbf->file_size) != 0) {
+		return 0;
 	}
+	dbf->alloc_size = dbf->file_size;
 	return 1;
 }
 
+void dbfile_touch_run(struct dbfile* dbf, size_t first, size_t n) {
+	size_t words = (first + n + 63) / 64;
+	if (words > dbf->touched_len) {
+		size_t next_len = dbf->touched_len * 2 > words ? dbf->touched_len * 2 : words;
+		dbf->touched = KAMOODB_REALLOC(dbf->touched, next_len * sizeof(uint64_t));
+		memset(dbf->touched + dbf->touched_len, 0, (next_len - dbf->touched_len) * sizeof(uint64_t));
+		dbf->touched_len = next_len;
+	}
+	for (size_t i = first; i < first + n; ++i) {
+		dbf->touched[i / 64] |= 1ULL << (i % 64);
+	}
+}
+
+// Records that page changed, for the generation stamps of the next checkpoint
+void dbfile_touch(struct dbfile* dbf, size_t page) {
+	if (page / 64 < dbf->touched_len) {
+		dbf->touched[page / 64] |= 1ULL << (page % 64);
+	} else {
+		dbfile_touch_run(dbf, page, 1);
+	}
+}
+
+int dbfile_touched(const struct dbfile* dbf, size_t page) {
+	return page / 64 < dbf->touched_len && (dbf->touched[page / 64] >> (page % 64)) & 1;
+}
+
+void dbfile_clear_touched(struct dbfile* dbf) {
+	if (dbf->touched != NULL) {
+		memset(dbf->touched, 0, dbf->touched_len * sizeof(uint64_t));
+	}
+}
+
 size_t dbfile_grow(struct dbfile* dbf , size_t n_pages) {
-	if ((dbf->page_count + n_pages) > dbf->page_cap) {
+	if (dbf->ftype == DBSTORE_IN_MEM && (dbf->page_count + n_pages) > dbf->page_cap) {
 		size_t oldcap = dbf->page_cap;
 		dbf->page_cap += n_pages * 5;
 		// cannot do realloc because memory MUST be zero'd
-		char** temp = calloc(1, sizeof(char*) * dbf->page_cap);
+		char** temp = KAMOODB_CALLOC(1, sizeof(char*) * dbf->page_cap);
 		memcpy(temp, dbf->pages, sizeof(char*) * oldcap);
+		KAMOODB_FREE(dbf->pages);
 		dbf->pages = temp;
 	}
 	size_t size_increase = n_pages * dbf->page_size;
-	dbf->file_size += size_increase;
-	lseek(dbf->fd, dbf->file_size-1, SEEK_SET);
-	write(dbf->fd, "", 1);
-	lseek(dbf->fd, 0, SEEK_SET);
 	size_t prev_page_count = dbf->page_count;
+	DBSTAT_ADD(dbf->stats, grows, 1);
+	DBSTAT_ADD(dbf->stats, grow_pages, n_pages);
+	if (dbf->ftype == DBSTORE_IN_MEM) {
+		char* mem = dbarena_alloc(&dbf->arena, size_increase);
+		if (mem == NULL) {
+			return (size_t)-1;
+		}
+		for (size_t i = 0; i < n_pages; ++i) {
+			dbf->pages[prev_page_count + i] = mem + (i * dbf->page_size);
+		}
+		dbf->file_size += size_increase;
+		dbf->alloc_size = dbf->file_size;
+		dbf->page_count += n_pages;
+		dbfile_record_page_count(dbf);
+		dbfile_touch_run(dbf, prev_page_count, n_pages);
+		return prev_page_count;
+	}
+	if (dbf->file_size + size_increase > dbf->alloc_size && !dbfile_reserve(dbf, dbf->file_size + size_increase)) {
+		return (size_t)-1;
+	}
+	dbf->file_size += size_increase;
 	dbf->page_count += n_pages;
+	dbfile_record_page_count(dbf);
+	dbfile_touch_run(dbf, prev_page_count, n_pages);
 	return prev_page_count;
 	// wait for pages to need to be mapped into memory lazily 
 }
 
-// todo, allow non linear get of page
+// In memory stores start out as a single zero page, or as a copy of
+// a file previously written by dbfile_save.
+static int dbfile_load_in_mem(struct dbfile* dbf, const char* path) {
+	dbf->filepath = path != NULL ? str_dupl(path) : NULL;
+	dbf->fd = -1;
+	dbf->file_size = 0;
+	dbf->alloc_size = 0;
+	dbf->page_count = 0;
+	dbf->page_cap = 10;
+	dbf->pages = KAMOODB_CALLOC(1, sizeof(char*) * dbf->page_cap);
+	if (path == NULL || !file_exists(path)) {
+		return dbfile_grow(dbf, 1) != (size_t)-1;
+	}
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		return 0;
+	}
+	ssize_t dbsize = file_size(path);
+	size_t n_pages = dbsize > 0 ? dbsize / dbf->page_size : 0;
+	int ok = dbfile_grow(dbf, n_pages > 0 ? n_pages : 1) != (size_t)-1;
+	for (size_t i = 0; ok && i < n_pages; ++i) {
+		ok = pread(fd, dbf->pages[i], dbf->page_size, i * dbf->page_size) == (ssize_t)dbf->page_size;
+	}
+	close(fd);
+	return ok;
+}
+
+// Drops resident regions that were not used since the clock hand last
+// passed them, until the budget is met. Pointers into a dropped region stay
+// valid, its pages are only taken out of the process and fault back in
+// from the page cache on the next use.
+static void dbfile_enforce_budget(struct dbfile* dbf) {
+	size_t region_size = dbf->page_size << dbf->region_shift;
+	size_t keep = dbf->map_budget / region_size;
+	keep = keep > DBFILE_MIN_RESIDENT ? keep : DBFILE_MIN_RESIDENT;
+	while (dbf->resident > keep) {
+		size_t r = dbf->region_hand;
+		dbf->region_hand = r + 1 < dbf->region_cap ? r + 1 : 0;
+		if (dbf->region_state[r] & DBFILE_REGION_REF) {
+			dbf->region_state[r] &= ~DBFILE_REGION_REF;
+		} else if (dbf->region_state[r] & DBFILE_REGION_RESIDENT) {
+			madvise(dbf->regions[r], region_size, MADV_DONTNEED);
+			dbf->region_state[r] = 0;
+			--dbf->resident;
+			DBSTAT_ADD(dbf->stats, region_drops, 1);
+		}
+	}
+}
+
+static char* dbfile_map_region(struct dbfile* dbf, size_t r) {
+	if (r >= dbf->region_cap) {
+		size_t next_cap = dbf->region_cap * 2 > r + 1 ? dbf->region_cap * 2 : r + 1;
+		char** regions = KAMOODB_REALLOC(dbf->regions, next_cap * sizeof(char*));
+		if (regions == NULL) {
+			return NULL;
+		}
+		dbf->regions = regions;
+		unsigned char* state = KAMOODB_REALLOC(dbf->region_state, next_cap);
+		if (state == NULL) {
+			return NULL;
+		}
+		dbf->region_state = state;
+		memset(dbf->regions + dbf->region_cap, 0, (next_cap - dbf->region_cap) * sizeof(char*));
+		memset(dbf->region_state + dbf->region_cap, 0, next_cap - dbf->region_cap);
+		dbf->region_cap = next_cap;
+	}
+	if (dbf->regions[r] == NULL) {
+		// the region may reach past the end of the file, only pages below
+		// page_count are ever used and those are always allocated
+		size_t region_size = dbf->page_size << dbf->region_shift;
+		char* base = mmap(0, region_size, PROT_READ | PROT_WRITE, MAP_SHARED, dbf->fd, r * region_size);
+		if (base == MAP_FAILED) {
+			return NULL;
+		}
+		dbf->regions[r] = base;
+		DBSTAT_ADD(dbf->stats, page_faults, 1);
+	}
+	if (!(dbf->region_state[r] & DBFILE_REGION_RESIDENT)) {
+		dbf->region_state[r] = DBFILE_REGION_RESIDENT | DBFILE_REGION_REF;
+		++dbf->resident;
+		if (dbf->map_budget > 0) {
+			dbfile_enforce_budget(dbf);
+		}
+	}
+	return dbf->regions[r];
+}
+
 char* dbfile_get_page(struct dbfile* dbf, size_t n) {
 	if (n >= dbf->page_count) {
 		dbfile_grow(dbf, (n - dbf->page_count) + 1);
 	}
-	if (dbf->pages[n] == NULL) {
-		char* pagemap = mmap(0, dbf->page_size, PROT_READ | PROT_WRITE, MAP_SHARED, dbf->fd, n * dbf->page_size);
-		dbf->pages[n] = pagemap;
+	if (dbf->ftype == DBSTORE_IN_MEM) {
+		return dbf->pages[n];
+	}
+	size_t r = n >> dbf->region_shift;
+	char* base = NULL;
+	if (r < dbf->region_cap && (dbf->region_state[r] & DBFILE_REGION_RESIDENT)) {
+		dbf->region_state[r] |= DBFILE_REGION_REF;
+		base = dbf->regions[r];
+	} else {
+		base = dbfile_map_region(dbf, r);
+		if (base == NULL) {
+			return NULL;
+		}
+	}
+	return base + ((n & ((1UL << dbf->region_shift) - 1)) * dbf->page_size);
+}
+
+// Maps n consecutive pages with a single mapping, returns the first one.
+// Returns NULL if the pages could not be mapped as one run.
+char* dbfile_map_run(struct dbfile* dbf, size_t first, size_t n) {
+	if (first + n > dbf->page_count) {
+		return NULL;
+	}
+	if (dbf->ftype == DBSTORE_IN_MEM) {
+		for (size_t i = 1; i < n; ++i) {
+			if (dbf->pages[first + i] != dbf->pages[first] + (i * dbf->page_size)) {
+				return NULL;
+			}
+		}
+		return dbf->pages[first];
+	}
+	if (first >> dbf->region_shift == (first + n - 1) >> dbf->region_shift) {
+		char* run = dbfile_get_page(dbf, first);
+		if (run != NULL) {
+			madvise(run, n * dbf->page_size, MADV_WILLNEED);
+		}
+		return run;
+	}
+	// runs across regions get a mapping of their own, the pages stay
+	// reachable through their regions too since both share the file
+	char* run = mmap(0, n * dbf->page_size, PROT_READ | PROT_WRITE, MAP_SHARED, dbf->fd, first * dbf->page_size);
+	if (run == MAP_FAILED) {
+		return NULL;
 	}
-	return dbf->pages[n];
+	madvise(run, n * dbf->page_size, MADV_WILLNEED);
+	struct dbfile_run* entry = KAMOODB_MALLOC(sizeof(struct dbfile_run));
+	entry->next = dbf->runs;
+	entry->base = run;
+	entry->size = n * dbf->page_size;
+	dbf->runs = entry;
+	return run;
 }
 
 void dbfile_sync_page(struct dbfile* dbf, char* page) {
+	if (dbf->ftype == DBSTORE_IN_MEM) {
+		return;
+	}
 	msync(page, dbf->page_size, MS_SYNC);
 }
 
+// Writes back every dirty page of the file at once
+int dbfile_sync(struct dbfile* dbf) {
+	if (dbf->ftype == DBSTORE_IN_MEM) {
+		return 1;
+	}
+	return fdatasync(dbf->fd) == 0;
+}
+
 int dbfile_get_place(struct dbfile* dbf, size_t offset, size_t* result) {
 	if (offset >= dbf->file_size) {
 		return 0;
@@ -227,6 +962,7 @@ int dbfile_write(struct dbfile* dbf, size_t offset, const char* data, size_t siz
 		char* page = dbfile_get_page(dbf, cur_page);
 		size_t to_write = dbf->page_size - cur_off;
 		memcpy(page + cur_off, data,  to_write > size ? size : to_write );
+		dbfile_touch(dbf, cur_page);
 		size = to_write  > size ? 0 : size - to_write;
 		data += to_write;
 		cur_off = 0;
@@ -238,12 +974,13 @@ int dbfile_write(struct dbfile* dbf, size_t offset, const char* data, size_t siz
 }
 
 int dbfile_write_po(struct dbfile* dbf, size_t page, size_t offset, const char* data, size_t size) {
-	size_t cur_page = page;
-	size_t cur_off = offset;
+	size_t cur_page = page + (offset / dbf->page_size);
+	size_t cur_off = offset % dbf->page_size;
 	while (size) {
 		char* page = dbfile_get_page(dbf, cur_page);
 		size_t to_write = dbf->page_size - cur_off;
 		memcpy(page + cur_off, data,  to_write > size ? size : to_write );
+		dbfile_touch(dbf, cur_page);
 		size = to_write  > size ? 0 : size - to_write;
 		data += to_write;
 		cur_off = 0;
@@ -254,8 +991,8 @@ int dbfile_write_po(struct dbfile* dbf, size_t page, size_t offset, const char*
 }
 
 int dbfile_read_po(struct dbfile* dbf, size_t page, size_t offset, char* data, size_t size) {
-	size_t cur_page = page;
-	size_t cur_off = offset;
+	size_t cur_page = page + (offset / dbf->page_size);
+	size_t cur_off = offset % dbf->page_size;
 	while (size) {
 		char* page = dbfile_get_page(dbf, cur_page);
 		size_t to_read = dbf->page_size - cur_off;
@@ -269,8 +1006,8 @@ int dbfile_read_po(struct dbfile* dbf, size_t page, size_t offset, char* data, s
 }
 
 size_t dbfile_hash_null(struct dbfile* dbf, size_t page, size_t offset) {
-	size_t cur_page = page;
-	size_t cur_off = offset;
+	size_t cur_page = page + (offset / dbf->page_size);
+	size_t cur_off = offset % dbf->page_size;
 	size_t hashbase = DJB2_HASH_BASE;
 	int found_null = 0;
 	while (!found_null) {
@@ -303,8 +1040,8 @@ int dbfile_read(struct dbfile* dbf, size_t offset, char* data, size_t size) {
 }
 
 int dbfile_cmp_null(struct dbfile* dbf, size_t page, size_t offset, const char* data, size_t size) {
-	size_t cur_page = page;
-	size_t cur_off = offset;
+	size_t cur_page = page + (offset / dbf->page_size);
+	size_t cur_off = offset % dbf->page_size;
 	//printf("cur_page %zu cur off %zu\n", cur_page, cur_off);
 	while (size) {
 		char* page = dbfile_get_page(dbf, cur_page);
@@ -321,30 +1058,120 @@ int dbfile_cmp_null(struct dbfile* dbf, size_t page, size_t offset, const char*
 	return 1;
 }
 
+// Orders the null terminated string at offset against data, like strcmp
+int dbfile_cmp_order(struct dbfile* dbf, size_t page, size_t offset, const char* data, size_t size) {
+	size_t cur_page = page + (offset / dbf->page_size);
+	size_t cur_off = offset % dbf->page_size;
+	const unsigned char* udata = (const unsigned char*)data;
+	while (size) {
+		const unsigned char* reader = (const unsigned char*)dbfile_get_page(dbf, cur_page) + cur_off;
+		size_t to_read = dbf->page_size - cur_off;
+		to_read = to_read > size ? size : to_read;
+		for (size_t i = 0; i < to_read; ++i) {
+			if (reader[i] != udata[i]) {
+				return reader[i] < udata[i] ? -1 : 1;
+			} else if (reader[i] == '\0') {
+				return 0;
+			}
+		}
+		size -= to_read;
+		udata += to_read;
+		cur_off = 0;
+		++cur_page;
+	}
+	return 0;
+}
+
+// Length of the null terminated string at offset, including the terminator
+size_t dbfile_null_len(struct dbfile* dbf, size_t page, size_t offset) {
+	size_t cur_page = page + (offset / dbf->page_size);
+	size_t cur_off = offset % dbf->page_size;
+	size_t total = 0;
+	while (1) {
+		char* reader = dbfile_get_page(dbf, cur_page) + cur_off;
+		size_t to_read = dbf->page_size - cur_off;
+		char* found = memchr(reader, '\0', to_read);
+		if (found != NULL) {
+			return total + (found - reader) + 1;
+		}
+		total += to_read;
+		cur_off = 0;
+		++cur_page;
+	}
+}
 
 void dbfile_close(struct dbfile* dbf) {
-	for (size_t i = 0; i < dbf->page_count; ++i){
-		if(munmap(dbf->pages[i], dbf->page_size) == -1) {
-			fprintf(stderr, "Failed to unmap page %zu\n", i);
+	if (dbf->ftype == DBSTORE_IN_MEM) {
+		dbarena_deinit(&dbf->arena);
+	} else {
+		size_t region_size = dbf->page_size << dbf->region_shift;
+		for (size_t i = 0; i < dbf->region_cap; ++i){
+			if(dbf->regions[i] != NULL && munmap(dbf->regions[i], region_size) == -1) {
+				fprintf(stderr, "Failed to unmap region %zu\n", i);
+			}
 		}
+		while (dbf->runs != NULL) {
+			struct dbfile_run* next = dbf->runs->next;
+			munmap(dbf->runs->base, dbf->runs->size);
+			KAMOODB_FREE(dbf->runs);
+			dbf->runs = next;
+		}
+		close(dbf->fd);
 	}
-	close(dbf->fd);
+	KAMOODB_FREE(dbf->pages);
+	dbf->pages = NULL;
+	KAMOODB_FREE(dbf->regions);
+	KAMOODB_FREE(dbf->region_state);
+	dbf->regions = NULL;
+	dbf->region_state = NULL;
+	dbf->region_cap = 0;
+	dbf->resident = 0;
 	dbf->fd = -1;
+	KAMOODB_FREE(dbf->touched);
+	dbf->touched = NULL;
+	dbf->touched_len = 0;
 }
 
 void dbfile_path_free(struct dbfile* dbf) {
 	if (dbf->filepath != NULL) {
-		free(dbf->filepath);
+		KAMOODB_FREE(dbf->filepath);
 		dbf->filepath = NULL;
 	}
 }
 
+// In memory stores only ever read their path, so there is nothing to remove
 void dbfile_remove(struct dbfile* dbf) {
-	if (dbf->filepath != NULL) {
+	if (dbf->filepath != NULL && dbf->ftype != DBSTORE_IN_MEM) {
 		remove(dbf->filepath);
 	}
 }
 
+// Writes every page out to path, through a temporary file so a
+// crash never leaves a half written copy behind.
+int dbfile_save(struct dbfile* dbf, const char* path) {
+	size_t tmp_size = strlen(path) + 5;
+	char* tmp_path = KAMOODB_MALLOC(tmp_size);
+	snprintf(tmp_path, tmp_size, "%s.tmp", path);
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, (mode_t)0600);
+	if (fd == -1) {
+		KAMOODB_FREE(tmp_path);
+		return 0;
+	}
+	int ok = 1;
+	for (size_t i = 0; ok && i < dbf->page_count; ++i) {
+		char* page = dbfile_get_page(dbf, i);
+		ok = pwrite(fd, page, dbf->page_size, i * dbf->page_size) == (ssize_t)dbf->page_size;
+	}
+	ok = ok && fsync(fd) == 0;
+	close(fd);
+	ok = ok && rename(tmp_path, path) == 0;
+	if (!ok) {
+		remove(tmp_path);
+	}
+	KAMOODB_FREE(tmp_path);
+	return ok;
+}
+
 // storage pointer form
 // [page number][offset in page][size]
 // number = 4 bytes
@@ -360,7 +1187,10 @@ void dbfile_remove(struct dbfile* dbf) {
 // hash blocks
 // * dependent on page size
 // [next page][hashslot]
-// hashslot = storage pointer 
+// hashslot = storage pointer [inline payload]
+// * the payload is only there if the file was created with an inline size
+// * a page number of -2 marks an inline record, offset and size then hold
+//   the key and value sizes, and the payload holds the key and the value
 //
 // storage blocks (optional , can just be free blocks)
 // [-header-][-list-]
@@ -371,58 +1201,694 @@ void dbfile_remove(struct dbfile* dbf) {
 // [next page][len][total free space][storageslot...]
 // storageslot = storage pointer
 //
-// db header
-// magic string, 4 bytes
-// [hashblocks root] = 4 bytes
-// [storageblocks root] = 4 bytes (optional)
-// [freeblocks root] = 4 bytes
-// hash block count (for hash modulo)
+// ------- value compression -------
+// Values can be stored compressed, chosen when the file is created. An
+// encoded value is [tag][raw size][payload], where the tag says which codec
+// wrote the payload. Values that are small or do not shrink are kept raw.
+// Both codecs can use a dictionary trained from sample values, which is kept
+// in the file so every process decodes with the same bytes.
+// * lz is a small lz77 codec in the style of lz4, built for speed
+// * deflate uses zlib with a preset dictionary for ratio, and needs
+//   KAMOODB_WITH_ZLIB and linking against zlib
 
-static const char MAGIC_SEQ[] = {'k', 'h', 'o', 'm'};
-static const size_t STORAGE_PTR_SIZE = sizeof(int32_t) * 3;
-static const size_t HASHSTORAGE_PTR_SIZE = sizeof(int32_t) * 3;
-static const size_t HASHSTORAGE_PTR_SIZE_INT = HASHSTORAGE_PTR_SIZE / sizeof(int32_t);
-static const size_t LEN_BLOCK_HEADER_SIZE = sizeof(int32_t) * 2;
-static const size_t HASH_BLOCK_HEADER_SIZE = sizeof(int32_t);
-static const size_t DB_HEADER_PAGE_SIZE_OFF = sizeof(MAGIC_SEQ) + (sizeof(int32_t) * 2);
-static const size_t DB_HEADER_HASH_LEN_OFF = sizeof(MAGIC_SEQ) + (sizeof(int32_t) * 3);
-static const size_t DB_HEADER_ITEM_COUNT_OFF = sizeof(MAGIC_SEQ) + (sizeof(int32_t) * 4);
-static const size_t DB_HEADER_FACT_LIM_OFF = sizeof(MAGIC_SEQ) + (sizeof(int32_t) * 4) + sizeof(int64_t);
+#define DBCODEC_LZ_HASH_BITS 12
+#define DBCODEC_LZ_HASH_SIZE (1 << DBCODEC_LZ_HASH_BITS)
+static const size_t DBCODEC_HEADER_SIZE = 1 + sizeof(uint32_t);
+static const size_t DBCODEC_MIN_SIZE = 32;
+static const size_t DBCODEC_DICT_MAX = 32 * 1024;
+static const size_t DBCODEC_LZ_MIN_MATCH = 4;
+static const size_t DBCODEC_LZ_MAX_OFFSET = 65535;
 
+struct dbcodec {
+	enum dbcodec_type type;
+	char* dict;
+	size_t dict_size;
+	// lz hash table primed with the dictionary positions
+	int32_t* dict_table;
+	int32_t* table;
+	char* work;
+	size_t work_cap;
+#if defined(KAMOODB_WITH_ZLIB)
+	z_stream* zdef;
+	z_stream* zinf;
+#endif
+};
 
-size_t items_per_block(size_t page_size) {
-	size_t slot_port = page_size - LEN_BLOCK_HEADER_SIZE;
-	return (slot_port - (slot_port % STORAGE_PTR_SIZE)) / STORAGE_PTR_SIZE;
+void dbcodec_init(struct dbcodec* c, enum dbcodec_type type) {
+	memset(c, 0, sizeof(struct dbcodec));
+	c->type = type;
 }
 
-size_t hashes_per_block(size_t page_size) {
-	size_t slot_port = page_size - HASH_BLOCK_HEADER_SIZE;
-	return (slot_port - (slot_port % HASHSTORAGE_PTR_SIZE)) / HASHSTORAGE_PTR_SIZE;
+void dbcodec_deinit(struct dbcodec* c) {
+	KAMOODB_FREE(c->dict);
+	KAMOODB_FREE(c->dict_table);
+	KAMOODB_FREE(c->table);
+	KAMOODB_FREE(c->work);
+#if defined(KAMOODB_WITH_ZLIB)
+	if (c->zdef != NULL) {
+		deflateEnd(c->zdef);
+		KAMOODB_FREE(c->zdef);
+	}
+	if (c->zinf != NULL) {
+		inflateEnd(c->zinf);
+		KAMOODB_FREE(c->zinf);
+	}
+#endif
+	dbcodec_init(c, DBCODEC_NONE);
 }
 
-struct database {
-	struct dbfile dbf;
-	struct page_vec hash_pages;
-};
+static uint32_t dbcodec_read32(const unsigned char* src) {
+	uint32_t val;
+	memcpy(&val, src, sizeof(val));
+	return val;
+}
 
-int _has_magic_seq(const char* page) {
-	return page[0] == MAGIC_SEQ[0] &&
-	       page[1] == MAGIC_SEQ[1] &&
-	       page[2] == MAGIC_SEQ[2] &&
-	       page[3] == MAGIC_SEQ[3];
+static size_t dbcodec_lz_hash(uint32_t seq) {
+	return (seq * 2654435761U) >> (32 - DBCODEC_LZ_HASH_BITS);
 }
 
-void _erase_region(char* ptr, size_t off, size_t size, size_t end) {
-	char* temp = malloc(end - (off + size));
-	memcpy(temp, ptr + off + size, end - (off + size));
-	memcpy(ptr + off, temp, end - (off + size));
-	free(temp);
+// Hashes every position of buf into table, later positions win
+static void dbcodec_lz_prime(int32_t* table, const unsigned char* buf, size_t size) {
+	for (size_t i = 0; i < DBCODEC_LZ_HASH_SIZE; ++i) {
+		table[i] = -1;
+	}
+	for (size_t i = 0; i + DBCODEC_LZ_MIN_MATCH <= size; ++i) {
+		table[dbcodec_lz_hash(dbcodec_read32(buf + i))] = i;
+	}
 }
 
-void _write_storage_ptr(char* ptr, int32_t page, int32_t off, int32_t size) {
-	int32_t* writer = (int32_t*)ptr;
-	writer[0] = page;
-	writer[1] = off;
+void dbcodec_set_dict(struct dbcodec* c, const char* dict, size_t dict_size) {
+	KAMOODB_FREE(c->dict);
+	c->dict = KAMOODB_MALLOC(dict_size);
+	memcpy(c->dict, dict, dict_size);
+	c->dict_size = dict_size;
+	if (c->dict_table == NULL) {
+		c->dict_table = KAMOODB_MALLOC(DBCODEC_LZ_HASH_SIZE * sizeof(int32_t));
+	}
+	dbcodec_lz_prime(c->dict_table, (const unsigned char*)dict, dict_size);
+}
+
+size_t dbcodec_bound(size_t val_size) {
+	return DBCODEC_HEADER_SIZE + val_size;
+}
+
+static size_t dbcodec_put_len(unsigned char* dst, size_t op, size_t cap, size_t len) {
+	while (len >= 255) {
+		if (op >= cap) {
+			return 0;
+		}
+		dst[op++] = 255;
+		len -= 255;
+	}
+	if (op >= cap) {
+		return 0;
+	}
+	dst[op++] = len;
+	return op;
+}
+
+// Writes one sequence of literals followed by a match, match_len 0 ends the block
+static size_t dbcodec_lz_emit(unsigned char* dst, size_t op, size_t cap, const unsigned char* lit,
+	                          size_t lit_len, size_t offset, size_t match_len) {
+	size_t match_code = match_len > 0 ? match_len - DBCODEC_LZ_MIN_MATCH : 0;
+	if (op >= cap) {
+		return 0;
+	}
+	dst[op++] = ((lit_len >= 15 ? 15 : lit_len) << 4) | (match_code >= 15 ? 15 : match_code);
+	if (lit_len >= 15 && (op = dbcodec_put_len(dst, op, cap, lit_len - 15)) == 0) {
+		return 0;
+	}
+	if (op + lit_len > cap) {
+		return 0;
+	}
+	memcpy(dst + op, lit, lit_len);
+	op += lit_len;
+	if (match_len == 0) {
+		return op;
+	}
+	if (op + 2 > cap) {
+		return 0;
+	}
+	dst[op++] = offset & 0xff;
+	dst[op++] = offset >> 8;
+	if (match_code >= 15 && (op = dbcodec_put_len(dst, op, cap, match_code - 15)) == 0) {
+		return 0;
+	}
+	return op;
+}
+
+// Returns the compressed size, or 0 if it would not fit in cap
+size_t dbcodec_lz_compress(struct dbcodec* c, const char* src, size_t size, char* dst, size_t cap) {
+	size_t end = c->dict_size + size;
+	if (c->work_cap < end) {
+		KAMOODB_FREE(c->work);
+		c->work_cap = end;
+		c->work = KAMOODB_MALLOC(c->work_cap);
+	}
+	if (c->table == NULL) {
+		c->table = KAMOODB_MALLOC(DBCODEC_LZ_HASH_SIZE * sizeof(int32_t));
+	}
+	// matches can reach back into the dictionary, so it goes in front of src
+	memcpy(c->work, c->dict, c->dict_size);
+	memcpy(c->work + c->dict_size, src, size);
+	if (c->dict_table != NULL) {
+		memcpy(c->table, c->dict_table, DBCODEC_LZ_HASH_SIZE * sizeof(int32_t));
+	} else {
+		dbcodec_lz_prime(c->table, NULL, 0);
+	}
+	const unsigned char* base = (const unsigned char*)c->work;
+	unsigned char* out = (unsigned char*)dst;
+	size_t ip = c->dict_size;
+	size_t anchor = ip;
+	size_t op = 0;
+	while (ip + DBCODEC_LZ_MIN_MATCH <= end) {
+		uint32_t seq = dbcodec_read32(base + ip);
+		size_t h = dbcodec_lz_hash(seq);
+		int32_t ref = c->table[h];
+		c->table[h] = ip;
+		if (ref < 0 || ip - ref > DBCODEC_LZ_MAX_OFFSET || dbcodec_read32(base + ref) != seq) {
+			++ip;
+			continue;
+		}
+		size_t match_len = DBCODEC_LZ_MIN_MATCH;
+		while (ip + match_len < end && base[ref + match_len] == base[ip + match_len]) {
+			++match_len;
+		}
+		op = dbcodec_lz_emit(out, op, cap, base + anchor, ip - anchor, ip - ref, match_len);
+		if (op == 0) {
+			return 0;
+		}
+		ip += match_len;
+		anchor = ip;
+	}
+	return dbcodec_lz_emit(out, op, cap, base + anchor, end - anchor, 0, 0);
+}
+
+static int dbcodec_get_len(const unsigned char* src, size_t* ip, size_t size, size_t* len) {
+	unsigned char b;
+	do {
+		if (*ip >= size) {
+			return 0;
+		}
+		b = src[(*ip)++];
+		*len += b;
+	} while (b == 255);
+	return 1;
+}
+
+int dbcodec_lz_decompress(struct dbcodec* c, const char* src, size_t size, char* dst, size_t raw_size) {
+	const unsigned char* in = (const unsigned char*)src;
+	size_t ip = 0;
+	size_t op = 0;
+	while (ip < size) {
+		unsigned char token = in[ip++];
+		size_t lit_len = token >> 4;
+		if (lit_len == 15 && !dbcodec_get_len(in, &ip, size, &lit_len)) {
+			return 0;
+		}
+		if (ip + lit_len > size || op + lit_len > raw_size) {
+			return 0;
+		}
+		memcpy(dst + op, in + ip, lit_len);
+		ip += lit_len;
+		op += lit_len;
+		if (ip == size) {
+			break;
+		}
+		if (ip + 2 > size) {
+			return 0;
+		}
+		size_t offset = in[ip] | (in[ip + 1] << 8);
+		size_t match_len = token & 15;
+		ip += 2;
+		if (match_len == 15 && !dbcodec_get_len(in, &ip, size, &match_len)) {
+			return 0;
+		}
+		match_len += DBCODEC_LZ_MIN_MATCH;
+		if (offset == 0 || offset > op + c->dict_size || op + match_len > raw_size) {
+			return 0;
+		}
+		// byte at a time, matches may overlap their own output
+		for (size_t i = 0; i < match_len; ++i, ++op) {
+			dst[op] = offset > op ? c->dict[c->dict_size - (offset - op)] : dst[op - offset];
+		}
+	}
+	return op == raw_size;
+}
+
+#if defined(KAMOODB_WITH_ZLIB)
+size_t dbcodec_deflate(struct dbcodec* c, const char* src, size_t size, char* dst, size_t cap) {
+	if (c->zdef == NULL) {
+		c->zdef = KAMOODB_CALLOC(1, sizeof(z_stream));
+		if (deflateInit2(c->zdef, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			KAMOODB_FREE(c->zdef);
+			c->zdef = NULL;
+			return 0;
+		}
+	} else {
+		deflateReset(c->zdef);
+	}
+	if (c->dict_size > 0) {
+		deflateSetDictionary(c->zdef, (const Bytef*)c->dict, c->dict_size);
+	}
+	c->zdef->next_in = (Bytef*)src;
+	c->zdef->avail_in = size;
+	c->zdef->next_out = (Bytef*)dst;
+	c->zdef->avail_out = cap;
+	if (deflate(c->zdef, Z_FINISH) != Z_STREAM_END) {
+		return 0;
+	}
+	return cap - c->zdef->avail_out;
+}
+
+int dbcodec_inflate(struct dbcodec* c, const char* src, size_t size, char* dst, size_t raw_size) {
+	if (c->zinf == NULL) {
+		c->zinf = KAMOODB_CALLOC(1, sizeof(z_stream));
+		if (inflateInit2(c->zinf, -15) != Z_OK) {
+			KAMOODB_FREE(c->zinf);
+			c->zinf = NULL;
+			return 0;
+		}
+	} else {
+		inflateReset(c->zinf);
+	}
+	if (c->dict_size > 0) {
+		inflateSetDictionary(c->zinf, (const Bytef*)c->dict, c->dict_size);
+	}
+	c->zinf->next_in = (Bytef*)src;
+	c->zinf->avail_in = size;
+	c->zinf->next_out = (Bytef*)dst;
+	c->zinf->avail_out = raw_size;
+	return inflate(c->zinf, Z_FINISH) == Z_STREAM_END && c->zinf->avail_out == 0;
+}
+#endif
+
+// Encodes val into out, which must hold dbcodec_bound(val_size) bytes.
+// Returns the encoded size.
+size_t dbcodec_encode(struct dbcodec* c, const char* val, size_t val_size, char* out) {
+	uint32_t raw_size = val_size;
+	size_t packed = 0;
+	// only keep the payload if it saves space
+	size_t cap = val_size - 1;
+	if (val_size >= DBCODEC_MIN_SIZE) {
+		if (c->type == DBCODEC_LZ) {
+			packed = dbcodec_lz_compress(c, val, val_size, out + DBCODEC_HEADER_SIZE, cap);
+		}
+#if defined(KAMOODB_WITH_ZLIB)
+		if (c->type == DBCODEC_DEFLATE) {
+			packed = dbcodec_deflate(c, val, val_size, out + DBCODEC_HEADER_SIZE, cap);
+		}
+#endif
+	}
+	memcpy(out + 1, &raw_size, sizeof(raw_size));
+	if (packed == 0) {
+		out[0] = DBCODEC_NONE;
+		memcpy(out + DBCODEC_HEADER_SIZE, val, val_size);
+		return DBCODEC_HEADER_SIZE + val_size;
+	}
+	out[0] = c->type;
+	return DBCODEC_HEADER_SIZE + packed;
+}
+
+// Returns the decoded value in a new buffer, or NULL if enc is corrupt
+char* dbcodec_decode(struct dbcodec* c, const char* enc, size_t enc_size) {
+	uint32_t raw_size = 0;
+	int ok = 0;
+	if (enc_size < DBCODEC_HEADER_SIZE) {
+		return NULL;
+	}
+	memcpy(&raw_size, enc + 1, sizeof(raw_size));
+	const char* payload = enc + DBCODEC_HEADER_SIZE;
+	size_t payload_size = enc_size - DBCODEC_HEADER_SIZE;
+	char* val = KAMOODB_MALLOC(raw_size > 0 ? raw_size : 1);
+	switch (enc[0]) {
+		case DBCODEC_NONE:
+			ok = payload_size == raw_size;
+			if (ok) {
+				memcpy(val, payload, raw_size);
+			}
+			break;
+		case DBCODEC_LZ:
+			ok = dbcodec_lz_decompress(c, payload, payload_size, val, raw_size);
+			break;
+#if defined(KAMOODB_WITH_ZLIB)
+		case DBCODEC_DEFLATE:
+			ok = dbcodec_inflate(c, payload, payload_size, val, raw_size);
+			break;
+#endif
+		default:
+			break;
+	}
+	if (!ok) {
+		KAMOODB_FREE(val);
+		return NULL;
+	}
+	return val;
+}
+
+struct dbcodec_segment {
+	size_t sample;
+	size_t offset;
+	size_t size;
+	uint64_t score;
+};
+
+static int dbcodec_segment_cmp(const void* a, const void* b) {
+	uint64_t sa = ((const struct dbcodec_segment*)a)->score;
+	uint64_t sb = ((const struct dbcodec_segment*)b)->score;
+	return sa < sb ? 1 : (sa > sb ? -1 : 0);
+}
+
+#define DBCODEC_TRAIN_GRAM 8
+#define DBCODEC_TRAIN_SEGMENT 64
+#define DBCODEC_TRAIN_BITS 16
+
+static size_t dbcodec_gram_hash(const char* at) {
+	uint64_t gram;
+	memcpy(&gram, at, sizeof(gram));
+	return (gram * 0x9E3779B97F4A7C15ULL) >> (64 - DBCODEC_TRAIN_BITS);
+}
+
+static uint64_t dbcodec_segment_score(const uint32_t* counts, const char* seg, size_t size) {
+	uint64_t score = 0;
+	for (size_t i = 0; i + DBCODEC_TRAIN_GRAM <= size; ++i) {
+		score += counts[dbcodec_gram_hash(seg + i)];
+	}
+	return score;
+}
+
+// Builds a dictionary of up to dict_cap bytes out of the sample segments
+// whose 8 byte grams repeat most across all samples. Grams already covered
+// by a chosen segment stop counting, so the dictionary does not repeat
+// itself. The best segments go last, closest to the data being compressed.
+size_t dbcodec_train(const char** samples, size_t n_samples, char* dict, size_t dict_cap) {
+	size_t n_segs = 0;
+	size_t seg_cap = 0;
+	size_t used = 0;
+	struct dbcodec_segment* segs = NULL;
+	uint32_t* counts = KAMOODB_CALLOC(1 << DBCODEC_TRAIN_BITS, sizeof(uint32_t));
+	for (size_t i = 0; i < n_samples; ++i) {
+		size_t size = strlen(samples[i]);
+		for (size_t j = 0; j + DBCODEC_TRAIN_GRAM <= size; ++j) {
+			++counts[dbcodec_gram_hash(samples[i] + j)];
+		}
+		for (size_t j = 0; j < size; j += DBCODEC_TRAIN_SEGMENT) {
+			if (n_segs == seg_cap) {
+				seg_cap = seg_cap == 0 ? 64 : seg_cap * 2;
+				segs = KAMOODB_REALLOC(segs, seg_cap * sizeof(struct dbcodec_segment));
+			}
+			segs[n_segs].sample = i;
+			segs[n_segs].offset = j;
+			segs[n_segs].size = size - j > DBCODEC_TRAIN_SEGMENT ? DBCODEC_TRAIN_SEGMENT : size - j;
+			++n_segs;
+		}
+	}
+	for (size_t i = 0; i < n_segs; ++i) {
+		segs[i].score = dbcodec_segment_score(counts, samples[segs[i].sample] + segs[i].offset, segs[i].size);
+	}
+	qsort(segs, n_segs, sizeof(struct dbcodec_segment), dbcodec_segment_cmp);
+	for (size_t i = 0; i < n_segs && used < dict_cap; ++i) {
+		const char* seg = samples[segs[i].sample] + segs[i].offset;
+		// a segment mostly covered by earlier picks adds little
+		if (dbcodec_segment_score(counts, seg, segs[i].size) * 2 < segs[i].score || segs[i].score == 0) {
+			continue;
+		}
+		size_t take = segs[i].size > dict_cap - used ? dict_cap - used : segs[i].size;
+		used += take;
+		memcpy(dict + dict_cap - used, seg, take);
+		for (size_t j = 0; j + DBCODEC_TRAIN_GRAM <= segs[i].size; ++j) {
+			counts[dbcodec_gram_hash(seg + j)] = 0;
+		}
+	}
+	memmove(dict, dict + dict_cap - used, used);
+	KAMOODB_FREE(segs);
+	KAMOODB_FREE(counts);
+	return used;
+}
+
+// db header
+// magic string, 4 bytes
+// [hashblocks root] = 4 bytes
+// [storageblocks root] = 4 bytes (optional)
+// [freeblocks root] = 4 bytes
+// hash block count (for hash modulo)
+
+static const char MAGIC_SEQ[] = {'k', 'h', 'o', 'm'};
+static const size_t STORAGE_PTR_SIZE = sizeof(int32_t) * 3;
+static const size_t HASHSTORAGE_PTR_SIZE = sizeof(int32_t) * 3;
+static const size_t HASHSTORAGE_PTR_SIZE_INT = HASHSTORAGE_PTR_SIZE / sizeof(int32_t);
+static const size_t LEN_BLOCK_HEADER_SIZE = sizeof(int32_t) * 2;
+static const size_t HASH_BLOCK_HEADER_SIZE = sizeof(int32_t);
+static const size_t DB_HEADER_PAGE_SIZE_OFF = sizeof(MAGIC_SEQ) + (sizeof(int32_t) * 2);
+static const size_t DB_HEADER_HASH_LEN_OFF = sizeof(MAGIC_SEQ) + (sizeof(int32_t) * 3);
+static const size_t DB_HEADER_ITEM_COUNT_OFF = sizeof(MAGIC_SEQ) + (sizeof(int32_t) * 4);
+static const size_t DB_HEADER_FACT_LIM_OFF = sizeof(MAGIC_SEQ) + (sizeof(int32_t) * 4) + sizeof(int64_t);
+static const size_t DB_HEADER_PAGE_COUNT_OFF = sizeof(MAGIC_SEQ) + (sizeof(int32_t) * 5) + sizeof(int64_t);
+static const size_t DB_HEADER_SLOT_SIZE_OFF = sizeof(MAGIC_SEQ) + (sizeof(int32_t) * 5) + (sizeof(int64_t) * 2);
+static const size_t DB_HEADER_TREE_ROOT_OFF = sizeof(MAGIC_SEQ) + (sizeof(int32_t) * 6) + (sizeof(int64_t) * 2);
+static const size_t DB_HEADER_CODEC_OFF = sizeof(MAGIC_SEQ) + (sizeof(int32_t) * 7) + (sizeof(int64_t) * 2);
+// storage pointer of the compression dictionary, page 0 if there is none
+static const size_t DB_HEADER_DICT_OFF = sizeof(MAGIC_SEQ) + (sizeof(int32_t) * 8) + (sizeof(int64_t) * 2);
+// set by database_checkpoint, cleared while the file is open for writing
+static const size_t DB_HEADER_CLEAN_OFF = sizeof(MAGIC_SEQ) + (sizeof(int32_t) * 11) + (sizeof(int64_t) * 2);
+static const size_t DB_HEADER_CSUM_ROOT_OFF = sizeof(MAGIC_SEQ) + (sizeof(int32_t) * 12) + (sizeof(int64_t) * 2);
+// crc of the header page, computed as if this field was not there
+static const size_t DB_HEADER_CSUM_OFF = sizeof(MAGIC_SEQ) + (sizeof(int32_t) * 13) + (sizeof(int64_t) * 2);
+// index sizing in millionths, 0 for the defaults
+// max load falls back to 1 / fact_lim so older files keep their limit
+static const size_t DB_HEADER_MAX_LOAD_OFF = sizeof(MAGIC_SEQ) + (sizeof(int32_t) * 14) + (sizeof(int64_t) * 2);
+static const size_t DB_HEADER_GROWTH_OFF = sizeof(MAGIC_SEQ) + (sizeof(int32_t) * 15) + (sizeof(int64_t) * 2);
+static const size_t DB_HEADER_MIN_LOAD_OFF = sizeof(MAGIC_SEQ) + (sizeof(int32_t) * 16) + (sizeof(int64_t) * 2);
+// checkpoint generation, and the first page of the stamps recording the
+// generation each page last changed in
+static const size_t DB_HEADER_GEN_OFF = sizeof(MAGIC_SEQ) + (sizeof(int32_t) * 17) + (sizeof(int64_t) * 2);
+static const size_t DB_HEADER_GEN_ROOT_OFF = sizeof(MAGIC_SEQ) + (sizeof(int32_t) * 18) + (sizeof(int64_t) * 2);
+// 1 if hash slots end in an expiry time
+static const size_t DB_HEADER_EXPIRY_OFF = sizeof(MAGIC_SEQ) + (sizeof(int32_t) * 19) + (sizeof(int64_t) * 2);
+// first page and page count of the Bloom filter, and its bits per key
+static const size_t DB_HEADER_BLOOM_ROOT_OFF = sizeof(MAGIC_SEQ) + (sizeof(int32_t) * 20) + (sizeof(int64_t) * 2);
+static const size_t DB_HEADER_BLOOM_PAGES_OFF = sizeof(MAGIC_SEQ) + (sizeof(int32_t) * 21) + (sizeof(int64_t) * 2);
+static const size_t DB_HEADER_BLOOM_BITS_OFF = sizeof(MAGIC_SEQ) + (sizeof(int32_t) * 22) + (sizeof(int64_t) * 2);
+static const double DB_LOAD_UNIT = 1000000.0;
+
+
+size_t items_per_block(size_t page_size) {
+	size_t slot_port = page_size - LEN_BLOCK_HEADER_SIZE;
+	return (slot_port - (slot_port % STORAGE_PTR_SIZE)) / STORAGE_PTR_SIZE;
+}
+
+size_t hashes_per_block(size_t page_size) {
+	size_t slot_port = page_size - HASH_BLOCK_HEADER_SIZE;
+	return (slot_port - (slot_port % HASHSTORAGE_PTR_SIZE)) / HASHSTORAGE_PTR_SIZE;
+}
+
+// A hash page as it was before the first write after snapshot tag was taken.
+// It serves every live snapshot newer than the previous copy of the page.
+struct dbcow_copy {
+	int32_t page;
+	uint64_t tag;
+	struct dbcow_copy* next;
+	char data[];
+};
+
+// storage freed while tag was the newest snapshot, reused once it is gone
+struct dbcow_free {
+	int32_t ptr[3];
+	uint64_t tag;
+};
+
+struct dbsnapshot;
+
+struct dbcow {
+	// tag of the newest copy of each page, indexed by page
+	uint64_t* tags;
+	size_t tags_len;
+	struct dbcow_copy** buckets;
+	struct dbcow_free* frees;
+	size_t frees_len;
+	size_t frees_cap;
+};
+
+struct database {
+	struct dbfile dbf;
+	struct page_vec hash_pages;
+	size_t avg_record_size;
+	// hash slot layout, fixed when the file is created
+	size_t slot_size;
+	size_t slots_per_block;
+	size_t inline_cap;
+	// offset of the expiry time in a slot, 0 if records never expire
+	size_t expiry_off;
+	// next slot database_sweep looks at
+	size_t sweep_pos;
+	// Bloom filter run, root 0 if there is none
+	int32_t bloom_root;
+	size_t bloom_pages;
+	size_t bloom_k;
+	struct dbcodec codec;
+	// checksums recorded at the last checkpoint, indexed by page
+	uint32_t* csums;
+	unsigned char* csum_state;
+	size_t csum_len;
+	// pages and storage pointers that failed verification
+	size_t corrupt;
+	struct dbstats stats;
+	// pages of the generation stamp table
+	struct page_vec gen_pages;
+	// live snapshots, newest first
+	struct dbsnapshot* snaps;
+	uint64_t snap_epoch;
+	struct dbcow cow;
+	// reused staging buffer for encoded records, only ever grows
+	char* scratch;
+	size_t scratch_cap;
+	// set when the file is shared with other processes
+	struct dbshared* shared;
+	// transaction log, -1 until the first commit
+	int wal_fd;
+	// a commit could not apply all of its ops, its record is still to finish
+	int wal_pending;
+	int txn_sync;
+	// cache mode, one reference bit per hash slot swept by a clock hand.
+	// The bits live in memory only, a reopened cache starts out cold.
+	size_t capacity;
+	unsigned char* clock_bits;
+	size_t clock_len;
+	size_t clock_hand;
+};
+
+// checksum table
+// [next page][count][entries]
+// entry = [page][crc32c of page]
+static const size_t CSUM_BLOCK_HEADER_SIZE = sizeof(int32_t) * 2;
+static const size_t CSUM_ENTRY_SIZE = sizeof(int32_t) * 2;
+
+enum dbcsum_state {
+	DBCSUM_NONE,
+	DBCSUM_PENDING,
+	DBCSUM_OK,
+	DBCSUM_BAD
+};
+
+uint32_t dbheader_crc(const char* header, size_t page_size) {
+	uint32_t crc = crc32c(0, header, DB_HEADER_CSUM_OFF);
+	size_t rest = DB_HEADER_CSUM_OFF + sizeof(uint32_t);
+	return crc32c(crc, header + rest, page_size - rest);
+}
+
+// Checks a page against its recorded checksum the first time it is used.
+// Pages without a checksum always pass.
+int database_check_page(struct database* db, int32_t page) {
+	if ((size_t)page >= db->csum_len || db->csum_state[page] == DBCSUM_NONE || db->csum_state[page] == DBCSUM_OK) {
+		return 1;
+	}
+	if (db->csum_state[page] == DBCSUM_PENDING) {
+		uint32_t crc = crc32c(0, dbfile_get_page(&db->dbf, page), db->dbf.page_size);
+		db->csum_state[page] = crc == db->csums[page] ? DBCSUM_OK : DBCSUM_BAD;
+		if (db->csum_state[page] == DBCSUM_OK) {
+			return 1;
+		}
+		++db->corrupt;
+	}
+	return 0;
+}
+
+// Bounds check for a hash slot, so a damaged slot can not send a read
+// past the end of the file
+int dbslot_valid(const int32_t* slot, size_t slot_size, size_t page_size, size_t page_count) {
+	if (slot[0] == -2) {
+		return slot[1] > 0 && slot[2] > 0 && (size_t)slot[1] + (size_t)slot[2] <= slot_size - (sizeof(int32_t) * 3);
+	}
+	// empty and deleted slots, any other page under 1 is damage
+	if (slot[0] == 0 || slot[0] == -1) {
+		return 1;
+	}
+	return slot[0] > 0 && (size_t)slot[0] < page_count && slot[1] >= 0 && slot[2] > 0 &&
+	       ((size_t)slot[0] * page_size) + (size_t)slot[1] + (size_t)slot[2] <= page_count * page_size;
+}
+
+int database_valid_slot(struct database* db, const int32_t* slot) {
+	if (dbslot_valid(slot, HASHSTORAGE_PTR_SIZE + db->inline_cap, db->dbf.page_size, db->dbf.page_count)) {
+		return 1;
+	}
+	++db->corrupt;
+	return 0;
+}
+
+// Files written before slot sizes were recorded use bare storage pointers.
+// With expiry the last 8 bytes of a slot hold the expiry time.
+void database_set_slot_size(struct database* db, size_t slot_size, int expiry) {
+	db->slot_size = slot_size > 0 ? slot_size : HASHSTORAGE_PTR_SIZE;
+	db->slots_per_block = (db->dbf.page_size - HASH_BLOCK_HEADER_SIZE) / db->slot_size;
+	db->expiry_off = expiry ? db->slot_size - sizeof(uint64_t) : 0;
+	db->inline_cap = db->slot_size - HASHSTORAGE_PTR_SIZE - (expiry ? sizeof(uint64_t) : 0);
+	db->sweep_pos = 0;
+}
+
+size_t database_slot_size_for(const struct dbcfg* cfg) {
+	size_t expiry_size = cfg != NULL && cfg->expiry ? sizeof(uint64_t) : 0;
+	if (cfg == NULL || cfg->inline_size == 0) {
+		return HASHSTORAGE_PTR_SIZE + expiry_size;
+	}
+	size_t inline_words = (cfg->inline_size + sizeof(int32_t) - 1) / sizeof(int32_t);
+	return HASHSTORAGE_PTR_SIZE + (inline_words * sizeof(int32_t)) + expiry_size;
+}
+
+int32_t* database_slot_at(struct database* db, char* block, size_t n) {
+	return (int32_t*)(block + HASH_BLOCK_HEADER_SIZE + (n * db->slot_size));
+}
+
+int32_t* database_slot_end(struct database* db, char* block) {
+	return database_slot_at(db, block, db->slots_per_block);
+}
+
+int32_t* database_slot_next(struct database* db, int32_t* slot) {
+	return (int32_t*)((char*)slot + db->slot_size);
+}
+
+// expiry times are wall clock milliseconds, so they hold across restarts
+uint64_t database_now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ((uint64_t)ts.tv_sec * 1000) + ((uint64_t)ts.tv_nsec / 1000000);
+}
+
+// The expiry time of the record in slot, 0 if it never expires
+uint64_t database_slot_expiry(struct database* db, const int32_t* slot) {
+	uint64_t at = 0;
+	if (db->expiry_off != 0) {
+		memcpy(&at, (const char*)slot + db->expiry_off, sizeof(at));
+	}
+	return at;
+}
+
+void database_set_slot_expiry(struct database* db, int32_t* slot, uint64_t at) {
+	if (db->expiry_off != 0) {
+		memcpy((char*)slot + db->expiry_off, &at, sizeof(at));
+	}
+}
+
+// Expired records read as missing until database_sweep reclaims them
+int database_slot_expired(struct database* db, const int32_t* slot) {
+	uint64_t at = database_slot_expiry(db, slot);
+	return at != 0 && at <= database_now_ms();
+}
+
+int _has_magic_seq(const char* page) {
+	return page[0] == MAGIC_SEQ[0] &&
+	       page[1] == MAGIC_SEQ[1] &&
+	       page[2] == MAGIC_SEQ[2] &&
+	       page[3] == MAGIC_SEQ[3];
+}
+
+void _erase_region(char* ptr, size_t off, size_t size, size_t end) {
+	memmove(ptr + off, ptr + off + size, end - (off + size));
+}
+
+void _write_storage_ptr(char* ptr, int32_t page, int32_t off, int32_t size) {
+	int32_t* writer = (int32_t*)ptr;
+	writer[0] = page;
+	writer[1] = off;
 	writer[2] = size;
 }
 
@@ -460,10 +1926,12 @@ void _read_storage_ptr_po(const char* ptr, int32_t size, int32_t* output) {
 	output[2] = size;
 }
 
+// offsets are kept below the page size so a pointer always names the page it starts in
 void _shift_storage_ptr(char* ptr, int32_t amount, size_t page_size) {
 	int32_t* writer = (int32_t*)ptr;
-	writer[0] += (amount / page_size);
-	writer[1] += amount;
+	size_t moved = (size_t)writer[1] + amount;
+	writer[0] += (moved / page_size);
+	writer[1] = moved % page_size;
 	writer[2] -= amount;
 }
 
@@ -484,6 +1952,34 @@ void _mark_del_storage_ptr(int32_t* reader) {
 	reader[0] = -1;
 }
 
+// page number of a hash slot holding its record inline
+static const int32_t SLOT_INLINE = -2;
+
+int _is_inline_slot(const int32_t* reader) {
+	return reader[0] == SLOT_INLINE;
+}
+
+char* _slot_payload(const int32_t* reader) {
+	return (char*)(reader + HASHSTORAGE_PTR_SIZE_INT);
+}
+
+// Copies the pointer of a slot a writer may be changing, so that the copy
+// is what gets checked and used
+void _read_slot_ptr(int32_t* out, const int32_t* reader) {
+	const volatile int32_t* src = reader;
+	out[0] = src[0];
+	out[1] = src[1];
+	out[2] = src[2];
+}
+
+void _write_inline_slot(int32_t* writer, const char* key, int32_t key_size, const char* val, int32_t val_size) {
+	writer[0] = SLOT_INLINE;
+	writer[1] = key_size;
+	writer[2] = val_size;
+	memcpy(_slot_payload(writer), key, key_size);
+	memcpy(_slot_payload(writer) + key_size, val, val_size);
+}
+
 int _is_size_zero_storage_ptr(const char* ptr) {
 	int32_t* reader = (int32_t*)ptr;
 	return reader[2] == 0;
@@ -528,7 +2024,7 @@ int32_t database_get_spaceroot(struct database* db) {
 size_t database_get_hash_len(struct database* db) {
 	char* header = dbfile_get_page(&db->dbf, 0);
 	int32_t hash_block_len = *(int32_t*)(header + DB_HEADER_HASH_LEN_OFF);
-	return hash_block_len * hashes_per_block(db->dbf.page_size);
+	return hash_block_len * db->slots_per_block;
 }
 
 int32_t database_get_hash_count(struct database* db) {
@@ -543,9 +2039,13 @@ int32_t database_get_page_size(struct database* db) {
 	return page_size;
 }
 
-int database_get_factor_lim(struct database* db, double* result) {
-	char* header = dbfile_get_page(&db->dbf, 0);
+static int dbheader_max_load(const char* header, double* result) {
+	int32_t max_load = *(int32_t*)(header + DB_HEADER_MAX_LOAD_OFF);
 	int32_t fact_lim = *(int32_t*)(header + DB_HEADER_FACT_LIM_OFF);
+	if (max_load > 0) {
+		*result = (double)max_load / DB_LOAD_UNIT;
+		return 1;
+	}
 	if (fact_lim > 0) {
 		*result = 1.0 / (double)fact_lim;
 		return 1;
@@ -553,13 +2053,47 @@ int database_get_factor_lim(struct database* db, double* result) {
 	return 0;
 }
 
+// Load factor the index expands at, 0 if it never does
+int database_get_factor_lim(struct database* db, double* result) {
+	return dbheader_max_load(dbfile_get_page(&db->dbf, 0), result);
+}
+
+// Sets the limit to 1 / amount, replacing any fractional limit
 int32_t database_set_factor_lim(struct database* db, int32_t amount) {
 	char* header = dbfile_get_page(&db->dbf, 0);
 	int32_t* fact_lim = (int32_t*)(header + DB_HEADER_FACT_LIM_OFF);
 	*fact_lim = amount;
+	*(int32_t*)(header + DB_HEADER_MAX_LOAD_OFF) = 0;
 	return amount;
 }
 
+double database_get_growth(struct database* db) {
+	char* header = dbfile_get_page(&db->dbf, 0);
+	int32_t growth = *(int32_t*)(header + DB_HEADER_GROWTH_OFF);
+	return growth > 0 ? (double)growth / DB_LOAD_UNIT : DB_DEF_GROWTH;
+}
+
+double database_get_min_load(struct database* db) {
+	char* header = dbfile_get_page(&db->dbf, 0);
+	return (double)*(int32_t*)(header + DB_HEADER_MIN_LOAD_OFF) / DB_LOAD_UNIT;
+}
+
+// Sets the sizing policy of the index, min_load 0 disables shrinking.
+// Returns 0 and changes nothing if the values do not pass dbload_validate.
+int database_set_load_policy(struct database* db, double max_load, double growth, double min_load) {
+	if (!dbload_validate(max_load, growth, min_load)) {
+		return 0;
+	}
+	char* header = dbfile_get_page(&db->dbf, 0);
+	*(int32_t*)(header + DB_HEADER_MAX_LOAD_OFF) = (int32_t)(max_load * DB_LOAD_UNIT + 0.5);
+	*(int32_t*)(header + DB_HEADER_GROWTH_OFF) = (int32_t)(growth * DB_LOAD_UNIT + 0.5);
+	*(int32_t*)(header + DB_HEADER_MIN_LOAD_OFF) = (int32_t)(min_load * DB_LOAD_UNIT + 0.5);
+	// nearest whole limit, for readers that only know fact_lim
+	int32_t fact_lim = (int32_t)(1.0 / max_load + 0.5);
+	*(int32_t*)(header + DB_HEADER_FACT_LIM_OFF) = fact_lim > 0 ? fact_lim : 1;
+	return 1;
+}
+
 int64_t database_get_item_count(struct database* db) {
 	char* header = dbfile_get_page(&db->dbf, 0);
 	int64_t item_len = *(int64_t*)(header + DB_HEADER_ITEM_COUNT_OFF);
@@ -584,6 +2118,25 @@ double database_get_load_factor(struct database* db) {
 	return (double)database_get_item_count(db) / (double)database_get_hash_len(db);
 }
 
+int32_t database_get_tree_root(struct database* db) {
+	char* header = dbfile_get_page(&db->dbf, 0);
+	return *(int32_t*)(header + DB_HEADER_TREE_ROOT_OFF);
+}
+
+void database_set_tree_root(struct database* db, int32_t new_root) {
+	char* header = dbfile_get_page(&db->dbf, 0);
+	*(int32_t*)(header + DB_HEADER_TREE_ROOT_OFF) = new_root;
+}
+
+int database_has_ordered_index(struct database* db) {
+	return database_get_tree_root(db) > 0;
+}
+
+// Records referenced by the ordered index need a storage pointer
+int database_fits_inline(struct database* db, size_t total_size) {
+	return total_size <= db->inline_cap && !database_has_ordered_index(db);
+}
+
 void database_set_hash_count(struct database* db, int32_t new_count) {
 	char* header = dbfile_get_page(&db->dbf, 0);
 	*(int32_t*)(header + DB_HEADER_HASH_LEN_OFF) = new_count;
@@ -667,6 +2220,7 @@ int32_t database_find_space_storage(struct database* db, int32_t min_size, int32
 	while (space_iter != -1) {
 		char* space_page = dbfile_get_page(&db->dbf, space_iter);
 		int32_t* header = (int32_t*)space_page;
+		DBSTAT_ADD(db->stats, free_list_scans, 1);
 		if (database_find_space_ptr(space_page, min_size, db->dbf.page_size, result) != -1) {
 			return 0;
 		}
@@ -708,6 +2262,9 @@ void database_place_ptr_in_len_block(char* block, int32_t page, int32_t off, int
 
 int32_t database_add_space_block(struct database* db) {
 	int32_t new_block = dbfile_grow(&db->dbf, 1);
+	if (new_block == -1) {
+		return -1;
+	}
 	database_len_init(dbfile_get_page(&db->dbf, new_block));
 	int32_t space_iter = database_get_spaceroot(db);
 	char* space_page = dbfile_get_page(&db->dbf, space_iter);
@@ -743,20 +2300,19 @@ int32_t database_add_hash_block(struct database* db, size_t n_blocks) {
 }
 // makes a linked list of new hash blocks
 int32_t database_make_hash_blocks(struct database* db, size_t n_blocks) {
-	int32_t hash_block_first = dbfile_grow(&db->dbf, 1);
-	database_hash_init(dbfile_get_page(&db->dbf, hash_block_first));
-	int32_t hash_iter = hash_block_first;
-	char* hash_page = dbfile_get_page(&db->dbf, hash_iter);
-	int32_t* reader = (int32_t*)hash_page;
-	// now at end of list, begin adding
-	while(--n_blocks) {
-		int32_t new_block = dbfile_grow(&db->dbf, 1);
-		char * got = dbfile_get_page(&db->dbf, new_block);
-		database_hash_init(got);
-		reader[0] = new_block;
-		hash_iter = reader[0];
-		hash_page = dbfile_get_page(&db->dbf, hash_iter);
-		reader = (int32_t*)hash_page;
+	// one contiguous run, so the whole index is a single extent on disk
+	int32_t hash_block_first = dbfile_grow(&db->dbf, n_blocks);
+	if (hash_block_first == -1) {
+		return -1;
+	}
+	char* run = dbfile_map_run(&db->dbf, hash_block_first, n_blocks);
+	size_t page_size = db->dbf.page_size;
+	for (size_t i = 0; i < n_blocks; ++i) {
+		char* page = run != NULL ? run + (i * page_size) : dbfile_get_page(&db->dbf, hash_block_first + i);
+		database_hash_init(page);
+		if (i + 1 < n_blocks) {
+			((int32_t*)page)[0] = hash_block_first + i + 1;
+		}
 	}
 	return hash_block_first;
 }
@@ -765,108 +2321,466 @@ int32_t database_make_hash_blocks(struct database* db, size_t n_blocks) {
 int32_t database_add_storage_blocks(struct database* db, int32_t size) {
 	int32_t block_count = (size / db->dbf.page_size) + 1;
 	int32_t new_block = dbfile_grow(&db->dbf, block_count);
+	if (new_block == -1) {
+		return -1;
+	}
 
 	int32_t toadd_to = database_find_space_block(db);
-	char* adding_space = dbfile_get_page(&db->dbf, toadd_to);
-	database_place_ptr_in_len_block(adding_space, new_block, 0, block_count * db->dbf.page_size);
-	return new_block;
-}
+	if (toadd_to == -1) {
+		toadd_to = database_add_space_block(db);
+	}
+	if (toadd_to == -1) {
+		return -1;
+	}
+	char* adding_space = dbfile_get_page(&db->dbf, toadd_to);
+	database_place_ptr_in_len_block(adding_space, new_block, 0, block_count * db->dbf.page_size);
+	return new_block;
+}
 
+// Returns 1 if the file had to grow, 0 if existing space was used, -1 if it could not grow
 int database_allocate_storage(struct database* db, int32_t size, int32_t* result) {
 	int did_inc = 0;
 	while (database_find_space_storage(db, size, result) == -1) {
 		did_inc = 1;
-		database_add_storage_blocks(db, size);
+		if (database_add_storage_blocks(db, size) == -1) {
+			return -1;
+		}
 	}
 	return did_inc;
 }
 
+// snapshots
+// * taking one only bumps an epoch, writers pay for it afterwards
+// * the first write to a hash page after a snapshot copies the page out,
+//   snapshots read a page through the oldest copy not older than them
+// * storage freed while a snapshot is live is held back until every
+//   snapshot that could still reference it is released
+// * the ordered index is not covered, snapshots read through the hash index
+struct dbsnapshot {
+	struct database* db;
+	uint64_t epoch;
+	int64_t item_count;
+	// the hash blocks of the snapshot, set once the live index was resized
+	struct page_vec hash_pages;
+	int own_pages;
+	struct dbsnapshot* older;
+	struct dbsnapshot* newer;
+};
+
+static const size_t DBCOW_BUCKETS = 256;
+
+// Saves page for the live snapshots before it is first written
+int database_cow_page(struct database* db, int32_t page) {
+	struct dbcow* cow = &db->cow;
+	if (db->snaps == NULL) {
+		return 1;
+	}
+	if ((size_t)page >= cow->tags_len) {
+		size_t next_len = cow->tags_len * 2 > (size_t)page ? cow->tags_len * 2 : (size_t)page + 1;
+		cow->tags = KAMOODB_REALLOC(cow->tags, next_len * sizeof(uint64_t));
+		memset(cow->tags + cow->tags_len, 0, (next_len - cow->tags_len) * sizeof(uint64_t));
+		cow->tags_len = next_len;
+	}
+	uint64_t newest = db->snaps->epoch;
+	if (cow->tags[page] >= newest) {
+		return 1;
+	}
+	struct dbcow_copy* copy = KAMOODB_MALLOC(sizeof(struct dbcow_copy) + db->dbf.page_size);
+	if (copy == NULL) {
+		return 0;
+	}
+	copy->page = page;
+	copy->tag = newest;
+	memcpy(copy->data, dbfile_get_page(&db->dbf, page), db->dbf.page_size);
+	struct dbcow_copy** bucket = &cow->buckets[(size_t)page % DBCOW_BUCKETS];
+	copy->next = *bucket;
+	*bucket = copy;
+	cow->tags[page] = newest;
+	DBSTAT_ADD(db->stats, cow_copies, 1);
+	return 1;
+}
+
+// The page as snapshot epoch saw it
+const char* database_cow_read(struct database* db, int32_t page, uint64_t epoch) {
+	const struct dbcow_copy* best = NULL;
+	if (db->cow.buckets != NULL && (size_t)page < db->cow.tags_len && db->cow.tags[page] >= epoch) {
+		for (const struct dbcow_copy* iter = db->cow.buckets[(size_t)page % DBCOW_BUCKETS]; iter != NULL; iter = iter->next) {
+			if (iter->page == page && iter->tag >= epoch && (best == NULL || iter->tag < best->tag)) {
+				best = iter;
+			}
+		}
+	}
+	if (best != NULL) {
+		return best->data;
+	}
+	return database_check_page(db, page) ? dbfile_get_page(&db->dbf, page) : NULL;
+}
+
+static int database_defer_free(struct database* db, const int32_t* result) {
+	struct dbcow* cow = &db->cow;
+	if (cow->frees_len == cow->frees_cap) {
+		size_t next_cap = cow->frees_cap > 0 ? cow->frees_cap * 2 : 64;
+		struct dbcow_free* next = KAMOODB_REALLOC(cow->frees, next_cap * sizeof(struct dbcow_free));
+		if (next == NULL) {
+			return 0;
+		}
+		cow->frees = next;
+		cow->frees_cap = next_cap;
+	}
+	memcpy(cow->frees[cow->frees_len].ptr, result, sizeof(int32_t) * 3);
+	cow->frees[cow->frees_len].tag = db->snaps->epoch;
+	++cow->frees_len;
+	return 1;
+}
+
+static int database_free_extent(struct database* db, const int32_t* result);
+
 int database_deallocate_storage(struct database* db, const int32_t* result) {
 	if (result[0] <= 0) {
 		return 0;
 	}
+	if (db->snaps != NULL) {
+		return database_defer_free(db, result);
+	}
+	return database_free_extent(db, result);
+}
+
+// Folds the free extents right before and after ext into it
+static void database_merge_free(struct database* db, int32_t* ext) {
+	size_t page_size = db->dbf.page_size;
+	for (int merged = 1; merged;) {
+		merged = 0;
+		size_t start = ((size_t)ext[0] * page_size) + ext[1];
+		size_t end = start + ext[2];
+		for (int32_t iter = database_get_spaceroot(db); iter != -1 && !merged;) {
+			char* block = dbfile_get_page(&db->dbf, iter);
+			int32_t* header = (int32_t*)block;
+			for (int32_t i = 0; i < header[1]; ++i) {
+				int32_t* entry = (int32_t*)(block + LEN_BLOCK_HEADER_SIZE + (i * STORAGE_PTR_SIZE));
+				size_t entry_start = ((size_t)entry[0] * page_size) + entry[1];
+				if ((entry_start + entry[2] != start && entry_start != end) || (int64_t)ext[2] + entry[2] > INT32_MAX) {
+					continue;
+				}
+				if (entry_start < start) {
+					ext[0] = entry[0];
+					ext[1] = entry[1];
+				}
+				ext[2] += entry[2];
+				_erase_region(block, (char*)entry - block, STORAGE_PTR_SIZE, page_size);
+				database_len_dec(block);
+				merged = 1;
+				break;
+			}
+			iter = header[0];
+		}
+	}
+}
 
+static int database_free_extent(struct database* db, const int32_t* result) {
+	int32_t ext[3] = {result[0], result[1], result[2]};
+	// in cache mode evicted records have to add up to room for new ones
+	if (db->capacity > 0) {
+		database_merge_free(db, ext);
+		result = ext;
+	}
 	int32_t toadd_to = -1;
 	toadd_to = database_find_space_block(db);
 	if (toadd_to == -1) {
 		toadd_to = database_add_space_block(db);
 	}
+	if (toadd_to == -1) {
+		return 0;
+	}
 	char* adding_space = dbfile_get_page(&db->dbf, toadd_to);
 	database_place_ptr_in_len_block(adding_space, result[0], result[1], result[2]);
 	return 1;
 }
 
-int database_compare_key(struct database* db, const char* key, size_t key_size, const int32_t* store_ptr) {
-	return dbfile_cmp_null(&db->dbf, store_ptr[0], store_ptr[1], key, key_size);
+// Frees a list of pages, coalescing runs of consecutive pages into single extents
+void database_deallocate_pages(struct database* db, const struct page_vec* pvec) {
+	size_t page_size = db->dbf.page_size;
+	size_t max_run = INT32_MAX / page_size;
+	size_t i = 0;
+	while (i < pvec->len) {
+		size_t run = 1;
+		while (i + run < pvec->len && run < max_run && pvec->pages[i + run] == pvec->pages[i] + (int32_t)run) {
+			++run;
+		}
+		int32_t freed_storage[3] = {pvec->pages[i], 0, (int32_t)(run * page_size)};
+		database_deallocate_storage(db, freed_storage);
+		i += run;
+	}
 }
 
-int32_t* database_hash_and_probe(struct database* db, const char* key, size_t key_size, 
-	                            int32_t sblock, int32_t* slot, int put) {
-	char* page = dbfile_get_page(&db->dbf, sblock);
-	int32_t* place = _hash_block_at(page, slot == NULL ? 0 : *slot);
-	if (_is_empty_ins_storage_ptr(place)) {
-		return place;
-	} else if(_is_del_storage_ptr(place)) {
-		if (put) {
-			return place;
-		}
-	} else if (database_compare_key(db, key, key_size, place)) {
-		return place;
+int database_compare_key(struct database* db, const char* key, size_t key_size, const int32_t* store_ptr) {
+	int32_t slot[3];
+	DBSTAT_ADD(db->stats, key_compares, 1);
+	_read_slot_ptr(slot, store_ptr);
+	if (!database_valid_slot(db, slot)) {
+		return 0;
 	}
+	if (_is_inline_slot(slot)) {
+		return (size_t)slot[1] == key_size && memcmp(_slot_payload(store_ptr), key, key_size) == 0;
+	}
+	return dbfile_cmp_null(&db->dbf, slot[0], slot[1], key, key_size);
+}
+
+// Probes one hash block starting at slot. Returns the slot holding key, or
+// an empty slot if key is not in the block. With put set, the first deleted
+// slot is handed back instead of an empty one so it gets reused. If the
+// whole block was probed without finding key or an empty slot, full is set
+// and that deleted slot or NULL is returned.
+static int32_t* database_probe_page_full(struct database* db, const char* key, size_t key_size,
+	                                     char* page, int32_t* slot, int put, int* full) {
+	int32_t* place = database_slot_at(db, page, slot == NULL ? 0 : *slot);
+	int32_t* begin = database_slot_at(db, page, 0);
+	int32_t* end = database_slot_end(db, page);
+	int32_t* first_del = NULL;
 	int32_t* iter = place;
-	int32_t* begin = _hash_block_begin(page);
-	int32_t* end = _hash_block_end(page, db->dbf.page_size);
-	while (iter != end) {
+	do {
+		DBSTAT_ADD(db->stats, probes, 1);
 		if (_is_empty_ins_storage_ptr(iter)) {
-			return iter;
+			return first_del != NULL ? first_del : iter;
 		} else if(_is_del_storage_ptr(iter)) {
-			if (put) {
-				return iter;
+			if (put && first_del == NULL) {
+				first_del = iter;
 			}
 		} else if (database_compare_key(db, key, key_size, iter)) {
 			return iter;
 		}
-		iter += HASHSTORAGE_PTR_SIZE_INT;
+		iter = database_slot_next(db, iter);
+		if (iter == end) {
+			iter = begin;
+		}
+	} while (iter != place);
+	*full = 1;
+	return first_del;
+}
+
+int32_t* database_probe_page(struct database* db, const char* key, size_t key_size,
+	                        char* page, int32_t* slot, int put) {
+	int full = 0;
+	return database_probe_page_full(db, key, key_size, page, slot, put, &full);
+}
+
+int32_t* database_hash_and_probe(struct database* db, const char* key, size_t key_size, 
+	                            int32_t sblock, int32_t* slot, int put) {
+	return database_probe_page(db, key, key_size, dbfile_get_page(&db->dbf, sblock), slot, put);
+}
+
+// bloom filter
+// * an optional blocked Bloom filter over the keys, checked before a get or
+//   del probes the index, so most misses touch no hash or storage page
+// * one contiguous run of pages cut into 64 byte blocks. A key picks one
+//   block from its hash and sets or tests all of its bits in that block,
+//   so a check reads a single cache line
+// * deletes leave their bits set, the filter is rebuilt from the live
+//   records whenever the index is resized
+static const size_t DBBLOOM_BLOCK_SIZE = 64;
+
+uint64_t dbhash_mix64(uint64_t hash) {
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+void database_load_bloom(struct database* db) {
+	char* header = dbfile_get_page(&db->dbf, 0);
+	int32_t root = *(int32_t*)(header + DB_HEADER_BLOOM_ROOT_OFF);
+	int32_t pages = *(int32_t*)(header + DB_HEADER_BLOOM_PAGES_OFF);
+	int32_t bits = *(int32_t*)(header + DB_HEADER_BLOOM_BITS_OFF);
+	if (root <= 0 || pages <= 0 || (size_t)root + pages > db->dbf.page_count) {
+		db->bloom_root = 0;
+		return;
 	}
-	iter = begin;
-	while (iter != place) {
-		if (_is_empty_ins_storage_ptr(iter)) {
-			return iter;
-		} else if(_is_del_storage_ptr(iter)) {
-			if (put) {
-				return iter;
-			}
-		} else if (database_compare_key(db, key, key_size, iter)) {
-			return iter;
+	db->bloom_root = root;
+	db->bloom_pages = pages;
+	// about the number of probes that gives the fewest false positives
+	size_t k = (size_t)((bits * 0.69) + 0.5);
+	db->bloom_k = k < 1 ? 1 : (k > 16 ? 16 : k);
+}
+
+// The block of the filter hash maps to, NULL if its page failed its checksum.
+// Only a prefetch may skip the check.
+static uint64_t* database_bloom_block(struct database* db, size_t hash, uint64_t* mixed, int check) {
+	size_t per_page = db->dbf.page_size / DBBLOOM_BLOCK_SIZE;
+	// seeded apart from dbsharded_shard_of, which picks by the same hash
+	uint64_t h = dbhash_mix64(hash ^ 0x2545f4914f6cdd1dULL);
+	size_t block = (size_t)(((unsigned __int128)h * (db->bloom_pages * per_page)) >> 64);
+	int32_t page = db->bloom_root + (int32_t)(block / per_page);
+	*mixed = dbhash_mix64(h ^ 0x9e3779b97f4a7c15ULL);
+	if (check && !database_check_page(db, page)) {
+		return NULL;
+	}
+	return (uint64_t*)(dbfile_get_page(&db->dbf, page) + ((block % per_page) * DBBLOOM_BLOCK_SIZE));
+}
+
+// hash is the hash_djb2 of the key, like the index uses
+void database_bloom_add(struct database* db, size_t hash) {
+	uint64_t mixed = 0;
+	uint64_t* words = db->bloom_root > 0 ? database_bloom_block(db, hash, &mixed, 1) : NULL;
+	uint32_t step = (uint32_t)(mixed >> 32) | 1;
+	for (size_t i = 0; words != NULL && i < db->bloom_k; ++i) {
+		uint32_t bit = ((uint32_t)mixed + ((uint32_t)i * step)) % (DBBLOOM_BLOCK_SIZE * 8);
+		words[bit / 64] |= 1ULL << (bit % 64);
+	}
+}
+
+// 0 if the key is certainly not in the database
+int database_bloom_maybe(struct database* db, size_t hash) {
+	uint64_t mixed = 0;
+	uint64_t* words = db->bloom_root > 0 ? database_bloom_block(db, hash, &mixed, 1) : NULL;
+	if (words == NULL) {
+		return 1;
+	}
+	uint32_t step = (uint32_t)(mixed >> 32) | 1;
+	for (size_t i = 0; i < db->bloom_k; ++i) {
+		uint32_t bit = ((uint32_t)mixed + ((uint32_t)i * step)) % (DBBLOOM_BLOCK_SIZE * 8);
+		if (!(words[bit / 64] & (1ULL << (bit % 64)))) {
+			return 0;
 		}
-		iter += HASHSTORAGE_PTR_SIZE_INT;
 	}
-	return NULL;
+	return 1;
+}
+
+// Replaces the filter with an empty one sized for an index of n_slots
+// filled up to its expansion limit. The old run is returned to be freed.
+static int database_bloom_reset(struct database* db, size_t n_slots, int32_t* old_run) {
+	char* header = dbfile_get_page(&db->dbf, 0);
+	int32_t bits = *(int32_t*)(header + DB_HEADER_BLOOM_BITS_OFF);
+	double max_load = DB_DEF_MAX_LOAD;
+	old_run[0] = db->bloom_root;
+	old_run[1] = 0;
+	old_run[2] = (int32_t)(db->bloom_pages * db->dbf.page_size);
+	if (bits <= 0) {
+		return 1;
+	}
+	database_get_factor_lim(db, &max_load);
+	size_t filter_bits = (size_t)((double)n_slots * max_load * bits);
+	size_t page_bits = db->dbf.page_size * 8;
+	size_t pages = (filter_bits + page_bits - 1) / page_bits;
+	pages = pages > 0 ? pages : 1;
+	int32_t root = dbfile_grow(&db->dbf, pages);
+	if (root == -1) {
+		return 0;
+	}
+	for (size_t i = 0; i < pages; ++i) {
+		memset(dbfile_get_page(&db->dbf, root + i), 0, db->dbf.page_size);
+	}
+	header = dbfile_get_page(&db->dbf, 0);
+	*(int32_t*)(header + DB_HEADER_BLOOM_ROOT_OFF) = root;
+	*(int32_t*)(header + DB_HEADER_BLOOM_PAGES_OFF) = (int32_t)pages;
+	database_load_bloom(db);
+	return 1;
+}
+
+// Finds the hash slot of key, falling back to the other blocks when its own
+// block is full. With put set, returns the slot key should be written to,
+// otherwise the slot holding key or NULL if key is not present or expired.
+// The index of the found slot over all hash blocks goes to slot_out.
+static int32_t* database_find_slot_in(struct database* db, const char* key, size_t key_size, int put,
+	                                  int32_t* block_out, size_t* slot_out) {
+	size_t hash = hash_djb2(key);
+	if (!put && !database_bloom_maybe(db, hash)) {
+		DBSTAT_ADD(db->stats, bloom_skips, 1);
+		return NULL;
+	}
+	size_t hash_slot = hash % database_get_hash_len(db);
+	int32_t hash_place = hash_slot % db->slots_per_block;
+	size_t block_n = hash_slot / db->slots_per_block;
+	int32_t into_block = database_get_hash_block(db, block_n);
+	if (!database_check_page(db, into_block)) {
+		return NULL;
+	}
+	int full = 0;
+	int32_t* found = database_probe_page_full(db, key, key_size, dbfile_get_page(&db->dbf, into_block),
+	                                          &hash_place, put, &full);
+	// a full home block may have sent key to the blocks it overflows to, a
+	// put looks for it there before taking a deleted or overflow slot
+	for (size_t i = 0; put && full && i < db->hash_pages.len; ++i) {
+		int32_t other = database_get_hash_block(db, i);
+		if (i == block_n) {
+			continue;
+		}
+		if (!database_check_page(db, other)) {
+			return NULL;
+		}
+		int32_t* there = database_hash_and_probe(db, key, key_size, other, NULL, 0);
+		if (there != NULL && !_is_empty_ins_storage_ptr(there)) {
+			found = there;
+			block_n = i;
+			into_block = other;
+			break;
+		}
+	}
+	for (size_t i = 0; found == NULL && i < db->hash_pages.len; ++i) {
+		block_n = i;
+		into_block = database_get_hash_block(db, i);
+		if (!database_check_page(db, into_block)) {
+			return NULL;
+		}
+		found = database_hash_and_probe(db, key, key_size, into_block, NULL, put);
+	}
+	if (found != NULL && !put && (_is_empty_ins_storage_ptr(found) || database_slot_expired(db, found))) {
+		return NULL;
+	}
+	*block_out = into_block;
+	if (found != NULL && slot_out != NULL) {
+		const char* first = (const char*)database_slot_at(db, dbfile_get_page(&db->dbf, into_block), 0);
+		*slot_out = (block_n * db->slots_per_block) + (size_t)((const char*)found - first) / db->slot_size;
+	}
+	return found;
+}
+
+int32_t* database_find_slot(struct database* db, const char* key, size_t key_size, int put) {
+	int32_t block = 0;
+	return database_find_slot_in(db, key, key_size, put, &block, NULL);
 }
+
+int database_grow(struct database* db);
+
+// Like database_find_slot for a slot about to be written, which first
+// preserves its page for any live snapshot. A put into an index with every
+// slot taken grows it first, as files with a limit of 1 can fill up.
+int32_t* database_find_slot_for_write(struct database* db, const char* key, size_t key_size, int put) {
+	int32_t block = 0;
+	int32_t* found = database_find_slot_in(db, key, key_size, put, &block, NULL);
+	if (found == NULL && put && database_get_item_count(db) >= (int64_t)database_get_hash_len(db) && database_grow(db)) {
+		found = database_find_slot_in(db, key, key_size, put, &block, NULL);
+	}
+	if (found != NULL && !database_cow_page(db, block)) {
+		return NULL;
+	}
+	return found;
+}
+
 /**
  * This function just compares if its empty or not because we know there cannot be a duplicate
  * */
 int32_t* database_rehash_and_probe(struct database* db, int32_t sblock, int32_t* slot) {
 	char* page = dbfile_get_page(&db->dbf, sblock);
-	int32_t* place = _hash_block_at(page, slot == NULL ? 0 : *slot);
+	int32_t* place = database_slot_at(db, page, slot == NULL ? 0 : *slot);
 	if (_is_empty_ins_storage_ptr(place)) {
 		return place;
 	} 
 	int32_t* iter = place;
-	int32_t* begin = _hash_block_begin(page);
-	int32_t* end = _hash_block_end(page, db->dbf.page_size);
+	int32_t* begin = database_slot_at(db, page, 0);
+	int32_t* end = database_slot_end(db, page);
 	while (iter != end) {
 		if (_is_empty_ins_storage_ptr(iter)) {
 			return iter;
 		}
-		iter += HASHSTORAGE_PTR_SIZE_INT;
+		iter = database_slot_next(db, iter);
 	}
 	iter = begin;
 	while (iter != place) {
 		if (_is_empty_ins_storage_ptr(iter)) {
 			return iter;
 		} 
-		iter += HASHSTORAGE_PTR_SIZE_INT;
+		iter = database_slot_next(db, iter);
 	}
 	return NULL;
 }
@@ -880,28 +2794,35 @@ int32_t database_hashlist_get_n(struct database* db, int32_t hash_list, size_t n
 	return hash_list;
 }
 
+size_t database_slot_hash(struct database* db, const int32_t* store_ptr) {
+	if (_is_inline_slot(store_ptr)) {
+		return hash_djb2(_slot_payload(store_ptr));
+	}
+	return dbfile_hash_null(&db->dbf, store_ptr[0], store_ptr[1]);
+}
 
 int database_rehash_into(struct database* db, const int32_t* store_ptr, struct page_vec* pvec, size_t hash_size) {
-	if (store_ptr[0] < 1) {
+	if (_is_empty_ins_storage_ptr(store_ptr) || _is_del_storage_ptr(store_ptr)) {
 		return 0;
 	}
-	size_t rehash = dbfile_hash_null(&db->dbf, store_ptr[0], store_ptr[1]);
+	size_t rehash = database_slot_hash(db, store_ptr);
 	size_t hash_slot = rehash % hash_size;
-	size_t hash_each_block = hashes_per_block(db->dbf.page_size);
+	size_t hash_each_block = db->slots_per_block;
+	database_bloom_add(db, rehash);
 	int32_t hash_place = hash_slot % hash_each_block;
 	//int32_t into_block = database_hashlist_get_n(db, hash_list, hash_slot / hash_each_block);
 	int32_t into_block = pvec->pages[hash_slot / hash_each_block];
 	int32_t* cur_spot = database_rehash_and_probe(db, into_block, &hash_place);
 	if (cur_spot != NULL) {
-		_write_storage_ptr_hash(cur_spot, store_ptr);
+		memcpy(cur_spot, store_ptr, db->slot_size);
 		return 1;
 	}
 	// iterate over other blocks
 	for (size_t i = 0; i < pvec->len; ++i)
 	{
-		int32_t* list_spot = database_rehash_and_probe(db, i, NULL);
+		int32_t* list_spot = database_rehash_and_probe(db, pvec->pages[i], NULL);
 		if (list_spot != NULL) {
-			_write_storage_ptr_hash(list_spot, store_ptr);
+			memcpy(list_spot, store_ptr, db->slot_size);
 			return 1;
 		}
 	}
@@ -910,16 +2831,70 @@ int database_rehash_into(struct database* db, const int32_t* store_ptr, struct p
 
 char* database_adv_to_val(struct database* db, const int32_t* store_ptr, size_t key_size) {
 	int32_t adv_ptr[3];
-	if (!store_ptr[0])
+	int32_t slot[3];
+	_read_slot_ptr(slot, store_ptr);
+	if (!slot[0] || !database_valid_slot(db, slot))
+		return NULL;
+	if (_is_inline_slot(slot)) {
+		char* inbuf = KAMOODB_MALLOC(slot[2]);
+		memcpy(inbuf, _slot_payload(store_ptr) + slot[1], slot[2]);
+		return inbuf;
+	}
+	// a slot rewritten since its key was compared may hold a shorter record
+	if (slot[0] < 0 || (size_t)slot[2] < key_size)
 		return NULL;
-	adv_ptr[0] = store_ptr[0] + (key_size / db->dbf.page_size);
-	adv_ptr[1] = store_ptr[1] + (key_size % db->dbf.page_size);
-	adv_ptr[2] = store_ptr[2] - key_size;
-	char* strbuf = malloc(adv_ptr[2]);
+	adv_ptr[0] = slot[0] + ((slot[1] + key_size) / db->dbf.page_size);
+	adv_ptr[1] = (slot[1] + key_size) % db->dbf.page_size;
+	adv_ptr[2] = slot[2] - key_size;
+	char* strbuf = KAMOODB_MALLOC(adv_ptr[2]);
 	dbfile_read_po(&db->dbf, adv_ptr[0], adv_ptr[1], strbuf, adv_ptr[2]);
+	if (db->codec.type != DBCODEC_NONE) {
+		char* decoded = dbcodec_decode(&db->codec, strbuf, adv_ptr[2]);
+		KAMOODB_FREE(strbuf);
+		return decoded;
+	}
 	return strbuf;
 }
 
+// Copies a stored value out of a record buffer, decoding it if need be
+char* database_decode_val(struct database* db, const char* stored, size_t size) {
+	if (db->codec.type != DBCODEC_NONE) {
+		return dbcodec_decode(&db->codec, stored, size);
+	}
+	char* val = KAMOODB_MALLOC(size);
+	memcpy(val, stored, size);
+	return val;
+}
+
+// Lays out key and val as a storage record in out, which must hold
+// key_size + dbcodec_bound(val_size) bytes. Returns the record size.
+// Staging space for one record, valid until the next call
+char* database_scratch(struct database* db, size_t size) {
+	if (db->scratch_cap < size) {
+		size_t cap = db->scratch_cap > 0 ? db->scratch_cap : 256;
+		while (cap < size) {
+			cap *= 2;
+		}
+		char* grown = KAMOODB_REALLOC(db->scratch, cap);
+		if (grown == NULL) {
+			return NULL;
+		}
+		db->scratch = grown;
+		db->scratch_cap = cap;
+	}
+	return db->scratch;
+}
+
+size_t database_encode_record(struct database* db, const char* key, size_t key_size,
+	                          const char* val, size_t val_size, char* out) {
+	memcpy(out, key, key_size);
+	if (db->codec.type != DBCODEC_NONE) {
+		return key_size + dbcodec_encode(&db->codec, val, val_size, out + key_size);
+	}
+	memcpy(out + key_size, val, val_size);
+	return key_size + val_size;
+}
+
 void database_populate_hash_pages(struct database* db, int32_t hash_list, struct page_vec* pv) {
 	page_vec_clear(pv);
 	int32_t iter = hash_list;
@@ -930,219 +2905,4089 @@ void database_populate_hash_pages(struct database* db, int32_t hash_list, struct
 	}
 }
 
-int database_expand(struct database* db, size_t n_blocks) {
-	//printf("Expanding Start %ld\n", time(NULL));
+// Rebuilds the index with next_count blocks, dropping tombstones on the way
+int database_resize(struct database* db, size_t next_count) {
+	uint64_t start = dbstat_now();
 	struct page_vec tmpvec;
-	page_vec_init(&tmpvec);
-	size_t cur_block_count = database_get_hash_block_count(db);
-	size_t next_count = (cur_block_count + n_blocks);
-	size_t next_len = next_count * hashes_per_block(db->dbf.page_size);
+	size_t cur_block_count = db->hash_pages.len;
+	if (next_count == 0 || next_count > INT32_MAX) {
+		return 0;
+	}
+	size_t next_len = next_count * db->slots_per_block;
+	for (size_t i = 0; i < cur_block_count; ++i) {
+		if (!database_check_page(db, db->hash_pages.pages[i])) {
+			return 0;
+		}
+	}
 	int32_t new_hash_lists = database_make_hash_blocks(db, next_count);
-	database_populate_hash_pages(db, new_hash_lists, &tmpvec);
-	int32_t old_hash_root = database_get_hashroot(db);
-	int32_t hashiter = old_hash_root;
-	while (hashiter != -1) {
-		char* page = dbfile_get_page(&db->dbf, hashiter);
-		int32_t* begin = _hash_block_begin(page);
-		int32_t* end = _hash_block_end(page, db->dbf.page_size);
-		int32_t* iter = begin;
-		// to do
+	if (new_hash_lists == -1) {
+		return 0;
+	}
+	// the records are hashed anyway, the filter is refilled on the way
+	int32_t old_bloom[3];
+	if (!database_bloom_reset(db, next_len, old_bloom)) {
+		return 0;
+	}
+	page_vec_init(&tmpvec);
+	for (size_t i = 0; i < next_count; ++i) {
+		page_vec_push(&tmpvec, new_hash_lists + i);
+	}
+	for (size_t i = 0; i < cur_block_count; ++i) {
+		char* page = dbfile_get_page(&db->dbf, db->hash_pages.pages[i]);
+		int32_t* iter = database_slot_at(db, page, 0);
+		int32_t* end = database_slot_end(db, page);
 		while (iter != end) {
 			database_rehash_into(db, iter, &tmpvec, next_len);
-			iter += HASHSTORAGE_PTR_SIZE_INT;
+			iter = database_slot_next(db, iter);
 		}
-		hashiter = ((int32_t*)(page))[0];
 	}
 	// reset the hash list,
 	database_set_hashroot(db, new_hash_lists);
-
-	// turn previous hash list into free blocks
-	int32_t old_hash_iter = old_hash_root;
-	while (old_hash_iter != -1) {
-		int32_t to_free = old_hash_iter;
-		char* page = dbfile_get_page(&db->dbf, old_hash_iter);
-		old_hash_iter = ((int32_t*)(page))[0];
-		int32_t freed_storage[3] = {to_free, 0, db->dbf.page_size};
-		database_deallocate_storage(db, freed_storage);
+	database_set_hash_count(db, next_count);
+	// snapshots keep reading the previous index
+	for (struct dbsnapshot* snap = db->snaps; snap != NULL; snap = snap->older) {
+		if (!snap->own_pages) {
+			page_vec_copy(&snap->hash_pages, &db->hash_pages);
+			snap->own_pages = 1;
+		}
+	}
+	// the previous index goes back to the free list as one extent per run of pages
+	database_deallocate_pages(db, &db->hash_pages);
+	if (old_bloom[0] > 0 && old_bloom[0] != db->bloom_root) {
+		database_deallocate_storage(db, old_bloom);
 	}
-	// now recompute the length
-	database_recomp_hash_len(db);
-	page_vec_clear(&db->hash_pages);
+	page_vec_deinit(&db->hash_pages);
 	page_vec_move(&db->hash_pages, &tmpvec);
-	//database_populate_hash_pages(db, new_hash_lists, &db->hash_pages);
-	//printf("Expanding End %ld\n", time(NULL));
+	if (next_count > cur_block_count) {
+		DBSTAT_ADD(db->stats, expands, 1);
+	} else {
+		DBSTAT_ADD(db->stats, shrinks, 1);
+	}
+	DBSTAT_TIME(db->stats, expand, start);
 	return 1;
 }
 
+int database_expand(struct database* db, size_t n_blocks) {
+	return database_resize(db, db->hash_pages.len + n_blocks);
+}
+
+// Grows the index by its growth factor, at least by one block
+int database_grow(struct database* db) {
+	size_t blocks = db->hash_pages.len;
+	size_t next_count = (size_t)((double)blocks * database_get_growth(db));
+	return database_resize(db, next_count > blocks ? next_count : blocks + 1);
+}
+
 void database_check_and_maybe_expand(struct database* db) {
 	double fact = 0.0;
 	if (database_get_factor_lim(db, &fact)) {
 		if (database_get_load_factor(db) > fact) {
-			database_expand(db, database_get_hash_block_count(db));
+			database_grow(db);
 		}
 	}
 }
 
-int database_put(struct database* db, const char* key, const char* val) {
-	int32_t storage_place[3];
-	database_check_and_maybe_expand(db);
-	size_t key_hash = hash_djb2(key);
-	size_t key_size = strlen(key) + 1;
-	size_t val_size = strlen(val) + 1;
-	size_t total_size = key_size + val_size;
-	char* buff = calloc(1, total_size);
-	memcpy(buff, key, key_size);
-	memcpy(buff + key_size, val, val_size);
-	database_allocate_storage(db, total_size, storage_place);
-
-	dbfile_write_po(&db->dbf, storage_place[0], storage_place[1], buff, total_size);
-	free(buff);
+size_t database_blocks_for_items(size_t slots_per_block, double max_load, size_t n_items);
 
-	size_t hash_size = database_get_hash_len(db);
-	size_t hash_slot = key_hash % hash_size;
-	size_t hash_each_block = hashes_per_block(db->dbf.page_size);
-	int32_t hash_place = hash_slot % hash_each_block;
-	int32_t into_block = database_get_hash_block(db, hash_slot / hash_each_block);
-	int32_t* found = database_hash_and_probe(db, key, key_size, into_block, &hash_place, 1);
-	if(found != NULL) {
-		database_deallocate_storage(db, found);
-		_write_storage_ptr_hash(found, storage_place);
-		database_inc_item_count(db, 1);
-		return 1;
+// Shrinks the index back to the size an expansion would have left it at
+void database_check_and_maybe_shrink(struct database* db) {
+	double fact = 0.0;
+	double min_load = database_get_min_load(db);
+	if (min_load <= 0.0 || db->hash_pages.len <= 1 || !database_get_factor_lim(db, &fact)) {
+		return;
 	}
-	int32_t block_iter = database_get_hashroot(db);
-	while (block_iter != -1) {
-		found = database_hash_and_probe(db, key, key_size, into_block, NULL, 1);
-		if(found != NULL) {
-			database_deallocate_storage(db, found);
-			_write_storage_ptr_hash(found, storage_place);
-			database_inc_item_count(db, 1);
-			return 1;
+	if (database_get_load_factor(db) < min_load) {
+		int64_t items = database_get_item_count(db);
+		size_t blocks = database_blocks_for_items(db->slots_per_block, fact / database_get_growth(db),
+		                                          items > 0 ? (size_t)items : 0);
+		if (blocks < db->hash_pages.len) {
+			database_resize(db, blocks);
 		}
-		char* hash_page = dbfile_get_page(&db->dbf, block_iter);
-		int32_t* header = (int32_t*)hash_page;
-		block_iter = header[0];
 	}
-	return 0;
 }
 
-char* database_get(struct database* db, const char* key) {
-	size_t key_hash = hash_djb2(key);
-	size_t key_size = strlen(key) + 1;
-	size_t hash_size = database_get_hash_len(db);
-	size_t hash_slot = key_hash % hash_size;
-	size_t hash_each_block = hashes_per_block(db->dbf.page_size);
-	int32_t hash_place = hash_slot % hash_each_block;
-	int32_t into_block = database_get_hash_block(db, hash_slot / hash_each_block);
+// ordered index
+// * optional B+tree kept next to the hash index, point lookups never use it
+// [kind][count][link][entries]
+// kind = 1 for a leaf, 0 for an inner node
+// leaf link = next leaf or -1, leaf entry = storage pointer of the record
+// inner link = leftmost child, inner entry = storage pointer of a separator key, child
+// * separators are copies of keys in storage, so they stay valid when the
+//   record they were taken from is deleted
+// * nodes are not merged on delete, scans step over empty leaves
+static const size_t TREE_NODE_HEADER_SIZE = sizeof(int32_t) * 3;
+static const size_t TREE_LEAF_ENTRY_SIZE = sizeof(int32_t) * 3;
+static const size_t TREE_INNER_ENTRY_SIZE = sizeof(int32_t) * 4;
 
-	int32_t* found = database_hash_and_probe(db, key, key_size, into_block, &hash_place, 0);
-	if(found != NULL) {
-		return database_adv_to_val(db, found, key_size);
-	}
-	int32_t block_iter = database_get_hashroot(db);
-	while (block_iter != -1) {
-		found = database_hash_and_probe(db, key, key_size, into_block, NULL, 0);
-		if(found != NULL) {
-			return database_adv_to_val(db, found, key_size);
-		}
-		char* hash_page = dbfile_get_page(&db->dbf, block_iter);
-		int32_t* header = (int32_t*)hash_page;
-		block_iter = header[0];
-	}
-	return NULL;
+typedef int (*database_scan_cb)(void* udata, const char* key, const char* val);
+
+int32_t* database_tree_entry(char* node, size_t n) {
+	size_t entry_size = ((int32_t*)node)[0] ? TREE_LEAF_ENTRY_SIZE : TREE_INNER_ENTRY_SIZE;
+	return (int32_t*)(node + TREE_NODE_HEADER_SIZE + (n * entry_size));
 }
 
-int database_del(struct database* db, const char* key) {
-	size_t key_hash = hash_djb2(key);
-	size_t key_size = strlen(key) + 1;
-	size_t hash_size = database_get_hash_len(db);
-	size_t hash_slot = key_hash % hash_size;
-	size_t hash_each_block = hashes_per_block(db->dbf.page_size);
-	int32_t hash_place = hash_slot % hash_each_block;
-	int32_t into_block = database_get_hash_block(db, hash_slot / hash_each_block);
+size_t database_tree_node_cap(struct database* db, char* node) {
+	size_t entry_size = ((int32_t*)node)[0] ? TREE_LEAF_ENTRY_SIZE : TREE_INNER_ENTRY_SIZE;
+	return (db->dbf.page_size - TREE_NODE_HEADER_SIZE) / entry_size;
+}
 
-	int32_t* found = database_hash_and_probe(db, key, key_size, into_block, &hash_place, 0);
-	if(found != NULL) {
-		database_deallocate_storage(db, found);
-		_mark_del_storage_ptr(found);
-		database_dec_item_count(db, 1);
-		return 1;
+int32_t database_tree_new_node(struct database* db, int32_t is_leaf) {
+	size_t page = dbfile_grow(&db->dbf, 1);
+	if (page == (size_t)-1) {
+		return -1;
 	}
-	int32_t block_iter = database_get_hashroot(db);
-	while (block_iter != -1) {
-		found = database_hash_and_probe(db, key, key_size, into_block, NULL, 0);
-		if(found != NULL) {
-			database_deallocate_storage(db, found);
-			_mark_del_storage_ptr(found);
-			database_dec_item_count(db, 1);
-			return 1;
+	int32_t* head = (int32_t*)dbfile_get_page(&db->dbf, page);
+	head[0] = is_leaf;
+	head[1] = 0;
+	head[2] = -1;
+	return page;
+}
+
+// Index of the first entry whose key is not below key, exact is set on a match
+size_t database_tree_lower_bound(struct database* db, char* node, const char* key, size_t key_size, int* exact) {
+	size_t lo = 0;
+	size_t hi = ((int32_t*)node)[1];
+	*exact = 0;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		int32_t* entry = database_tree_entry(node, mid);
+		int cmp = dbfile_cmp_order(&db->dbf, entry[0], entry[1], key, key_size);
+		if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			*exact = cmp == 0;
+			hi = mid;
 		}
-		char* hash_page = dbfile_get_page(&db->dbf, block_iter);
-		int32_t* header = (int32_t*)hash_page;
-		block_iter = header[0];
 	}
-	return 0;
+	return lo;
 }
 
-void database_init(struct database* db) {
-	int32_t roots[2];
-	int32_t hash_len = 1;
-	int64_t item_count = 0;
-	int32_t factor_limit = 2;
-	struct dbfile* dbf = &db->dbf;
-	char* header = dbfile_get_page(dbf, 0);
-	header[0] = MAGIC_SEQ[0];
-	header[1] = MAGIC_SEQ[1];
-	header[2] = MAGIC_SEQ[2];
-	header[3] = MAGIC_SEQ[3];
-	header += sizeof(MAGIC_SEQ);
-	int32_t hash_root = dbfile_grow(dbf, 1);
-	int32_t space_root = dbfile_grow(dbf, 1);
-	roots[0] = hash_root; // beginning of hash list
-	roots[1] = space_root; // beginning of space heap
-	memcpy(header, roots, sizeof(roots));
-	header += sizeof(roots);
-	int32_t page_size = dbf->page_size;
-	memcpy(header, &page_size, sizeof(page_size));
-	header += sizeof(page_size);
-	memcpy(header, &hash_len, sizeof(hash_len));
-	header += sizeof(hash_len);
-	memcpy(header, &item_count, sizeof(item_count)); // used for load factor
-	header += sizeof(item_count);
-	memcpy(header, &factor_limit, sizeof(factor_limit)); // used to tell when to expand
-	// init roots
-	char* hash_page = dbfile_get_page(dbf, hash_root);
-	char* space_page = dbfile_get_page(dbf, space_root);
-	database_hash_init(hash_page);
-	database_len_init(space_page);
+int32_t database_tree_child(struct database* db, char* node, const char* key, size_t key_size) {
+	int exact = 0;
+	size_t pos = database_tree_lower_bound(db, node, key, key_size, &exact);
+	if (exact) {
+		return database_tree_entry(node, pos)[3];
+	}
+	return pos == 0 ? ((int32_t*)node)[2] : database_tree_entry(node, pos - 1)[3];
+}
 
-	database_add_storage_blocks(db, page_size); // todo beginning allocation strategy
+void database_tree_place(char* node, size_t pos, const int32_t* entry) {
+	int32_t* head = (int32_t*)node;
+	size_t entry_size = head[0] ? TREE_LEAF_ENTRY_SIZE : TREE_INNER_ENTRY_SIZE;
+	char* at = (char*)database_tree_entry(node, pos);
+	memmove(at + entry_size, at, (head[1] - pos) * entry_size);
+	memcpy(at, entry, entry_size);
+	++head[1];
 }
 
-int database_open(struct database* db, const char* pathfile, struct dbcfg* cfg) {
-	if (!dbfile_open(&db->dbf, pathfile, cfg))
+// Copies the key a storage pointer starts with into its own storage record
+int database_tree_copy_key(struct database* db, const int32_t* store_ptr, int32_t* result) {
+	size_t key_size = dbfile_null_len(&db->dbf, store_ptr[0], store_ptr[1]);
+	if (database_allocate_storage(db, key_size, result) == -1) {
 		return 0;
-	char* header = dbfile_get_page(&db->dbf, 0);
-	if (!_has_magic_seq(header)) {
-		database_init(db);
 	}
-	db->dbf.page_size = database_get_page_size(db);
-	page_vec_init(&db->hash_pages);
-	database_populate_hash_pages(db, database_get_hashroot(db), &db->hash_pages);
+	char* buf = KAMOODB_MALLOC(key_size);
+	dbfile_read_po(&db->dbf, store_ptr[0], store_ptr[1], buf, key_size);
+	dbfile_write_po(&db->dbf, result[0], result[1], buf, key_size);
+	KAMOODB_FREE(buf);
 	return 1;
 }
 
-void database_close(struct database* db) {
-	dbfile_close(&db->dbf);
-	dbfile_path_free(&db->dbf);
-	page_vec_deinit(&db->hash_pages);
-}
-
-void database_close_and_remove(struct database* db) {
+// Inserts or replaces the entry for key below node. Returns 1 if node split,
+// with the separator and new right node written to split, and -1 on failure.
+int database_tree_insert_at(struct database* db, int32_t node_page, const char* key, size_t key_size,
+	                        const int32_t* store_ptr, int32_t* split) {
+	int exact = 0;
+	int32_t entry[4];
+	char* node = dbfile_get_page(&db->dbf, node_page);
+	int32_t* head = (int32_t*)node;
+	size_t pos = database_tree_lower_bound(db, node, key, key_size, &exact);
+	if (head[0]) {
+		if (exact) {
+			memcpy(database_tree_entry(node, pos), store_ptr, TREE_LEAF_ENTRY_SIZE);
+			dbfile_touch(&db->dbf, node_page);
+			return 0;
+		}
+		memcpy(entry, store_ptr, TREE_LEAF_ENTRY_SIZE);
+	} else {
+		int32_t child = exact ? database_tree_entry(node, pos)[3] :
+		                pos == 0 ? head[2] : database_tree_entry(node, pos - 1)[3];
+		int res = database_tree_insert_at(db, child, key, key_size, store_ptr, entry);
+		if (res != 1) {
+			return res;
+		}
+		// the separator of the new child goes after the one just descended into
+		pos += exact;
+	}
+	dbfile_touch(&db->dbf, node_page);
+	if ((size_t)head[1] < database_tree_node_cap(db, node)) {
+		database_tree_place(node, pos, entry);
+		return 0;
+	}
+	int32_t right_page = database_tree_new_node(db, head[0]);
+	if (right_page == -1) {
+		return -1;
+	}
+	char* right = dbfile_get_page(&db->dbf, right_page);
+	int32_t* right_head = (int32_t*)right;
+	size_t entry_size = head[0] ? TREE_LEAF_ENTRY_SIZE : TREE_INNER_ENTRY_SIZE;
+	size_t half = head[1] / 2;
+	if (head[0]) {
+		right_head[1] = head[1] - half;
+		memcpy(database_tree_entry(right, 0), database_tree_entry(node, half), right_head[1] * entry_size);
+		right_head[2] = head[2];
+		head[1] = half;
+		head[2] = right_page;
+		if (pos <= half) {
+			database_tree_place(node, pos, entry);
+		} else {
+			database_tree_place(right, pos - half, entry);
+		}
+		if (!database_tree_copy_key(db, database_tree_entry(right, 0), split)) {
+			return -1;
+		}
+	} else {
+		// the middle separator moves up and its child becomes the right link
+		int32_t* middle = database_tree_entry(node, half);
+		memcpy(split, middle, TREE_LEAF_ENTRY_SIZE);
+		right_head[2] = middle[3];
+		right_head[1] = head[1] - half - 1;
+		memcpy(database_tree_entry(right, 0), database_tree_entry(node, half + 1), right_head[1] * entry_size);
+		head[1] = half;
+		if (pos <= half) {
+			database_tree_place(node, pos, entry);
+		} else {
+			database_tree_place(right, pos - half - 1, entry);
+		}
+	}
+	split[3] = right_page;
+	return 1;
+}
+
+int database_tree_insert(struct database* db, const char* key, size_t key_size, const int32_t* store_ptr) {
+	int32_t split[4];
+	int32_t root = database_get_tree_root(db);
+	int res = database_tree_insert_at(db, root, key, key_size, store_ptr, split);
+	if (res == 1) {
+		int32_t new_root = database_tree_new_node(db, 0);
+		if (new_root == -1) {
+			return 0;
+		}
+		char* node = dbfile_get_page(&db->dbf, new_root);
+		((int32_t*)node)[2] = root;
+		database_tree_place(node, 0, split);
+		database_set_tree_root(db, new_root);
+	}
+	return res != -1;
+}
+
+int database_tree_remove(struct database* db, const char* key, size_t key_size) {
+	int exact = 0;
+	int32_t node_page = database_get_tree_root(db);
+	char* node = dbfile_get_page(&db->dbf, node_page);
+	while (!((int32_t*)node)[0]) {
+		node_page = database_tree_child(db, node, key, key_size);
+		node = dbfile_get_page(&db->dbf, node_page);
+	}
+	size_t pos = database_tree_lower_bound(db, node, key, key_size, &exact);
+	if (!exact) {
+		return 0;
+	}
+	int32_t* head = (int32_t*)node;
+	char* at = (char*)database_tree_entry(node, pos);
+	memmove(at, at + TREE_LEAF_ENTRY_SIZE, (head[1] - pos - 1) * TREE_LEAF_ENTRY_SIZE);
+	--head[1];
+	dbfile_touch(&db->dbf, node_page);
+	return 1;
+}
+
+// Walks the leaves from the first key not below lo, stopping at hi or at the
+// first key not starting with prefix. Returns the number of records visited.
+size_t database_tree_walk(struct database* db, const char* lo, const char* hi, const char* prefix,
+	                      database_scan_cb cb, void* udata) {
+	int exact = 0;
+	size_t visited = 0;
+	size_t pos = 0;
+	size_t buf_cap = 0;
+	char* buf = NULL;
+	size_t prefix_len = prefix != NULL ? strlen(prefix) : 0;
+	if (!database_has_ordered_index(db)) {
+		return 0;
+	}
+	char* node = dbfile_get_page(&db->dbf, database_get_tree_root(db));
+	while (!((int32_t*)node)[0]) {
+		int32_t child = lo != NULL ? database_tree_child(db, node, lo, strlen(lo) + 1) : ((int32_t*)node)[2];
+		node = dbfile_get_page(&db->dbf, child);
+	}
+	if (lo != NULL) {
+		pos = database_tree_lower_bound(db, node, lo, strlen(lo) + 1, &exact);
+	}
+	while (1) {
+		int32_t* head = (int32_t*)node;
+		for (; pos < (size_t)head[1]; ++pos) {
+			int32_t* entry = database_tree_entry(node, pos);
+			if (buf_cap < (size_t)entry[2]) {
+				KAMOODB_FREE(buf);
+				buf_cap = entry[2];
+				buf = KAMOODB_MALLOC(buf_cap);
+			}
+			dbfile_read_po(&db->dbf, entry[0], entry[1], buf, entry[2]);
+			if ((hi != NULL && strcmp(buf, hi) >= 0) ||
+			    (prefix != NULL && strncmp(buf, prefix, prefix_len) != 0)) {
+				KAMOODB_FREE(buf);
+				return visited;
+			}
+			++visited;
+			size_t key_size = strlen(buf) + 1;
+			char* val = database_decode_val(db, buf + key_size, entry[2] - key_size);
+			int more = val != NULL && cb(udata, buf, val);
+			KAMOODB_FREE(val);
+			if (!more) {
+				KAMOODB_FREE(buf);
+				return visited;
+			}
+		}
+		if (head[2] == -1) {
+			break;
+		}
+		node = dbfile_get_page(&db->dbf, head[2]);
+		pos = 0;
+	}
+	KAMOODB_FREE(buf);
+	return visited;
+}
+
+// Calls cb for every key in [lo, hi) in order, NULL leaves a side open.
+// cb returns 0 to stop early and must not modify the database.
+size_t database_range(struct database* db, const char* lo, const char* hi, database_scan_cb cb, void* udata) {
+	return database_tree_walk(db, lo, hi, NULL, cb, udata);
+}
+
+// Calls cb for every key starting with prefix in order
+size_t database_prefix(struct database* db, const char* prefix, database_scan_cb cb, void* udata) {
+	return database_tree_walk(db, prefix, NULL, prefix, cb, udata);
+}
+
+// Builds the ordered index over the records already in the database.
+// Inline records have no storage pointer to index, so this fails if the
+// file was created with an inline size.
+int database_add_ordered_index(struct database* db) {
+	if (database_has_ordered_index(db)) {
+		return 1;
+	}
+	if (db->inline_cap > 0) {
+		return 0;
+	}
+	int32_t root = database_tree_new_node(db, 1);
+	if (root == -1) {
+		return 0;
+	}
+	database_set_tree_root(db, root);
+	for (size_t i = 0; i < db->hash_pages.len; ++i) {
+		char* page = dbfile_get_page(&db->dbf, db->hash_pages.pages[i]);
+		int32_t* iter = database_slot_at(db, page, 0);
+		int32_t* end = database_slot_end(db, page);
+		for (; iter != end; iter = database_slot_next(db, iter)) {
+			if (_is_empty_ins_storage_ptr(iter) || _is_del_storage_ptr(iter)) {
+				continue;
+			}
+			size_t key_size = dbfile_null_len(&db->dbf, iter[0], iter[1]);
+			char* key = KAMOODB_MALLOC(key_size);
+			dbfile_read_po(&db->dbf, iter[0], iter[1], key, key_size);
+			int added = database_tree_insert(db, key, key_size, iter);
+			KAMOODB_FREE(key);
+			if (!added) {
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+// 1 if the slot holds a record, overwriting it leaves the item count as is
+int database_slot_live(const int32_t* slot) {
+	return !_is_empty_ins_storage_ptr(slot) && !_is_del_storage_ptr(slot);
+}
+
+// Points the hash slot of key at an already written storage record
+int database_put_storage(struct database* db, const char* key, size_t key_size, const int32_t* storage_place) {
+	int32_t* found = database_find_slot_for_write(db, key, key_size, 1);
+	if(found == NULL) {
+		return 0;
+	}
+	// the tree compares against the old record, so it is freed afterwards
+	if (database_has_ordered_index(db) && !database_tree_insert(db, key, key_size, storage_place)) {
+		return 0;
+	}
+	int live = database_slot_live(found);
+	database_deallocate_storage(db, found);
+	_write_storage_ptr_hash(found, storage_place);
+	database_set_slot_expiry(db, found, 0);
+	if (db->bloom_root > 0) {
+		database_bloom_add(db, hash_djb2(key));
+	}
+	database_inc_item_count(db, !live);
+	return 1;
+}
+
+// Small records skip the storage allocator and live in the hash slot itself
+int database_put_inline(struct database* db, const char* key, size_t key_size, const char* val, size_t val_size) {
+	int32_t* found = database_find_slot_for_write(db, key, key_size, 1);
+	if(found == NULL) {
+		return 0;
+	}
+	int live = database_slot_live(found);
+	database_deallocate_storage(db, found);
+	_write_inline_slot(found, key, key_size, val, val_size);
+	database_set_slot_expiry(db, found, 0);
+	if (db->bloom_root > 0) {
+		database_bloom_add(db, hash_djb2(key));
+	}
+	database_inc_item_count(db, !live);
+	return 1;
+}
+
+// 1 if the slot holds a record that has not expired
+int database_slot_present(struct database* db, const int32_t* slot) {
+	return database_slot_live(slot) && !database_slot_expired(db, slot);
+}
+
+// Deletes the record in slot without looking up its key. The slot page
+// has to be copied for snapshots already.
+static void database_drop_slot(struct database* db, int32_t* slot) {
+	if (database_has_ordered_index(db)) {
+		if (_is_inline_slot(slot)) {
+			database_tree_remove(db, _slot_payload(slot), slot[1]);
+		} else {
+			// not the scratch buffer, a put may be staging its record there
+			char* rec = KAMOODB_MALLOC(slot[2]);
+			if (rec != NULL) {
+				dbfile_read_po(&db->dbf, slot[0], slot[1], rec, slot[2]);
+				database_tree_remove(db, rec, strnlen(rec, slot[2]) + 1);
+				KAMOODB_FREE(rec);
+			}
+		}
+	}
+	database_deallocate_storage(db, slot);
+	_mark_del_storage_ptr(slot);
+	database_dec_item_count(db, 1);
+}
+
+// cache mode
+// * a get sets the reference bit of the slot it hits, new records start
+//   with the bit clear
+// * when storage would have to grow past the capacity, the clock hand goes
+//   over the slots, clearing set bits and evicting records whose bit was
+//   already clear, one at a time until the new record fits
+// * freed extents are merged with free neighbours, or records a little
+//   larger than the ones evicted would never fit
+// * a put evicts a bounded number of records and looks at a bounded number
+//   of slots for each, a record that still finds no room grows the file
+
+// slots the hand looks at for one eviction, at most
+static const size_t DBEVICT_SCAN = 4096;
+// evictions before a put gives up and grows the file
+static const int DBEVICT_MAX = 16;
+
+// The reference bits, cleared whenever the index was resized
+static unsigned char* database_clock_bits(struct database* db) {
+	size_t total = db->hash_pages.len * db->slots_per_block;
+	if (db->clock_len != total) {
+		unsigned char* bits = KAMOODB_REALLOC(db->clock_bits, (total / 8) + 1);
+		if (bits == NULL) {
+			return NULL;
+		}
+		memset(bits, 0, (total / 8) + 1);
+		db->clock_bits = bits;
+		db->clock_len = total;
+		db->clock_hand = 0;
+	}
+	return db->clock_bits;
+}
+
+void database_clock_touch(struct database* db, size_t slot_n) {
+	unsigned char* bits = db->capacity > 0 ? database_clock_bits(db) : NULL;
+	if (bits != NULL && slot_n < db->clock_len) {
+		bits[slot_n / 8] |= (unsigned char)(1 << (slot_n % 8));
+	}
+}
+
+// Runs the clock hand up to the next cold record and evicts it. keep is
+// the slot being written. Returns 0 if the scan limit was hit first.
+static int database_evict(struct database* db, const int32_t* keep) {
+	unsigned char* bits = database_clock_bits(db);
+	for (size_t n = 0; bits != NULL && n < DBEVICT_SCAN && n < db->clock_len; ++n) {
+		size_t pos = db->clock_hand;
+		unsigned char mask = (unsigned char)(1 << (pos % 8));
+		db->clock_hand = pos + 1 < db->clock_len ? pos + 1 : 0;
+		if (bits[pos / 8] & mask) {
+			bits[pos / 8] &= ~mask;
+			continue;
+		}
+		int32_t block = db->hash_pages.pages[pos / db->slots_per_block];
+		if (!database_check_page(db, block)) {
+			continue;
+		}
+		int32_t* slot = database_slot_at(db, dbfile_get_page(&db->dbf, block), pos % db->slots_per_block);
+		// inline records hold no storage
+		if (slot == keep || slot[0] <= 0 || !database_valid_slot(db, slot) || !database_cow_page(db, block)) {
+			continue;
+		}
+		database_drop_slot(db, slot);
+		DBSTAT_ADD(db->stats, evictions, 1);
+		return 1;
+	}
+	return 0;
+}
+
+// database_allocate_storage that evicts before growing the file past the
+// capacity
+static int database_allocate_bounded(struct database* db, int32_t size, int32_t* result, const int32_t* keep) {
+	for (int evicted = 0; database_find_space_storage(db, size, result) == -1; ++evicted) {
+		size_t file_size = db->dbf.page_count * db->dbf.page_size;
+		if (db->capacity > 0 && evicted < DBEVICT_MAX && file_size + size > db->capacity &&
+		    database_evict(db, keep)) {
+			continue;
+		}
+		if (database_add_storage_blocks(db, size) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// A record can be rewritten over its old extent when nothing else may
+// still read the old bytes. Snapshots hold on to old extents, and the
+// ordered index keeps the size of the extent it points to.
+static int database_fits_in_place(struct database* db, const int32_t* slot, size_t size) {
+	if (slot[0] <= 0 || db->snaps != NULL || size > (size_t)slot[2]) {
+		return 0;
+	}
+	return size == (size_t)slot[2] || !database_has_ordered_index(db);
+}
+
+// Writes key and val into the slot the probe found for key, expiring at
+// expires or never if it is 0
+static int database_store_at(struct database* db, int32_t* found, const char* key, size_t key_size,
+	                         const char* val, size_t val_size, uint64_t expires) {
+	int32_t storage_place[3];
+	int live = database_slot_live(found);
+	size_t total_size = key_size + val_size;
+	if (!live && db->bloom_root > 0) {
+		database_bloom_add(db, hash_djb2(key));
+	}
+	if (database_fits_inline(db, total_size)) {
+		database_deallocate_storage(db, found);
+		_write_inline_slot(found, key, key_size, val, val_size);
+		database_set_slot_expiry(db, found, expires);
+		database_inc_item_count(db, !live);
+		return 1;
+	}
+	char* buff = NULL;
+	if (db->codec.type != DBCODEC_NONE) {
+		buff = database_scratch(db, key_size + dbcodec_bound(val_size));
+		if (buff == NULL) {
+			return 0;
+		}
+		total_size = database_encode_record(db, key, key_size, val, val_size, buff);
+	}
+	int in_place = live && database_fits_in_place(db, found, total_size);
+	if (in_place) {
+		memcpy(storage_place, found, sizeof(storage_place));
+	} else if (database_allocate_bounded(db, total_size, storage_place, found) == -1) {
+		return 0;
+	}
+	if (buff != NULL) {
+		dbfile_write_po(&db->dbf, storage_place[0], storage_place[1], buff, total_size);
+	} else {
+		// key and value go straight to the extent
+		dbfile_write_po(&db->dbf, storage_place[0], storage_place[1], key, key_size);
+		dbfile_write_po(&db->dbf, storage_place[0], storage_place[1] + key_size, val, val_size);
+	}
+	if (in_place) {
+		DBSTAT_ADD(db->stats, in_place, 1);
+		if (total_size < (size_t)found[2]) {
+			// the rest of the old extent goes back to the free list
+			size_t tail_off = found[1] + total_size;
+			int32_t tail[3] = {found[0] + (int32_t)(tail_off / db->dbf.page_size),
+			                   (int32_t)(tail_off % db->dbf.page_size), found[2] - (int32_t)total_size};
+			database_deallocate_storage(db, tail);
+			found[2] = total_size;
+		}
+		database_set_slot_expiry(db, found, expires);
+		return 1;
+	}
+	// the tree compares against the old record, so it is freed afterwards
+	if (database_has_ordered_index(db) && !database_tree_insert(db, key, key_size, storage_place)) {
+		database_deallocate_storage(db, storage_place);
+		return 0;
+	}
+	database_deallocate_storage(db, found);
+	_write_storage_ptr_hash(found, storage_place);
+	database_set_slot_expiry(db, found, expires);
+	database_inc_item_count(db, !live);
+	return 1;
+}
+
+static int database_put_record(struct database* db, const char* key, const char* val, uint64_t expires) {
+	database_check_and_maybe_expand(db);
+	size_t key_size = strlen(key) + 1;
+	int32_t* found = database_find_slot_for_write(db, key, key_size, 1);
+	if (found == NULL) {
+		return 0;
+	}
+	return database_store_at(db, found, key, key_size, val, strlen(val) + 1, expires);
+}
+
+int database_put(struct database* db, const char* key, const char* val) {
+	uint64_t start = dbstat_now();
+	int res = database_put_record(db, key, val, 0);
+	DBSTAT_TIME(db->stats, put, start);
+	return res;
+}
+
+// Puts a record that reads as missing once ttl_ms milliseconds have passed,
+// a ttl of 0 never expires. Only for files created with expiry. Range and
+// prefix scans see expired records until database_sweep reclaims them.
+int database_put_ttl(struct database* db, const char* key, const char* val, uint64_t ttl_ms) {
+	if (db->expiry_off == 0) {
+		return 0;
+	}
+	uint64_t start = dbstat_now();
+	int res = database_put_record(db, key, val, ttl_ms > 0 ? database_now_ms() + ttl_ms : 0);
+	DBSTAT_TIME(db->stats, put, start);
+	return res;
+}
+
+// Puts key only if it is not there yet. Returns 1 if it was put, 0 if the
+// key was already present or the put failed.
+int database_put_if_absent(struct database* db, const char* key, const char* val) {
+	uint64_t start = dbstat_now();
+	database_check_and_maybe_expand(db);
+	size_t key_size = strlen(key) + 1;
+	int32_t* found = database_find_slot_for_write(db, key, key_size, 1);
+	int res = found != NULL && !database_slot_present(db, found) && database_store_at(db, found, key, key_size, val, strlen(val) + 1, 0);
+	DBSTAT_TIME(db->stats, put, start);
+	return res;
+}
+
+// Replaces the value of key with val if it is currently expected, NULL
+// expects the key to be absent. Returns 1 if val was put.
+int database_cas(struct database* db, const char* key, const char* expected, const char* val) {
+	uint64_t start = dbstat_now();
+	database_check_and_maybe_expand(db);
+	size_t key_size = strlen(key) + 1;
+	int32_t* found = database_find_slot_for_write(db, key, key_size, 1);
+	int res = 0;
+	if (found != NULL && !database_slot_present(db, found)) {
+		res = expected == NULL && database_store_at(db, found, key, key_size, val, strlen(val) + 1, 0);
+	} else if (found != NULL && expected != NULL) {
+		char* cur = database_adv_to_val(db, found, key_size);
+		res = cur != NULL && strcmp(cur, expected) == 0 && database_store_at(db, found, key, key_size, val, strlen(val) + 1, 0);
+		KAMOODB_FREE(cur);
+	}
+	DBSTAT_TIME(db->stats, put, start);
+	return res;
+}
+
+// Adds suffix to the end of the value of key, or puts it as the value of a
+// missing key. The record keeps its expiry time.
+int database_append(struct database* db, const char* key, const char* suffix) {
+	uint64_t start = dbstat_now();
+	database_check_and_maybe_expand(db);
+	size_t key_size = strlen(key) + 1;
+	size_t suffix_size = strlen(suffix) + 1;
+	int32_t* found = database_find_slot_for_write(db, key, key_size, 1);
+	int res = 0;
+	if (found != NULL && !database_slot_present(db, found)) {
+		res = database_store_at(db, found, key, key_size, suffix, suffix_size, 0);
+	} else if (found != NULL) {
+		char* cur = database_adv_to_val(db, found, key_size);
+		size_t cur_len = cur != NULL ? strlen(cur) : 0;
+		char* joined = cur != NULL ? KAMOODB_REALLOC(cur, cur_len + suffix_size) : NULL;
+		if (joined != NULL) {
+			memcpy(joined + cur_len, suffix, suffix_size);
+			res = database_store_at(db, found, key, key_size, joined, cur_len + suffix_size, database_slot_expiry(db, found));
+			KAMOODB_FREE(joined);
+		} else {
+			KAMOODB_FREE(cur);
+		}
+	}
+	DBSTAT_TIME(db->stats, put, start);
+	return res;
+}
+
+char* database_get(struct database* db, const char* key) {
+	uint64_t start = dbstat_now();
+	char* val = NULL;
+	size_t key_size = strlen(key) + 1;
+	int32_t block = 0;
+	size_t slot_n = 0;
+	int32_t* found = database_find_slot_in(db, key, key_size, 0, &block, &slot_n);
+	if(found != NULL) {
+		val = database_adv_to_val(db, found, key_size);
+		database_clock_touch(db, slot_n);
+	}
+	DBSTAT_TIME(db->stats, get, start);
+	return val;
+}
+
+// batched gets
+// * keys are looked up in windows of DBBATCH_WINDOW and three passes, so the
+//   cache misses of a window overlap instead of coming one after another
+// * the first pass hashes the keys and prefetches their home slots, and
+//   their filter blocks if there is a filter
+// * the second pass walks the first DBBATCH_PROBE slots of each probe run
+//   and prefetches the records they point to, since the key compare reads
+//   every one of them
+// * the last pass runs database_get, which then mostly finds its lines in
+//   cache. Longer probe runs still miss past the prefetched slots.
+static const size_t DBBATCH_WINDOW = 32;
+static const size_t DBBATCH_PROBE = 4;
+
+// Looks up n keys, storing each value or NULL in vals like database_get.
+// Returns the number of keys found.
+size_t database_get_batch(struct database* db, const char* const* keys, size_t n, char** vals) {
+	int32_t* homes[DBBATCH_WINDOW];
+	char* blocks[DBBATCH_WINDOW];
+	size_t per_block = db->slots_per_block;
+	size_t page_size = db->dbf.page_size;
+	size_t found = 0;
+	for (size_t base = 0; base < n; base += DBBATCH_WINDOW) {
+		size_t len = n - base < DBBATCH_WINDOW ? n - base : DBBATCH_WINDOW;
+		size_t hash_len = database_get_hash_len(db);
+		for (size_t i = 0; i < len; ++i) {
+			size_t hash = hash_djb2(keys[base + i]);
+			size_t hash_slot = hash % hash_len;
+			blocks[i] = dbfile_get_page(&db->dbf, database_get_hash_block(db, hash_slot / per_block));
+			homes[i] = database_slot_at(db, blocks[i], hash_slot % per_block);
+			__builtin_prefetch(homes[i]);
+			if (db->bloom_root > 0) {
+				uint64_t mixed = 0;
+				__builtin_prefetch(database_bloom_block(db, hash, &mixed, 0));
+			}
+		}
+		for (size_t i = 0; i < len; ++i) {
+			int32_t* slot = homes[i];
+			int32_t* end = database_slot_end(db, blocks[i]);
+			for (size_t k = 0; k < DBBATCH_PROBE && slot != end && !_is_empty_ins_storage_ptr(slot); ++k) {
+				if (slot[0] > 0 && dbslot_valid(slot, HASHSTORAGE_PTR_SIZE + db->inline_cap, page_size, db->dbf.page_count)) {
+					const char* rec = dbfile_get_page(&db->dbf, slot[0]) + slot[1];
+					__builtin_prefetch(rec);
+					// pages of an in memory store are not contiguous
+					if ((size_t)slot[1] + 64 < page_size && slot[2] > 64) {
+						__builtin_prefetch(rec + 64);
+					}
+				}
+				slot = database_slot_next(db, slot);
+			}
+		}
+		for (size_t i = 0; i < len; ++i) {
+			vals[base + i] = database_get(db, keys[base + i]);
+			found += vals[base + i] != NULL;
+		}
+	}
+	return found;
+}
+
+int database_del(struct database* db, const char* key) {
+	uint64_t start = dbstat_now();
+	int res = 0;
+	size_t key_size = strlen(key) + 1;
+	int32_t* found = database_find_slot_for_write(db, key, key_size, 0);
+	if(found != NULL) {
+		if (database_has_ordered_index(db)) {
+			database_tree_remove(db, key, key_size);
+		}
+		database_deallocate_storage(db, found);
+		_mark_del_storage_ptr(found);
+		database_dec_item_count(db, 1);
+		database_check_and_maybe_shrink(db);
+		res = 1;
+	}
+	DBSTAT_TIME(db->stats, del, start);
+	return res;
+}
+
+// slots looked at between checks of the sweep budget
+static const size_t DBSWEEP_BATCH = 64;
+
+static uint64_t database_sweep_clock(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000) + (uint64_t)ts.tv_nsec;
+}
+
+// Reclaims expired records, walking the hash blocks on from where the last
+// sweep stopped. Stops once budget_ns has been spent, or after one pass
+// over the index if it is 0. Returns the number of records reclaimed.
+// Writes like a put, so run it on the writing thread or under
+// database_shared_lock.
+size_t database_sweep(struct database* db, uint64_t budget_ns) {
+	size_t per_block = db->slots_per_block;
+	size_t total = db->hash_pages.len * per_block;
+	size_t reclaimed = 0;
+	if (db->expiry_off == 0 || total == 0) {
+		return 0;
+	}
+	uint64_t now = database_now_ms();
+	uint64_t start = database_sweep_clock();
+	for (size_t seen = 0; seen < total;) {
+		size_t pos = db->sweep_pos % total;
+		int32_t block = db->hash_pages.pages[pos / per_block];
+		// a batch stays within one hash block
+		size_t block_end = pos - (pos % per_block) + per_block;
+		size_t batch_end = pos + DBSWEEP_BATCH < block_end ? pos + DBSWEEP_BATCH : block_end;
+		char* page = database_check_page(db, block) ? dbfile_get_page(&db->dbf, block) : NULL;
+		for (size_t i = pos; page != NULL && i < batch_end; ++i) {
+			int32_t* slot = database_slot_at(db, page, i % per_block);
+			uint64_t at = database_slot_expiry(db, slot);
+			if (at == 0 || at > now || !database_slot_live(slot) || !database_valid_slot(db, slot)) {
+				continue;
+			}
+			if (!database_cow_page(db, block)) {
+				return reclaimed;
+			}
+			database_drop_slot(db, slot);
+			++reclaimed;
+		}
+		seen += batch_end - pos;
+		db->sweep_pos = batch_end % total;
+		if (budget_ns > 0 && database_sweep_clock() - start >= budget_ns) {
+			break;
+		}
+	}
+	DBSTAT_ADD(db->stats, swept, reclaimed);
+	if (reclaimed > 0) {
+		database_check_and_maybe_shrink(db);
+	}
+	return reclaimed;
+}
+
+// Copies out the counters and latency histograms gathered since the
+// database was opened or the stats were last reset
+void database_stats(struct database* db, struct dbstats* out) {
+	memcpy(out, &db->stats, sizeof(struct dbstats));
+	out->file = db->dbf.stats;
+}
+
+void database_stats_reset(struct database* db) {
+	memset(&db->stats, 0, sizeof(struct dbstats));
+	memset(&db->dbf.stats, 0, sizeof(struct dbfile_stats));
+}
+
+// Takes a consistent read view of the database. It stays valid until
+// database_snapshot_release and has to be released before the database is
+// closed. Snapshots are not thread safe against writers on their own.
+int database_snapshot(struct database* db, struct dbsnapshot* snap) {
+	// other processes do not copy pages before writing them
+	if (db->shared != NULL) {
+		return 0;
+	}
+	if (db->cow.buckets == NULL) {
+		db->cow.buckets = KAMOODB_CALLOC(DBCOW_BUCKETS, sizeof(struct dbcow_copy*));
+		if (db->cow.buckets == NULL) {
+			return 0;
+		}
+	}
+	snap->db = db;
+	snap->epoch = ++db->snap_epoch;
+	snap->item_count = database_get_item_count(db);
+	snap->own_pages = 0;
+	snap->older = db->snaps;
+	snap->newer = NULL;
+	if (db->snaps != NULL) {
+		db->snaps->newer = snap;
+	}
+	db->snaps = snap;
+	return 1;
+}
+
+static int database_snapshot_live(struct database* db, uint64_t lo, uint64_t hi) {
+	for (struct dbsnapshot* snap = db->snaps; snap != NULL; snap = snap->older) {
+		if (snap->epoch > lo && snap->epoch <= hi) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Frees the page copies and held back storage no live snapshot needs
+void database_cow_reclaim(struct database* db) {
+	struct dbcow* cow = &db->cow;
+	uint64_t oldest = UINT64_MAX;
+	for (struct dbsnapshot* snap = db->snaps; snap != NULL; snap = snap->older) {
+		oldest = snap->epoch;
+	}
+	for (size_t b = 0; cow->buckets != NULL && b < DBCOW_BUCKETS; ++b) {
+		struct dbcow_copy** link = &cow->buckets[b];
+		while (*link != NULL) {
+			struct dbcow_copy* copy = *link;
+			uint64_t prev = 0;
+			for (struct dbcow_copy* iter = cow->buckets[b]; iter != NULL; iter = iter->next) {
+				if (iter->page == copy->page && iter->tag < copy->tag && iter->tag > prev) {
+					prev = iter->tag;
+				}
+			}
+			if (database_snapshot_live(db, prev, copy->tag)) {
+				link = &copy->next;
+			} else {
+				*link = copy->next;
+				KAMOODB_FREE(copy);
+			}
+		}
+	}
+	size_t kept = 0;
+	for (size_t i = 0; i < cow->frees_len; ++i) {
+		if (cow->frees[i].tag < oldest) {
+			database_free_extent(db, cow->frees[i].ptr);
+		} else {
+			cow->frees[kept++] = cow->frees[i];
+		}
+	}
+	cow->frees_len = kept;
+}
+
+void database_snapshot_release(struct dbsnapshot* snap) {
+	struct database* db = snap->db;
+	if (snap->newer != NULL) {
+		snap->newer->older = snap->older;
+	} else {
+		db->snaps = snap->older;
+	}
+	if (snap->older != NULL) {
+		snap->older->newer = snap->newer;
+	}
+	if (snap->own_pages) {
+		page_vec_deinit(&snap->hash_pages);
+	}
+	database_cow_reclaim(db);
+}
+
+// Detaches any snapshots still live, reclaim returns their held back
+// storage to the free list
+static void database_snapshot_drop_all(struct database* db, int reclaim) {
+	while (db->snaps != NULL) {
+		struct dbsnapshot* snap = db->snaps;
+		db->snaps = snap->older;
+		if (snap->own_pages) {
+			page_vec_deinit(&snap->hash_pages);
+			snap->own_pages = 0;
+		}
+	}
+	if (reclaim) {
+		database_cow_reclaim(db);
+	}
+	for (size_t b = 0; db->cow.buckets != NULL && b < DBCOW_BUCKETS; ++b) {
+		while (db->cow.buckets[b] != NULL) {
+			struct dbcow_copy* copy = db->cow.buckets[b];
+			db->cow.buckets[b] = copy->next;
+			KAMOODB_FREE(copy);
+		}
+	}
+	KAMOODB_FREE(db->cow.buckets);
+	KAMOODB_FREE(db->cow.tags);
+	KAMOODB_FREE(db->cow.frees);
+	memset(&db->cow, 0, sizeof(struct dbcow));
+}
+
+static const struct page_vec* database_snapshot_pages(const struct dbsnapshot* snap) {
+	return snap->own_pages ? &snap->hash_pages : &snap->db->hash_pages;
+}
+
+int64_t database_snapshot_item_count(const struct dbsnapshot* snap) {
+	return snap->item_count;
+}
+
+// database_get as of when the snapshot was taken
+char* database_snapshot_get(struct dbsnapshot* snap, const char* key) {
+	struct database* db = snap->db;
+	const struct page_vec* pages = database_snapshot_pages(snap);
+	size_t key_size = strlen(key) + 1;
+	size_t hash_slot = hash_djb2(key) % (pages->len * db->slots_per_block);
+	int32_t hash_place = hash_slot % db->slots_per_block;
+	const char* page = database_cow_read(db, pages->pages[hash_slot / db->slots_per_block], snap->epoch);
+	int32_t* found = page != NULL ? database_probe_page(db, key, key_size, (char*)page, &hash_place, 0) : NULL;
+	for (size_t i = 0; page != NULL && found == NULL && i < pages->len; ++i) {
+		page = database_cow_read(db, pages->pages[i], snap->epoch);
+		found = page != NULL ? database_probe_page(db, key, key_size, (char*)page, NULL, 0) : NULL;
+	}
+	if (found == NULL || _is_empty_ins_storage_ptr(found) || database_slot_expired(db, found)) {
+		return NULL;
+	}
+	return database_adv_to_val(db, found, key_size);
+}
+
+// Calls cb for every record in the snapshot, in hash order. cb returns 0
+// to stop early. Returns the number of records visited.
+size_t database_snapshot_scan(struct dbsnapshot* snap, database_scan_cb cb, void* udata) {
+	struct database* db = snap->db;
+	const struct page_vec* pages = database_snapshot_pages(snap);
+	size_t visited = 0;
+	size_t buf_cap = 0;
+	char* buf = NULL;
+	for (size_t i = 0; i < pages->len; ++i) {
+		const char* page = database_cow_read(db, pages->pages[i], snap->epoch);
+		for (size_t n = 0; page != NULL && n < db->slots_per_block; ++n) {
+			const int32_t* slot = database_slot_at(db, (char*)page, n);
+			char* val = NULL;
+			const char* key = buf;
+			if (_is_empty_ins_storage_ptr(slot) || _is_del_storage_ptr(slot) || !database_valid_slot(db, slot) ||
+			    database_slot_expired(db, slot)) {
+				continue;
+			} else if (_is_inline_slot(slot)) {
+				key = _slot_payload(slot);
+				val = database_adv_to_val(db, slot, slot[1]);
+			} else {
+				if (buf_cap < (size_t)slot[2]) {
+					KAMOODB_FREE(buf);
+					buf_cap = slot[2];
+					buf = KAMOODB_MALLOC(buf_cap);
+				}
+				dbfile_read_po(&db->dbf, slot[0], slot[1], buf, slot[2]);
+				key = buf;
+				size_t key_size = strnlen(buf, slot[2]) + 1;
+				val = key_size < (size_t)slot[2] ? database_decode_val(db, buf + key_size, slot[2] - key_size) : NULL;
+			}
+			if (val == NULL) {
+				continue;
+			}
+			++visited;
+			int more = cb(udata, key, val);
+			KAMOODB_FREE(val);
+			if (!more) {
+				KAMOODB_FREE(buf);
+				return visited;
+			}
+		}
+	}
+	KAMOODB_FREE(buf);
+	return visited;
+}
+
+// Number of hash blocks that hold n_items without going over max_load
+size_t database_blocks_for_items(size_t slots_per_block, double max_load, size_t n_items) {
+	double per_block = max_load * (double)slots_per_block;
+	size_t blocks = (size_t)((double)n_items / per_block);
+	while ((double)blocks * per_block < (double)n_items) {
+		++blocks;
+	}
+	return blocks > 0 ? blocks : 1;
+}
+
+// Puts size bytes of storage on the free list up front, in as few extents as possible
+int database_reserve_storage(struct database* db, size_t size) {
+	size_t max_extent = (INT32_MAX / db->dbf.page_size - 1) * db->dbf.page_size;
+	while (size > 0) {
+		size_t extent = size > max_extent ? max_extent : size;
+		if (database_add_storage_blocks(db, extent) == -1) {
+			return 0;
+		}
+		size -= extent;
+	}
+	return 1;
+}
+
+// Sizes the index for n items in total, so loading them needs no expansions
+int database_reserve(struct database* db, size_t n_items) {
+	double fact = 0.0;
+	if (!database_get_factor_lim(db, &fact)) {
+		return 1;
+	}
+	size_t blocks = database_blocks_for_items(db->slots_per_block, fact, n_items);
+	if (blocks > db->hash_pages.len && !database_expand(db, blocks - db->hash_pages.len)) {
+		return 0;
+	}
+	int64_t items = database_get_item_count(db);
+	if (db->avg_record_size > 0 && (int64_t)n_items > items) {
+		return database_reserve_storage(db, (n_items - items) * db->avg_record_size);
+	}
+	return 1;
+}
+
+void database_init(struct database* db, const struct dbcfg* cfg) {
+	int32_t roots[2];
+	int32_t hash_len = 1;
+	int64_t item_count = 0;
+	int32_t factor_limit = 2;
+	struct dbfile* dbf = &db->dbf;
+	size_t expected_items = cfg != NULL ? cfg->expected_items : 0;
+	double max_load = cfg != NULL && cfg->max_load > 0.0 ? cfg->max_load : DB_DEF_MAX_LOAD;
+	if (expected_items > 0) {
+		hash_len = database_blocks_for_items(db->slots_per_block, max_load, expected_items);
+	}
+	char* header = dbfile_get_page(dbf, 0);
+	header[0] = MAGIC_SEQ[0];
+	header[1] = MAGIC_SEQ[1];
+	header[2] = MAGIC_SEQ[2];
+	header[3] = MAGIC_SEQ[3];
+	header += sizeof(MAGIC_SEQ);
+	int32_t hash_root = hash_len > 1 ? database_make_hash_blocks(db, hash_len) : (int32_t)dbfile_grow(dbf, 1);
+	int32_t space_root = dbfile_grow(dbf, 1);
+	roots[0] = hash_root; // beginning of hash list
+	roots[1] = space_root; // beginning of space heap
+	memcpy(header, roots, sizeof(roots));
+	header += sizeof(roots);
+	int32_t page_size = dbf->page_size;
+	memcpy(header, &page_size, sizeof(page_size));
+	header += sizeof(page_size);
+	memcpy(header, &hash_len, sizeof(hash_len));
+	header += sizeof(hash_len);
+	memcpy(header, &item_count, sizeof(item_count)); // used for load factor
+	header += sizeof(item_count);
+	memcpy(header, &factor_limit, sizeof(factor_limit)); // used to tell when to expand
+	if (cfg != NULL && (cfg->max_load > 0.0 || cfg->growth > 0.0 || cfg->min_load > 0.0)) {
+		database_set_load_policy(db, max_load, cfg->growth > 0.0 ? cfg->growth : DB_DEF_GROWTH, cfg->min_load);
+	}
+	int32_t slot_size = db->slot_size;
+	memcpy(dbfile_get_page(dbf, 0) + DB_HEADER_SLOT_SIZE_OFF, &slot_size, sizeof(slot_size));
+	int32_t expiry = db->expiry_off != 0;
+	memcpy(dbfile_get_page(dbf, 0) + DB_HEADER_EXPIRY_OFF, &expiry, sizeof(expiry));
+	int32_t bloom_bits = cfg != NULL ? (int32_t)cfg->bloom_bits : 0;
+	memcpy(dbfile_get_page(dbf, 0) + DB_HEADER_BLOOM_BITS_OFF, &bloom_bits, sizeof(bloom_bits));
+	int32_t no_bloom[3];
+	database_bloom_reset(db, hash_len * db->slots_per_block, no_bloom);
+	// init roots
+	char* space_page = dbfile_get_page(dbf, space_root);
+	if (hash_len == 1) {
+		database_hash_init(dbfile_get_page(dbf, hash_root));
+	}
+	database_len_init(space_page);
+	if (cfg != NULL && cfg->ordered_index) {
+		database_set_tree_root(db, database_tree_new_node(db, 1));
+	}
+	int32_t codec = cfg != NULL ? cfg->codec : DBCODEC_NONE;
+	memcpy(dbfile_get_page(dbf, 0) + DB_HEADER_CODEC_OFF, &codec, sizeof(codec));
+
+	if (expected_items > 0 && db->avg_record_size > 0) {
+		database_reserve_storage(db, expected_items * db->avg_record_size);
+	} else {
+		database_add_storage_blocks(db, page_size); // todo beginning allocation strategy
+	}
+}
+
+static void database_release(struct database* db);
+
+// Sets up the codec recorded in the header, with its dictionary if any
+int database_load_codec(struct database* db) {
+	char* header = dbfile_get_page(&db->dbf, 0);
+	int32_t codec = *(int32_t*)(header + DB_HEADER_CODEC_OFF);
+	int32_t* dict_ptr = (int32_t*)(header + DB_HEADER_DICT_OFF);
+	dbcodec_init(&db->codec, codec);
+#if !defined(KAMOODB_WITH_ZLIB)
+	if (codec == DBCODEC_DEFLATE) {
+		return 0;
+	}
+#endif
+	if (dict_ptr[0] > 0) {
+		char* dict = KAMOODB_MALLOC(dict_ptr[2]);
+		dbfile_read_po(&db->dbf, dict_ptr[0], dict_ptr[1], dict, dict_ptr[2]);
+		dbcodec_set_dict(&db->codec, dict, dict_ptr[2]);
+		KAMOODB_FREE(dict);
+	}
+	return 1;
+}
+
+// Header, hash and space pages, the pages covered by checksums
+void database_collect_meta_pages(struct database* db, struct page_vec* out) {
+	page_vec_push(out, 0);
+	for (size_t i = 0; i < db->hash_pages.len; ++i) {
+		page_vec_push(out, db->hash_pages.pages[i]);
+	}
+	int32_t space_iter = database_get_spaceroot(db);
+	while (space_iter != -1) {
+		page_vec_push(out, space_iter);
+		space_iter = ((int32_t*)dbfile_get_page(&db->dbf, space_iter))[0];
+	}
+	for (size_t i = 0; db->bloom_root > 0 && i < db->bloom_pages; ++i) {
+		page_vec_push(out, db->bloom_root + i);
+	}
+}
+
+void database_mark_dirty(struct database* db) {
+	char* header = dbfile_get_page(&db->dbf, 0);
+	if (*(int32_t*)(header + DB_HEADER_CLEAN_OFF) != 0) {
+		*(int32_t*)(header + DB_HEADER_CLEAN_OFF) = 0;
+		dbfile_sync_page(&db->dbf, header);
+	}
+}
+
+// Loads the checksums of a cleanly closed file. The header and the space
+// pages are checked right away, hash pages the first time they are probed.
+// The file is then marked dirty until the next checkpoint.
+int database_load_checksums(struct database* db) {
+	size_t page_size = db->dbf.page_size;
+	char* header = dbfile_get_page(&db->dbf, 0);
+	int32_t csum_iter = *(int32_t*)(header + DB_HEADER_CSUM_ROOT_OFF);
+	if (*(int32_t*)(header + DB_HEADER_CLEAN_OFF) != 1 || csum_iter <= 0) {
+		return 1;
+	}
+	if (dbheader_crc(header, page_size) != *(uint32_t*)(header + DB_HEADER_CSUM_OFF)) {
+		++db->corrupt;
+		return 0;
+	}
+	// only meta pages have checksums, so the tables are sized for the
+	// highest of them rather than for the whole file
+	size_t csum_len = 0;
+	for (int32_t iter = csum_iter; iter > 0 && (size_t)iter < db->dbf.page_count; ) {
+		int32_t* reader = (int32_t*)dbfile_get_page(&db->dbf, iter);
+		int32_t* entry = reader + (CSUM_BLOCK_HEADER_SIZE / sizeof(int32_t));
+		for (int32_t i = 0; i < reader[1]; ++i, entry += 2) {
+			if (entry[0] > 0 && (size_t)entry[0] < db->dbf.page_count && (size_t)entry[0] >= csum_len) {
+				csum_len = entry[0] + 1;
+			}
+		}
+		csum_len = (size_t)iter >= csum_len ? iter + 1 : csum_len;
+		iter = reader[0];
+	}
+	db->csum_len = csum_len;
+	db->csums = KAMOODB_CALLOC(db->csum_len, sizeof(uint32_t));
+	db->csum_state = KAMOODB_CALLOC(db->csum_len, 1);
+	while (csum_iter > 0 && (size_t)csum_iter < db->csum_len) {
+		int32_t* reader = (int32_t*)dbfile_get_page(&db->dbf, csum_iter);
+		int32_t* entry = reader + (CSUM_BLOCK_HEADER_SIZE / sizeof(int32_t));
+		for (int32_t i = 0; i < reader[1]; ++i, entry += 2) {
+			if (entry[0] > 0 && (size_t)entry[0] < db->csum_len) {
+				db->csums[entry[0]] = (uint32_t)entry[1];
+				db->csum_state[entry[0]] = DBCSUM_PENDING;
+			}
+		}
+		csum_iter = reader[0];
+	}
+	int32_t space_iter = database_get_spaceroot(db);
+	while (space_iter != -1) {
+		if (!database_check_page(db, space_iter)) {
+			return 0;
+		}
+		space_iter = ((int32_t*)dbfile_get_page(&db->dbf, space_iter))[0];
+	}
+	database_mark_dirty(db);
+	return 1;
+}
+
+// generation stamps
+// [next page][count][stamps]
+// stamp n of the k-th table page is the generation page k * per page + n
+// last changed in. A checkpoint that finds touched pages bumps the
+// generation in the header and stamps them with it.
+static const size_t GEN_BLOCK_HEADER_SIZE = sizeof(int32_t) * 2;
+
+size_t database_gen_per_page(struct database* db) {
+	return (db->dbf.page_size - GEN_BLOCK_HEADER_SIZE) / sizeof(uint32_t);
+}
+
+uint32_t database_get_generation(struct database* db) {
+	return *(uint32_t*)(dbfile_get_page(&db->dbf, 0) + DB_HEADER_GEN_OFF);
+}
+
+// Generation page last changed in as of the last checkpoint, 0 if unknown
+uint32_t database_page_gen(struct database* db, size_t page) {
+	size_t per_page = database_gen_per_page(db);
+	if (page / per_page >= db->gen_pages.len) {
+		return 0;
+	}
+	char* table = dbfile_get_page(&db->dbf, db->gen_pages.pages[page / per_page]);
+	return ((uint32_t*)(table + GEN_BLOCK_HEADER_SIZE))[page % per_page];
+}
+
+static int database_range_touched(struct database* db, size_t first, size_t end) {
+	const struct dbfile* dbf = &db->dbf;
+	size_t i = first;
+	while (i < end && i / 64 < dbf->touched_len) {
+		if (i % 64 == 0 && dbf->touched[i / 64] == 0) {
+			i += 64;
+			continue;
+		}
+		if (dbfile_touched(dbf, i)) {
+			return 1;
+		}
+		++i;
+	}
+	return 0;
+}
+
+int database_stamp_pages(struct database* db) {
+	struct dbfile* dbf = &db->dbf;
+	size_t per_page = database_gen_per_page(db);
+	char* header = dbfile_get_page(dbf, 0);
+	if (!database_range_touched(db, 0, dbf->page_count)) {
+		return 1;
+	}
+	while (db->gen_pages.len * per_page < dbf->page_count) {
+		size_t new_page = dbfile_grow(dbf, 1);
+		if (new_page == (size_t)-1) {
+			return 0;
+		}
+		int32_t* writer = (int32_t*)dbfile_get_page(dbf, new_page);
+		writer[0] = -1;
+		writer[1] = 0;
+		if (db->gen_pages.len == 0) {
+			*(int32_t*)(header + DB_HEADER_GEN_ROOT_OFF) = new_page;
+		} else {
+			((int32_t*)dbfile_get_page(dbf, db->gen_pages.pages[db->gen_pages.len - 1]))[0] = new_page;
+		}
+		page_vec_push(&db->gen_pages, new_page);
+	}
+	uint32_t gen = database_get_generation(db) + 1;
+	*(uint32_t*)(header + DB_HEADER_GEN_OFF) = gen;
+	dbfile_touch(dbf, 0);
+	// a table page changes if it stamps a touched page, which touches the
+	// table page holding its own stamp in turn
+	int more = 1;
+	while (more) {
+		more = 0;
+		for (size_t k = 0; k < db->gen_pages.len; ++k) {
+			size_t end = (k + 1) * per_page < dbf->page_count ? (k + 1) * per_page : dbf->page_count;
+			if (!dbfile_touched(dbf, db->gen_pages.pages[k]) && database_range_touched(db, k * per_page, end)) {
+				dbfile_touch(dbf, db->gen_pages.pages[k]);
+				more = 1;
+			}
+		}
+	}
+	for (size_t k = 0; k < db->gen_pages.len; ++k) {
+		size_t end = (k + 1) * per_page < dbf->page_count ? (k + 1) * per_page : dbf->page_count;
+		if (!dbfile_touched(dbf, db->gen_pages.pages[k])) {
+			continue;
+		}
+		char* table = dbfile_get_page(dbf, db->gen_pages.pages[k]);
+		uint32_t* stamps = (uint32_t*)(table + GEN_BLOCK_HEADER_SIZE);
+		for (size_t i = k * per_page; i < end; ++i) {
+			if (dbfile_touched(dbf, i)) {
+				stamps[i - (k * per_page)] = gen;
+			}
+		}
+		((int32_t*)table)[1] = end - (k * per_page);
+	}
+	return 1;
+}
+
+struct dbcsum_entry {
+	int32_t page;
+	uint32_t crc;
+};
+
+static int dbcsum_entry_cmp(const void* a, const void* b) {
+	int32_t pa = ((const struct dbcsum_entry*)a)->page;
+	int32_t pb = ((const struct dbcsum_entry*)b)->page;
+	return (pa > pb) - (pa < pb);
+}
+
+static int database_wal_finish(struct database* db);
+static void database_wal_reset(struct database* db);
+
+// Records checksums of the header, hash and space pages, syncs them, and
+// marks the file clean. Meta pages whose checksum moved since the last
+// checkpoint count as touched, then every touched page is stamped with a
+// new generation. database_close does this on the way out.
+int database_checkpoint(struct database* db) {
+	struct page_vec meta;
+	struct page_vec table;
+	// transactions a failed apply or a dead writer left part way go in first
+	int logged_all = database_wal_finish(db);
+	size_t page_size = db->dbf.page_size;
+	size_t per_page = (page_size - CSUM_BLOCK_HEADER_SIZE) / CSUM_ENTRY_SIZE;
+	char* header = dbfile_get_page(&db->dbf, 0);
+	page_vec_init(&meta);
+	page_vec_init(&table);
+	database_collect_meta_pages(db, &meta);
+	// the table is reused across checkpoints and only grows with the index
+	int32_t csum_iter = *(int32_t*)(header + DB_HEADER_CSUM_ROOT_OFF);
+	while (csum_iter > 0) {
+		page_vec_push(&table, csum_iter);
+		csum_iter = ((int32_t*)dbfile_get_page(&db->dbf, csum_iter))[0];
+	}
+	while (table.len * per_page < meta.len) {
+		size_t new_page = dbfile_grow(&db->dbf, 1);
+		if (new_page == (size_t)-1) {
+			page_vec_deinit(&meta);
+			page_vec_deinit(&table);
+			return 0;
+		}
+		((int32_t*)dbfile_get_page(&db->dbf, new_page))[0] = -1;
+		if (table.len == 0) {
+			*(int32_t*)(header + DB_HEADER_CSUM_ROOT_OFF) = new_page;
+		} else {
+			((int32_t*)dbfile_get_page(&db->dbf, table.pages[table.len - 1]))[0] = new_page;
+		}
+		page_vec_push(&table, new_page);
+	}
+	size_t n_old = 0;
+	struct dbcsum_entry* old = KAMOODB_MALLOC(sizeof(struct dbcsum_entry) * (table.len * per_page + 1));
+	uint32_t* table_crcs = KAMOODB_MALLOC(sizeof(uint32_t) * (table.len + 1));
+	for (size_t i = 0; i < table.len; ++i) {
+		int32_t* writer = (int32_t*)dbfile_get_page(&db->dbf, table.pages[i]);
+		int32_t* entry = writer + (CSUM_BLOCK_HEADER_SIZE / sizeof(int32_t));
+		table_crcs[i] = crc32c(0, (char*)writer, page_size);
+		for (int32_t n = 0; n < writer[1] && (size_t)n < per_page; ++n, entry += 2) {
+			old[n_old].page = entry[0];
+			old[n_old++].crc = (uint32_t)entry[1];
+		}
+		writer[1] = 0;
+	}
+	qsort(old, n_old, sizeof(struct dbcsum_entry), dbcsum_entry_cmp);
+	// the header checksum is taken on its own once everything else is in
+	for (size_t i = 1; i < meta.len; ++i) {
+		char* page = dbfile_get_page(&db->dbf, meta.pages[i]);
+		int32_t* writer = (int32_t*)dbfile_get_page(&db->dbf, table.pages[(i - 1) / per_page]);
+		int32_t* entry = writer + (CSUM_BLOCK_HEADER_SIZE / sizeof(int32_t)) + (writer[1] * 2);
+		struct dbcsum_entry key = {meta.pages[i], 0};
+		struct dbcsum_entry* prev = bsearch(&key, old, n_old, sizeof(struct dbcsum_entry), dbcsum_entry_cmp);
+		entry[0] = meta.pages[i];
+		entry[1] = (int32_t)crc32c(0, page, page_size);
+		if (prev == NULL || prev->crc != (uint32_t)entry[1]) {
+			dbfile_touch(&db->dbf, meta.pages[i]);
+		}
+		++writer[1];
+	}
+	KAMOODB_FREE(old);
+	for (size_t i = 0; i < table.len; ++i) {
+		char* page = dbfile_get_page(&db->dbf, table.pages[i]);
+		if (crc32c(0, page, page_size) != table_crcs[i]) {
+			dbfile_touch(&db->dbf, table.pages[i]);
+		}
+	}
+	KAMOODB_FREE(table_crcs);
+	// one sync for everything, the header only says clean once it is done
+	if (!database_stamp_pages(db) || !dbfile_sync(&db->dbf)) {
+		page_vec_deinit(&meta);
+		page_vec_deinit(&table);
+		return 0;
+	}
+	dbfile_clear_touched(&db->dbf);
+	*(int32_t*)(header + DB_HEADER_CLEAN_OFF) = 1;
+	*(uint32_t*)(header + DB_HEADER_CSUM_OFF) = dbheader_crc(header, page_size);
+	dbfile_sync_page(&db->dbf, header);
+	// every logged transaction is in the file now
+	if (logged_all) {
+		database_wal_reset(db);
+	}
+	page_vec_deinit(&meta);
+	page_vec_deinit(&table);
+	return 1;
+}
+
+static int database_open_file(struct database* db, const char* pathfile, struct dbcfg* cfg) {
+	if (!dbfile_open(&db->dbf, pathfile, cfg))
+		return 0;
+	db->csums = NULL;
+	db->csum_state = NULL;
+	db->csum_len = 0;
+	db->corrupt = 0;
+	memset(&db->stats, 0, sizeof(struct dbstats));
+	db->snaps = NULL;
+	db->snap_epoch = 0;
+	memset(&db->cow, 0, sizeof(struct dbcow));
+	db->scratch = NULL;
+	db->scratch_cap = 0;
+	db->shared = NULL;
+	db->wal_fd = -1;
+	db->wal_pending = 0;
+	db->txn_sync = cfg != NULL ? cfg->txn_sync : 0;
+	db->capacity = cfg != NULL ? cfg->capacity : 0;
+	db->clock_bits = NULL;
+	db->clock_len = 0;
+	db->clock_hand = 0;
+	db->bloom_root = 0;
+	db->bloom_pages = 0;
+	dbfile_track_page_count(&db->dbf, DB_HEADER_PAGE_COUNT_OFF);
+	db->avg_record_size = cfg != NULL ? cfg->avg_record_size : 0;
+	char* header = dbfile_get_page(&db->dbf, 0);
+	if (!_has_magic_seq(header)) {
+		database_set_slot_size(db, database_slot_size_for(cfg), cfg != NULL && cfg->expiry);
+		database_init(db, cfg);
+	}
+	db->dbf.page_size = database_get_page_size(db);
+	database_set_slot_size(db, *(int32_t*)(header + DB_HEADER_SLOT_SIZE_OFF), *(int32_t*)(header + DB_HEADER_EXPIRY_OFF) == 1);
+	page_vec_init(&db->hash_pages);
+	database_populate_hash_pages(db, database_get_hashroot(db), &db->hash_pages);
+	database_load_bloom(db);
+	page_vec_init(&db->gen_pages);
+	int32_t gen_root = *(int32_t*)(header + DB_HEADER_GEN_ROOT_OFF);
+	if (gen_root > 0) {
+		database_populate_hash_pages(db, gen_root, &db->gen_pages);
+	}
+	// changes made before a crash were never stamped
+	int was_clean = *(int32_t*)(header + DB_HEADER_CLEAN_OFF) == 1;
+	if (!was_clean) {
+		dbfile_touch_run(&db->dbf, 0, db->dbf.page_count);
+	}
+	if (!database_load_codec(db) || !database_load_checksums(db) || !database_wal_finish(db)) {
+		database_release(db);
+		return 0;
+	}
+	return 1;
+}
+
+int database_open(struct database* db, const char* pathfile, struct dbcfg* cfg) {
+	return database_open_file(db, pathfile, cfg);
+}
+
+// Trains a compression dictionary from sample values and stores it in the
+// file. Values are only ever decoded with the dictionary they were encoded
+// with, so this has to happen before the first put.
+int database_train_dict(struct database* db, const char** samples, size_t n_samples, size_t dict_cap) {
+	int32_t dict_ptr[3];
+	if (db->codec.type == DBCODEC_NONE || db->codec.dict_size > 0 || database_get_item_count(db) > 0) {
+		return 0;
+	}
+	dict_cap = dict_cap > DBCODEC_DICT_MAX ? DBCODEC_DICT_MAX : dict_cap;
+	char* dict = KAMOODB_MALLOC(dict_cap);
+	size_t dict_size = dbcodec_train(samples, n_samples, dict, dict_cap);
+	if (dict_size == 0 || database_allocate_storage(db, dict_size, dict_ptr) == -1) {
+		KAMOODB_FREE(dict);
+		return 0;
+	}
+	dbfile_write_po(&db->dbf, dict_ptr[0], dict_ptr[1], dict, dict_size);
+	memcpy(dbfile_get_page(&db->dbf, 0) + DB_HEADER_DICT_OFF, dict_ptr, sizeof(dict_ptr));
+	dbcodec_set_dict(&db->codec, dict, dict_size);
+	KAMOODB_FREE(dict);
+	return 1;
+}
+
+// Writes a copy of the database to path, for in memory stores this is
+// the snapshot that a later database_open of path loads back.
+int database_save(struct database* db, const char* path) {
+	// the copy is written clean, the open store keeps changing
+	int ok = database_checkpoint(db) && dbfile_save(&db->dbf, path);
+	database_mark_dirty(db);
+	return ok;
+}
+
+// ------- backup -------
+// A backup streams the file to a copy while the database stays in use.
+// It starts from a checkpoint and copies a run of pages per step, the
+// database can be used between steps. database_backup_finish checkpoints
+// again and recopies the pages stamped since the start, so the copy is
+// the database as of the finish.
+// A delta only holds the pages stamped after a given generation
+// [magic][page size][since][generation][page count]
+// followed by [page number][page] records, later records win
+static const char DELTA_MAGIC_SEQ[] = {'k', 'h', 'd', 'l'};
+static const size_t DELTA_HEADER_SIZE = sizeof(DELTA_MAGIC_SEQ) + (sizeof(uint32_t) * 3) + sizeof(uint64_t);
+static const size_t DELTA_RECORD_HEADER_SIZE = sizeof(uint64_t);
+
+struct dbbackup {
+	struct database* db;
+	int fd;
+	char* path;
+	char* tmp_path;
+	// a delta of the pages stamped after since, or a full copy
+	int delta;
+	uint32_t since;
+	// generation of the checkpoint the pass started from
+	uint32_t start_gen;
+	size_t next_page;
+	size_t end_page;
+	uint64_t delta_off;
+	size_t pages_copied;
+};
+
+// Copies pages [first, first + n) to the same place in the backup, inside
+// the kernel when both sides are files
+static int dbbackup_copy_run(struct dbbackup* bk, size_t first, size_t n) {
+	struct dbfile* dbf = &bk->db->dbf;
+	size_t page_size = dbf->page_size;
+	size_t done = 0;
+#if defined(KAMOODB_HAS_FS_COPY) && defined(SYS_copy_file_range)
+	if (dbf->ftype != DBSTORE_IN_MEM) {
+		int64_t in_off = first * page_size;
+		int64_t out_off = first * page_size;
+		while (done < n * page_size) {
+			ssize_t res = syscall(SYS_copy_file_range, dbf->fd, &in_off, bk->fd, &out_off, (n * page_size) - done, 0);
+			if (res <= 0) {
+				break;
+			}
+			done += res;
+		}
+		done -= done % page_size;
+	}
+#endif
+	for (size_t i = done / page_size; i < n; ++i) {
+		if (pwrite(bk->fd, dbfile_get_page(dbf, first + i), page_size, (first + i) * page_size) != (ssize_t)page_size) {
+			return 0;
+		}
+	}
+	bk->pages_copied += n;
+	return 1;
+}
+
+static int dbbackup_put_page(struct dbbackup* bk, size_t page) {
+	struct dbfile* dbf = &bk->db->dbf;
+	uint64_t page_n = page;
+	if (!bk->delta) {
+		return dbbackup_copy_run(bk, page, 1);
+	}
+	if (pwrite(bk->fd, &page_n, sizeof(page_n), bk->delta_off) != (ssize_t)sizeof(page_n) ||
+	    pwrite(bk->fd, dbfile_get_page(dbf, page), dbf->page_size, bk->delta_off + DELTA_RECORD_HEADER_SIZE) != (ssize_t)dbf->page_size) {
+		return 0;
+	}
+	bk->delta_off += DELTA_RECORD_HEADER_SIZE + dbf->page_size;
+	++bk->pages_copied;
+	return 1;
+}
+
+static int dbbackup_start(struct dbbackup* bk, struct database* db, const char* path, int delta, uint32_t since) {
+	memset(bk, 0, sizeof(struct dbbackup));
+	bk->db = db;
+	bk->delta = delta;
+	bk->since = since;
+	bk->fd = -1;
+	if (!database_checkpoint(db)) {
+		return 0;
+	}
+	database_mark_dirty(db);
+	bk->start_gen = database_get_generation(db);
+	bk->end_page = db->dbf.page_count;
+	bk->delta_off = DELTA_HEADER_SIZE;
+	size_t tmp_size = strlen(path) + 5;
+	bk->path = str_dupl(path);
+	bk->tmp_path = KAMOODB_MALLOC(tmp_size);
+	snprintf(bk->tmp_path, tmp_size, "%s.tmp", path);
+	bk->fd = open(bk->tmp_path, O_WRONLY | O_CREAT | O_TRUNC, (mode_t)0600);
+	if (bk->fd == -1) {
+		return 0;
+	}
+#if defined(KAMOODB_HAS_FS_COPY) && defined(FICLONE)
+	// a reflink shares the extents of the whole file at once
+	if (!delta && db->dbf.ftype != DBSTORE_IN_MEM && ioctl(bk->fd, FICLONE, db->dbf.fd) == 0) {
+		bk->next_page = bk->end_page;
+	}
+#endif
+	return 1;
+}
+
+static void dbbackup_release(struct dbbackup* bk, int ok) {
+	if (bk->fd != -1) {
+		close(bk->fd);
+		bk->fd = -1;
+	}
+	if (bk->tmp_path != NULL && !ok) {
+		remove(bk->tmp_path);
+	}
+	KAMOODB_FREE(bk->tmp_path);
+	KAMOODB_FREE(bk->path);
+	bk->tmp_path = NULL;
+	bk->path = NULL;
+}
+
+// Starts a full copy of the database to path
+int database_backup_begin(struct dbbackup* bk, struct database* db, const char* path) {
+	if (!dbbackup_start(bk, db, path, 0, 0)) {
+		dbbackup_release(bk, 0);
+		return 0;
+	}
+	return 1;
+}
+
+// Starts a delta of the pages changed after generation since
+int database_delta_begin(struct dbbackup* bk, struct database* db, const char* path, uint32_t since) {
+	if (!dbbackup_start(bk, db, path, 1, since)) {
+		dbbackup_release(bk, 0);
+		return 0;
+	}
+	return 1;
+}
+
+// Copies up to n_pages more pages. Returns 1 while there are pages left,
+// 0 once the pass is done and -1 on failure.
+int database_backup_step(struct dbbackup* bk, size_t n_pages) {
+	size_t end = bk->next_page + n_pages < bk->end_page ? bk->next_page + n_pages : bk->end_page;
+	if (!bk->delta) {
+		if (end > bk->next_page && !dbbackup_copy_run(bk, bk->next_page, end - bk->next_page)) {
+			return -1;
+		}
+	} else {
+		for (size_t i = bk->next_page; i < end; ++i) {
+			if (database_page_gen(bk->db, i) > bk->since && !dbbackup_put_page(bk, i)) {
+				return -1;
+			}
+		}
+	}
+	bk->next_page = end;
+	return bk->next_page < bk->end_page;
+}
+
+// Completes the pass, then brings the copy up to date with a checkpoint
+// and moves it into place. Returns 1 on success, the copy is removed
+// otherwise.
+int database_backup_finish(struct dbbackup* bk) {
+	struct database* db = bk->db;
+	int ok = bk->fd != -1;
+	while (ok && bk->next_page < bk->end_page) {
+		ok = database_backup_step(bk, SIZE_MAX) != -1;
+	}
+	ok = ok && database_checkpoint(db);
+	// the header is always rewritten by the checkpoint
+	ok = ok && dbbackup_put_page(bk, 0);
+	for (size_t i = 1; ok && i < db->dbf.page_count; ++i) {
+		if (database_page_gen(db, i) > bk->start_gen) {
+			ok = dbbackup_put_page(bk, i);
+		}
+	}
+	if (ok && bk->delta) {
+		char head[DELTA_HEADER_SIZE];
+		uint32_t fields[3] = {(uint32_t)db->dbf.page_size, bk->since, database_get_generation(db)};
+		uint64_t page_count = db->dbf.page_count;
+		memcpy(head, DELTA_MAGIC_SEQ, sizeof(DELTA_MAGIC_SEQ));
+		memcpy(head + sizeof(DELTA_MAGIC_SEQ), fields, sizeof(fields));
+		memcpy(head + sizeof(DELTA_MAGIC_SEQ) + sizeof(fields), &page_count, sizeof(page_count));
+		ok = pwrite(bk->fd, head, DELTA_HEADER_SIZE, 0) == (ssize_t)DELTA_HEADER_SIZE;
+	} else if (ok) {
+		ok = ftruncate(bk->fd, db->dbf.page_count * db->dbf.page_size) == 0;
+	}
+	ok = ok && fsync(bk->fd) == 0;
+	ok = ok && rename(bk->tmp_path, bk->path) == 0;
+	database_mark_dirty(db);
+	dbbackup_release(bk, ok);
+	return ok;
+}
+
+void database_backup_abort(struct dbbackup* bk) {
+	dbbackup_release(bk, 0);
+}
+
+int database_backup(struct database* db, const char* path) {
+	struct dbbackup bk;
+	return database_backup_begin(&bk, db, path) && database_backup_finish(&bk);
+}
+
+int database_backup_delta(struct database* db, const char* path, uint32_t since) {
+	struct dbbackup bk;
+	return database_delta_begin(&bk, db, path, since) && database_backup_finish(&bk);
+}
+
+// Brings a closed copy at generation since up to the generation of the
+// delta. Deltas have to be applied in order.
+int database_apply_delta(const char* path, const char* delta_path) {
+	char head[DELTA_HEADER_SIZE];
+	uint32_t fields[3];
+	uint64_t page_count = 0;
+	uint32_t gen = 0;
+	int fd = open(path, O_RDWR);
+	int delta_fd = open(delta_path, O_RDONLY);
+	int ok = fd != -1 && delta_fd != -1;
+	ok = ok && pread(delta_fd, head, DELTA_HEADER_SIZE, 0) == (ssize_t)DELTA_HEADER_SIZE;
+	ok = ok && memcmp(head, DELTA_MAGIC_SEQ, sizeof(DELTA_MAGIC_SEQ)) == 0;
+	if (ok) {
+		memcpy(fields, head + sizeof(DELTA_MAGIC_SEQ), sizeof(fields));
+		memcpy(&page_count, head + sizeof(DELTA_MAGIC_SEQ) + sizeof(fields), sizeof(page_count));
+		ok = fields[0] > 0 && pread(fd, &gen, sizeof(gen), DB_HEADER_GEN_OFF) == (ssize_t)sizeof(gen) && gen == fields[1];
+	}
+	char* page = ok ? KAMOODB_MALLOC(fields[0]) : NULL;
+	uint64_t off = DELTA_HEADER_SIZE;
+	uint64_t page_n = 0;
+	while (ok && pread(delta_fd, &page_n, sizeof(page_n), off) == (ssize_t)sizeof(page_n)) {
+		ok = page_n < page_count && pread(delta_fd, page, fields[0], off + DELTA_RECORD_HEADER_SIZE) == (ssize_t)fields[0];
+		ok = ok && pwrite(fd, page, fields[0], page_n * fields[0]) == (ssize_t)fields[0];
+		off += DELTA_RECORD_HEADER_SIZE + fields[0];
+	}
+	ok = ok && ftruncate(fd, page_count * fields[0]) == 0 && fsync(fd) == 0;
+	KAMOODB_FREE(page);
+	if (fd != -1) {
+		close(fd);
+	}
+	if (delta_fd != -1) {
+		close(delta_fd);
+	}
+	return ok;
+}
+
+static void database_release(struct database* db) {
+	database_snapshot_drop_all(db, 0);
 	dbfile_close(&db->dbf);
-	dbfile_remove(&db->dbf);
 	dbfile_path_free(&db->dbf);
 	page_vec_deinit(&db->hash_pages);
+	page_vec_deinit(&db->gen_pages);
+	dbcodec_deinit(&db->codec);
+	KAMOODB_FREE(db->csums);
+	KAMOODB_FREE(db->csum_state);
+	KAMOODB_FREE(db->scratch);
+	KAMOODB_FREE(db->clock_bits);
+	if (db->wal_fd != -1) {
+		close(db->wal_fd);
+		db->wal_fd = -1;
+	}
+}
+
+int database_shared_lock(struct database* db);
+void database_shared_unlock(struct database* db);
+static void database_shared_detach(struct database* db);
+
+void database_close(struct database* db) {
+	database_snapshot_drop_all(db, 1);
+	if (db->shared != NULL) {
+		if (database_shared_lock(db)) {
+			database_checkpoint(db);
+			database_shared_unlock(db);
+		}
+		database_release(db);
+		database_shared_detach(db);
+		return;
+	}
+	database_checkpoint(db);
+	database_release(db);
+}
+
+static char* database_wal_path(struct database* db);
+
+void database_close_and_remove(struct database* db) {
+	char* wal_path = database_wal_path(db);
+	if (wal_path != NULL) {
+		remove(wal_path);
+		KAMOODB_FREE(wal_path);
+	}
+	dbfile_remove(&db->dbf);
+	database_release(db);
+	database_shared_detach(db);
+}
+
+// ------- shared access -------
+// Several processes can open the same file with database_open_shared. A
+// sidecar file next to it, path.shm, holds a process shared robust mutex
+// that serializes writers, and a sequence number that is odd while a
+// writer is inside. Readers take no lock, they note the sequence, read,
+// and retry if it moved, so a reader never holds up the writer. Each
+// process keeps its own copy of the index page list and the page count,
+// and refreshes them from the header when the sequence shows that another
+// process changed the file.
+//
+// A checkpoint stamps the pages changed by the process that runs it, so
+// every writer process has to close the database for deltas to be complete.
+static const uint32_t DBSHARED_MAGIC = 0x6b736d31;
+
+struct dbshared_region {
+	uint32_t magic;
+	uint32_t pad;
+	uint64_t seq;
+	// writers that died holding the lock, their last change may be partial
+	uint64_t owner_deaths;
+	pthread_mutex_t lock;
+};
+
+struct dbshared {
+	int fd;
+	struct dbshared_region* region;
+	// sequence the local view of the file was last brought up to, and the
+	// one its generation table list was
+	uint64_t seen;
+	uint64_t gen_seen;
+};
+
+static struct dbshared* dbshared_attach(const char* path) {
+	size_t size = strlen(path) + 5;
+	char* shm_path = KAMOODB_MALLOC(size);
+	snprintf(shm_path, size, "%s.shm", path);
+	int fd = open(shm_path, O_RDWR | O_CREAT, (mode_t)0600);
+	KAMOODB_FREE(shm_path);
+	if (fd == -1) {
+		return NULL;
+	}
+	// every process holds a shared lock on the sidecar while attached, so
+	// getting it exclusively means no other process is. The first process
+	// in sets the region up before it lets the others in.
+	struct dbshared_region* region = MAP_FAILED;
+	int alone = flock(fd, LOCK_EX | LOCK_NB) == 0;
+	if (alone || flock(fd, LOCK_SH) == 0) {
+		struct stat sb;
+		if (fstat(fd, &sb) == 0 && ((size_t)sb.st_size >= sizeof(struct dbshared_region) ||
+		                            ftruncate(fd, sizeof(struct dbshared_region)) == 0)) {
+			region = mmap(0, sizeof(struct dbshared_region), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		}
+		if (region != MAP_FAILED && region->magic != DBSHARED_MAGIC) {
+			pthread_mutexattr_t attr;
+			pthread_mutexattr_init(&attr);
+			pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+			pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+			pthread_mutex_init(&region->lock, &attr);
+			pthread_mutexattr_destroy(&attr);
+			region->seq = 0;
+			region->owner_deaths = 0;
+			__atomic_store_n(&region->magic, DBSHARED_MAGIC, __ATOMIC_RELEASE);
+		}
+		if (alone) {
+			flock(fd, LOCK_SH);
+		}
+	}
+	if (region == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	struct dbshared* sh = KAMOODB_CALLOC(1, sizeof(struct dbshared));
+	sh->fd = fd;
+	sh->region = region;
+	return sh;
+}
+
+static void database_shared_detach(struct database* db) {
+	if (db->shared == NULL) {
+		return;
+	}
+	munmap(db->shared->region, sizeof(struct dbshared_region));
+	close(db->shared->fd);
+	KAMOODB_FREE(db->shared);
+	db->shared = NULL;
+}
+
+static int dbshared_mutex_lock(struct dbshared_region* region, int* owner_died) {
+	int err = pthread_mutex_lock(&region->lock);
+	*owner_died = err == EOWNERDEAD;
+	if (err == EOWNERDEAD) {
+		// the writer died inside, close its section so readers go on
+		if (region->seq & 1) {
+			__atomic_add_fetch(&region->seq, 1, __ATOMIC_SEQ_CST);
+		}
+		++region->owner_deaths;
+		err = pthread_mutex_consistent(&region->lock);
+	}
+	return err == 0;
+}
+
+// Brings the local view of the file up to what other processes wrote.
+// Readers run this while a writer may be changing the header, so everything
+// taken from it is bounds checked, 0 means the view could not be trusted.
+// Slots are read once into a copy that is checked before it is used, see
+// _read_slot_ptr, as a writer can change them between two reads.
+static int database_shared_refresh(struct database* db, uint64_t seq, int writer) {
+	struct dbshared* sh = db->shared;
+	char* header = dbfile_get_page(&db->dbf, 0);
+	// only a checkpoint needs the generation table, and only writers run one
+	if (writer && seq != sh->gen_seen) {
+		int32_t gen_root = *(int32_t*)(header + DB_HEADER_GEN_ROOT_OFF);
+		page_vec_clear(&db->gen_pages);
+		if (gen_root > 0) {
+			database_populate_hash_pages(db, gen_root, &db->gen_pages);
+		}
+		sh->gen_seen = seq;
+	}
+	if (seq == sh->seen) {
+		return 1;
+	}
+	// checksums only hold for the file as this process last left it
+	KAMOODB_FREE(db->csums);
+	KAMOODB_FREE(db->csum_state);
+	db->csums = NULL;
+	db->csum_state = NULL;
+	db->csum_len = 0;
+	int64_t page_count = *(volatile int64_t*)(header + DB_HEADER_PAGE_COUNT_OFF);
+	struct stat sb;
+	if (fstat(db->dbf.fd, &sb) != 0 || page_count <= 0 || (size_t)page_count * db->dbf.page_size > (size_t)sb.st_size) {
+		return 0;
+	}
+	db->dbf.page_count = page_count;
+	db->dbf.file_size = page_count * db->dbf.page_size;
+	db->dbf.alloc_size = sb.st_size;
+	int32_t root = database_get_hashroot(db);
+	if (db->hash_pages.len != (size_t)database_get_hash_count(db) || db->hash_pages.len == 0 ||
+	    db->hash_pages.pages[0] != root) {
+		page_vec_clear(&db->hash_pages);
+		while (root != -1) {
+			if (root <= 0 || root >= page_count || db->hash_pages.len >= (size_t)page_count) {
+				return 0;
+			}
+			page_vec_push(&db->hash_pages, root);
+			root = *(volatile int32_t*)dbfile_get_page(&db->dbf, root);
+		}
+	}
+	if (db->codec.dict_size == 0 && ((int32_t*)(header + DB_HEADER_DICT_OFF))[0] > 0) {
+		dbcodec_deinit(&db->codec);
+		database_load_codec(db);
+	}
+	database_load_bloom(db);
+	sh->seen = seq;
+	return 1;
+}
+
+// Takes the writer lock and brings the local view up to date. Every
+// change to a shared database has to happen between this and
+// database_shared_unlock.
+int database_shared_lock(struct database* db) {
+	struct dbshared* sh = db->shared;
+	int owner_died = 0;
+	if (!dbshared_mutex_lock(sh->region, &owner_died)) {
+		return 0;
+	}
+	uint64_t seq = __atomic_fetch_add(&sh->region->seq, 1, __ATOMIC_SEQ_CST);
+	if (!database_shared_refresh(db, seq, 1)) {
+		database_shared_unlock(db);
+		return 0;
+	}
+	// a checkpoint by another process left the file marked clean
+	database_mark_dirty(db);
+	// the writer that died may have been part way through a transaction
+	if (owner_died) {
+		database_wal_finish(db);
+	}
+	return 1;
+}
+
+void database_shared_unlock(struct database* db) {
+	struct dbshared* sh = db->shared;
+	uint64_t seq = __atomic_add_fetch(&sh->region->seq, 1, __ATOMIC_SEQ_CST);
+	// what this process wrote is already in its view
+	sh->seen = sh->seen + 2 == seq ? seq : sh->seen;
+	sh->gen_seen = sh->gen_seen + 2 == seq ? seq : sh->gen_seen;
+	pthread_mutex_unlock(&sh->region->lock);
+}
+
+// Starts a lock free read. Returns the sequence to hand to
+// database_shared_read_retry once the read is done.
+uint64_t database_shared_read_begin(struct database* db) {
+	struct dbshared* sh = db->shared;
+	for (;;) {
+		uint64_t seq = __atomic_load_n(&sh->region->seq, __ATOMIC_ACQUIRE);
+		if (!(seq & 1) && database_shared_refresh(db, seq, 0)) {
+			return seq;
+		}
+		sched_yield();
+	}
+}
+
+// 1 if a writer got in since database_shared_read_begin and the read has
+// to be done again
+int database_shared_read_retry(struct database* db, uint64_t seq) {
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&db->shared->region->seq, __ATOMIC_RELAXED) != seq;
+}
+
+// Opens path for use by several processes at once. In memory stores can
+// not be shared.
+int database_open_shared(struct database* db, const char* path, struct dbcfg* cfg) {
+	if (cfg != NULL && cfg->ftype == DBSTORE_IN_MEM) {
+		return 0;
+	}
+	struct dbshared* sh = dbshared_attach(path);
+	if (sh == NULL) {
+		return 0;
+	}
+	// opening writes to the header, and creates the file if it is new. It
+	// also finishes a transaction a writer that died left part way.
+	int owner_died = 0;
+	if (!dbshared_mutex_lock(sh->region, &owner_died)) {
+		db->shared = sh;
+		database_shared_detach(db);
+		return 0;
+	}
+	__atomic_add_fetch(&sh->region->seq, 1, __ATOMIC_SEQ_CST);
+	int ok = database_open_file(db, path, cfg);
+	sh->seen = __atomic_add_fetch(&sh->region->seq, 1, __ATOMIC_SEQ_CST);
+	sh->gen_seen = sh->seen;
+	pthread_mutex_unlock(&sh->region->lock);
+	db->shared = sh;
+	if (!ok) {
+		database_shared_detach(db);
+	}
+	return ok;
+}
+
+int database_shared_put(struct database* db, const char* key, const char* val) {
+	if (!database_shared_lock(db)) {
+		return 0;
+	}
+	int res = database_put(db, key, val);
+	database_shared_unlock(db);
+	return res;
+}
+
+int database_shared_del(struct database* db, const char* key) {
+	if (!database_shared_lock(db)) {
+		return 0;
+	}
+	int res = database_del(db, key);
+	database_shared_unlock(db);
+	return res;
+}
+
+char* database_shared_get(struct database* db, const char* key) {
+	for (;;) {
+		size_t corrupt = db->corrupt;
+		uint64_t seq = database_shared_read_begin(db);
+		char* val = database_get(db, key);
+		if (!database_shared_read_retry(db, seq)) {
+			return val;
+		}
+		// whatever the torn read ran into was not damage
+		KAMOODB_FREE(val);
+		db->corrupt = corrupt;
+	}
+}
+
+// ------- transactions -------
+// A transaction buffers puts and deletes and applies them together on
+// commit. Values read through the transaction are checked again at commit,
+// and the commit fails if any of them changed since, so of two interleaved
+// transactions that read a key and write it only the first one to commit
+// goes through. Slots have no spare room for a version counter, so the
+// transaction keeps a copy of each value it read and compares it.
+//
+// The batch is appended to path.wal as one record before it is applied,
+// and the record is marked applied once all of its ops are in. A record
+// left unmarked, by a failed op or a process that died, is finished by the
+// next commit or checkpoint, by an open, or by the process that takes the
+// lock over from a dead writer, so a transaction lands whole or not at all.
+// Records marked applied are never replayed, as that would undo later
+// writes. With txn_sync the file is synced before a record is marked, so
+// its ops also outlive a system crash. A checkpoint empties the log once
+// every record is in. Stores without a file keep no log.
+//
+// record = [magic, or the applied magic][op count][body size][crc32c of body]
+// body = ops, op = [key size][val size, -1 for a delete][key][val]
+static const char WAL_MAGIC_SEQ[] = {'k', 'h', 't', 'x'};
+static const char WAL_DONE_SEQ[] = {'k', 'h', 't', 'd'};
+static const size_t WAL_RECORD_HEADER_SIZE = sizeof(WAL_MAGIC_SEQ) + (sizeof(uint32_t) * 3);
+static const uint32_t WAL_DEL = UINT32_MAX;
+
+struct dbtxn_read {
+	char* key;
+	// the value read, NULL for a missing key
+	char* val;
+};
+
+struct dbtxn {
+	struct database* db;
+	// the log record of the commit, the ops follow its header
+	char* rec;
+	size_t rec_len;
+	size_t rec_cap;
+	uint32_t n_ops;
+	// where the record went in the log, -1 if there is no log
+	off_t wal_at;
+	struct dbtxn_read* reads;
+	size_t n_reads;
+	size_t reads_cap;
+};
+
+static char* database_wal_path(struct database* db) {
+	if (db->dbf.ftype == DBSTORE_IN_MEM || db->dbf.filepath == NULL) {
+		return NULL;
+	}
+	size_t size = strlen(db->dbf.filepath) + 5;
+	char* path = KAMOODB_MALLOC(size);
+	snprintf(path, size, "%s.wal", db->dbf.filepath);
+	return path;
+}
+
+static void database_wal_reset(struct database* db) {
+	if (db->wal_fd != -1 && ftruncate(db->wal_fd, 0) != 0) {
+		fprintf(stderr, "Failed to reset the transaction log\n");
+	}
+}
+
+// Applies the ops of one record body, deletes of missing keys are no error
+static int database_wal_apply(struct database* db, const char* body, uint32_t n_ops) {
+	for (uint32_t i = 0; i < n_ops; ++i) {
+		uint32_t sizes[2];
+		memcpy(sizes, body, sizeof(sizes));
+		const char* key = body + sizeof(sizes);
+		if (sizes[1] == WAL_DEL) {
+			database_del(db, key);
+			body = key + sizes[0];
+		} else {
+			if (!database_put(db, key, key + sizes[0])) {
+				return 0;
+			}
+			body = key + sizes[0] + sizes[1];
+		}
+	}
+	return 1;
+}
+
+// Opens the log, creating it if asked. Without a log file the descriptor
+// stays -1, 0 only if there is one that can not be opened.
+static int database_wal_open(struct database* db, int create) {
+	if (db->wal_fd != -1) {
+		return 1;
+	}
+	char* path = database_wal_path(db);
+	if (path == NULL || (!create && !file_exists(path))) {
+		KAMOODB_FREE(path);
+		return 1;
+	}
+	db->wal_fd = open(path, O_RDWR | O_CREAT, (mode_t)0600);
+	KAMOODB_FREE(path);
+	return db->wal_fd != -1;
+}
+
+static void database_wal_mark(struct database* db, off_t at) {
+	if (db->txn_sync && !dbfile_sync(&db->dbf)) {
+		fprintf(stderr, "Failed to sync the ops of a transaction\n");
+	}
+	if (pwrite(db->wal_fd, WAL_DONE_SEQ, sizeof(WAL_DONE_SEQ), at) != (ssize_t)sizeof(WAL_DONE_SEQ)) {
+		fprintf(stderr, "Failed to mark a transaction log record applied\n");
+	}
+}
+
+// Applies the log records no commit finished and marks them applied. A
+// record cut short by a crash was never applied and is dropped. Returns 0
+// if a record could not be applied, it is then tried again later.
+static int database_wal_finish(struct database* db) {
+	if (!database_wal_open(db, 0)) {
+		return 0;
+	}
+	if (db->wal_fd == -1) {
+		db->wal_pending = 0;
+		return 1;
+	}
+	char head[WAL_RECORD_HEADER_SIZE];
+	uint32_t fields[3];
+	off_t off = 0;
+	char* body = NULL;
+	int ok = 1;
+	while (pread(db->wal_fd, head, WAL_RECORD_HEADER_SIZE, off) == (ssize_t)WAL_RECORD_HEADER_SIZE) {
+		int done = memcmp(head, WAL_DONE_SEQ, sizeof(WAL_DONE_SEQ)) == 0;
+		if (!done && memcmp(head, WAL_MAGIC_SEQ, sizeof(WAL_MAGIC_SEQ)) != 0) {
+			break;
+		}
+		memcpy(fields, head + sizeof(WAL_MAGIC_SEQ), sizeof(fields));
+		if (done) {
+			off += WAL_RECORD_HEADER_SIZE + fields[1];
+			continue;
+		}
+		char* grown = KAMOODB_REALLOC(body, fields[1] > 0 ? fields[1] : 1);
+		if (grown == NULL) {
+			ok = 0;
+			break;
+		}
+		body = grown;
+		if (pread(db->wal_fd, body, fields[1], off + WAL_RECORD_HEADER_SIZE) != (ssize_t)fields[1] ||
+		    crc32c(0, body, fields[1]) != fields[2]) {
+			break;
+		}
+		// later records wait, they may depend on this one
+		if (!database_wal_apply(db, body, fields[0])) {
+			ok = 0;
+			break;
+		}
+		database_wal_mark(db, off);
+		off += WAL_RECORD_HEADER_SIZE + fields[1];
+	}
+	KAMOODB_FREE(body);
+	// later records go after the last whole one
+	ok = ok && ftruncate(db->wal_fd, off) == 0;
+	db->wal_pending = !ok;
+	return ok;
+}
+
+// Appends the ops of txn to the log as one record
+int database_wal_append(struct database* db, struct dbtxn* txn) {
+	txn->wal_at = -1;
+	if (!database_wal_open(db, 1)) {
+		return 0;
+	}
+	if (db->wal_fd == -1) {
+		return 1;
+	}
+	uint32_t fields[3];
+	fields[0] = txn->n_ops;
+	fields[1] = txn->rec_len - WAL_RECORD_HEADER_SIZE;
+	fields[2] = crc32c(0, txn->rec + WAL_RECORD_HEADER_SIZE, fields[1]);
+	memcpy(txn->rec, WAL_MAGIC_SEQ, sizeof(WAL_MAGIC_SEQ));
+	memcpy(txn->rec + sizeof(WAL_MAGIC_SEQ), fields, sizeof(fields));
+	off_t at = lseek(db->wal_fd, 0, SEEK_END);
+	if (at == -1) {
+		return 0;
+	}
+	if (pwrite(db->wal_fd, txn->rec, txn->rec_len, at) != (ssize_t)txn->rec_len) {
+		// a torn record would hide the ones appended after it
+		if (ftruncate(db->wal_fd, at) != 0) {
+			fprintf(stderr, "Failed to drop a torn transaction log record\n");
+		}
+		return 0;
+	}
+	txn->wal_at = at;
+	return !db->txn_sync || fdatasync(db->wal_fd) == 0;
+}
+
+// 1 if a value read back at commit is the one the transaction saw
+static int dbtxn_same_val(const char* seen, const char* val) {
+	return seen == NULL ? val == NULL : val != NULL && strcmp(seen, val) == 0;
+}
+
+int database_txn_begin(struct database* db, struct dbtxn* txn) {
+	memset(txn, 0, sizeof(struct dbtxn));
+	txn->db = db;
+	txn->rec_cap = 256;
+	txn->rec = KAMOODB_MALLOC(txn->rec_cap);
+	txn->rec_len = WAL_RECORD_HEADER_SIZE;
+	return txn->rec != NULL;
+}
+
+static int dbtxn_add_op(struct dbtxn* txn, const char* key, const char* val) {
+	uint32_t sizes[2];
+	sizes[0] = strlen(key) + 1;
+	sizes[1] = val != NULL ? strlen(val) + 1 : WAL_DEL;
+	size_t size = sizeof(sizes) + sizes[0] + (val != NULL ? sizes[1] : 0);
+	if (txn->rec_len + size > txn->rec_cap) {
+		size_t cap = txn->rec_cap * 2 > txn->rec_len + size ? txn->rec_cap * 2 : txn->rec_len + size;
+		char* grown = KAMOODB_REALLOC(txn->rec, cap);
+		if (grown == NULL) {
+			return 0;
+		}
+		txn->rec = grown;
+		txn->rec_cap = cap;
+	}
+	char* writer = txn->rec + txn->rec_len;
+	memcpy(writer, sizes, sizeof(sizes));
+	memcpy(writer + sizeof(sizes), key, sizes[0]);
+	if (val != NULL) {
+		memcpy(writer + sizeof(sizes) + sizes[0], val, sizes[1]);
+	}
+	txn->rec_len += size;
+	++txn->n_ops;
+	return 1;
+}
+
+int database_txn_put(struct dbtxn* txn, const char* key, const char* val) {
+	return dbtxn_add_op(txn, key, val);
+}
+
+int database_txn_del(struct dbtxn* txn, const char* key) {
+	return dbtxn_add_op(txn, key, NULL);
+}
+
+// Reads key as the transaction sees it, its own writes included. The
+// value read is checked again at commit.
+char* database_txn_get(struct dbtxn* txn, const char* key) {
+	const char* body = txn->rec + WAL_RECORD_HEADER_SIZE;
+	const char* own = NULL;
+	int own_found = 0;
+	for (uint32_t i = 0; i < txn->n_ops; ++i) {
+		uint32_t sizes[2];
+		memcpy(sizes, body, sizeof(sizes));
+		const char* op_key = body + sizeof(sizes);
+		if (strcmp(op_key, key) == 0) {
+			own_found = 1;
+			own = sizes[1] == WAL_DEL ? NULL : op_key + sizes[0];
+		}
+		body = op_key + sizes[0] + (sizes[1] == WAL_DEL ? 0 : sizes[1]);
+	}
+	if (own_found) {
+		return own != NULL ? str_dupl(own) : NULL;
+	}
+	char* val = txn->db->shared != NULL ? database_shared_get(txn->db, key) : database_get(txn->db, key);
+	for (size_t i = 0; i < txn->n_reads; ++i) {
+		if (strcmp(txn->reads[i].key, key) == 0) {
+			return val;
+		}
+	}
+	if (txn->n_reads == txn->reads_cap) {
+		size_t cap = txn->reads_cap > 0 ? txn->reads_cap * 2 : 8;
+		struct dbtxn_read* grown = KAMOODB_REALLOC(txn->reads, cap * sizeof(struct dbtxn_read));
+		if (grown == NULL) {
+			KAMOODB_FREE(val);
+			return NULL;
+		}
+		txn->reads = grown;
+		txn->reads_cap = cap;
+	}
+	txn->reads[txn->n_reads].key = str_dupl(key);
+	txn->reads[txn->n_reads].val = val != NULL ? str_dupl(val) : NULL;
+	++txn->n_reads;
+	return val;
+}
+
+void database_txn_abort(struct dbtxn* txn) {
+	for (size_t i = 0; i < txn->n_reads; ++i) {
+		KAMOODB_FREE(txn->reads[i].key);
+		KAMOODB_FREE(txn->reads[i].val);
+	}
+	KAMOODB_FREE(txn->reads);
+	KAMOODB_FREE(txn->rec);
+	memset(txn, 0, sizeof(struct dbtxn));
+}
+
+// Applies the transaction if nothing it read has changed since. Returns 0
+// on a conflict or a failure, with none of it applied. Once logged it is
+// committed, ops that fail to apply are finished later from the log. The
+// transaction is released either way.
+int database_txn_commit(struct dbtxn* txn) {
+	struct database* db = txn->db;
+	int ok = db->shared == NULL || database_shared_lock(db);
+	int locked = ok && db->shared != NULL;
+	for (size_t i = 0; ok && i < txn->n_reads; ++i) {
+		char* val = database_get(db, txn->reads[i].key);
+		ok = dbtxn_same_val(txn->reads[i].val, val);
+		KAMOODB_FREE(val);
+	}
+	if (ok && txn->n_ops > 0) {
+		// the pages the ops change are stamped by the next checkpoint
+		database_mark_dirty(db);
+		// the logged record is the commit point. Records a failed apply left
+		// go in before it, and if an op fails now the record stays unmarked
+		// until the next commit, checkpoint or open finishes it.
+		ok = (!db->wal_pending || database_wal_finish(db)) && database_wal_append(db, txn);
+		if (ok && database_wal_apply(db, txn->rec + WAL_RECORD_HEADER_SIZE, txn->n_ops)) {
+			if (txn->wal_at != -1) {
+				database_wal_mark(db, txn->wal_at);
+			}
+		} else if (ok) {
+			db->wal_pending = 1;
+		}
+	}
+	if (locked) {
+		database_shared_unlock(db);
+	}
+	database_txn_abort(txn);
+	return ok;
+}
+
+// ------- analyzer -------
+// An offline look at how the hash index is laid out. It reports block
+// occupancy, tombstones, how far present keys sit from their home slot,
+// and how fragmented the free list is. Hash blocks are split across
+// threads and only ever read, so it can run against a read only mapping
+// of a file that is not open anywhere else.
+
+#define DBANALYZE_PROBE_BUCKETS 65
+#define DBANALYZE_FILL_BUCKETS 11
+#define DBANALYZE_FREE_BUCKETS 32
+
+// A read only view of a database file
+struct dbview {
+	// the whole file in one mapping, or NULL to go through pages
+	const char* base;
+	char** pages;
+	size_t page_size;
+	size_t page_count;
+	size_t slot_size;
+	// the slot bytes dbslot_valid checks, without a trailing expiry time
+	size_t check_size;
+	size_t slots_per_block;
+	size_t hash_len;
+	int32_t space_root;
+	int64_t item_count;
+	double max_load;
+	struct page_vec hash_pages;
+	// the view owns these when they are set
+	int fd;
+	size_t map_size;
+};
+
+struct dbanalysis {
+	size_t blocks;
+	size_t slots;
+	size_t used;
+	size_t tombstones;
+	size_t inline_records;
+	// present keys that did not fit in their home block
+	size_t overflow;
+	size_t bad_slots;
+	uint64_t probe_sum;
+	size_t probe_max;
+	// slots probed to reach each present key, the last bucket holds the rest
+	uint64_t probe_hist[DBANALYZE_PROBE_BUCKETS];
+	// blocks by how full they are, in tenths
+	size_t fill_hist[DBANALYZE_FILL_BUCKETS];
+	size_t block_min_used;
+	size_t block_max_used;
+	size_t free_extents;
+	uint64_t free_bytes;
+	size_t free_largest;
+	// free extents by size, bucket n holds sizes in [2^n, 2^(n+1))
+	size_t free_hist[DBANALYZE_FREE_BUCKETS];
+	int64_t item_count;
+	// load factor the index expands at, 0 if it never does
+	double max_load;
+};
+
+const char* dbview_page(const struct dbview* view, size_t n) {
+	return view->base != NULL ? view->base + (n * view->page_size) : view->pages[n];
+}
+
+static int dbview_load(struct dbview* view) {
+	const char* header = dbview_page(view, 0);
+	int32_t slot_size = *(int32_t*)(header + DB_HEADER_SLOT_SIZE_OFF);
+	int32_t hash_iter = *(int32_t*)(header + sizeof(MAGIC_SEQ));
+	view->slot_size = slot_size > 0 ? (size_t)slot_size : HASHSTORAGE_PTR_SIZE;
+	// a damaged slot size would leave no slots to a block
+	if (view->slot_size > SLOT_INLINE_MAX + HASHSTORAGE_PTR_SIZE + sizeof(uint64_t) ||
+	    view->slot_size > view->page_size - HASH_BLOCK_HEADER_SIZE) {
+		return 0;
+	}
+	view->slots_per_block = (view->page_size - HASH_BLOCK_HEADER_SIZE) / view->slot_size;
+	int expiry = *(int32_t*)(header + DB_HEADER_EXPIRY_OFF) == 1;
+	view->check_size = expiry && view->slot_size > sizeof(uint64_t) ? view->slot_size - sizeof(uint64_t) : view->slot_size;
+	view->space_root = *(int32_t*)(header + sizeof(MAGIC_SEQ) + sizeof(int32_t));
+	view->item_count = *(int64_t*)(header + DB_HEADER_ITEM_COUNT_OFF);
+	view->max_load = 0.0;
+	dbheader_max_load(header, &view->max_load);
+	page_vec_init(&view->hash_pages);
+	while (hash_iter != -1) {
+		if (hash_iter <= 0 || (size_t)hash_iter >= view->page_count || view->hash_pages.len >= view->page_count) {
+			return 0;
+		}
+		page_vec_push(&view->hash_pages, hash_iter);
+		hash_iter = *(const int32_t*)dbview_page(view, hash_iter);
+	}
+	view->hash_len = view->hash_pages.len * view->slots_per_block;
+	return 1;
+}
+
+void dbview_close(struct dbview* view);
+
+// Maps the file at path read only
+int dbview_open(struct dbview* view, const char* path) {
+	struct stat sb;
+	memset(view, 0, sizeof(struct dbview));
+	view->fd = open(path, O_RDONLY);
+	if (view->fd == -1) {
+		return 0;
+	}
+	if (fstat(view->fd, &sb) != 0 || (size_t)sb.st_size < DB_HEADER_CSUM_OFF + sizeof(uint32_t)) {
+		close(view->fd);
+		return 0;
+	}
+	void* base = mmap(0, sb.st_size, PROT_READ, MAP_SHARED, view->fd, 0);
+	if (base == MAP_FAILED) {
+		close(view->fd);
+		return 0;
+	}
+	view->base = base;
+	view->map_size = sb.st_size;
+	view->page_size = *(int32_t*)(view->base + DB_HEADER_PAGE_SIZE_OFF);
+	int64_t page_count = *(int64_t*)(view->base + DB_HEADER_PAGE_COUNT_OFF);
+	view->page_count = view->page_size >= DB_HEADER_CSUM_OFF + sizeof(uint32_t) ? view->map_size / view->page_size : 0;
+	if (page_count > 0 && (size_t)page_count < view->page_count) {
+		view->page_count = page_count;
+	}
+	if (!_has_magic_seq(view->base) || view->page_count == 0 || !dbview_load(view)) {
+		dbview_close(view);
+		return 0;
+	}
+	return 1;
+}
+
+// A view of an open database, valid until the database changes
+int dbview_from_database(struct dbview* view, struct database* db) {
+	memset(view, 0, sizeof(struct dbview));
+	view->fd = -1;
+	view->page_size = db->dbf.page_size;
+	view->page_count = db->dbf.page_count;
+	if (db->dbf.ftype == DBSTORE_IN_MEM) {
+		view->pages = db->dbf.pages;
+	} else {
+		// pages of a file store are mapped lazily, so take one mapping of all of them
+		view->map_size = view->page_count * view->page_size;
+		void* base = mmap(0, view->map_size, PROT_READ, MAP_SHARED, db->dbf.fd, 0);
+		if (base == MAP_FAILED) {
+			view->map_size = 0;
+			return 0;
+		}
+		view->base = base;
+	}
+	return dbview_load(view);
+}
+
+void dbview_close(struct dbview* view) {
+	if (view->map_size > 0) {
+		munmap((void*)view->base, view->map_size);
+	}
+	if (view->fd != -1) {
+		close(view->fd);
+	}
+	page_vec_deinit(&view->hash_pages);
+}
+
+static size_t dbview_hash_key(const struct dbview* view, const int32_t* slot) {
+	if (slot[0] == SLOT_INLINE) {
+		return hash_djb2((const char*)(slot + HASHSTORAGE_PTR_SIZE_INT));
+	}
+	size_t hash = DJB2_HASH_BASE;
+	size_t page = slot[0] + (slot[1] / view->page_size);
+	size_t off = slot[1] % view->page_size;
+	size_t left = slot[2];
+	while (left > 0 && page < view->page_count) {
+		size_t to_read = view->page_size - off > left ? left : view->page_size - off;
+		if (hash_djb2_n(dbview_page(view, page) + off, to_read, &hash)) {
+			break;
+		}
+		left -= to_read;
+		off = 0;
+		++page;
+	}
+	return hash;
+}
+
+static void dbanalysis_block(const struct dbview* view, size_t block, struct dbanalysis* out) {
+	const char* page = dbview_page(view, view->hash_pages.pages[block]);
+	size_t per_block = view->slots_per_block;
+	size_t used = 0;
+	for (size_t i = 0; i < per_block; ++i) {
+		const int32_t* slot = (const int32_t*)(page + HASH_BLOCK_HEADER_SIZE + (i * view->slot_size));
+		if (slot[0] == 0) {
+			continue;
+		} else if (slot[0] == -1) {
+			++out->tombstones;
+			continue;
+		} else if (!dbslot_valid(slot, view->check_size, view->page_size, view->page_count)) {
+			++out->bad_slots;
+			continue;
+		}
+		++used;
+		out->inline_records += slot[0] == SLOT_INLINE;
+		size_t hash_slot = dbview_hash_key(view, slot) % view->hash_len;
+		size_t home_block = hash_slot / per_block;
+		size_t home_pos = hash_slot % per_block;
+		size_t probe = 0;
+		if (home_block == block) {
+			probe = ((i + per_block - home_pos) % per_block) + 1;
+		} else {
+			// the home block was probed in full, then the blocks in order up to this one
+			++out->overflow;
+			probe = per_block + (block * per_block) + i + 1;
+		}
+		out->probe_sum += probe;
+		out->probe_max = probe > out->probe_max ? probe : out->probe_max;
+		++out->probe_hist[probe < DBANALYZE_PROBE_BUCKETS ? probe - 1 : DBANALYZE_PROBE_BUCKETS - 1];
+	}
+	++out->blocks;
+	out->slots += per_block;
+	out->used += used;
+	++out->fill_hist[(used * 10) / per_block];
+	out->block_min_used = out->blocks == 1 || used < out->block_min_used ? used : out->block_min_used;
+	out->block_max_used = used > out->block_max_used ? used : out->block_max_used;
+}
+
+static void dbanalysis_merge(struct dbanalysis* into, const struct dbanalysis* from) {
+	if (from->blocks == 0) {
+		return;
+	}
+	into->block_min_used = into->blocks == 0 || from->block_min_used < into->block_min_used ?
+	                       from->block_min_used : into->block_min_used;
+	into->block_max_used = from->block_max_used > into->block_max_used ? from->block_max_used : into->block_max_used;
+	into->blocks += from->blocks;
+	into->slots += from->slots;
+	into->used += from->used;
+	into->tombstones += from->tombstones;
+	into->inline_records += from->inline_records;
+	into->overflow += from->overflow;
+	into->bad_slots += from->bad_slots;
+	into->probe_sum += from->probe_sum;
+	into->probe_max = from->probe_max > into->probe_max ? from->probe_max : into->probe_max;
+	for (size_t i = 0; i < DBANALYZE_PROBE_BUCKETS; ++i) {
+		into->probe_hist[i] += from->probe_hist[i];
+	}
+	for (size_t i = 0; i < DBANALYZE_FILL_BUCKETS; ++i) {
+		into->fill_hist[i] += from->fill_hist[i];
+	}
+}
+
+static void dbanalysis_free_list(const struct dbview* view, struct dbanalysis* out) {
+	int32_t space_iter = view->space_root;
+	size_t seen = 0;
+	while (space_iter > 0 && (size_t)space_iter < view->page_count && seen++ < view->page_count) {
+		const int32_t* reader = (const int32_t*)dbview_page(view, space_iter);
+		size_t len = reader[1] > 0 ? (size_t)reader[1] : 0;
+		len = len > items_per_block(view->page_size) ? items_per_block(view->page_size) : len;
+		const int32_t* entry = reader + (LEN_BLOCK_HEADER_SIZE / sizeof(int32_t));
+		for (size_t i = 0; i < len; ++i, entry += 3) {
+			if (entry[2] <= 0) {
+				continue;
+			}
+			size_t bucket = 63 - __builtin_clzll((uint64_t)entry[2]);
+			++out->free_extents;
+			out->free_bytes += entry[2];
+			out->free_largest = (size_t)entry[2] > out->free_largest ? (size_t)entry[2] : out->free_largest;
+			++out->free_hist[bucket < DBANALYZE_FREE_BUCKETS ? bucket : DBANALYZE_FREE_BUCKETS - 1];
+		}
+		space_iter = reader[0];
+	}
+}
+
+struct dbanalysis_job {
+	const struct dbview* view;
+	pthread_t thread;
+	int started;
+	size_t first;
+	size_t last;
+	struct dbanalysis result;
+};
+
+static void* dbanalysis_run(void* arg) {
+	struct dbanalysis_job* job = arg;
+	for (size_t i = job->first; i < job->last; ++i) {
+		dbanalysis_block(job->view, i, &job->result);
+	}
+	return NULL;
+}
+
+// Analyzes the view with n_threads threads, 0 for one per cpu
+int dbview_analyze(const struct dbview* view, struct dbanalysis* out, size_t n_threads) {
+	memset(out, 0, sizeof(struct dbanalysis));
+	out->item_count = view->item_count;
+	out->max_load = view->max_load;
+	if (view->hash_pages.len == 0) {
+		return 0;
+	}
+	n_threads = n_threads > 0 ? n_threads : (size_t)sysconf(_SC_NPROCESSORS_ONLN);
+	n_threads = n_threads > view->hash_pages.len ? view->hash_pages.len : n_threads;
+	struct dbanalysis_job* jobs = KAMOODB_CALLOC(n_threads, sizeof(struct dbanalysis_job));
+	size_t per_thread = (view->hash_pages.len + n_threads - 1) / n_threads;
+	for (size_t i = 0; i < n_threads; ++i) {
+		jobs[i].view = view;
+		jobs[i].first = i * per_thread;
+		jobs[i].last = jobs[i].first + per_thread > view->hash_pages.len ? view->hash_pages.len : jobs[i].first + per_thread;
+		jobs[i].started = i > 0 && pthread_create(&jobs[i].thread, NULL, dbanalysis_run, &jobs[i]) == 0;
+	}
+	// this thread takes the first share, and any share a thread could not be started for
+	for (size_t i = 0; i < n_threads; ++i) {
+		if (!jobs[i].started) {
+			dbanalysis_run(&jobs[i]);
+		}
+	}
+	for (size_t i = 0; i < n_threads; ++i) {
+		if (jobs[i].started) {
+			pthread_join(jobs[i].thread, NULL);
+		}
+		dbanalysis_merge(out, &jobs[i].result);
+	}
+	KAMOODB_FREE(jobs);
+	dbanalysis_free_list(view, out);
+	return 1;
+}
+
+int database_analyze(struct database* db, struct dbanalysis* out, size_t n_threads) {
+	struct dbview view;
+	int ok = dbview_from_database(&view, db) && dbview_analyze(&view, out, n_threads);
+	dbview_close(&view);
+	return ok;
+}
+
+// ------- bulk builder -------
+// Builds a new database file from a batch of records without going
+// through database_put. The index is sized for the batch up front, the
+// records are partitioned by hash block with a parallel radix pass, each
+// block is filled in one go, and the storage records of all blocks are
+// laid out back to back in a single run of pages. Later duplicates of a
+// key replace earlier ones, like a sequence of puts would.
+struct dbbuild_rec {
+	uint64_t off;
+	uint32_t key_size;
+	uint32_t val_size;
+	size_t hash;
+};
+
+struct dbbuilder {
+	char* path;
+	struct dbcfg cfg;
+	int has_cfg;
+	// records as key\0val\0, in the order they were added
+	char* data;
+	size_t data_len;
+	size_t data_cap;
+	struct dbbuild_rec* recs;
+	size_t n_recs;
+	size_t recs_cap;
+};
+
+// where a record ends up, rel_off is -1 for a record stored inline
+struct dbbuild_place {
+	size_t block;
+	size_t slot;
+	size_t rec;
+	int64_t rel_off;
+	uint32_t size;
+};
+
+struct dbbuild_ctx {
+	struct dbbuilder* b;
+	struct database* db;
+	size_t n_blocks;
+	size_t hash_len;
+	char** blocks;
+	// records grouped by block, the group of block n starts at block_start[n]
+	size_t* order;
+	size_t* block_start;
+	size_t first_page;
+	char* run;
+};
+
+struct dbbuild_job {
+	struct dbbuild_ctx* ctx;
+	pthread_t thread;
+	int started;
+	// a slice of the records for the radix pass, a range of blocks after it
+	size_t first;
+	size_t last;
+	size_t* counts;
+	struct dbcodec codec;
+	char* buf;
+	size_t buf_len;
+	size_t buf_cap;
+	uint64_t base;
+	struct dbbuild_place* places;
+	size_t n_places;
+	size_t places_cap;
+	size_t* overflow;
+	size_t n_overflow;
+	size_t overflow_cap;
+	int failed;
+};
+
+int dbbuilder_init(struct dbbuilder* b, const char* path, const struct dbcfg* cfg) {
+	memset(b, 0, sizeof(struct dbbuilder));
+	if (!dbcfg_validate(cfg)) {
+		return 0;
+	}
+	b->path = str_dupl(path);
+	if (cfg != NULL) {
+		b->cfg = *cfg;
+		b->has_cfg = 1;
+	}
+	return 1;
+}
+
+void dbbuilder_deinit(struct dbbuilder* b) {
+	KAMOODB_FREE(b->path);
+	KAMOODB_FREE(b->data);
+	KAMOODB_FREE(b->recs);
+	memset(b, 0, sizeof(struct dbbuilder));
+}
+
+int dbbuilder_add(struct dbbuilder* b, const char* key, const char* val) {
+	size_t key_size = strlen(key) + 1;
+	size_t val_size = strlen(val) + 1;
+	if (b->data_len + key_size + val_size > b->data_cap) {
+		size_t next_cap = b->data_cap > 0 ? b->data_cap * 2 : 1024 * 1024;
+		while (next_cap < b->data_len + key_size + val_size) {
+			next_cap *= 2;
+		}
+		char* next = KAMOODB_REALLOC(b->data, next_cap);
+		if (next == NULL) {
+			return 0;
+		}
+		b->data = next;
+		b->data_cap = next_cap;
+	}
+	if (b->n_recs == b->recs_cap) {
+		size_t next_cap = b->recs_cap > 0 ? b->recs_cap * 2 : 4096;
+		struct dbbuild_rec* next = KAMOODB_REALLOC(b->recs, next_cap * sizeof(struct dbbuild_rec));
+		if (next == NULL) {
+			return 0;
+		}
+		b->recs = next;
+		b->recs_cap = next_cap;
+	}
+	struct dbbuild_rec* rec = &b->recs[b->n_recs++];
+	rec->off = b->data_len;
+	rec->key_size = key_size;
+	rec->val_size = val_size;
+	memcpy(b->data + b->data_len, key, key_size);
+	memcpy(b->data + b->data_len + key_size, val, val_size);
+	b->data_len += key_size + val_size;
+	return 1;
+}
+
+static const char* dbbuild_key(const struct dbbuilder* b, size_t rec) {
+	return b->data + b->recs[rec].off;
+}
+
+static const char* dbbuild_val(const struct dbbuilder* b, size_t rec) {
+	return b->data + b->recs[rec].off + b->recs[rec].key_size;
+}
+
+static size_t dbbuild_block_of(const struct dbbuild_ctx* ctx, size_t rec) {
+	return (ctx->b->recs[rec].hash % ctx->hash_len) / ctx->db->slots_per_block;
+}
+
+static void dbbuild_parallel(struct dbbuild_job* jobs, size_t n_threads, void* (*fn)(void*)) {
+	for (size_t i = 0; i < n_threads; ++i) {
+		jobs[i].started = i > 0 && pthread_create(&jobs[i].thread, NULL, fn, &jobs[i]) == 0;
+	}
+	for (size_t i = 0; i < n_threads; ++i) {
+		if (!jobs[i].started) {
+			fn(&jobs[i]);
+		}
+	}
+	for (size_t i = 0; i < n_threads; ++i) {
+		if (jobs[i].started) {
+			pthread_join(jobs[i].thread, NULL);
+		}
+	}
+}
+
+static void* dbbuild_count(void* arg) {
+	struct dbbuild_job* job = arg;
+	struct dbbuilder* b = job->ctx->b;
+	for (size_t i = job->first; i < job->last; ++i) {
+		b->recs[i].hash = hash_djb2(dbbuild_key(b, i));
+		++job->counts[dbbuild_block_of(job->ctx, i)];
+	}
+	return NULL;
+}
+
+// counts hold each job's first position in every block group by now
+static void* dbbuild_scatter(void* arg) {
+	struct dbbuild_job* job = arg;
+	for (size_t i = job->first; i < job->last; ++i) {
+		job->ctx->order[job->counts[dbbuild_block_of(job->ctx, i)]++] = i;
+	}
+	return NULL;
+}
+
+static int dbbuild_push_place(struct dbbuild_job* job, const struct dbbuild_place* place) {
+	if (job->n_places == job->places_cap) {
+		size_t next_cap = job->places_cap > 0 ? job->places_cap * 2 : 1024;
+		struct dbbuild_place* next = KAMOODB_REALLOC(job->places, next_cap * sizeof(struct dbbuild_place));
+		if (next == NULL) {
+			return 0;
+		}
+		job->places = next;
+		job->places_cap = next_cap;
+	}
+	job->places[job->n_places++] = *place;
+	return 1;
+}
+
+static int dbbuild_push_overflow(struct dbbuild_job* job, size_t rec) {
+	if (job->n_overflow == job->overflow_cap) {
+		size_t next_cap = job->overflow_cap > 0 ? job->overflow_cap * 2 : 64;
+		size_t* next = KAMOODB_REALLOC(job->overflow, next_cap * sizeof(size_t));
+		if (next == NULL) {
+			return 0;
+		}
+		job->overflow = next;
+		job->overflow_cap = next_cap;
+	}
+	job->overflow[job->n_overflow++] = rec;
+	return 1;
+}
+
+static int dbbuild_encode(struct dbbuild_job* job, size_t rec, struct dbbuild_place* place) {
+	struct dbbuilder* b = job->ctx->b;
+	const struct dbbuild_rec* r = &b->recs[rec];
+	size_t bound = r->key_size + dbcodec_bound(r->val_size);
+	if (job->buf_len + bound > job->buf_cap) {
+		size_t next_cap = job->buf_cap > 0 ? job->buf_cap * 2 : 1024 * 1024;
+		while (next_cap < job->buf_len + bound) {
+			next_cap *= 2;
+		}
+		char* next = KAMOODB_REALLOC(job->buf, next_cap);
+		if (next == NULL) {
+			return 0;
+		}
+		job->buf = next;
+		job->buf_cap = next_cap;
+	}
+	char* out = job->buf + job->buf_len;
+	size_t size = r->key_size + r->val_size;
+	memcpy(out, dbbuild_key(b, rec), r->key_size);
+	if (job->codec.type != DBCODEC_NONE) {
+		size = r->key_size + dbcodec_encode(&job->codec, dbbuild_val(b, rec), r->val_size, out + r->key_size);
+	} else {
+		memcpy(out + r->key_size, dbbuild_val(b, rec), r->val_size);
+	}
+	place->rel_off = job->buf_len;
+	place->size = size;
+	job->buf_len += size;
+	return 1;
+}
+
+// Places the records of each block of the job, and encodes the survivors
+static void* dbbuild_fill(void* arg) {
+	struct dbbuild_job* job = arg;
+	struct dbbuild_ctx* ctx = job->ctx;
+	struct dbbuilder* b = ctx->b;
+	size_t spb = ctx->db->slots_per_block;
+	int64_t* occ = KAMOODB_MALLOC(spb * sizeof(int64_t));
+	job->failed = occ == NULL;
+	for (size_t blk = job->first; !job->failed && blk < job->last; ++blk) {
+		for (size_t n = 0; n < spb; ++n) {
+			occ[n] = -1;
+		}
+		for (size_t j = ctx->block_start[blk]; j < ctx->block_start[blk + 1]; ++j) {
+			size_t rec = ctx->order[j];
+			size_t home = (b->recs[rec].hash % ctx->hash_len) % spb;
+			size_t n = 0;
+			for (; n < spb; ++n) {
+				int64_t* at = &occ[(home + n) % spb];
+				if (*at == -1 || (b->recs[*at].hash == b->recs[rec].hash &&
+				                  strcmp(dbbuild_key(b, *at), dbbuild_key(b, rec)) == 0)) {
+					*at = rec;
+					break;
+				}
+			}
+			if (n == spb && !dbbuild_push_overflow(job, rec)) {
+				job->failed = 1;
+				break;
+			}
+		}
+		for (size_t n = 0; n < spb; ++n) {
+			if (occ[n] == -1) {
+				continue;
+			}
+			const struct dbbuild_rec* r = &b->recs[occ[n]];
+			struct dbbuild_place place = {blk, n, (size_t)occ[n], -1, 0};
+			if ((!database_fits_inline(ctx->db, r->key_size + r->val_size) && !dbbuild_encode(job, occ[n], &place)) ||
+			    !dbbuild_push_place(job, &place)) {
+				job->failed = 1;
+				break;
+			}
+		}
+	}
+	KAMOODB_FREE(occ);
+	return NULL;
+}
+
+static void* dbbuild_write(void* arg) {
+	struct dbbuild_job* job = arg;
+	struct dbbuild_ctx* ctx = job->ctx;
+	struct dbbuilder* b = ctx->b;
+	size_t page_size = ctx->db->dbf.page_size;
+	memcpy(ctx->run + job->base, job->buf, job->buf_len);
+	for (size_t i = 0; i < job->n_places; ++i) {
+		const struct dbbuild_place* place = &job->places[i];
+		const struct dbbuild_rec* r = &b->recs[place->rec];
+		int32_t* slot = database_slot_at(ctx->db, ctx->blocks[place->block], place->slot);
+		if (place->rel_off < 0) {
+			_write_inline_slot(slot, dbbuild_key(b, place->rec), r->key_size, dbbuild_val(b, place->rec), r->val_size);
+		} else {
+			uint64_t off = job->base + place->rel_off;
+			int32_t store_ptr[3] = {(int32_t)(ctx->first_page + (off / page_size)), (int32_t)(off % page_size),
+			                        (int32_t)place->size};
+			_write_storage_ptr_hash(slot, store_ptr);
+		}
+	}
+	return NULL;
+}
+
+// Trains the dictionary of a compressed file on a spread of the values
+static void dbbuild_train(struct dbbuilder* b, struct database* db) {
+	size_t n_samples = b->n_recs < 4096 ? b->n_recs : 4096;
+	if (db->codec.type == DBCODEC_NONE || n_samples == 0) {
+		return;
+	}
+	const char** samples = KAMOODB_MALLOC(n_samples * sizeof(char*));
+	for (size_t i = 0; i < n_samples; ++i) {
+		samples[i] = dbbuild_val(b, (i * b->n_recs) / n_samples);
+	}
+	database_train_dict(db, samples, n_samples, DBCODEC_DICT_MAX);
+	KAMOODB_FREE(samples);
+}
+
+static void dbbuild_jobs_deinit(struct dbbuild_job* jobs, size_t n_threads) {
+	for (size_t i = 0; i < n_threads; ++i) {
+		KAMOODB_FREE(jobs[i].counts);
+		KAMOODB_FREE(jobs[i].buf);
+		KAMOODB_FREE(jobs[i].places);
+		KAMOODB_FREE(jobs[i].overflow);
+		dbcodec_deinit(&jobs[i].codec);
+	}
+	KAMOODB_FREE(jobs);
+}
+
+static int dbbuild_run(struct dbbuilder* b, struct database* db, size_t n_threads) {
+	struct dbbuild_ctx ctx;
+	size_t n = b->n_recs;
+	size_t page_size = db->dbf.page_size;
+	int ok = 1;
+	ctx.b = b;
+	ctx.db = db;
+	ctx.n_blocks = db->hash_pages.len;
+	ctx.hash_len = ctx.n_blocks * db->slots_per_block;
+	ctx.blocks = KAMOODB_MALLOC(ctx.n_blocks * sizeof(char*));
+	ctx.order = KAMOODB_MALLOC((n + 1) * sizeof(size_t));
+	ctx.block_start = KAMOODB_CALLOC(ctx.n_blocks + 1, sizeof(size_t));
+	ctx.run = NULL;
+	struct dbbuild_job* jobs = KAMOODB_CALLOC(n_threads, sizeof(struct dbbuild_job));
+	ok = ctx.blocks != NULL && ctx.order != NULL && ctx.block_start != NULL && jobs != NULL;
+	for (size_t i = 0; ok && i < ctx.n_blocks; ++i) {
+		ctx.blocks[i] = dbfile_get_page(&db->dbf, db->hash_pages.pages[i]);
+	}
+	for (size_t i = 0; ok && i < n_threads; ++i) {
+		jobs[i].ctx = &ctx;
+		jobs[i].first = (n * i) / n_threads;
+		jobs[i].last = (n * (i + 1)) / n_threads;
+		jobs[i].counts = KAMOODB_CALLOC(ctx.n_blocks, sizeof(size_t));
+		dbcodec_init(&jobs[i].codec, db->codec.type);
+		if (db->codec.dict_size > 0) {
+			dbcodec_set_dict(&jobs[i].codec, db->codec.dict, db->codec.dict_size);
+		}
+		ok = jobs[i].counts != NULL;
+	}
+	if (ok) {
+		dbbuild_parallel(jobs, n_threads, dbbuild_count);
+		// turn the counts into where each job starts writing in every group
+		size_t pos = 0;
+		for (size_t blk = 0; blk < ctx.n_blocks; ++blk) {
+			ctx.block_start[blk] = pos;
+			for (size_t i = 0; i < n_threads; ++i) {
+				size_t count = jobs[i].counts[blk];
+				jobs[i].counts[blk] = pos;
+				pos += count;
+			}
+		}
+		ctx.block_start[ctx.n_blocks] = pos;
+		dbbuild_parallel(jobs, n_threads, dbbuild_scatter);
+		// hand out blocks in runs holding about the same number of records
+		size_t blk = 0;
+		for (size_t i = 0; i < n_threads; ++i) {
+			jobs[i].first = blk;
+			while (blk < ctx.n_blocks && (i + 1 == n_threads || ctx.block_start[blk] < (n * (i + 1)) / n_threads)) {
+				++blk;
+			}
+			jobs[i].last = blk;
+		}
+		dbbuild_parallel(jobs, n_threads, dbbuild_fill);
+	}
+	uint64_t total = 0;
+	size_t placed = 0;
+	for (size_t i = 0; ok && i < n_threads; ++i) {
+		ok = !jobs[i].failed;
+		jobs[i].base = total;
+		total += jobs[i].buf_len;
+		placed += jobs[i].n_places;
+	}
+	size_t n_pages = (total + page_size - 1) / page_size;
+	if (ok && n_pages > 0) {
+		ctx.first_page = dbfile_grow(&db->dbf, n_pages);
+		ok = ctx.first_page != (size_t)-1;
+		ctx.run = ok ? dbfile_map_run(&db->dbf, ctx.first_page, n_pages) : NULL;
+		ok = ok && ctx.run != NULL;
+	}
+	if (ok) {
+		dbbuild_parallel(jobs, n_threads, dbbuild_write);
+		database_inc_item_count(db, placed);
+		// filter words are shared between records, so they are set here
+		for (size_t i = 0; db->bloom_root > 0 && i < n_threads; ++i) {
+			for (size_t j = 0; j < jobs[i].n_places; ++j) {
+				database_bloom_add(db, b->recs[jobs[i].places[j].rec].hash);
+			}
+		}
+	}
+	// blocks that ran full spill over like they would for database_put
+	for (size_t i = 0; ok && i < n_threads; ++i) {
+		for (size_t j = 0; ok && j < jobs[i].n_overflow; ++j) {
+			ok = database_put(db, dbbuild_key(b, jobs[i].overflow[j]), dbbuild_val(b, jobs[i].overflow[j]));
+		}
+	}
+	if (jobs != NULL) {
+		dbbuild_jobs_deinit(jobs, n_threads);
+	}
+	KAMOODB_FREE(ctx.blocks);
+	KAMOODB_FREE(ctx.order);
+	KAMOODB_FREE(ctx.block_start);
+	return ok;
+}
+
+// Writes the records added so far to a new file at the builder path with
+// n_threads threads, 0 for one per cpu. The file is built next to the
+// path and moved over it once complete. The builder is released either way.
+int dbbuilder_finish(struct dbbuilder* b, size_t n_threads) {
+	struct database db;
+	struct dbcfg cfg;
+	memset(&cfg, 0, sizeof(cfg));
+	if (b->has_cfg) {
+		cfg = b->cfg;
+	}
+	// the file is mapped so the blocks can be filled in parallel
+	cfg.ftype = DBSTORE_MEM_MAP;
+	cfg.expected_items = b->n_recs;
+	cfg.avg_record_size = 0;
+	cfg.ordered_index = 0;
+	// records in the ordered index need storage pointers
+	if (b->has_cfg && b->cfg.ordered_index) {
+		cfg.inline_size = 0;
+	}
+	n_threads = n_threads > 0 ? n_threads : (size_t)sysconf(_SC_NPROCESSORS_ONLN);
+	n_threads = n_threads > 0 ? n_threads : 1;
+	size_t tmp_size = strlen(b->path) + 5;
+	char* tmp_path = KAMOODB_MALLOC(tmp_size);
+	snprintf(tmp_path, tmp_size, "%s.tmp", b->path);
+	remove(tmp_path);
+	int ok = database_open(&db, tmp_path, &cfg);
+	if (ok) {
+		dbbuild_train(b, &db);
+		ok = dbbuild_run(b, &db, n_threads);
+		if (ok && b->has_cfg && b->cfg.ordered_index) {
+			ok = database_add_ordered_index(&db);
+		}
+		database_close(&db);
+	}
+	ok = ok && rename(tmp_path, b->path) == 0;
+	if (!ok) {
+		remove(tmp_path);
+	}
+	KAMOODB_FREE(tmp_path);
+	dbbuilder_deinit(b);
+	return ok;
+}
+
+// ------- sharded database -------
+// Spreads the keys over n independent databases, one file each in a
+// directory. Every shard has its own header, index and item count, so a
+// shard expands on its own and the expansions are smaller and staggered,
+// and each shard has its own lock so writers to different shards do not
+// wait on each other. The shard count is fixed when the directory is
+// created and kept in its MANIFEST.
+//
+// dir/MANIFEST        kamoodb shards <n>
+// dir/shard-<i>       the database of shard i
+static const size_t DB_SHARDS_MAX = 4096;
+
+struct dbshard {
+	struct database db;
+	pthread_mutex_t lock;
+	// cpu the parallel calls run this shard on, -1 for any
+	int cpu;
+	int open;
+};
+
+struct dbsharded {
+	char* dir;
+	size_t n_shards;
+	struct dbshard* shards;
+};
+
+// The slot in a shard is picked with hash_djb2 modulo the shard's slot
+// count, so the shard is picked from the mixed high bits of the same hash.
+// Taking it modulo n would leave each shard with keys from 1/n of its slots.
+size_t dbsharded_shard_of(const struct dbsharded* sd, const char* key) {
+	uint64_t hash = dbhash_mix64(hash_djb2(key));
+	return (size_t)(((unsigned __int128)hash * sd->n_shards) >> 64);
+}
+
+static char* dbsharded_path(const char* dir, const char* name, size_t shard) {
+	size_t size = strlen(dir) + strlen(name) + 32;
+	char* path = KAMOODB_MALLOC(size);
+	if (shard == (size_t)-1) {
+		snprintf(path, size, "%s/%s", dir, name);
+	} else {
+		snprintf(path, size, "%s/%s-%04zu", dir, name, shard);
+	}
+	return path;
+}
+
+// Shard count recorded in the directory, 0 if there is none
+static size_t dbsharded_read_manifest(const char* dir) {
+	char* path = dbsharded_path(dir, "MANIFEST", (size_t)-1);
+	FILE* fp = fopen(path, "r");
+	KAMOODB_FREE(path);
+	size_t n_shards = 0;
+	if (fp == NULL) {
+		return 0;
+	}
+	if (fscanf(fp, "kamoodb shards %zu", &n_shards) != 1 || n_shards > DB_SHARDS_MAX) {
+		n_shards = 0;
+	}
+	fclose(fp);
+	return n_shards;
+}
+
+static int dbsharded_write_manifest(const char* dir, size_t n_shards) {
+	char* path = dbsharded_path(dir, "MANIFEST", (size_t)-1);
+	char* tmp_path = dbsharded_path(dir, "MANIFEST.tmp", (size_t)-1);
+	FILE* fp = fopen(tmp_path, "w");
+	int ok = fp != NULL && fprintf(fp, "kamoodb shards %zu\n", n_shards) > 0;
+	ok = fp != NULL && fclose(fp) == 0 && ok;
+	ok = ok && rename(tmp_path, path) == 0;
+	KAMOODB_FREE(path);
+	KAMOODB_FREE(tmp_path);
+	return ok;
+}
+
+// Moves the calling thread onto cpu, a no op for -1
+static void dbsharded_pin_self(int cpu) {
+#if defined(KAMOODB_HAS_AFFINITY)
+	unsigned long mask[16];
+	if (cpu < 0 || (size_t)cpu >= sizeof(mask) * CHAR_BIT) {
+		return;
+	}
+	memset(mask, 0, sizeof(mask));
+	mask[cpu / (sizeof(unsigned long) * CHAR_BIT)] = 1UL << (cpu % (sizeof(unsigned long) * CHAR_BIT));
+	syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask);
+#else
+	(void)cpu;
+#endif
+}
+
+enum dbsharded_op {
+	DBSHARDED_OPEN,
+	DBSHARDED_CLOSE,
+	DBSHARDED_SCAN,
+	DBSHARDED_CHECKPOINT
+};
+
+struct dbsharded_job {
+	struct dbsharded* sd;
+	enum dbsharded_op op;
+	pthread_t thread;
+	int started;
+	// only jobs on their own thread move onto the shard cpus
+	int pin;
+	// the job takes shards first, first + stride, ...
+	size_t first;
+	size_t stride;
+	struct dbcfg* cfg;
+	database_scan_cb cb;
+	void* udata;
+	size_t visited;
+	int failed;
+};
+
+static void dbsharded_run_shard(struct dbsharded_job* job, size_t i) {
+	struct dbshard* shard = &job->sd->shards[i];
+	if (job->op == DBSHARDED_OPEN) {
+		char* path = dbsharded_path(job->sd->dir, "shard", i);
+		shard->open = database_open(&shard->db, path, job->cfg);
+		job->failed |= !shard->open;
+		KAMOODB_FREE(path);
+		return;
+	}
+	if (!shard->open) {
+		return;
+	}
+	pthread_mutex_lock(&shard->lock);
+	if (job->op == DBSHARDED_CLOSE) {
+		database_close(&shard->db);
+		shard->open = 0;
+	} else if (job->op == DBSHARDED_CHECKPOINT) {
+		job->failed |= !database_checkpoint(&shard->db);
+	} else {
+		struct dbsnapshot snap;
+		if (database_snapshot(&shard->db, &snap)) {
+			job->visited += database_snapshot_scan(&snap, job->cb, job->udata);
+			database_snapshot_release(&snap);
+		} else {
+			job->failed = 1;
+		}
+	}
+	pthread_mutex_unlock(&shard->lock);
+}
+
+static void* dbsharded_run(void* arg) {
+	struct dbsharded_job* job = arg;
+	for (size_t i = job->first; i < job->sd->n_shards; i += job->stride) {
+		if (job->pin) {
+			dbsharded_pin_self(job->sd->shards[i].cpu);
+		}
+		dbsharded_run_shard(job, i);
+	}
+	return NULL;
+}
+
+// Runs op over all shards with up to one thread per cpu
+static int dbsharded_parallel(struct dbsharded* sd, struct dbsharded_job* proto, size_t n_threads) {
+	n_threads = n_threads > 0 ? n_threads : (size_t)sysconf(_SC_NPROCESSORS_ONLN);
+	n_threads = n_threads > sd->n_shards ? sd->n_shards : n_threads;
+	n_threads = n_threads > 0 ? n_threads : 1;
+	struct dbsharded_job* jobs = KAMOODB_CALLOC(n_threads, sizeof(struct dbsharded_job));
+	for (size_t i = 0; i < n_threads; ++i) {
+		jobs[i] = *proto;
+		jobs[i].first = i;
+		jobs[i].stride = n_threads;
+		jobs[i].pin = 1;
+		jobs[i].started = pthread_create(&jobs[i].thread, NULL, dbsharded_run, &jobs[i]) == 0;
+		// the thread reads pin, so it is only cleared when there is none
+		if (!jobs[i].started) {
+			jobs[i].pin = 0;
+		}
+	}
+	// the caller is not pinned, it only runs the shares no thread took
+	int failed = 0;
+	proto->visited = 0;
+	for (size_t i = 0; i < n_threads; ++i) {
+		if (jobs[i].started) {
+			pthread_join(jobs[i].thread, NULL);
+		} else {
+			dbsharded_run(&jobs[i]);
+		}
+		failed |= jobs[i].failed;
+		proto->visited += jobs[i].visited;
+	}
+	KAMOODB_FREE(jobs);
+	return !failed;
+}
+
+void dbsharded_close(struct dbsharded* sd, size_t n_threads);
+
+// Opens or creates the sharded database in dir with n_threads threads, 0
+// for one per cpu. n_shards is the shard count for a new directory, 0 for
+// one per cpu, and has to match the manifest or be 0 for an existing one.
+// cfg applies to every shard, expected_items is for the whole database.
+int dbsharded_open(struct dbsharded* sd, const char* dir, size_t n_shards, struct dbcfg* cfg, size_t n_threads) {
+	struct dbcfg shard_cfg;
+	struct dbsharded_job proto;
+	if (!dbcfg_validate(cfg) || n_shards > DB_SHARDS_MAX) {
+		return 0;
+	}
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+		return 0;
+	}
+	size_t found = dbsharded_read_manifest(dir);
+	if (found > 0 && n_shards > 0 && found != n_shards) {
+		return 0;
+	}
+	if (found == 0) {
+		n_shards = n_shards > 0 ? n_shards : (size_t)sysconf(_SC_NPROCESSORS_ONLN);
+		n_shards = n_shards > 0 ? n_shards : 1;
+		if (!dbsharded_write_manifest(dir, n_shards)) {
+			return 0;
+		}
+	}
+	sd->dir = str_dupl(dir);
+	sd->n_shards = found > 0 ? found : n_shards;
+	sd->shards = KAMOODB_CALLOC(sd->n_shards, sizeof(struct dbshard));
+	for (size_t i = 0; i < sd->n_shards; ++i) {
+		pthread_mutex_init(&sd->shards[i].lock, NULL);
+		sd->shards[i].cpu = -1;
+	}
+	memset(&proto, 0, sizeof(proto));
+	proto.sd = sd;
+	proto.op = DBSHARDED_OPEN;
+	if (cfg != NULL) {
+		shard_cfg = *cfg;
+		shard_cfg.expected_items = (cfg->expected_items + sd->n_shards - 1) / sd->n_shards;
+		proto.cfg = &shard_cfg;
+	}
+	if (!dbsharded_parallel(sd, &proto, n_threads)) {
+		dbsharded_close(sd, n_threads);
+		return 0;
+	}
+	return 1;
+}
+
+// Checkpoints and closes every shard with n_threads threads, 0 for one per cpu
+void dbsharded_close(struct dbsharded* sd, size_t n_threads) {
+	struct dbsharded_job proto;
+	memset(&proto, 0, sizeof(proto));
+	proto.sd = sd;
+	proto.op = DBSHARDED_CLOSE;
+	dbsharded_parallel(sd, &proto, n_threads);
+	for (size_t i = 0; i < sd->n_shards; ++i) {
+		pthread_mutex_destroy(&sd->shards[i].lock);
+	}
+	KAMOODB_FREE(sd->shards);
+	KAMOODB_FREE(sd->dir);
+	sd->shards = NULL;
+	sd->dir = NULL;
+	sd->n_shards = 0;
+}
+
+int dbsharded_checkpoint(struct dbsharded* sd, size_t n_threads) {
+	struct dbsharded_job proto;
+	memset(&proto, 0, sizeof(proto));
+	proto.sd = sd;
+	proto.op = DBSHARDED_CHECKPOINT;
+	return dbsharded_parallel(sd, &proto, n_threads);
+}
+
+// Pins the parallel calls for a shard to a cpu, -1 to unpin. Threads that
+// serve a shard's gets and puts are the caller's to place, dbsharded_shard_of
+// tells which shard a key goes to.
+void dbsharded_pin(struct dbsharded* sd, size_t shard, int cpu) {
+	sd->shards[shard].cpu = cpu;
+}
+
+struct database* dbsharded_shard(struct dbsharded* sd, size_t shard) {
+	return &sd->shards[shard].db;
+}
+
+int dbsharded_put(struct dbsharded* sd, const char* key, const char* val) {
+	struct dbshard* shard = &sd->shards[dbsharded_shard_of(sd, key)];
+	pthread_mutex_lock(&shard->lock);
+	int res = database_put(&shard->db, key, val);
+	pthread_mutex_unlock(&shard->lock);
+	return res;
+}
+
+char* dbsharded_get(struct dbsharded* sd, const char* key) {
+	struct dbshard* shard = &sd->shards[dbsharded_shard_of(sd, key)];
+	pthread_mutex_lock(&shard->lock);
+	char* val = database_get(&shard->db, key);
+	pthread_mutex_unlock(&shard->lock);
+	return val;
+}
+
+int dbsharded_del(struct dbsharded* sd, const char* key) {
+	struct dbshard* shard = &sd->shards[dbsharded_shard_of(sd, key)];
+	pthread_mutex_lock(&shard->lock);
+	int res = database_del(&shard->db, key);
+	pthread_mutex_unlock(&shard->lock);
+	return res;
+}
+
+int64_t dbsharded_item_count(struct dbsharded* sd) {
+	int64_t total = 0;
+	for (size_t i = 0; i < sd->n_shards; ++i) {
+		pthread_mutex_lock(&sd->shards[i].lock);
+		total += database_get_item_count(&sd->shards[i].db);
+		pthread_mutex_unlock(&sd->shards[i].lock);
+	}
+	return total;
+}
+
+// Sweeps every shard in turn, each for its share of budget_ns and under
+// its lock, so a background thread can keep expired records in check while
+// others use the database. Returns the number of records reclaimed.
+size_t dbsharded_sweep(struct dbsharded* sd, uint64_t budget_ns) {
+	size_t reclaimed = 0;
+	for (size_t i = 0; i < sd->n_shards; ++i) {
+		pthread_mutex_lock(&sd->shards[i].lock);
+		reclaimed += database_sweep(&sd->shards[i].db, budget_ns > 0 ? (budget_ns / sd->n_shards) + 1 : 0);
+		pthread_mutex_unlock(&sd->shards[i].lock);
+	}
+	return reclaimed;
+}
+
+// Calls cb for every record with n_threads threads, 0 for one per cpu.
+// Shards are scanned in parallel, so cb has to be safe to call from
+// several threads at once, and a shard is locked while it is scanned.
+// Returning 0 from cb stops the scan of the current shard only.
+// Returns the number of records visited.
+size_t dbsharded_scan(struct dbsharded* sd, database_scan_cb cb, void* udata, size_t n_threads) {
+	struct dbsharded_job proto;
+	memset(&proto, 0, sizeof(proto));
+	proto.sd = sd;
+	proto.op = DBSHARDED_SCAN;
+	proto.cb = cb;
+	proto.udata = udata;
+	dbsharded_parallel(sd, &proto, n_threads);
+	return proto.visited;
+}
+
+// ------- async api -------
+// Gets and puts that never fault on a mapped page. Lookups read the hash
+// block and then the storage record with io_uring reads against the file,
+// so a single thread can keep many lookups in flight. Stores without a
+// file descriptor, or kernels without io_uring, run each op synchronously
+// and still deliver the result through database_aio_poll.
+
+#if defined(KAMOODB_HAS_URING)
+
+struct dbring {
+	int fd;
+	unsigned entries;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+	unsigned sq_local_tail;
+	struct io_uring_sqe* sqes;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	struct io_uring_cqe* cqes;
+	void* sq_ring;
+	size_t sq_ring_size;
+	void* cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+};
+
+int dbring_init(struct dbring* ring, unsigned entries) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	memset(ring, 0, sizeof(struct dbring));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd < 0) {
+		ring->fd = -1;
+		return 0;
+	}
+	ring->entries = params.sq_entries;
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size) {
+			ring->sq_ring_size = ring->cq_ring_size;
+		}
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+	ring->sq_ring = mmap(0, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		close(ring->fd);
+		ring->fd = -1;
+		return 0;
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(0, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	}
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(0, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+		munmap(ring->sq_ring, ring->sq_ring_size);
+		close(ring->fd);
+		ring->fd = -1;
+		return 0;
+	}
+	char* sq = ring->sq_ring;
+	char* cq = ring->cq_ring;
+	ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+	ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+	ring->sq_local_tail = *ring->sq_tail;
+	ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+	return 1;
+}
+
+// Returns a zeroed submission entry, or NULL if the submission queue is full
+struct io_uring_sqe* dbring_get_sqe(struct dbring* ring) {
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (ring->sq_local_tail - head >= ring->entries) {
+		return NULL;
+	}
+	unsigned idx = ring->sq_local_tail & *ring->sq_mask;
+	struct io_uring_sqe* sqe = &ring->sqes[idx];
+	ring->sq_array[idx] = idx;
+	++ring->sq_local_tail;
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	return sqe;
+}
+
+int dbring_submit(struct dbring* ring, unsigned wait_nr) {
+	unsigned to_submit = ring->sq_local_tail - *ring->sq_tail;
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+	if (to_submit == 0 && wait_nr == 0) {
+		return 0;
+	}
+	int ret;
+	do {
+		ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr,
+		              wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+	return ret;
+}
+
+struct io_uring_cqe* dbring_peek_cqe(struct dbring* ring) {
+	unsigned head = *ring->cq_head;
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+	return &ring->cqes[head & *ring->cq_mask];
+}
+
+void dbring_cqe_seen(struct dbring* ring) {
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+void dbring_deinit(struct dbring* ring) {
+	if (ring->fd == -1) {
+		return;
+	}
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring != ring->sq_ring) {
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	}
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+	ring->fd = -1;
+}
+
+#endif // KAMOODB_HAS_URING
+
+// status is 1 on a hit or a finished put, 0 on a miss, and -errno on failure.
+// A returned value is owned by the callback, the same as from database_get.
+typedef void (*database_aio_cb)(void* udata, int status, char* val);
+
+enum database_aio_state {
+	DBAIO_FREE,
+	DBAIO_HASH_READ,
+	DBAIO_REC_READ,
+	DBAIO_WRITE,
+	DBAIO_DONE
+};
+
+enum database_aio_kind {
+	DBAIO_GET,
+	DBAIO_PUT
+};
+
+struct database_aio_op {
+	enum database_aio_kind kind;
+	enum database_aio_state state;
+	database_aio_cb cb;
+	void* udata;
+	char* key;
+	size_t key_size;
+	size_t key_cap;
+	// hash block position of the probe, the block index counts how many
+	// blocks have been looked at, starting from the home block
+	size_t block_idx;
+	size_t blocks_seen;
+	int32_t slot_start;
+	int32_t slot_seen;
+	int32_t cand[3];
+	int status;
+	char* page_buf;
+	char* rec_buf;
+	size_t rec_cap;
+	// the read or write in flight, a short one is resubmitted for the rest
+	char* io_buf;
+	size_t io_len;
+	size_t io_off;
+	size_t io_done;
+	char* result;
+	struct database_aio_op* next_done;
+};
+
+struct database_aio {
+	struct database* db;
+	unsigned depth;
+	size_t inflight;
+	struct database_aio_op* ops;
+	struct database_aio_op** free_ops;
+	size_t free_len;
+	struct database_aio_op* done;
+	int use_ring;
+	// emulated device latency for each read, used to model slow storage on tmpfs
+	uint64_t latency_ns;
+#if defined(KAMOODB_HAS_URING)
+	struct dbring ring;
+	struct __kernel_timespec delay;
+#endif
+};
+
+static const uint64_t DBAIO_TIMEOUT_TAG = UINT64_MAX;
+
+int database_aio_init(struct database_aio* aio, struct database* db, unsigned depth) {
+	aio->db = db;
+	aio->depth = depth > 0 ? depth : 1;
+	aio->inflight = 0;
+	aio->done = NULL;
+	aio->latency_ns = 0;
+	aio->use_ring = 0;
+	aio->ops = KAMOODB_CALLOC(aio->depth, sizeof(struct database_aio_op));
+	aio->free_ops = KAMOODB_MALLOC(sizeof(struct database_aio_op*) * aio->depth);
+	aio->free_len = 0;
+	for (unsigned i = 0; i < aio->depth; ++i) {
+		struct database_aio_op* op = &aio->ops[aio->depth - i - 1];
+		op->page_buf = KAMOODB_MALLOC(db->dbf.page_size);
+		aio->free_ops[aio->free_len++] = op;
+	}
+#if defined(KAMOODB_HAS_URING)
+	if (db->dbf.fd != -1) {
+		// every read may be preceded by a linked timeout
+		aio->use_ring = dbring_init(&aio->ring, aio->depth * 2);
+	}
+	if (!aio->use_ring) {
+		aio->ring.fd = -1;
+	}
+#endif
+	return 1;
+}
+
+void database_aio_set_latency(struct database_aio* aio, uint64_t latency_ns) {
+	aio->latency_ns = latency_ns;
+}
+
+static void database_aio_finish(struct database_aio* aio, struct database_aio_op* op, int status, char* result) {
+	op->state = DBAIO_DONE;
+	op->status = status;
+	op->result = result;
+	op->next_done = aio->done;
+	aio->done = op;
+}
+
+// Queues what is left of the op's read or write
+static void database_aio_queue(struct database_aio* aio, struct database_aio_op* op, int write) {
+#if defined(KAMOODB_HAS_URING)
+	struct io_uring_sqe* sqe = NULL;
+	if (!write && aio->latency_ns > 0) {
+		aio->delay.tv_sec = aio->latency_ns / 1000000000;
+		aio->delay.tv_nsec = aio->latency_ns % 1000000000;
+		sqe = dbring_get_sqe(&aio->ring);
+		sqe->opcode = IORING_OP_TIMEOUT;
+		sqe->fd = -1;
+		sqe->addr = (uint64_t)(uintptr_t)&aio->delay;
+		sqe->len = 1;
+		sqe->timeout_flags = IORING_TIMEOUT_ETIME_SUCCESS;
+		sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = DBAIO_TIMEOUT_TAG;
+	}
+	sqe = dbring_get_sqe(&aio->ring);
+	sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = aio->db->dbf.fd;
+	sqe->addr = (uint64_t)(uintptr_t)(op->io_buf + op->io_done);
+	sqe->len = op->io_len - op->io_done;
+	sqe->off = op->io_off + op->io_done;
+	sqe->user_data = (uint64_t)(uintptr_t)op;
+#else
+	(void)aio;
+	(void)op;
+	(void)write;
+#endif
+}
+
+static void database_aio_read(struct database_aio* aio, struct database_aio_op* op, char* buf, size_t size, size_t offset) {
+	op->io_buf = buf;
+	op->io_len = size;
+	op->io_off = offset;
+	op->io_done = 0;
+#if defined(KAMOODB_HAS_URING)
+	if (aio->use_ring) {
+		database_aio_queue(aio, op, 0);
+		return;
+	}
+#endif
+	ssize_t got = pread(aio->db->dbf.fd, buf, size, offset);
+	op->status = got == (ssize_t)size ? 1 : -EIO;
+}
+
+static void database_aio_issue_block(struct database_aio* aio, struct database_aio_op* op) {
+	struct database* db = aio->db;
+	int32_t block = database_get_hash_block(db, op->block_idx);
+	if (!database_check_page(db, block)) {
+		database_aio_finish(aio, op, -EIO, NULL);
+		return;
+	}
+	op->state = DBAIO_HASH_READ;
+	op->slot_seen = 0;
+	database_aio_read(aio, op, op->page_buf, db->dbf.page_size, (size_t)block * db->dbf.page_size);
+}
+
+// Walks the buffered hash block from where the probe left off, issuing a
+// storage read for the next candidate or finishing the op on a miss
+static void database_aio_probe(struct database_aio* aio, struct database_aio_op* op) {
+	struct database* db = aio->db;
+	int32_t per_block = db->slots_per_block;
+	while (op->slot_seen < per_block) {
+		int32_t slot = (op->slot_start + op->slot_seen) % per_block;
+		int32_t* place = database_slot_at(db, op->page_buf, slot);
+		++op->slot_seen;
+		if (_is_empty_ins_storage_ptr(place)) {
+			database_aio_finish(aio, op, 0, NULL);
+			return;
+		} else if (_is_del_storage_ptr(place) || database_slot_expired(db, place)) {
+			// an expired record reads as missing, the probe runs on to the empty slot
+			continue;
+		} else if (_is_inline_slot(place)) {
+			if (database_compare_key(db, op->key, op->key_size, place)) {
+				database_aio_finish(aio, op, 1, database_adv_to_val(db, place, op->key_size));
+				return;
+			}
+			continue;
+		} else if ((size_t)place[2] < op->key_size) {
+			continue;
+		}
+		op->cand[0] = place[0];
+		op->cand[1] = place[1];
+		op->cand[2] = place[2];
+		if (op->rec_cap < (size_t)place[2]) {
+			KAMOODB_FREE(op->rec_buf);
+			op->rec_cap = place[2];
+			op->rec_buf = KAMOODB_MALLOC(op->rec_cap);
+		}
+		op->state = DBAIO_REC_READ;
+		database_aio_read(aio, op, op->rec_buf, place[2], ((size_t)place[0] * db->dbf.page_size) + place[1]);
+		return;
+	}
+	// the block is full, fall back to the blocks in order like database_find_slot
+	if (op->blocks_seen >= db->hash_pages.len) {
+		database_aio_finish(aio, op, 0, NULL);
+		return;
+	}
+	op->block_idx = op->blocks_seen++;
+	op->slot_start = 0;
+	database_aio_issue_block(aio, op);
+}
+
+static void database_aio_advance(struct database_aio* aio, struct database_aio_op* op, int res) {
+	// a read past the end of the file or a write that makes no progress fails the op
+	if (res == 0 && op->io_done < op->io_len) {
+		res = -EIO;
+	}
+	if (res < 0) {
+		if (op->state == DBAIO_WRITE) {
+			// the reserved extent was never published
+			database_deallocate_storage(aio->db, op->cand);
+		}
+		database_aio_finish(aio, op, res, NULL);
+		return;
+	}
+	op->io_done += (size_t)res;
+	if (op->io_done < op->io_len) {
+		database_aio_queue(aio, op, op->state == DBAIO_WRITE);
+		return;
+	}
+	switch (op->state) {
+		case DBAIO_HASH_READ:
+			database_aio_probe(aio, op);
+			break;
+		case DBAIO_REC_READ:
+			if (memcmp(op->rec_buf, op->key, op->key_size) == 0) {
+				char* val = database_decode_val(aio->db, op->rec_buf + op->key_size, op->cand[2] - op->key_size);
+				database_aio_finish(aio, op, val != NULL ? 1 : -EIO, val);
+			} else {
+				database_aio_probe(aio, op);
+			}
+			break;
+		case DBAIO_WRITE:
+			// the record is durable in the page cache, now publish it
+			if (!database_put_storage(aio->db, op->rec_buf, op->key_size, op->cand)) {
+				database_deallocate_storage(aio->db, op->cand);
+				database_aio_finish(aio, op, -EIO, NULL);
+				break;
+			}
+			database_aio_finish(aio, op, 1, NULL);
+			break;
+		default:
+			break;
+	}
+}
+
+static struct database_aio_op* database_aio_take(struct database_aio* aio) {
+	if (aio->free_len == 0) {
+		return NULL;
+	}
+	struct database_aio_op* op = aio->free_ops[--aio->free_len];
+	op->result = NULL;
+	op->status = 0;
+	op->blocks_seen = 0;
+	++aio->inflight;
+	return op;
+}
+
+// Starts an async get, returns 0 if all op slots are in use.
+int database_aio_get(struct database_aio* aio, const char* key, database_aio_cb cb, void* udata) {
+	struct database* db = aio->db;
+	struct database_aio_op* op = database_aio_take(aio);
+	if (op == NULL) {
+		return 0;
+	}
+	op->kind = DBAIO_GET;
+	op->cb = cb;
+	op->udata = udata;
+	if (!aio->use_ring) {
+		char* val = database_get(db, key);
+		database_aio_finish(aio, op, val != NULL, val);
+		return 1;
+	}
+	op->key_size = strlen(key) + 1;
+	if (op->key_cap < op->key_size) {
+		KAMOODB_FREE(op->key);
+		op->key_cap = op->key_size;
+		op->key = KAMOODB_MALLOC(op->key_cap);
+	}
+	memcpy(op->key, key, op->key_size);
+	size_t hash_slot = hash_djb2(key) % database_get_hash_len(db);
+	size_t hash_each_block = db->slots_per_block;
+	op->block_idx = hash_slot / hash_each_block;
+	op->slot_start = hash_slot % hash_each_block;
+	database_aio_issue_block(aio, op);
+	return 1;
+}
+
+// Starts an async put. Space is reserved up front and the record is written
+// through the ring; the hash slot is published once the write completes.
+int database_aio_put(struct database_aio* aio, const char* key, const char* val, database_aio_cb cb, void* udata) {
+	struct database* db = aio->db;
+	struct database_aio_op* op = database_aio_take(aio);
+	if (op == NULL) {
+		return 0;
+	}
+	op->kind = DBAIO_PUT;
+	op->cb = cb;
+	op->udata = udata;
+	// records that fit the hash slot have no storage write to wait for
+	if (!aio->use_ring || database_fits_inline(db, strlen(key) + strlen(val) + 2)) {
+		database_aio_finish(aio, op, database_put(db, key, val), NULL);
+		return 1;
+	}
+	database_check_and_maybe_expand(db);
+	op->key_size = strlen(key) + 1;
+	size_t val_size = strlen(val) + 1;
+	size_t total_size = op->key_size + dbcodec_bound(val_size);
+	if (op->rec_cap < total_size) {
+		KAMOODB_FREE(op->rec_buf);
+		op->rec_cap = total_size;
+		op->rec_buf = KAMOODB_MALLOC(op->rec_cap);
+	}
+	total_size = database_encode_record(db, key, op->key_size, val, val_size, op->rec_buf);
+	if (database_allocate_storage(db, total_size, op->cand) == -1) {
+		database_aio_finish(aio, op, -errno, NULL);
+		return 1;
+	}
+	op->state = DBAIO_WRITE;
+	op->io_buf = op->rec_buf;
+	op->io_len = total_size;
+	op->io_off = ((size_t)op->cand[0] * db->dbf.page_size) + op->cand[1];
+	op->io_done = 0;
+	// the ring writes past dbfile_write_po, so the pages are marked for the next checkpoint here
+	dbfile_touch_run(&db->dbf, op->cand[0], ((op->io_off + total_size - 1) / db->dbf.page_size) - op->cand[0] + 1);
+	database_aio_queue(aio, op, 1);
+	return 1;
+}
+
+// Hands queued ops to the kernel without waiting
+void database_aio_submit(struct database_aio* aio) {
+#if defined(KAMOODB_HAS_URING)
+	if (aio->use_ring) {
+		dbring_submit(&aio->ring, 0);
+	}
+#endif
+}
+
+static size_t database_aio_run_done(struct database_aio* aio) {
+	size_t n = 0;
+	while (aio->done != NULL) {
+		struct database_aio_op* op = aio->done;
+		aio->done = op->next_done;
+		op->state = DBAIO_FREE;
+		aio->free_ops[aio->free_len++] = op;
+		--aio->inflight;
+		++n;
+		if (op->cb != NULL) {
+			op->cb(op->udata, op->status, op->result);
+		} else {
+			KAMOODB_FREE(op->result);
+		}
+	}
+	return n;
+}
+
+// Submits queued reads and reaps completions, running callbacks for
+// finished ops. Blocks until at least min_complete ops have finished or
+// nothing is left in flight. Returns the number of finished ops.
+size_t database_aio_poll(struct database_aio* aio, size_t min_complete) {
+	size_t finished = database_aio_run_done(aio);
+#if defined(KAMOODB_HAS_URING)
+	while (aio->use_ring && aio->inflight > 0) {
+		int wait = finished < min_complete;
+		dbring_submit(&aio->ring, wait ? 1 : 0);
+		struct io_uring_cqe* cqe;
+		while ((cqe = dbring_peek_cqe(&aio->ring)) != NULL) {
+			uint64_t tag = cqe->user_data;
+			int res = cqe->res;
+			dbring_cqe_seen(&aio->ring);
+			if (tag == DBAIO_TIMEOUT_TAG) {
+				continue;
+			}
+			database_aio_advance(aio, (struct database_aio_op*)(uintptr_t)tag, res);
+		}
+		finished += database_aio_run_done(aio);
+		if (finished >= min_complete) {
+			break;
+		}
+	}
+#endif
+	return finished;
+}
+
+size_t database_aio_inflight(struct database_aio* aio) {
+	return aio->inflight;
+}
+
+void database_aio_deinit(struct database_aio* aio) {
+	while (aio->inflight > 0) {
+		database_aio_poll(aio, aio->inflight);
+	}
+#if defined(KAMOODB_HAS_URING)
+	dbring_deinit(&aio->ring);
+#endif
+	for (unsigned i = 0; i < aio->depth; ++i) {
+		KAMOODB_FREE(aio->ops[i].page_buf);
+		KAMOODB_FREE(aio->ops[i].rec_buf);
+		KAMOODB_FREE(aio->ops[i].key);
+	}
+	KAMOODB_FREE(aio->ops);
+	KAMOODB_FREE(aio->free_ops);
+	aio->ops = NULL;
+	aio->free_ops = NULL;
 }
 
 #endif // KAMOODB_HEADER
\ No newline at end of file
@@ -1,5 +1,10 @@
 #include "kamoodb.h"
 #include <time.h>
+#include <math.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
 
 #define SEC_TO_US(sec) ((sec)*1000000)
 #define NS_TO_US(ns)    ((ns)/1000)
@@ -35,20 +40,869 @@ static uint64_t micro_stamp() {
     return us;
 }
 
-int main(int argc, char const *argv[])
-{
+static void bench_put(const char* path, struct dbcfg* cfg, const char* label) {
 	struct database db;
-	srand(time(NULL));
-	fill_rand_arr();
-	printf("Will hash and insert %zu keys and values\n", RAND_ARR_SIZE);
-	database_open(&db, "bench", NULL);
+	printf("[%s] Will hash and insert %zu keys and values\n", label, RAND_ARR_SIZE);
+	database_open(&db, path, cfg);
 	uint64_t start = micro_stamp();
 	for (size_t i = 0; i < RAND_ARR_SIZE; ++i)
 	{
 		database_put(&db, RAND_STR_ARR[i], RAND_STR_ARR[i]);
 	}
 	uint64_t end = micro_stamp();
-	printf("Time taken %lluus\n", end - start);
+	printf("[%s] Time taken %lluus\n", label, end - start);
 	database_close_and_remove(&db);
+}
+
+static void bench_aio_cb(void* udata, int status, char* val) {
+	size_t* hits = udata;
+	if (status == 1) {
+		++*hits;
+	}
+	free(val);
+}
+
+// Random gets at queue depths 1 to 256. On tmpfs, pass a latency to model
+// a device that takes that long to serve each read.
+static void bench_aio(const char* path, uint64_t latency_us) {
+	struct database db;
+	const size_t n_keys = 100000;
+	const size_t n_gets = 20000;
+	database_open(&db, path, NULL);
+	for (size_t i = 0; i < n_keys; ++i)
+	{
+		database_put(&db, RAND_STR_ARR[i], RAND_STR_ARR[i]);
+	}
+	printf("[aio] %zu keys in %s, %lluus injected latency\n", n_keys, path, (unsigned long long)latency_us);
+	for (unsigned depth = 1; depth <= 256; depth *= 2) {
+		struct database_aio aio;
+		size_t hits = 0;
+		database_aio_init(&aio, &db, depth);
+		database_aio_set_latency(&aio, latency_us * 1000);
+		uint64_t start = micro_stamp();
+		for (size_t i = 0; i < n_gets; ++i) {
+			while (!database_aio_get(&aio, RAND_STR_ARR[rand() % n_keys], bench_aio_cb, &hits)) {
+				database_aio_poll(&aio, 1);
+			}
+		}
+		database_aio_poll(&aio, database_aio_inflight(&aio));
+		uint64_t end = micro_stamp();
+		double secs = (double)(end - start) / 1000000.0;
+		printf("[aio] depth %3u: %10.0f gets/s, %zu hits\n", depth, (double)n_gets / secs, hits);
+		database_aio_deinit(&aio);
+	}
+	database_close_and_remove(&db);
+}
+
+static unsigned file_extent_count(int fd) {
+	struct fiemap fm;
+	memset(&fm, 0, sizeof(fm));
+	fm.fm_length = FIEMAP_MAX_OFFSET;
+	fm.fm_flags = FIEMAP_FLAG_SYNC;
+	if (ioctl(fd, FS_IOC_FIEMAP, &fm) != 0) {
+		return 0;
+	}
+	return fm.fm_mapped_extents;
+}
+
+// Bulk load time and resulting file layout for a given growth chunk
+static void bench_grow(size_t grow_chunk, const char* label) {
+	struct database db;
+	struct dbcfg cfg = {0, DBSTORE_MEM_MAP, grow_chunk, 0};
+	const size_t n_keys = 200000;
+	remove("bench_grow");
+	database_open(&db, "bench_grow", &cfg);
+	uint64_t start = micro_stamp();
+	for (size_t i = 0; i < n_keys; ++i)
+	{
+		database_put(&db, RAND_STR_ARR[i], RAND_STR_ARR[i]);
+	}
+	uint64_t end = micro_stamp();
+	printf("[grow %s] %zu keys in %lluus, %zu pages used, %zu unused, %u extents\n", label, n_keys,
+	       (unsigned long long)(end - start), db.dbf.page_count, dbfile_unused_pages(&db.dbf),
+	       file_extent_count(db.dbf.fd));
+	database_close_and_remove(&db);
+}
+
+// Time to double an index that already holds many keys
+static void bench_expand(void) {
+	struct database db;
+	const size_t n_keys = 200000;
+	database_open(&db, "bench_expand", NULL);
+	for (size_t i = 0; i < n_keys; ++i)
+	{
+		database_put(&db, RAND_STR_ARR[i], RAND_STR_ARR[i]);
+	}
+	size_t blocks = db.hash_pages.len;
+	uint64_t start = micro_stamp();
+	database_expand(&db, blocks);
+	uint64_t end = micro_stamp();
+	printf("[expand] %zu to %zu blocks with %zu keys in %lluus\n", blocks, db.hash_pages.len, n_keys,
+	       (unsigned long long)(end - start));
+	database_close_and_remove(&db);
+}
+
+// Bulk load into a database sized for the load up front
+static void bench_presize(void) {
+	const size_t n_keys = 200000;
+	struct dbcfg cfg = {0, DBSTORE_MEM_MAP, 0, 0, n_keys, 62};
+	struct database db;
+	database_open(&db, "bench_presize", &cfg);
+	uint64_t start = micro_stamp();
+	for (size_t i = 0; i < n_keys; ++i)
+	{
+		database_put(&db, RAND_STR_ARR[i], RAND_STR_ARR[i]);
+	}
+	uint64_t end = micro_stamp();
+	printf("[presize] %zu keys in %lluus, %zu blocks\n", n_keys, (unsigned long long)(end - start), db.hash_pages.len);
+	database_close_and_remove(&db);
+}
+
+// 8 byte keys with 13 byte values, stored inline or through the allocator
+static void bench_inline(size_t inline_size, const char* label) {
+	const size_t n_keys = 200000;
+	struct dbcfg cfg = {0, DBSTORE_MEM_MAP, 0, 0, 0, 0, inline_size};
+	struct database db;
+	char keybuf[16];
+	char valbuf[16];
+	database_open(&db, "bench_inline", &cfg);
+	for (size_t i = 0; i < n_keys; ++i)
+	{
+		snprintf(keybuf, sizeof(keybuf), "%.7s", RAND_STR_ARR[i]);
+		snprintf(valbuf, sizeof(valbuf), "%.12s", RAND_STR_ARR[i] + 7);
+		database_put(&db, keybuf, valbuf);
+	}
+	uint64_t start = micro_stamp();
+	for (size_t i = 0; i < n_keys; ++i)
+	{
+		snprintf(keybuf, sizeof(keybuf), "%.7s", RAND_STR_ARR[i]);
+		free(database_get(&db, keybuf));
+	}
+	uint64_t end = micro_stamp();
+	printf("[inline %s] %zu gets in %lluus, %zu bytes per item\n", label, n_keys,
+		   (unsigned long long)(end - start), (db.dbf.page_count * db.dbf.page_size) / n_keys);
+	database_close_and_remove(&db);
+}
+
+static void bench_ordered(int ordered_index, const char* label) {
+	const size_t n_keys = 200000;
+	struct dbcfg cfg = {0, DBSTORE_MEM_MAP, 0, 0, 0, 0, 0, ordered_index};
+	struct database db;
+	database_open(&db, "bench_ordered", &cfg);
+	uint64_t start = micro_stamp();
+	for (size_t i = 0; i < n_keys; ++i)
+	{
+		database_put(&db, RAND_STR_ARR[i], RAND_STR_ARR[i]);
+	}
+	uint64_t end = micro_stamp();
+	printf("[ordered %s] %zu puts in %lluus, %zu pages\n", label, n_keys,
+		   (unsigned long long)(end - start), db.dbf.page_count);
+	database_close_and_remove(&db);
+}
+
+static void make_json_val(char* buf, size_t cap, size_t i) {
+	static const char* plans[] = {"free", "basic", "pro", "enterprise"};
+	snprintf(buf, cap, "{\"id\": %zu, \"name\": \"%.12s\", \"status\": \"active\", "
+		     "\"plan\": \"%s\", \"region\": \"us-east-%zu\", \"tags\": [\"web\", \"mobile\"]}",
+		     i, RAND_STR_ARR[i], plans[i % 4], i % 3);
+}
+
+static void bench_codec(enum dbcodec_type type, int trained, const char* label) {
+	const size_t n_keys = 200000;
+	struct dbcfg cfg = {0, DBSTORE_MEM_MAP, 0, 0, 0, 0, 0, 0, type};
+	struct database db;
+	char valbuf[256];
+	database_open(&db, "bench_codec", &cfg);
+	if (trained) {
+		const size_t n_samples = 1000;
+		char* samples[1000];
+		for (size_t i = 0; i < n_samples; ++i) {
+			make_json_val(valbuf, sizeof(valbuf), RAND_ARR_SIZE - 1 - i);
+			samples[i] = strdup(valbuf);
+		}
+		database_train_dict(&db, (const char**)samples, n_samples, 4096);
+		for (size_t i = 0; i < n_samples; ++i) {
+			free(samples[i]);
+		}
+	}
+	size_t pages_before = db.dbf.page_count;
+	uint64_t start = micro_stamp();
+	for (size_t i = 0; i < n_keys; ++i)
+	{
+		make_json_val(valbuf, sizeof(valbuf), i);
+		database_put(&db, RAND_STR_ARR[i], valbuf);
+	}
+	uint64_t mid = micro_stamp();
+	for (size_t i = 0; i < n_keys; ++i)
+	{
+		free(database_get(&db, RAND_STR_ARR[i]));
+	}
+	uint64_t end = micro_stamp();
+	printf("[codec %s] %zu puts in %lluus, gets %.3fus each, %zu pages\n", label, n_keys,
+		   (unsigned long long)(mid - start), (double)(end - mid) / n_keys, db.dbf.page_count - pages_before);
+	database_close_and_remove(&db);
+}
+
+static void bench_checksum_gets(struct database* db, size_t n_keys, const char* label) {
+	uint64_t start = micro_stamp();
+	for (size_t i = 0; i < n_keys; ++i)
+	{
+		free(database_get(db, RAND_STR_ARR[i]));
+	}
+	uint64_t end = micro_stamp();
+	printf("[checksum %s] %.3fus per get\n", label, (double)(end - start) / n_keys);
+}
+
+static void bench_checksum(void) {
+	const size_t n_keys = 200000;
+	const size_t crc_size = 64 * 1024 * 1024;
+	struct database db;
+	char* data = malloc(crc_size);
+	memset(data, 'k', crc_size);
+	uint64_t start = micro_stamp();
+	uint32_t crc = crc32c(0, data, crc_size);
+	uint64_t mid = micro_stamp();
+	crc ^= crc32c_sw(0, data, crc_size);
+	uint64_t end = micro_stamp();
+	printf("[checksum crc32c] %.0f MB/s, software %.0f MB/s (%u)\n", 64.0 / ((double)(mid - start) / 1000000.0),
+		   64.0 / ((double)(end - mid) / 1000000.0), crc);
+	free(data);
+	database_open(&db, "bench_csum", NULL);
+	for (size_t i = 0; i < n_keys; ++i)
+	{
+		database_put(&db, RAND_STR_ARR[i], RAND_STR_ARR[i]);
+	}
+	bench_checksum_gets(&db, n_keys, "unchecked");
+	start = micro_stamp();
+	database_close(&db);
+	printf("[checksum close] %lluus\n", (unsigned long long)(micro_stamp() - start));
+	database_open(&db, "bench_csum", NULL);
+	// the first pass verifies each hash block as it is probed
+	bench_checksum_gets(&db, n_keys, "first pass");
+	bench_checksum_gets(&db, n_keys, "verified");
+	database_close_and_remove(&db);
+}
+
+static void print_hist(const char* label, const struct dbhist* hist) {
+	printf("[stats %s] n=%llu mean=%.0fns p50=%lluns p99=%lluns p99.9=%lluns max=%lluns\n", label,
+		   (unsigned long long)hist->count, hist->count > 0 ? (double)hist->sum / hist->count : 0.0,
+		   (unsigned long long)dbhist_percentile(hist, 0.5), (unsigned long long)dbhist_percentile(hist, 0.99),
+		   (unsigned long long)dbhist_percentile(hist, 0.999), (unsigned long long)hist->max);
+}
+
+static void bench_stats(void) {
+	const size_t n_keys = 200000;
+	const size_t n_stamps = 1000000;
+	struct database db;
+	struct dbstats stats;
+	uint64_t sink = 0;
+	uint64_t start = micro_stamp();
+	for (size_t i = 0; i < n_stamps; ++i) {
+		sink += dbstat_now();
+	}
+	uint64_t end = micro_stamp();
+	printf("[stats] timer read %.1fns, two per op (%llu)\n", (double)(end - start) * 1000.0 / n_stamps,
+		   (unsigned long long)(sink & 1));
+	database_open(&db, "bench_stats", NULL);
+	for (size_t i = 0; i < n_keys; ++i)
+	{
+		database_put(&db, RAND_STR_ARR[i], RAND_STR_ARR[i]);
+	}
+	for (size_t i = 0; i < n_keys; ++i)
+	{
+		free(database_get(&db, RAND_STR_ARR[i]));
+	}
+	database_stats(&db, &stats);
+	print_hist("put", &stats.put);
+	print_hist("get", &stats.get);
+	print_hist("expand", &stats.expand);
+	printf("[stats] probes=%llu compares=%llu free list scans=%llu faults=%llu grows=%llu\n",
+		   (unsigned long long)stats.probes, (unsigned long long)stats.key_compares,
+		   (unsigned long long)stats.free_list_scans, (unsigned long long)stats.file.page_faults,
+		   (unsigned long long)stats.file.grows);
+	database_close_and_remove(&db);
+}
+
+static void bench_snapshot(size_t every, const char* label) {
+	const size_t n_keys = 200000;
+	struct database db;
+	struct dbsnapshot snap;
+	struct dbstats stats;
+	int live = 0;
+	uint64_t snap_us = 0;
+	database_open(&db, "bench_snapshot", NULL);
+	for (size_t i = 0; i < n_keys; ++i)
+	{
+		database_put(&db, RAND_STR_ARR[i], RAND_STR_ARR[i]);
+	}
+	uint64_t start = micro_stamp();
+	for (size_t i = 0; i < n_keys; ++i)
+	{
+		// a new snapshot replaces the last one, like periodic backups
+		if (every > 0 && i % every == 0) {
+			uint64_t snap_start = micro_stamp();
+			if (live) {
+				database_snapshot_release(&snap);
+			}
+			live = database_snapshot(&db, &snap);
+			snap_us += micro_stamp() - snap_start;
+		}
+		database_put(&db, RAND_STR_ARR[i], RAND_STR_ARR[n_keys - i - 1]);
+	}
+	uint64_t end = micro_stamp();
+	if (live) {
+		database_snapshot_release(&snap);
+	}
+	database_stats(&db, &stats);
+	printf("[snapshot %s] %zu overwrites in %lluus, %llu page copies, %lluus taking and releasing\n", label, n_keys,
+		   (unsigned long long)(end - start), (unsigned long long)stats.cow_copies, (unsigned long long)snap_us);
+	database_close_and_remove(&db);
+}
+
+static void bench_backup(void) {
+	const size_t n_keys = 200000;
+	struct database db;
+	database_open(&db, "bench_backup", NULL);
+	for (size_t i = 0; i < n_keys; ++i)
+	{
+		database_put(&db, RAND_STR_ARR[i], RAND_STR_ARR[i]);
+	}
+	uint64_t start = micro_stamp();
+	database_backup(&db, "bench_backup.bak");
+	uint64_t end = micro_stamp();
+	size_t bytes = db.dbf.page_count * db.dbf.page_size;
+	printf("[backup full] %zu bytes in %lluus, %.1fMB/s\n", bytes, (unsigned long long)(end - start),
+		   (double)bytes / (double)(end - start));
+	uint32_t gen = database_get_generation(&db);
+	for (size_t i = 0; i < n_keys / 100; ++i)
+	{
+		database_put(&db, RAND_STR_ARR[i], RAND_STR_ARR[i + 1]);
+	}
+	start = micro_stamp();
+	database_backup_delta(&db, "bench_backup.delta", gen);
+	end = micro_stamp();
+	printf("[backup delta] 1%% of keys rewritten, %zd bytes in %lluus\n", file_size("bench_backup.delta"),
+		   (unsigned long long)(end - start));
+	remove("bench_backup.bak");
+	remove("bench_backup.delta");
+	database_close_and_remove(&db);
+}
+
+static size_t resident_bytes(void) {
+	size_t total = 0;
+	size_t resident = 0;
+	FILE* fp = fopen("/proc/self/statm", "r");
+	if (fp != NULL) {
+		if (fscanf(fp, "%zu %zu", &total, &resident) != 2) {
+			resident = 0;
+		}
+		fclose(fp);
+	}
+	return resident * get_page_size();
+}
+
+// Opens a database whose file is extended to gb gigabytes of sparse pages,
+// the header claims all of them so the open sees a file of that size
+static void bench_open(size_t gb, size_t map_budget) {
+	const size_t n_keys = 100000;
+	struct database db;
+	struct dbcfg cfg = {0, DBSTORE_MEM_MAP, 0, 0};
+	cfg.map_budget = map_budget;
+	database_open(&db, "bench_open", NULL);
+	for (size_t i = 0; i < n_keys; ++i)
+	{
+		database_put(&db, RAND_STR_ARR[i], RAND_STR_ARR[i]);
+	}
+	database_close(&db);
+	size_t size = gb << 30;
+	int fd = open("bench_open", O_RDWR);
+	char* header = malloc(get_page_size());
+	int ok = fd != -1 && ftruncate(fd, size) == 0 && pread(fd, header, get_page_size(), 0) == (ssize_t)get_page_size();
+	if (ok) {
+		*(int64_t*)(header + DB_HEADER_PAGE_COUNT_OFF) = size / get_page_size();
+		*(uint32_t*)(header + DB_HEADER_CSUM_OFF) = dbheader_crc(header, get_page_size());
+		ok = pwrite(fd, header, get_page_size(), 0) == (ssize_t)get_page_size();
+	}
+	free(header);
+	if (fd != -1) {
+		close(fd);
+	}
+	if (!ok) {
+		printf("[open %zuGB] could not make a sparse file of that size\n", gb);
+		remove("bench_open");
+		return;
+	}
+	size_t rss_before = resident_bytes();
+	uint64_t start = micro_stamp();
+	database_open(&db, "bench_open", &cfg);
+	uint64_t end = micro_stamp();
+	size_t rss_open = resident_bytes();
+	for (size_t i = 0; i < n_keys; ++i)
+	{
+		free(database_get(&db, RAND_STR_ARR[i]));
+	}
+	size_t rss_gets = resident_bytes();
+	printf("[open %zuGB budget %zuMB] open in %lluus, rss +%zuKB after open, +%zuKB after %zu gets\n", gb,
+		   map_budget >> 20, (unsigned long long)(end - start), (rss_open - rss_before) >> 10,
+		   (rss_gets - rss_before) >> 10, n_keys);
+	database_close_and_remove(&db);
+}
+
+// Lock free reads against a second process that keeps writing
+static void bench_shared(void) {
+	const size_t n_keys = 200000;
+	struct database db;
+	remove("bench_shared");
+	remove("bench_shared.shm");
+	database_open_shared(&db, "bench_shared", NULL);
+	for (size_t i = 0; i < n_keys; ++i)
+	{
+		database_shared_put(&db, RAND_STR_ARR[i], RAND_STR_ARR[i]);
+	}
+	uint64_t start = micro_stamp();
+	for (size_t i = 0; i < n_keys; ++i)
+	{
+		free(database_shared_get(&db, RAND_STR_ARR[i]));
+	}
+	uint64_t end = micro_stamp();
+	printf("[shared gets alone] %zu gets in %lluus\n", n_keys, (unsigned long long)(end - start));
+	pid_t writer = fork();
+	if (writer == 0) {
+		struct database child;
+		database_open_shared(&child, "bench_shared", NULL);
+		for (size_t i = n_keys; i < n_keys * 2; ++i)
+		{
+			database_shared_put(&child, RAND_STR_ARR[i], RAND_STR_ARR[i]);
+		}
+		database_close(&child);
+		_exit(0);
+	}
+	start = micro_stamp();
+	for (size_t i = 0; i < n_keys; ++i)
+	{
+		free(database_shared_get(&db, RAND_STR_ARR[i]));
+	}
+	end = micro_stamp();
+	waitpid(writer, NULL, 0);
+	printf("[shared gets with a writer] %zu gets in %lluus\n", n_keys, (unsigned long long)(end - start));
+	database_close_and_remove(&db);
+	remove("bench_shared.shm");
+}
+
+static void bench_txn(size_t per_txn, int sync, size_t n_keys, const char* label) {
+	struct database db;
+	struct dbcfg cfg = {0, DBSTORE_MEM_MAP, 0, 0};
+	cfg.txn_sync = sync;
+	database_open(&db, "bench_txn", &cfg);
+	uint64_t start = micro_stamp();
+	for (size_t i = 0; i < n_keys; i += per_txn)
+	{
+		if (per_txn == 0) {
+			break;
+		}
+		struct dbtxn txn;
+		database_txn_begin(&db, &txn);
+		for (size_t j = i; j < i + per_txn && j < n_keys; ++j)
+		{
+			database_txn_put(&txn, RAND_STR_ARR[j], RAND_STR_ARR[j]);
+		}
+		database_txn_commit(&txn);
+	}
+	for (size_t i = 0; per_txn == 0 && i < n_keys; ++i)
+	{
+		database_put(&db, RAND_STR_ARR[i], RAND_STR_ARR[i]);
+	}
+	uint64_t end = micro_stamp();
+	printf("[%s] %zu keys in %lluus\n", label, n_keys, (unsigned long long)(end - start));
+	database_close_and_remove(&db);
+}
+
+static void bench_update(int hold_snapshot, size_t rounds, const char* label) {
+	const size_t n_keys = 100000;
+	struct database db;
+	struct dbstats stats;
+	struct dbsnapshot snap;
+	char val[64];
+	database_open(&db, "bench_update", NULL);
+	for (size_t i = 0; i < n_keys; ++i)
+	{
+		snprintf(val, sizeof(val), "%060zu", i);
+		database_put(&db, RAND_STR_ARR[i], val);
+	}
+	// a live snapshot keeps every overwrite from reusing the old extent
+	if (hold_snapshot) {
+		database_snapshot(&db, &snap);
+	}
+	size_t pages_before = db.dbf.page_count;
+	database_stats_reset(&db);
+	uint64_t start = micro_stamp();
+	for (size_t r = 1; r <= rounds; ++r)
+	{
+		for (size_t i = 0; i < n_keys; ++i)
+		{
+			snprintf(val, sizeof(val), "%060zu", i + r);
+			database_put(&db, RAND_STR_ARR[i], val);
+		}
+	}
+	uint64_t end = micro_stamp();
+	database_stats(&db, &stats);
+	printf("[%s] %zu overwrites in %lluus, %llu in place, file grew by %zu pages\n", label, n_keys * rounds,
+		   (unsigned long long)(end - start), (unsigned long long)stats.in_place, db.dbf.page_count - pages_before);
+	if (hold_snapshot) {
+		database_snapshot_release(&snap);
+	}
+	database_close_and_remove(&db);
+}
+
+static void bench_expiry(void) {
+	const size_t n_keys = 500000;
+	struct database db;
+	struct dbcfg cfg = {0, DBSTORE_MEM_MAP, 0, 0};
+	cfg.expiry = 1;
+	database_open(&db, "bench_expiry", &cfg);
+	// every other record has already expired by the time it is read
+	for (size_t i = 0; i < n_keys; ++i)
+	{
+		database_put_ttl(&db, RAND_STR_ARR[i], RAND_STR_ARR[i], i % 2 ? 1 : 0);
+	}
+	struct timespec pause = {0, 2000000};
+	nanosleep(&pause, NULL);
+	size_t hits = 0;
+	uint64_t start = micro_stamp();
+	for (size_t i = 0; i < n_keys; ++i)
+	{
+		char* val = database_get(&db, RAND_STR_ARR[i]);
+		hits += val != NULL;
+		free(val);
+	}
+	uint64_t end = micro_stamp();
+	printf("[expiry] %zu gets, %zu hits in %lluus\n", n_keys, hits, (unsigned long long)(end - start));
+	size_t swept = 0;
+	size_t steps = 0;
+	uint64_t worst = 0;
+	start = micro_stamp();
+	while (swept < n_keys / 2)
+	{
+		uint64_t step_start = micro_stamp();
+		swept += database_sweep(&db, 1000000);
+		uint64_t step = micro_stamp() - step_start;
+		worst = step > worst ? step : worst;
+		++steps;
+	}
+	end = micro_stamp();
+	printf("[expiry] swept %zu records in %zu steps of 1ms, %lluus total, longest step %lluus\n", swept, steps,
+		   (unsigned long long)(end - start), (unsigned long long)worst);
+	database_close_and_remove(&db);
+}
+
+// Key ranks drawn from a Zipf distribution over n keys, by inverting the cdf
+static size_t* make_zipf_trace(size_t n, double skew, size_t len) {
+	double* cdf = malloc(n * sizeof(double));
+	double sum = 0.0;
+	for (size_t i = 0; i < n; ++i)
+	{
+		sum += 1.0 / pow((double)(i + 1), skew);
+		cdf[i] = sum;
+	}
+	size_t* trace = malloc(len * sizeof(size_t));
+	for (size_t i = 0; i < len; ++i)
+	{
+		double u = ((double)rand() / RAND_MAX) * sum;
+		size_t lo = 0;
+		size_t hi = n - 1;
+		while (lo < hi) {
+			size_t mid = (lo + hi) / 2;
+			if (cdf[mid] < u) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		trace[i] = lo;
+	}
+	free(cdf);
+	return trace;
+}
+
+static void bench_cache(const size_t* trace, size_t len, size_t capacity, const char* label) {
+	struct database db;
+	struct dbstats stats;
+	struct dbcfg cfg = {0, DBSTORE_MEM_MAP, 0, 0};
+	char val[128];
+	cfg.capacity = capacity;
+	database_open(&db, "bench_cache", &cfg);
+	size_t hits = 0;
+	uint64_t start = micro_stamp();
+	// read through, a miss loads the value into the cache
+	for (size_t i = 0; i < len; ++i)
+	{
+		const char* key = RAND_STR_ARR[trace[i]];
+		char* got = database_get(&db, key);
+		if (got != NULL) {
+			++hits;
+			free(got);
+		} else {
+			snprintf(val, sizeof(val), "%0100zu", trace[i]);
+			database_put(&db, key, val);
+		}
+	}
+	uint64_t end = micro_stamp();
+	database_stats(&db, &stats);
+	printf("[%s] %zu ops in %lluus, hit ratio %.3f, %llu evictions, file %zu KB\n", label, len,
+		   (unsigned long long)(end - start), (double)hits / len, (unsigned long long)stats.evictions,
+		   (db.dbf.page_count * db.dbf.page_size) / 1024);
+	database_close_and_remove(&db);
+}
+
+static void bench_bloom(size_t bloom_bits, const char* label) {
+	const size_t n_keys = RAND_ARR_SIZE / 2;
+	struct database db;
+	struct dbcfg cfg = {0, DBSTORE_MEM_MAP, 0, 0};
+	cfg.bloom_bits = bloom_bits;
+	database_open(&db, "bench_bloom", &cfg);
+	for (size_t i = 0; i < n_keys; ++i)
+	{
+		database_put(&db, RAND_STR_ARR[i], RAND_STR_ARR[i]);
+	}
+	// the second half of the keys was never put
+	database_stats_reset(&db);
+	uint64_t start = micro_stamp();
+	for (size_t i = n_keys; i < RAND_ARR_SIZE; ++i)
+	{
+		free(database_get(&db, RAND_STR_ARR[i]));
+	}
+	uint64_t miss_us = micro_stamp() - start;
+	struct dbstats stats;
+	database_stats(&db, &stats);
+	start = micro_stamp();
+	for (size_t i = 0; i < n_keys; ++i)
+	{
+		free(database_get(&db, RAND_STR_ARR[i]));
+	}
+	uint64_t hit_us = micro_stamp() - start;
+	printf("[%s] misses %.1fns each, %.2f%% answered by the filter, hits %.1fns each\n", label,
+		   (miss_us * 1000.0) / n_keys, (stats.bloom_skips * 100.0) / n_keys, (hit_us * 1000.0) / n_keys);
+	database_close_and_remove(&db);
+}
+
+// Gets all keys in a shuffled order one by one and then in batches. The file
+// is well over the size of a last level cache.
+static void bench_batch(size_t batch) {
+	struct database db;
+	database_open(&db, "bench_batch", NULL);
+	for (size_t i = 0; i < RAND_ARR_SIZE; ++i)
+	{
+		database_put(&db, RAND_STR_ARR[i], RAND_STR_ARR[i]);
+	}
+	const char** order = malloc(sizeof(char*) * RAND_ARR_SIZE);
+	char** vals = malloc(sizeof(char*) * batch);
+	for (size_t i = 0; i < RAND_ARR_SIZE; ++i)
+	{
+		order[i] = RAND_STR_ARR[i];
+	}
+	for (size_t i = RAND_ARR_SIZE - 1; i > 0; --i)
+	{
+		size_t j = (size_t)rand() % (i + 1);
+		const char* tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+	uint64_t start = micro_stamp();
+	for (size_t i = 0; i < RAND_ARR_SIZE; ++i)
+	{
+		free(database_get(&db, order[i]));
+	}
+	uint64_t serial_us = micro_stamp() - start;
+	size_t found = 0;
+	start = micro_stamp();
+	for (size_t i = 0; i < RAND_ARR_SIZE; i += batch)
+	{
+		size_t len = RAND_ARR_SIZE - i < batch ? RAND_ARR_SIZE - i : batch;
+		found += database_get_batch(&db, order + i, len, vals);
+		for (size_t k = 0; k < len; ++k)
+		{
+			free(vals[k]);
+		}
+	}
+	uint64_t batch_us = micro_stamp() - start;
+	printf("[batch %zu] gets %.1fns each one by one, %.1fns each batched, %zu found\n", batch,
+		   (serial_us * 1000.0) / RAND_ARR_SIZE, (batch_us * 1000.0) / RAND_ARR_SIZE, found);
+	free(vals);
+	free(order);
+	database_close_and_remove(&db);
+}
+
+static void bench_build(void) {
+	const size_t n_keys = 500000;
+	struct database db;
+	struct dbbuilder b;
+	uint64_t start = micro_stamp();
+	database_open(&db, "bench_build", NULL);
+	for (size_t i = 0; i < n_keys; ++i)
+	{
+		database_put(&db, RAND_STR_ARR[i % RAND_ARR_SIZE], RAND_STR_ARR[(i + 1) % RAND_ARR_SIZE]);
+	}
+	database_close(&db);
+	uint64_t end = micro_stamp();
+	printf("[build puts] %zu keys in %lluus, %zd bytes\n", n_keys, (unsigned long long)(end - start),
+		   file_size("bench_build"));
+	remove("bench_build");
+	start = micro_stamp();
+	dbbuilder_init(&b, "bench_build", NULL);
+	for (size_t i = 0; i < n_keys; ++i)
+	{
+		dbbuilder_add(&b, RAND_STR_ARR[i % RAND_ARR_SIZE], RAND_STR_ARR[(i + 1) % RAND_ARR_SIZE]);
+	}
+	dbbuilder_finish(&b, 0);
+	end = micro_stamp();
+	printf("[build builder] %zu keys in %lluus, %zd bytes\n", n_keys, (unsigned long long)(end - start),
+		   file_size("bench_build"));
+	remove("bench_build");
+}
+
+struct bench_shard_writer {
+	struct dbsharded* sd;
+	size_t first;
+	size_t last;
+};
+
+static void* bench_shard_write(void* arg) {
+	struct bench_shard_writer* w = arg;
+	for (size_t i = w->first; i < w->last; ++i) {
+		dbsharded_put(w->sd, RAND_STR_ARR[i], RAND_STR_ARR[(i + 1) % RAND_ARR_SIZE]);
+	}
+	return NULL;
+}
+
+static void bench_sharded(size_t n_shards, size_t n_threads, const char* label) {
+	const size_t n_keys = 400000;
+	struct dbsharded sd;
+	struct bench_shard_writer writers[64];
+	pthread_t threads[64];
+	char path[64];
+	n_threads = n_threads > 64 ? 64 : n_threads;
+	uint64_t start = micro_stamp();
+	dbsharded_open(&sd, "bench_shards", n_shards, NULL, 0);
+	for (size_t i = 0; i < n_threads; ++i) {
+		writers[i].sd = &sd;
+		writers[i].first = i * n_keys / n_threads;
+		writers[i].last = (i + 1) * n_keys / n_threads;
+		pthread_create(&threads[i], NULL, bench_shard_write, &writers[i]);
+	}
+	for (size_t i = 0; i < n_threads; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	dbsharded_close(&sd, 0);
+	uint64_t end = micro_stamp();
+	printf("[%s] %zu keys from %zu threads into %zu shards in %lluus\n", label, n_keys, n_threads, n_shards,
+		   (unsigned long long)(end - start));
+	for (size_t i = 0; i < n_shards; ++i) {
+		sprintf(path, "bench_shards/shard-%04zu", i);
+		remove(path);
+	}
+	remove("bench_shards/MANIFEST");
+	rmdir("bench_shards");
+}
+
+int main(int argc, char const *argv[])
+{
+	const char* mode = argc > 1 ? argv[1] : "mmap";
+	srand(time(NULL));
+	fill_rand_arr();
+	if (strcmp(mode, "mmap") == 0 || strcmp(mode, "all") == 0) {
+		bench_put("bench", NULL, "mmap");
+	}
+	if (strcmp(mode, "inmem") == 0 || strcmp(mode, "all") == 0) {
+		struct dbcfg cfg = {0, DBSTORE_IN_MEM};
+		bench_put(NULL, &cfg, "inmem");
+	}
+	if (strcmp(mode, "grow") == 0 || strcmp(mode, "all") == 0) {
+		bench_grow(get_page_size(), "page");
+		bench_grow(1024 * 1024, "1MB");
+		bench_grow(64 * 1024 * 1024, "64MB");
+	}
+	if (strcmp(mode, "expand") == 0 || strcmp(mode, "all") == 0) {
+		bench_expand();
+	}
+	if (strcmp(mode, "presize") == 0 || strcmp(mode, "all") == 0) {
+		bench_grow(0, "default");
+		bench_presize();
+	}
+	if (strcmp(mode, "inline") == 0 || strcmp(mode, "all") == 0) {
+		bench_inline(0, "off");
+		bench_inline(24, "24");
+	}
+	if (strcmp(mode, "ordered") == 0 || strcmp(mode, "all") == 0) {
+		bench_ordered(0, "off");
+		bench_ordered(1, "on");
+	}
+	if (strcmp(mode, "codec") == 0 || strcmp(mode, "all") == 0) {
+		bench_codec(DBCODEC_NONE, 0, "none");
+		bench_codec(DBCODEC_LZ, 0, "lz");
+		bench_codec(DBCODEC_LZ, 1, "lz+dict");
+#if defined(KAMOODB_WITH_ZLIB)
+		bench_codec(DBCODEC_DEFLATE, 0, "deflate");
+		bench_codec(DBCODEC_DEFLATE, 1, "deflate+dict");
+#endif
+	}
+	if (strcmp(mode, "checksum") == 0 || strcmp(mode, "all") == 0) {
+		bench_checksum();
+	}
+	if (strcmp(mode, "stats") == 0 || strcmp(mode, "all") == 0) {
+		bench_stats();
+	}
+	if (strcmp(mode, "snapshot") == 0 || strcmp(mode, "all") == 0) {
+		bench_snapshot(0, "off");
+		bench_snapshot(20000, "every 20000");
+	}
+	if (strcmp(mode, "backup") == 0 || strcmp(mode, "all") == 0) {
+		bench_backup();
+	}
+	if (strcmp(mode, "build") == 0 || strcmp(mode, "all") == 0) {
+		bench_build();
+	}
+	if (strcmp(mode, "sharded") == 0 || strcmp(mode, "all") == 0) {
+		size_t n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		bench_sharded(1, n_cpus, "sharded one");
+		bench_sharded(n_cpus * 4, n_cpus, "sharded many");
+	}
+	if (strcmp(mode, "open") == 0 || strcmp(mode, "all") == 0) {
+		bench_open(10, 0);
+		bench_open(100, 0);
+		bench_open(1024, 0);
+		bench_open(1024, 64 << 20);
+	}
+	if (strcmp(mode, "shared") == 0 || strcmp(mode, "all") == 0) {
+		bench_shared();
+	}
+	if (strcmp(mode, "txn") == 0 || strcmp(mode, "all") == 0) {
+		bench_txn(0, 0, 200000, "txn raw puts");
+		bench_txn(4, 0, 200000, "txn 4 puts");
+		bench_txn(4, 1, 20000, "txn 4 puts synced");
+	}
+	if (strcmp(mode, "update") == 0 || strcmp(mode, "all") == 0) {
+		bench_update(0, 10, "update in place");
+		bench_update(1, 1, "update with snapshot");
+	}
+	if (strcmp(mode, "expiry") == 0 || strcmp(mode, "all") == 0) {
+		bench_expiry();
+	}
+	if (strcmp(mode, "cache") == 0 || strcmp(mode, "all") == 0) {
+		size_t* trace = make_zipf_trace(RAND_ARR_SIZE, 0.99, 1000000);
+		bench_cache(trace, 1000000, 0, "cache unbounded");
+		bench_cache(trace, 1000000, 32 << 20, "cache 32MB");
+		bench_cache(trace, 1000000, 16 << 20, "cache 16MB");
+		free(trace);
+	}
+	if (strcmp(mode, "bloom") == 0 || strcmp(mode, "all") == 0) {
+		bench_bloom(0, "bloom off");
+		bench_bloom(10, "bloom 10 bits");
+	}
+	if (strcmp(mode, "batch") == 0 || strcmp(mode, "all") == 0) {
+		bench_batch(64);
+	}
+	if (strcmp(mode, "aio") == 0) {
+		bench_aio(argc > 2 ? argv[2] : "bench_aio", argc > 3 ? strtoull(argv[3], NULL, 10) : 0);
+	}
 	return 0;
-}
\ No newline at end of file
+}
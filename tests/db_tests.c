@@ -1,3 +1,30 @@
+#include <stdlib.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+// counts the heap allocations made by the library
+static size_t _allocs = 0;
+
+static void* count_malloc(size_t size) {
+	__atomic_add_fetch(&_allocs, 1, __ATOMIC_RELAXED);
+	return malloc(size);
+}
+
+static void* count_calloc(size_t n, size_t size) {
+	__atomic_add_fetch(&_allocs, 1, __ATOMIC_RELAXED);
+	return calloc(n, size);
+}
+
+static void* count_realloc(void* ptr, size_t size) {
+	__atomic_add_fetch(&_allocs, 1, __ATOMIC_RELAXED);
+	return realloc(ptr, size);
+}
+
+#define KAMOODB_MALLOC(size) count_malloc(size)
+#define KAMOODB_CALLOC(n, size) count_calloc(n, size)
+#define KAMOODB_REALLOC(ptr, size) count_realloc(ptr, size)
+
 #include "kamoodb.h"
 
 //------- tests ---------
@@ -112,6 +139,59 @@ static void test_dbfile_grow(void) {
 	dbfile_path_free(&foo);
 }
 
+static void test_dbfile_grow_chunk(void) {
+	struct dbfile foo;
+	struct dbcfg cfg = {0, DBSTORE_MEM_MAP, 0, 0};
+	cfg.grow_chunk = get_page_size() * 16;
+	dbfile_open(&foo, "boof", &cfg);
+	CHECKIT(foo.page_count == 1);
+	CHECKIT(dbfile_grow(&foo, 1) == 1);
+	CHECKIT(foo.alloc_size == foo.page_size * 17);
+	CHECKIT(dbfile_unused_pages(&foo) == 15);
+	CHECKIT(dbfile_grow(&foo, 15) == 2);
+	CHECKIT(dbfile_unused_pages(&foo) == 0);
+	CHECKIT(dbfile_grow(&foo, 1) == 17);
+	CHECKIT(dbfile_unused_pages(&foo) == 15);
+	CHECKIT(file_size("boof") == (ssize_t)foo.alloc_size);
+	CHECKIT(dbfile_trim(&foo));
+	CHECKIT(file_size("boof") == (ssize_t)(foo.page_size * 18));
+	dbfile_close(&foo);
+	dbfile_remove(&foo);
+	dbfile_path_free(&foo);
+}
+
+static void test_dbfile_map_budget(void) {
+	struct dbfile foo;
+	struct dbcfg cfg = {0, DBSTORE_MEM_MAP, 0, 0};
+	cfg.map_budget = 1;
+	// a sparse file of 10 regions, only the pages written take space
+	remove("boof");
+	int fd = open("boof", O_RDWR | O_CREAT, (mode_t)0600);
+	CHECKIT(fd != -1 && ftruncate(fd, DBFILE_REGION_SIZE * 10) == 0);
+	close(fd);
+	CHECKIT(dbfile_open(&foo, "boof", &cfg));
+	CHECKIT(foo.resident == 0 && foo.regions == NULL);
+	size_t per_region = (size_t)1 << foo.region_shift;
+	CHECKIT(foo.page_count == per_region * 10);
+	for (size_t r = 0; r < 10; ++r) {
+		char* page = dbfile_get_page(&foo, r * per_region + 3);
+		sprintf(page, "region %zu", r);
+	}
+	CHECKIT(foo.resident == DBFILE_MIN_RESIDENT);
+	CHECKIT(foo.stats.region_drops == 10 - DBFILE_MIN_RESIDENT);
+	// dropped regions fault back in with what was written to them
+	for (size_t r = 0; r < 10; ++r) {
+		char expect[32];
+		sprintf(expect, "region %zu", r);
+		CHECKIT(strcmp(dbfile_get_page(&foo, r * per_region + 3), expect) == 0);
+	}
+	CHECKIT(foo.resident == DBFILE_MIN_RESIDENT);
+	CHECKIT(foo.stats.page_faults == 10);
+	dbfile_close(&foo);
+	dbfile_remove(&foo);
+	dbfile_path_free(&foo);
+}
+
 static void test_database_open_close(void) {
 	struct database db;
 	CHECKIT(database_open(&db, "boof", NULL));
@@ -333,6 +413,25 @@ static void test_database_put_get_reopen(void) {
 	database_close_and_remove(&db);
 }
 
+static void test_database_page_count_reopen(void) {
+	struct database db;
+	char* res = NULL;
+	CHECKIT(database_open(&db, "boof", NULL));
+	CHECKIT(database_put(&db, "abcdef", "abcdefg"));
+	size_t used_pages = db.dbf.page_count;
+	CHECKIT(dbfile_unused_pages(&db.dbf) > 0);
+	database_close(&db);
+	// the preallocated tail is not mistaken for used pages
+	CHECKIT(file_size("boof") > (ssize_t)(used_pages * get_page_size()));
+	CHECKIT(database_open(&db, "boof", NULL));
+	// plus the checksum and generation tables written by the close
+	CHECKIT(db.dbf.page_count == used_pages + 2);
+	res = database_get(&db, "abcdef");
+	CHECKIT(res != NULL && strcmp(res, "abcdefg") == 0);
+	free(res);
+	database_close_and_remove(&db);
+}
+
 static void test_database_load_factor(void) {
 	struct database db;
 	const char* key1 = "abcdef";
@@ -394,6 +493,434 @@ static void test_database_expand(void) {
 	database_close_and_remove(&db);
 }
 
+static void test_database_expand_contiguous(void) {
+	struct database db;
+	CHECKIT(database_open(&db, "boof", NULL));
+	CHECKIT(database_put(&db, "abcdef", "abcdefg"));
+	CHECKIT(database_expand(&db, 1));
+	CHECKIT(database_expand(&db, 2));
+	CHECKIT(db.hash_pages.len == 4);
+	CHECKIT(database_get_hash_count(&db) == 4);
+	for (size_t i = 1; i < db.hash_pages.len; ++i) {
+		CHECKIT(db.hash_pages.pages[i] == db.hash_pages.pages[0] + (int32_t)i);
+	}
+	// the two block index is released as one two page extent
+	char* space_page = dbfile_get_page(&db.dbf, database_get_spaceroot(&db));
+	int32_t len = database_len_get(space_page);
+	int32_t* last = (int32_t*)(space_page + LEN_BLOCK_HEADER_SIZE + ((len - 1) * STORAGE_PTR_SIZE));
+	CHECKIT(last[1] == 0);
+	CHECKIT(last[2] == (int32_t)(2 * db.dbf.page_size));
+	char* res = database_get(&db, "abcdef");
+	CHECKIT(res != NULL && strcmp(res, "abcdefg") == 0);
+	free(res);
+	database_close_and_remove(&db);
+}
+
+static void test_database_presized(void) {
+	struct database db;
+	struct dbcfg cfg = {0, DBSTORE_MEM_MAP, 0, 0, 5000, 24};
+	char keybuf[32];
+	CHECKIT(database_open(&db, "boof", &cfg));
+	size_t blocks = db.hash_pages.len;
+	size_t pages = db.dbf.page_count;
+	CHECKIT(blocks == database_blocks_for_items(db.slots_per_block, 0.5, 5000));
+	CHECKIT(blocks > 1);
+	for (int i = 0; i < 5000; ++i) {
+		snprintf(keybuf, sizeof(keybuf), "key%d", i);
+		CHECKIT(database_put(&db, keybuf, keybuf));
+	}
+	// neither the index nor the file had to grow
+	CHECKIT(db.hash_pages.len == blocks);
+	CHECKIT(db.dbf.page_count == pages);
+	database_close_and_remove(&db);
+}
+
+static void test_database_reserve(void) {
+	struct database db;
+	char keybuf[32];
+	char* res = NULL;
+	CHECKIT(database_open(&db, "boof", NULL));
+	CHECKIT(database_put(&db, "key0", "key0"));
+	CHECKIT(database_reserve(&db, 3000));
+	size_t blocks = db.hash_pages.len;
+	CHECKIT(blocks > 1);
+	for (int i = 0; i < 3000; ++i) {
+		snprintf(keybuf, sizeof(keybuf), "key%d", i);
+		CHECKIT(database_put(&db, keybuf, keybuf));
+	}
+	CHECKIT(db.hash_pages.len == blocks);
+	res = database_get(&db, "key0");
+	CHECKIT(res != NULL && strcmp(res, "key0") == 0);
+	free(res);
+	database_close_and_remove(&db);
+}
+
+static void test_database_inline(void) {
+	struct database db;
+	struct dbcfg cfg = {0, DBSTORE_MEM_MAP, 0, 0, 0, 0, 24};
+	char keybuf[32];
+	char* res = NULL;
+	CHECKIT(database_open(&db, "boof", &cfg));
+	CHECKIT(db.slot_size == 36);
+	CHECKIT(db.inline_cap == 24);
+	CHECKIT(db.slots_per_block == (db.dbf.page_size - sizeof(int32_t)) / 36);
+	CHECKIT(database_put(&db, "foo", "bar"));
+	int32_t* slot = database_find_slot(&db, "foo", 4, 0);
+	CHECKIT(slot != NULL && _is_inline_slot(slot));
+	res = database_get(&db, "foo");
+	CHECKIT(res != NULL && strcmp(res, "bar") == 0);
+	free(res);
+	// too large for the slot, moves out to storage and back again
+	CHECKIT(database_put(&db, "foo", "a value that does not fit inline"));
+	CHECKIT(!_is_inline_slot(database_find_slot(&db, "foo", 4, 0)));
+	res = database_get(&db, "foo");
+	CHECKIT(res != NULL && strcmp(res, "a value that does not fit inline") == 0);
+	free(res);
+	CHECKIT(database_put(&db, "foo", "baz"));
+	CHECKIT(_is_inline_slot(database_find_slot(&db, "foo", 4, 0)));
+	CHECKIT(database_del(&db, "foo"));
+	CHECKIT(database_get(&db, "foo") == NULL);
+	CHECKIT(!database_del(&db, "foo"));
+	// enough items to expand the index a few times
+	for (int i = 0; i < 2000; ++i) {
+		snprintf(keybuf, sizeof(keybuf), "k%d", i);
+		CHECKIT(database_put(&db, keybuf, keybuf));
+	}
+	CHECKIT(db.hash_pages.len > 1);
+	database_close(&db);
+	cfg.inline_size = 0;
+	CHECKIT(database_open(&db, "boof", &cfg));
+	CHECKIT(db.inline_cap == 24);
+	for (int i = 0; i < 2000; ++i) {
+		snprintf(keybuf, sizeof(keybuf), "k%d", i);
+		res = database_get(&db, keybuf);
+		CHECKIT(res != NULL && strcmp(res, keybuf) == 0);
+		free(res);
+	}
+	database_close_and_remove(&db);
+	cfg.inline_size = 1024;
+	CHECKIT(!dbcfg_validate(&cfg));
+}
+
+struct scan_tally {
+	size_t count;
+	char last[32];
+	int ordered;
+};
+
+static int scan_tally_cb(void* udata, const char* key, const char* val) {
+	struct scan_tally* tally = udata;
+	if (tally->count > 0 && strcmp(tally->last, key) >= 0) {
+		tally->ordered = 0;
+	}
+	if (strcmp(key, val) != 0) {
+		tally->ordered = 0;
+	}
+	snprintf(tally->last, sizeof(tally->last), "%s", key);
+	++tally->count;
+	return 1;
+}
+
+static void test_database_ordered(void) {
+	struct database db;
+	// small pages so the tree splits its inner nodes as well
+	struct dbcfg cfg = {512, DBSTORE_IN_MEM, 0, 0, 0, 0, 0, 1};
+	struct scan_tally tally = {0, "", 1};
+	char keybuf[32];
+	CHECKIT(database_open(&db, NULL, &cfg));
+	CHECKIT(database_has_ordered_index(&db));
+	for (int i = 2999; i >= 0; --i) {
+		snprintf(keybuf, sizeof(keybuf), "t%d:%04d", i % 3, i);
+		CHECKIT(database_put(&db, keybuf, keybuf));
+	}
+	char* root = dbfile_get_page(&db.dbf, database_get_tree_root(&db));
+	CHECKIT(((int32_t*)root)[0] == 0);
+	CHECKIT(database_range(&db, NULL, NULL, scan_tally_cb, &tally) == 3000);
+	CHECKIT(tally.count == 3000 && tally.ordered);
+	memset(&tally, 0, sizeof(tally));
+	tally.ordered = 1;
+	CHECKIT(database_prefix(&db, "t1:", scan_tally_cb, &tally) == 1000);
+	CHECKIT(tally.ordered && strcmp(tally.last, "t1:2998") == 0);
+	memset(&tally, 0, sizeof(tally));
+	tally.ordered = 1;
+	CHECKIT(database_range(&db, "t2:0100", "t2:0200", scan_tally_cb, &tally) == 33);
+	CHECKIT(tally.ordered);
+	// deletes and overwrites keep the tree in step with the hash index
+	for (int i = 0; i < 3000; i += 3) {
+		snprintf(keybuf, sizeof(keybuf), "t0:%04d", i);
+		CHECKIT(database_del(&db, keybuf));
+	}
+	CHECKIT(database_put(&db, "t1:0001", "t1:0001"));
+	memset(&tally, 0, sizeof(tally));
+	tally.ordered = 1;
+	CHECKIT(database_range(&db, NULL, NULL, scan_tally_cb, &tally) == 2000);
+	CHECKIT(tally.ordered);
+	database_close(&db);
+}
+
+static void test_database_add_ordered_index(void) {
+	struct database db;
+	struct scan_tally tally = {0, "", 1};
+	char keybuf[32];
+	CHECKIT(database_open(&db, "boof", NULL));
+	CHECKIT(!database_has_ordered_index(&db));
+	CHECKIT(database_range(&db, NULL, NULL, scan_tally_cb, &tally) == 0);
+	for (int i = 0; i < 500; ++i) {
+		snprintf(keybuf, sizeof(keybuf), "k%d", i);
+		CHECKIT(database_put(&db, keybuf, keybuf));
+	}
+	CHECKIT(database_add_ordered_index(&db));
+	database_close(&db);
+	CHECKIT(database_open(&db, "boof", NULL));
+	CHECKIT(database_prefix(&db, "k4", scan_tally_cb, &tally) == 111);
+	CHECKIT(tally.ordered);
+	database_close_and_remove(&db);
+}
+
+static void test_dbcodec_lz(void) {
+	struct dbcodec codec;
+	char val[600];
+	char enc[700];
+	dbcodec_init(&codec, DBCODEC_LZ);
+	for (size_t i = 0; i < sizeof(val) - 1; ++i) {
+		val[i] = "{\"name\": \"kamoo\", "[i % 19];
+	}
+	val[sizeof(val) - 1] = '\0';
+	size_t enc_size = dbcodec_encode(&codec, val, sizeof(val), enc);
+	CHECKIT(enc[0] == DBCODEC_LZ);
+	CHECKIT(enc_size < sizeof(val) / 4);
+	char* res = dbcodec_decode(&codec, enc, enc_size);
+	CHECKIT(res != NULL && memcmp(res, val, sizeof(val)) == 0);
+	free(res);
+	// corrupt input is rejected rather than overrunning the output
+	enc[7] = (char)0xff;
+	res = dbcodec_decode(&codec, enc, enc_size);
+	CHECKIT(res == NULL || memcmp(res, val, sizeof(val)) != 0);
+	free(res);
+	// short values stay raw
+	CHECKIT(dbcodec_encode(&codec, "tiny", 5, enc) == 5 + DBCODEC_HEADER_SIZE);
+	CHECKIT(enc[0] == DBCODEC_NONE);
+	dbcodec_deinit(&codec);
+}
+
+static void run_codec_db(enum dbcodec_type type) {
+	struct database db;
+	struct dbcfg cfg = {0, DBSTORE_MEM_MAP, 0, 0, 0, 0, 0, 0, type};
+	char keybuf[32];
+	char valbuf[128];
+	const char* samples[64];
+	char sample_buf[64][128];
+	for (int i = 0; i < 64; ++i) {
+		snprintf(sample_buf[i], sizeof(sample_buf[i]), "{\"user\": %d, \"status\": \"active\", \"plan\": \"basic\"}", i * 7);
+		samples[i] = sample_buf[i];
+	}
+	CHECKIT(database_open(&db, "boof", &cfg));
+	CHECKIT(database_train_dict(&db, samples, 64, 1024));
+	CHECKIT(db.codec.dict_size > 0);
+	for (int i = 0; i < 500; ++i) {
+		snprintf(keybuf, sizeof(keybuf), "k%d", i);
+		snprintf(valbuf, sizeof(valbuf), "{\"user\": %d, \"status\": \"active\", \"plan\": \"basic\"}", i);
+		CHECKIT(database_put(&db, keybuf, valbuf));
+	}
+	// a dictionary can not be swapped under existing values
+	CHECKIT(!database_train_dict(&db, samples, 64, 1024));
+	int32_t* slot = database_find_slot(&db, "k10", 4, 0);
+	CHECKIT(slot != NULL && (size_t)slot[2] < 4 + strlen("{\"user\": 10, \"status\": \"active\", \"plan\": \"basic\"}"));
+	database_close(&db);
+	CHECKIT(database_open(&db, "boof", NULL));
+	CHECKIT(db.codec.type == type && db.codec.dict_size > 0);
+	for (int i = 0; i < 500; ++i) {
+		snprintf(keybuf, sizeof(keybuf), "k%d", i);
+		snprintf(valbuf, sizeof(valbuf), "{\"user\": %d, \"status\": \"active\", \"plan\": \"basic\"}", i);
+		char* res = database_get(&db, keybuf);
+		CHECKIT(res != NULL && strcmp(res, valbuf) == 0);
+		free(res);
+	}
+	database_close_and_remove(&db);
+}
+
+static void test_database_codec(void) {
+	run_codec_db(DBCODEC_LZ);
+#if defined(KAMOODB_WITH_ZLIB)
+	run_codec_db(DBCODEC_DEFLATE);
+#else
+	struct dbcfg cfg = {0, DBSTORE_MEM_MAP, 0, 0, 0, 0, 0, 0, DBCODEC_DEFLATE};
+	CHECKIT(!dbcfg_validate(&cfg));
+#endif
+}
+
+static void test_crc32c(void) {
+	const char* check = "123456789";
+	CHECKIT(crc32c_sw(0, check, 9) == 0xE3069283U);
+	CHECKIT(crc32c(0, check, 9) == 0xE3069283U);
+	// split updates chain like one call
+	CHECKIT(crc32c(crc32c(0, check, 4), check + 4, 5) == 0xE3069283U);
+}
+
+static void corrupt_byte(const char* path, size_t offset) {
+	char byte = 0;
+	int fd = open(path, O_RDWR);
+	pread(fd, &byte, 1, offset);
+	byte ^= 0x5a;
+	pwrite(fd, &byte, 1, offset);
+	close(fd);
+}
+
+static void test_database_checksums(void) {
+	struct database db;
+	char keybuf[32];
+	char* res = NULL;
+	CHECKIT(database_open(&db, "boof", NULL));
+	for (int i = 0; i < 300; ++i) {
+		snprintf(keybuf, sizeof(keybuf), "k%d", i);
+		CHECKIT(database_put(&db, keybuf, keybuf));
+	}
+	size_t page_size = db.dbf.page_size;
+	// the block k7 hashes to
+	size_t hash_slot = hash_djb2("k7") % database_get_hash_len(&db);
+	int32_t hash_block = database_get_hash_block(&db, hash_slot / db.slots_per_block);
+	database_close(&db);
+	CHECKIT(database_open(&db, "boof", NULL));
+	res = database_get(&db, "k7");
+	CHECKIT(res != NULL && strcmp(res, "k7") == 0);
+	free(res);
+	CHECKIT(db.corrupt == 0);
+	database_close(&db);
+	// a flipped bit in a hash block is caught when the block is probed
+	corrupt_byte("boof", (hash_block * page_size) + 100);
+	CHECKIT(database_open(&db, "boof", NULL));
+	CHECKIT(database_get(&db, "k7") == NULL);
+	CHECKIT(!database_put(&db, "k7", "new"));
+	CHECKIT(db.corrupt == 1);
+	database_close(&db);
+	// a damaged header fails the open
+	corrupt_byte("boof", 20);
+	CHECKIT(!database_open(&db, "boof", NULL));
+	remove("boof");
+}
+
+static void test_database_bad_storage_ptr(void) {
+	struct database db;
+	CHECKIT(database_open(&db, "boof", NULL));
+	CHECKIT(database_put(&db, "foo", "bar"));
+	int32_t* slot = database_find_slot(&db, "foo", 4, 0);
+	CHECKIT(slot != NULL);
+	// points far past the end of the file
+	slot[0] = 1 << 20;
+	CHECKIT(database_get(&db, "foo") == NULL);
+	CHECKIT(db.corrupt > 0);
+	CHECKIT(db.dbf.page_count < (1 << 20));
+	// a negative page that is none of the slot markers
+	size_t corrupt = db.corrupt;
+	slot[0] = -7;
+	slot[1] = 0;
+	slot[2] = 8;
+	CHECKIT(database_get(&db, "foo") == NULL);
+	CHECKIT(db.corrupt > corrupt);
+	slot[0] = 0;
+	database_close_and_remove(&db);
+}
+
+static void test_dbhist(void) {
+	struct dbhist hist;
+	memset(&hist, 0, sizeof(hist));
+	for (size_t i = 0; i < DBHIST_BUCKETS; ++i) {
+		CHECKIT(dbhist_index(dbhist_bucket_low(i)) == i);
+	}
+	for (uint64_t val = 1; val <= 100000; ++val) {
+		dbhist_record(&hist, val);
+	}
+	CHECKIT(hist.count == 100000 && hist.max == 100000);
+	uint64_t p50 = dbhist_percentile(&hist, 0.5);
+	uint64_t p99 = dbhist_percentile(&hist, 0.99);
+	// within the 1/32 bucket error
+	CHECKIT(p50 >= 50000 && p50 <= 50000 + (50000 / 32));
+	CHECKIT(p99 >= 99000 && p99 <= 99000 + (99000 / 32));
+	CHECKIT(dbhist_percentile(&hist, 1.0) == 100000);
+	CHECKIT(dbhist_index((uint64_t)1 << 50) == DBHIST_BUCKETS - 1);
+}
+
+static void test_database_stats(void) {
+	struct database db;
+	struct dbstats stats;
+	char keybuf[32];
+	CHECKIT(database_open(&db, "boof", NULL));
+	for (int i = 0; i < 2000; ++i) {
+		snprintf(keybuf, sizeof(keybuf), "k%d", i);
+		CHECKIT(database_put(&db, keybuf, keybuf));
+	}
+	for (int i = 0; i < 2000; ++i) {
+		snprintf(keybuf, sizeof(keybuf), "k%d", i);
+		free(database_get(&db, keybuf));
+	}
+	CHECKIT(database_del(&db, "k1"));
+	CHECKIT(!database_del(&db, "k1"));
+	database_stats(&db, &stats);
+	CHECKIT(stats.put.count == 2000);
+	CHECKIT(stats.get.count == 2000);
+	CHECKIT(stats.del.count == 2);
+	CHECKIT(stats.expands > 0 && stats.expand.count == stats.expands);
+	CHECKIT(stats.probes >= 4000);
+	CHECKIT(stats.key_compares >= 2000);
+	CHECKIT(stats.free_list_scans >= 2000);
+	CHECKIT(stats.file.page_faults > 0 && stats.file.grows > 0);
+	CHECKIT(dbhist_percentile(&stats.get, 0.5) <= dbhist_percentile(&stats.get, 0.99));
+	database_stats_reset(&db);
+	database_stats(&db, &stats);
+	CHECKIT(stats.put.count == 0 && stats.probes == 0 && stats.file.grows == 0);
+	database_close_and_remove(&db);
+}
+
+static void test_database_analyze(void) {
+	struct database db;
+	struct dbanalysis res;
+	struct dbview view;
+	char keybuf[32];
+	CHECKIT(database_open(&db, "boof", NULL));
+	for (int i = 0; i < 3000; ++i) {
+		snprintf(keybuf, sizeof(keybuf), "k%d", i);
+		CHECKIT(database_put(&db, keybuf, keybuf));
+	}
+	for (int i = 0; i < 3000; i += 10) {
+		snprintf(keybuf, sizeof(keybuf), "k%d", i);
+		CHECKIT(database_del(&db, keybuf));
+	}
+	CHECKIT(database_analyze(&db, &res, 3));
+	CHECKIT(res.blocks == db.hash_pages.len);
+	CHECKIT(res.slots == db.hash_pages.len * db.slots_per_block);
+	CHECKIT(res.used == 2700);
+	CHECKIT(res.tombstones == 300);
+	CHECKIT(res.bad_slots == 0);
+	uint64_t probed = 0;
+	size_t filled = 0;
+	for (size_t i = 0; i < DBANALYZE_PROBE_BUCKETS; ++i) {
+		probed += res.probe_hist[i];
+	}
+	for (size_t i = 0; i < DBANALYZE_FILL_BUCKETS; ++i) {
+		filled += res.fill_hist[i];
+	}
+	CHECKIT(probed == 2700 && filled == res.blocks);
+	CHECKIT(res.probe_hist[0] > 0 && res.probe_sum >= 2700);
+	CHECKIT(res.block_min_used <= res.block_max_used);
+	CHECKIT(res.free_extents > 0 && res.free_bytes > 0);
+	CHECKIT(res.item_count == 2700);
+	database_close(&db);
+	// the same figures from a read only mapping of the closed file
+	struct dbanalysis offline;
+	CHECKIT(dbview_open(&view, "boof"));
+	CHECKIT(dbview_analyze(&view, &offline, 0));
+	CHECKIT(offline.used == res.used && offline.probe_sum == res.probe_sum);
+	dbview_close(&view);
+	// a slot size that leaves no slots to a block is refused
+	int32_t slot_size = 1 << 20;
+	int fd = open("boof", O_RDWR);
+	CHECKIT(pwrite(fd, &slot_size, sizeof(slot_size), DB_HEADER_SLOT_SIZE_OFF) == sizeof(slot_size));
+	close(fd);
+	CHECKIT(!dbview_open(&view, "boof"));
+	remove("boof");
+	CHECKIT(!dbview_open(&view, "boof"));
+}
+
 static void test_database_put_load_fact_expand(void) {
 	struct database db;
 	const char* key1 = "abcdef";
@@ -417,6 +944,1061 @@ static void test_database_put_load_fact_expand(void) {
 	database_close_and_remove(&db);
 }
 
+static void test_database_load_policy(void) {
+	struct database db;
+	struct dbcfg cfg = {0, DBSTORE_MEM_MAP, 0, 0, 0, 0, 0, 0, DBCODEC_NONE, 0.75, 1.5, 0.2};
+	char keybuf[32];
+	double fact = 0.0;
+	CHECKIT(database_open(&db, "boof", &cfg));
+	CHECKIT(database_get_factor_lim(&db, &fact) && fact == 0.75);
+	CHECKIT(database_get_growth(&db) == 1.5);
+	// shrinking to 0.5 / 2.0 would put the index right back under 0.3
+	CHECKIT(!database_set_load_policy(&db, 0.5, 2.0, 0.3));
+	CHECKIT(!database_set_load_policy(&db, 1.5, 2.0, 0.0));
+	size_t blocks = db.hash_pages.len;
+	for (size_t i = 0; i < 5000; ++i) {
+		sprintf(keybuf, "key%zu", i);
+		CHECKIT(database_put(&db, keybuf, "val"));
+		if (db.hash_pages.len != blocks) {
+			// grows by half, except when a single block has to become two
+			CHECKIT(db.hash_pages.len == (blocks * 3) / 2 || (blocks == 1 && db.hash_pages.len == 2));
+			blocks = db.hash_pages.len;
+		}
+	}
+	CHECKIT(database_get_load_factor(&db) <= 0.75);
+	CHECKIT(database_get_load_factor(&db) > 0.75 / 1.5);
+	database_close(&db);
+	CHECKIT(database_open(&db, "boof", NULL));
+	CHECKIT(database_get_factor_lim(&db, &fact) && fact == 0.75);
+	CHECKIT(database_get_min_load(&db) == 0.2);
+	for (size_t i = 0; i < 4900; ++i) {
+		sprintf(keybuf, "key%zu", i);
+		CHECKIT(database_del(&db, keybuf));
+	}
+	CHECKIT(db.hash_pages.len < blocks);
+	CHECKIT(database_get_load_factor(&db) >= 0.2 || db.hash_pages.len == 1);
+	for (size_t i = 4900; i < 5000; ++i) {
+		sprintf(keybuf, "key%zu", i);
+		char* val = database_get(&db, keybuf);
+		CHECKIT(val != NULL && strcmp(val, "val") == 0);
+		free(val);
+	}
+	// the whole number limit replaces the fraction
+	database_set_factor_lim(&db, 4);
+	CHECKIT(database_get_factor_lim(&db, &fact) && fact == 0.25);
+	database_close_and_remove(&db);
+
+	// with a limit of 1 a full index grows on the put that finds no slot
+	CHECKIT(database_open(&db, "boof", NULL));
+	CHECKIT(!database_set_load_policy(&db, 1.0, 2.0, 0.0));
+	database_set_factor_lim(&db, 1);
+	size_t slots = database_get_hash_len(&db);
+	for (size_t i = 0; i < slots * 3; ++i) {
+		sprintf(keybuf, "key%zu", i);
+		CHECKIT(database_put(&db, keybuf, "val"));
+	}
+	CHECKIT(database_get_hash_len(&db) >= slots * 3);
+	for (size_t i = 0; i < slots * 3; ++i) {
+		sprintf(keybuf, "key%zu", i);
+		char* val = database_get(&db, keybuf);
+		CHECKIT(val != NULL && strcmp(val, "val") == 0);
+		free(val);
+	}
+	database_close_and_remove(&db);
+}
+
+static void test_database_in_mem(void) {
+	struct database db;
+	struct dbcfg cfg = {0, DBSTORE_IN_MEM};
+	char keybuf[32];
+	char* res = NULL;
+	CHECKIT(database_open(&db, NULL, &cfg));
+	CHECKIT(db.dbf.fd == -1);
+	for (int i = 0; i < 2000; ++i) {
+		snprintf(keybuf, sizeof(keybuf), "key%d", i);
+		CHECKIT(database_put(&db, keybuf, keybuf));
+	}
+	CHECKIT(database_get_hash_block_count(&db) > 1);
+	for (int i = 0; i < 2000; ++i) {
+		snprintf(keybuf, sizeof(keybuf), "key%d", i);
+		res = database_get(&db, keybuf);
+		CHECKIT(res != NULL && strcmp(res, keybuf) == 0);
+		free(res);
+	}
+	CHECKIT(database_del(&db, "key7"));
+	CHECKIT(database_get(&db, "key7") == NULL);
+	database_close_and_remove(&db);
+}
+
+static void test_database_in_mem_save_load(void) {
+	struct database db;
+	struct dbcfg cfg = {0, DBSTORE_IN_MEM};
+	const char* key1 = "abcdef";
+	const char* val1 = "abcdefg";
+	char* key1res = NULL;
+	CHECKIT(database_open(&db, NULL, &cfg));
+	CHECKIT(database_put(&db, key1, val1));
+	CHECKIT(database_save(&db, "boof"));
+	database_close_and_remove(&db);
+	// the snapshot can be loaded back into memory
+	CHECKIT(database_open(&db, "boof", &cfg));
+	key1res = database_get(&db, key1);
+	CHECKIT(key1res != NULL && strcmp(key1res, val1) == 0);
+	free(key1res);
+	CHECKIT(database_put(&db, "abc5ef", val1));
+	database_close_and_remove(&db);
+	CHECKIT(file_exists("boof"));
+	// or opened as a regular file
+	CHECKIT(database_open(&db, "boof", NULL));
+	key1res = database_get(&db, key1);
+	CHECKIT(key1res != NULL && strcmp(key1res, val1) == 0);
+	free(key1res);
+	CHECKIT(database_get(&db, "abc5ef") == NULL);
+	database_close_and_remove(&db);
+}
+
+struct aio_tally {
+	int hits;
+	int misses;
+	int bad;
+};
+
+static void aio_tally_cb(void* udata, int status, char* val) {
+	struct aio_tally* tally = udata;
+	if (status == 1) {
+		++tally->hits;
+		if (val != NULL && strncmp(val, "key", 3) != 0) {
+			++tally->bad;
+		}
+	} else if (status == 0) {
+		++tally->misses;
+	} else {
+		++tally->bad;
+	}
+	free(val);
+}
+
+static void run_aio_round(struct database* db) {
+	struct database_aio aio;
+	struct aio_tally tally = {0, 0, 0};
+	char keybuf[32];
+	char* res = NULL;
+	CHECKIT(database_aio_init(&aio, db, 16));
+	for (int i = 0; i < 500; ++i) {
+		snprintf(keybuf, sizeof(keybuf), "key%d", i);
+		while (!database_aio_put(&aio, keybuf, keybuf, aio_tally_cb, &tally)) {
+			database_aio_poll(&aio, 1);
+		}
+	}
+	database_aio_poll(&aio, database_aio_inflight(&aio));
+	CHECKIT(tally.hits == 500);
+	res = database_get(db, "key42");
+	CHECKIT(res != NULL && strcmp(res, "key42") == 0);
+	free(res);
+	tally.hits = 0;
+	for (int i = 0; i < 600; ++i) {
+		snprintf(keybuf, sizeof(keybuf), "key%d", i);
+		while (!database_aio_get(&aio, keybuf, aio_tally_cb, &tally)) {
+			database_aio_poll(&aio, 1);
+		}
+	}
+	database_aio_poll(&aio, database_aio_inflight(&aio));
+	CHECKIT(database_aio_inflight(&aio) == 0);
+	CHECKIT(tally.hits == 500);
+	CHECKIT(tally.misses == 100);
+	CHECKIT(tally.bad == 0);
+	database_aio_deinit(&aio);
+}
+
+static void test_database_aio(void) {
+	struct database db;
+	struct dbcfg cfg = {0, DBSTORE_IN_MEM};
+	CHECKIT(database_open(&db, "boof", NULL));
+	run_aio_round(&db);
+	database_close_and_remove(&db);
+	// stores without a file run each op synchronously
+	CHECKIT(database_open(&db, NULL, &cfg));
+	run_aio_round(&db);
+	database_close_and_remove(&db);
+
+	// a record cut short by the end of the file fails instead of reading stale bytes
+	struct database_aio aio;
+	struct aio_tally tally = {0, 0, 0};
+	char valbuf[300];
+	memset(valbuf, 'v', sizeof(valbuf) - 1);
+	valbuf[sizeof(valbuf) - 1] = '\0';
+	CHECKIT(database_open(&db, "boof", NULL));
+	CHECKIT(database_put(&db, "key-short", valbuf));
+	CHECKIT(database_aio_init(&aio, &db, 4));
+	// records the ring writes are stamped by the next checkpoint like any other
+	CHECKIT(database_checkpoint(&db));
+	CHECKIT(database_aio_put(&aio, "key-ring", valbuf, aio_tally_cb, &tally));
+	database_aio_poll(&aio, 1);
+	int32_t* ring_slot = database_find_slot(&db, "key-ring", 9, 0);
+	CHECKIT(tally.hits == 1 && ring_slot != NULL && dbfile_touched(&db.dbf, ring_slot[0]));
+	tally.hits = 0;
+	int32_t* slot = database_find_slot(&db, "key-short", 10, 0);
+	size_t page_size = db.dbf.page_size;
+	size_t hash_slot = hash_djb2("key-short") % database_get_hash_len(&db);
+	int32_t hash_block = database_get_hash_block(&db, hash_slot / db.slots_per_block);
+	size_t rec_off = ((size_t)slot[0] * page_size) + slot[1];
+	if (aio.use_ring && (size_t)hash_block * page_size + page_size <= rec_off) {
+		CHECKIT(ftruncate(db.dbf.fd, rec_off + 100) == 0);
+		CHECKIT(database_aio_get(&aio, "key-short", aio_tally_cb, &tally));
+		database_aio_poll(&aio, 1);
+		CHECKIT(tally.bad == 1 && tally.hits == 0);
+		CHECKIT(ftruncate(db.dbf.fd, db.dbf.page_count * page_size) == 0);
+	}
+	database_aio_deinit(&aio);
+	database_close_and_remove(&db);
+}
+
+static void snapshot_val(char* out, size_t i, const char* tag) {
+	// every other record is too long to be stored inline
+	sprintf(out, i % 2 ? "%s%zu" : "%s%zu-padded-past-the-inline-limit", tag, i);
+}
+
+struct snapshot_tally {
+	size_t count;
+	size_t bad;
+};
+
+static int snapshot_tally_cb(void* udata, const char* key, const char* val) {
+	struct snapshot_tally* tally = udata;
+	char expect[64];
+	snapshot_val(expect, strtoul(key + 1, NULL, 10), "v");
+	tally->bad += strcmp(val, expect) != 0;
+	++tally->count;
+	return 1;
+}
+
+static void test_database_snapshot(void) {
+	struct database db;
+	struct dbsnapshot old_snap;
+	struct dbsnapshot new_snap;
+	struct dbstats stats;
+	struct snapshot_tally tally = {0, 0};
+	struct dbcfg cfg = {0, DBSTORE_MEM_MAP, 0, 0, 0, 0, 24};
+	char keybuf[32];
+	char valbuf[64];
+	CHECKIT(database_open(&db, "boof", &cfg));
+	for (size_t i = 0; i < 200; ++i) {
+		sprintf(keybuf, "k%zu", i);
+		snapshot_val(valbuf, i, "v");
+		CHECKIT(database_put(&db, keybuf, valbuf));
+	}
+	size_t blocks = db.hash_pages.len;
+	CHECKIT(database_snapshot(&db, &old_snap));
+	for (size_t i = 0; i < 100; ++i) {
+		sprintf(keybuf, "k%zu", i);
+		snapshot_val(valbuf, i, "new");
+		CHECKIT(database_put(&db, keybuf, valbuf));
+	}
+	for (size_t i = 100; i < 150; ++i) {
+		sprintf(keybuf, "k%zu", i);
+		CHECKIT(database_del(&db, keybuf));
+	}
+	// enough new keys to make the live index expand under the snapshot
+	for (size_t i = 1000; i < 3000; ++i) {
+		sprintf(keybuf, "k%zu", i);
+		CHECKIT(database_put(&db, keybuf, "x"));
+	}
+	CHECKIT(db.hash_pages.len > blocks);
+	CHECKIT(database_snapshot_item_count(&old_snap) == 200);
+	CHECKIT(database_snapshot_scan(&old_snap, snapshot_tally_cb, &tally) == 200);
+	CHECKIT(tally.count == 200 && tally.bad == 0);
+	char* val = database_snapshot_get(&old_snap, "k120");
+	CHECKIT(val != NULL && strcmp(val, "v120-padded-past-the-inline-limit") == 0);
+	free(val);
+	CHECKIT(database_snapshot_get(&old_snap, "k1500") == NULL);
+	val = database_get(&db, "k1");
+	CHECKIT(val != NULL && strcmp(val, "new1") == 0);
+	free(val);
+	CHECKIT(database_get(&db, "k120") == NULL);
+
+	CHECKIT(database_snapshot(&db, &new_snap));
+	CHECKIT(database_del(&db, "k1"));
+	CHECKIT(database_put(&db, "k3", "newest"));
+	val = database_snapshot_get(&new_snap, "k1");
+	CHECKIT(val != NULL && strcmp(val, "new1") == 0);
+	free(val);
+	val = database_snapshot_get(&old_snap, "k1");
+	CHECKIT(val != NULL && strcmp(val, "v1") == 0);
+	free(val);
+	database_snapshot_release(&old_snap);
+	val = database_snapshot_get(&new_snap, "k3");
+	CHECKIT(val != NULL && strcmp(val, "new3") == 0);
+	free(val);
+	database_snapshot_release(&new_snap);
+	database_stats(&db, &stats);
+	CHECKIT(stats.cow_copies > 0);
+	CHECKIT(db.cow.frees_len == 0);
+	database_close(&db);
+
+	CHECKIT(database_open(&db, "boof", NULL));
+	CHECKIT(database_get(&db, "k1") == NULL);
+	val = database_get(&db, "k3");
+	CHECKIT(val != NULL && strcmp(val, "newest") == 0);
+	free(val);
+	CHECKIT(db.corrupt == 0);
+	database_close_and_remove(&db);
+}
+
+static void check_backup_keys(const char* path, size_t n_keys, size_t n_deleted) {
+	struct database db;
+	char keybuf[32];
+	CHECKIT(database_open(&db, path, NULL));
+	CHECKIT(db.corrupt == 0);
+	CHECKIT(database_get_item_count(&db) == (int64_t)(n_keys - n_deleted));
+	for (size_t i = 0; i < n_keys; ++i) {
+		sprintf(keybuf, "key%zu", i);
+		char* val = database_get(&db, keybuf);
+		CHECKIT(i < n_deleted ? val == NULL : val != NULL && strcmp(val, keybuf) == 0);
+		free(val);
+	}
+	database_close(&db);
+}
+
+static void test_database_backup(void) {
+	struct database db;
+	struct dbbackup bk;
+	char keybuf[32];
+	CHECKIT(database_open(&db, "boof", NULL));
+	for (size_t i = 0; i < 3000; ++i) {
+		sprintf(keybuf, "key%zu", i);
+		CHECKIT(database_put(&db, keybuf, keybuf));
+	}
+	// writes between steps end up in the copy
+	CHECKIT(database_backup_begin(&bk, &db, "boof.bak"));
+	size_t next_key = 3000;
+	while (database_backup_step(&bk, 4) == 1) {
+		for (size_t i = 0; i < 20; ++i, ++next_key) {
+			sprintf(keybuf, "key%zu", next_key);
+			CHECKIT(database_put(&db, keybuf, keybuf));
+		}
+	}
+	CHECKIT(database_backup_finish(&bk));
+	uint32_t gen = database_get_generation(&db);
+	CHECKIT(gen > 0);
+	check_backup_keys("boof.bak", next_key, 0);
+
+	for (size_t i = 0; i < 100; ++i) {
+		sprintf(keybuf, "key%zu", i);
+		CHECKIT(database_del(&db, keybuf));
+	}
+	for (size_t i = next_key; i < next_key + 500; ++i) {
+		sprintf(keybuf, "key%zu", i);
+		CHECKIT(database_put(&db, keybuf, keybuf));
+	}
+	next_key += 500;
+	CHECKIT(database_backup_delta(&db, "boof.delta", gen));
+	CHECKIT(file_size("boof.delta") < file_size("boof.bak"));
+	CHECKIT(database_apply_delta("boof.bak", "boof.delta"));
+	check_backup_keys("boof.bak", next_key, 100);
+	// a delta only applies on top of the generation it was taken from
+	CHECKIT(!database_apply_delta("boof.bak", "boof.delta"));
+	database_close_and_remove(&db);
+	remove("boof.bak");
+	remove("boof.delta");
+}
+
+static void builder_val(char* out, size_t i) {
+	// a mix of inline records and compressible storage records
+	if (i % 3 == 0) {
+		sprintf(out, "v%zu", i);
+	} else {
+		sprintf(out, "value-%zu-value-%zu-value-%zu", i, i, i);
+	}
+}
+
+static void check_built(const char* path, size_t n_keys, size_t dup_every) {
+	struct database db;
+	char keybuf[32];
+	char valbuf[96];
+	CHECKIT(database_open(&db, path, NULL));
+	CHECKIT(database_get_item_count(&db) == (int64_t)n_keys);
+	for (size_t i = 0; i < n_keys; ++i) {
+		sprintf(keybuf, "key%zu", i);
+		if (dup_every > 0 && i % dup_every == 0) {
+			sprintf(valbuf, "dup%zu", i);
+		} else {
+			builder_val(valbuf, i);
+		}
+		char* val = database_get(&db, keybuf);
+		CHECKIT(val != NULL && strcmp(val, valbuf) == 0);
+		free(val);
+	}
+	database_close_and_remove(&db);
+}
+
+static void test_dbbuilder(void) {
+	struct dbbuilder b;
+	struct dbcfg cfg = {0, DBSTORE_MEM_MAP, 0, 0, 0, 0, 24, 0, DBCODEC_LZ};
+	char keybuf[32];
+	char valbuf[96];
+	CHECKIT(dbbuilder_init(&b, "boof", &cfg));
+	for (size_t i = 0; i < 5000; ++i) {
+		sprintf(keybuf, "key%zu", i);
+		builder_val(valbuf, i);
+		CHECKIT(dbbuilder_add(&b, keybuf, valbuf));
+	}
+	// later duplicates win
+	for (size_t i = 0; i < 5000; i += 7) {
+		sprintf(keybuf, "key%zu", i);
+		sprintf(valbuf, "dup%zu", i);
+		CHECKIT(dbbuilder_add(&b, keybuf, valbuf));
+	}
+	CHECKIT(dbbuilder_finish(&b, 4));
+	check_built("boof", 5000, 7);
+
+	// a full index makes blocks overflow into their neighbours
+	struct dbcfg dense = {0, DBSTORE_MEM_MAP, 0, 0, 0, 0, 0, 0, DBCODEC_NONE, 1.0};
+	CHECKIT(!dbcfg_validate(&dense));
+	dense.max_load = 0.99;
+	CHECKIT(dbbuilder_init(&b, "boof", &dense));
+	for (size_t i = 0; i < 3000; ++i) {
+		sprintf(keybuf, "key%zu", i);
+		builder_val(valbuf, i);
+		CHECKIT(dbbuilder_add(&b, keybuf, valbuf));
+	}
+	CHECKIT(dbbuilder_finish(&b, 3));
+	check_built("boof", 3000, 0);
+}
+
+struct sharded_writer {
+	struct dbsharded* sd;
+	size_t first;
+	size_t last;
+};
+
+static void* sharded_write(void* arg) {
+	struct sharded_writer* w = arg;
+	char keybuf[32];
+	char valbuf[32];
+	for (size_t i = w->first; i < w->last; ++i) {
+		sprintf(keybuf, "key%zu", i);
+		sprintf(valbuf, "val%zu", i);
+		dbsharded_put(w->sd, keybuf, valbuf);
+	}
+	return NULL;
+}
+
+static int sharded_tally(void* udata, const char* key, const char* val) {
+	__atomic_add_fetch((size_t*)udata, strncmp(key, "key", 3) == 0 && strncmp(val, "val", 3) == 0, __ATOMIC_RELAXED);
+	return 1;
+}
+
+static void remove_sharded(const char* dir, size_t n_shards) {
+	char path[64];
+	for (size_t i = 0; i < n_shards; ++i) {
+		sprintf(path, "%s/shard-%04zu", dir, i);
+		remove(path);
+	}
+	sprintf(path, "%s/MANIFEST", dir);
+	remove(path);
+	rmdir(dir);
+}
+
+static void test_dbsharded(void) {
+	struct dbsharded sd;
+	struct sharded_writer writers[4];
+	pthread_t threads[4];
+	char keybuf[32];
+	char valbuf[32];
+	size_t tally = 0;
+	remove_sharded("boofdir", 4);
+	CHECKIT(dbsharded_open(&sd, "boofdir", 4, NULL, 0));
+	CHECKIT(sd.n_shards == 4);
+	for (size_t i = 0; i < 4; ++i) {
+		writers[i].sd = &sd;
+		writers[i].first = i * 2000;
+		writers[i].last = (i + 1) * 2000;
+		pthread_create(&threads[i], NULL, sharded_write, &writers[i]);
+	}
+	for (size_t i = 0; i < 4; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	CHECKIT(dbsharded_item_count(&sd) == 8000);
+	for (size_t i = 0; i < 4; ++i) {
+		// every shard gets a share of the keys
+		CHECKIT(database_get_item_count(dbsharded_shard(&sd, i)) > 1000);
+	}
+	for (size_t i = 0; i < 8000; i += 4) {
+		sprintf(keybuf, "key%zu", i);
+		CHECKIT(dbsharded_del(&sd, keybuf));
+	}
+	CHECKIT(dbsharded_scan(&sd, sharded_tally, &tally, 2) == 6000);
+	CHECKIT(tally == 6000);
+	dbsharded_pin(&sd, 0, 0);
+	CHECKIT(dbsharded_checkpoint(&sd, 0));
+	dbsharded_close(&sd, 3);
+
+	// the manifest keeps the shard count
+	CHECKIT(!dbsharded_open(&sd, "boofdir", 3, NULL, 0));
+	CHECKIT(dbsharded_open(&sd, "boofdir", 0, NULL, 1));
+	CHECKIT(sd.n_shards == 4);
+	CHECKIT(dbsharded_item_count(&sd) == 6000);
+	for (size_t i = 0; i < 8000; ++i) {
+		sprintf(keybuf, "key%zu", i);
+		sprintf(valbuf, "val%zu", i);
+		char* val = dbsharded_get(&sd, keybuf);
+		CHECKIT(i % 4 == 0 ? val == NULL : val != NULL && strcmp(val, valbuf) == 0);
+		free(val);
+	}
+	dbsharded_close(&sd, 0);
+	remove_sharded("boofdir", 4);
+}
+
+static size_t put_allocs(struct database* db, size_t first, size_t n, const char* val) {
+	char keybuf[32];
+	size_t before = _allocs;
+	for (size_t i = first; i < first + n; ++i) {
+		sprintf(keybuf, "key%zu", i);
+		CHECKIT(database_put(db, keybuf, val));
+	}
+	return _allocs - before;
+}
+
+static void test_database_put_no_alloc(void) {
+	struct database db;
+	struct dbcfg inline_cfg = {0, DBSTORE_MEM_MAP, 0, 0, 0, 0, 24};
+	struct dbcfg lz_cfg = {0, DBSTORE_MEM_MAP, 0, 0, 0, 0, 0, 0, DBCODEC_LZ};
+	const char* long_val = "a value that is too long to be stored inline in the slot, a value that is too long";
+	CHECKIT(database_open(&db, "boof", &inline_cfg));
+	CHECKIT(database_reserve(&db, 4000));
+	CHECKIT(database_reserve_storage(&db, 4000 * 128));
+	put_allocs(&db, 0, 100, long_val);
+	// storage records, inline records and frees reused by overwrites
+	CHECKIT(put_allocs(&db, 100, 1000, long_val) == 0);
+	CHECKIT(put_allocs(&db, 1100, 1000, "short") == 0);
+	CHECKIT(put_allocs(&db, 0, 1000, "another value that is too long to be stored inline in the slot") == 0);
+	database_close_and_remove(&db);
+
+	// encoded records are staged in a buffer that is reused once it is large enough
+	CHECKIT(database_open(&db, "boof", &lz_cfg));
+	CHECKIT(database_reserve(&db, 4000));
+	CHECKIT(database_reserve_storage(&db, 4000 * 128));
+	put_allocs(&db, 0, 100, long_val);
+	CHECKIT(put_allocs(&db, 100, 2000, long_val) == 0);
+	database_close_and_remove(&db);
+}
+
+static void test_database_shared(void) {
+	struct database db;
+	char keybuf[32];
+	char valbuf[32];
+	int status = 0;
+	remove("boof");
+	remove("boof.shm");
+	CHECKIT(database_open_shared(&db, "boof", NULL));
+	CHECKIT(database_shared_put(&db, "before", "fork"));
+	size_t blocks = db.hash_pages.len;
+	pid_t writer = fork();
+	if (writer == 0) {
+		struct database child;
+		int ok = database_open_shared(&child, "boof", NULL);
+		for (size_t i = 0; ok && i < 5000; ++i) {
+			sprintf(keybuf, "key%zu", i);
+			sprintf(valbuf, "val%zu", i);
+			ok = database_shared_put(&child, keybuf, valbuf);
+		}
+		if (ok) {
+			database_close(&child);
+		}
+		_exit(ok ? 0 : 1);
+	}
+	// reads go on while the other process writes and expands the index
+	size_t torn = 0;
+	while (waitpid(writer, &status, WNOHANG) == 0) {
+		char* val = database_shared_get(&db, "key10");
+		torn += val != NULL && strcmp(val, "val10") != 0;
+		free(val);
+	}
+	CHECKIT(torn == 0);
+	CHECKIT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	for (size_t i = 0; i < 5000; ++i) {
+		sprintf(keybuf, "key%zu", i);
+		sprintf(valbuf, "val%zu", i);
+		char* val = database_shared_get(&db, keybuf);
+		CHECKIT(val != NULL && strcmp(val, valbuf) == 0);
+		free(val);
+	}
+	CHECKIT(db.hash_pages.len > blocks);
+	CHECKIT(database_shared_del(&db, "key0"));
+	CHECKIT(database_get_item_count(&db) == 5000);
+
+	// a writer that dies holding the lock does not wedge the others
+	pid_t dead = fork();
+	if (dead == 0) {
+		struct database child;
+		if (database_open_shared(&child, "boof", NULL) && database_shared_lock(&child)) {
+			_exit(0);
+		}
+		_exit(1);
+	}
+	CHECKIT(waitpid(dead, &status, 0) == dead && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	CHECKIT(database_shared_put(&db, "after", "death"));
+	CHECKIT(db.shared->region->owner_deaths == 1);
+	// one that dies part way through a transaction has it finished by the next writer
+	dead = fork();
+	if (dead == 0) {
+		struct database child;
+		struct dbtxn txn;
+		int ok = database_open_shared(&child, "boof", NULL) && database_shared_lock(&child);
+		ok = ok && database_txn_begin(&child, &txn) && database_txn_put(&txn, "half1", "x");
+		ok = ok && database_txn_put(&txn, "half2", "y") && database_wal_append(&child, &txn);
+		ok = ok && database_put(&child, "half1", "x");
+		_exit(ok ? 0 : 1);
+	}
+	CHECKIT(waitpid(dead, &status, 0) == dead && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	// attaching under a live process finishes it without dropping the log
+	pid_t joiner = fork();
+	if (joiner == 0) {
+		struct database child;
+		int ok = database_open_shared(&child, "boof", NULL);
+		char* half = ok ? database_shared_get(&child, "half2") : NULL;
+		ok = half != NULL && strcmp(half, "y") == 0;
+		free(half);
+		_exit(ok ? 0 : 1);
+	}
+	CHECKIT(waitpid(joiner, &status, 0) == joiner && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	CHECKIT(database_shared_put(&db, "after", "death"));
+	CHECKIT(db.shared->region->owner_deaths == 2);
+	char* half = database_shared_get(&db, "half2");
+	CHECKIT(half != NULL && strcmp(half, "y") == 0);
+	free(half);
+	database_close(&db);
+	CHECKIT(db.shared == NULL);
+
+	CHECKIT(database_open(&db, "boof", NULL));
+	CHECKIT(database_get_item_count(&db) == 5003);
+	char* val = database_get(&db, "after");
+	CHECKIT(val != NULL && strcmp(val, "death") == 0);
+	free(val);
+	CHECKIT(db.corrupt == 0);
+	database_close_and_remove(&db);
+	remove("boof.shm");
+}
+
+static int check_val(struct database* db, const char* key, const char* expect) {
+	char* val = database_get(db, key);
+	int same = expect == NULL ? val == NULL : val != NULL && strcmp(val, expect) == 0;
+	free(val);
+	return same;
+}
+
+static void test_database_txn(void) {
+	struct database db;
+	struct dbtxn t1;
+	struct dbtxn t2;
+	int status = 0;
+	remove("boof");
+	remove("boof.wal");
+	CHECKIT(database_open(&db, "boof", NULL));
+	CHECKIT(database_put(&db, "gone", "soon"));
+	CHECKIT(database_txn_begin(&db, &t1));
+	CHECKIT(database_txn_put(&t1, "a", "1"));
+	CHECKIT(database_txn_put(&t1, "b", "2"));
+	CHECKIT(database_txn_del(&t1, "gone"));
+	// the transaction sees its own writes, the database does not yet
+	char* val = database_txn_get(&t1, "a");
+	CHECKIT(val != NULL && strcmp(val, "1") == 0);
+	free(val);
+	CHECKIT(database_txn_get(&t1, "gone") == NULL);
+	CHECKIT(check_val(&db, "a", NULL) && check_val(&db, "gone", "soon"));
+	CHECKIT(database_txn_commit(&t1));
+	CHECKIT(check_val(&db, "a", "1") && check_val(&db, "b", "2") && check_val(&db, "gone", NULL));
+
+	// two transactions read a, the second one to commit a write loses
+	CHECKIT(database_txn_begin(&db, &t1));
+	CHECKIT(database_txn_begin(&db, &t2));
+	free(database_txn_get(&t1, "a"));
+	free(database_txn_get(&t2, "a"));
+	CHECKIT(database_txn_put(&t2, "a", "t2"));
+	CHECKIT(database_txn_commit(&t2));
+	CHECKIT(database_txn_put(&t1, "a", "t1"));
+	CHECKIT(database_txn_put(&t1, "c", "t1"));
+	CHECKIT(!database_txn_commit(&t1));
+	CHECKIT(check_val(&db, "a", "t2") && check_val(&db, "c", NULL));
+	// a read of a missing key conflicts with its insert
+	CHECKIT(database_txn_begin(&db, &t1));
+	CHECKIT(database_txn_get(&t1, "c") == NULL);
+	CHECKIT(database_put(&db, "c", "put"));
+	CHECKIT(database_txn_put(&t1, "c", "t1"));
+	CHECKIT(!database_txn_commit(&t1));
+	// writes alone are never checked
+	CHECKIT(database_txn_begin(&db, &t1));
+	CHECKIT(database_txn_put(&t1, "c", "blind"));
+	CHECKIT(database_txn_commit(&t1));
+	CHECKIT(check_val(&db, "c", "blind"));
+	database_close(&db);
+	// a checkpoint empties the log
+	CHECKIT(file_size("boof.wal") == 0);
+
+	// a process that dies after logging a batch and applying part of it
+	pid_t child = fork();
+	if (child == 0) {
+		struct database cdb;
+		struct dbtxn txn;
+		int ok = database_open(&cdb, "boof", NULL) && database_txn_begin(&cdb, &txn);
+		ok = ok && database_txn_put(&txn, "x", "1") && database_txn_put(&txn, "y", "2");
+		ok = ok && database_txn_del(&txn, "a");
+		ok = ok && database_wal_append(&cdb, &txn) && database_put(&cdb, "x", "1");
+		_exit(ok ? 0 : 1);
+	}
+	CHECKIT(waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	// a record cut short never applies
+	FILE* fp = fopen("boof.wal", "a");
+	fwrite("khtx\1\0\0\0", 1, 8, fp);
+	fclose(fp);
+	CHECKIT(database_open(&db, "boof", NULL));
+	CHECKIT(check_val(&db, "x", "1") && check_val(&db, "y", "2") && check_val(&db, "a", NULL));
+	CHECKIT(check_val(&db, "b", "2") && check_val(&db, "c", "blind"));
+	database_close_and_remove(&db);
+	CHECKIT(!file_exists("boof.wal"));
+
+	// a crash after a commit does not replay it over later writes
+	child = fork();
+	if (child == 0) {
+		struct database cdb;
+		struct dbtxn txn;
+		int ok = database_open(&cdb, "boof", NULL) && database_txn_begin(&cdb, &txn);
+		ok = ok && database_txn_put(&txn, "k", "from-txn") && database_txn_put(&txn, "gone", "x");
+		ok = ok && database_txn_commit(&txn);
+		ok = ok && database_put(&cdb, "k", "later-put") && database_del(&cdb, "gone");
+		_exit(ok ? 0 : 1);
+	}
+	CHECKIT(waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	CHECKIT(database_open(&db, "boof", NULL));
+	CHECKIT(check_val(&db, "k", "later-put") && check_val(&db, "gone", NULL));
+	database_close_and_remove(&db);
+
+	// an op that fails to apply leaves the record to be finished, not half a commit
+	child = fork();
+	if (child == 0) {
+		struct database cdb;
+		struct dbtxn txn;
+		struct dbcfg cfg = {0, DBSTORE_MEM_MAP, 4096};
+		struct rlimit lim;
+		char valbuf[1000];
+		int ok = database_open(&cdb, "boof", &cfg);
+		memset(valbuf, 'v', sizeof(valbuf) - 1);
+		valbuf[sizeof(valbuf) - 1] = '\0';
+		for (int i = 0; ok && i < 300; ++i) {
+			char keybuf[32];
+			snprintf(keybuf, sizeof(keybuf), "k%d", i);
+			ok = database_put(&cdb, keybuf, valbuf);
+		}
+		// the freed extent takes the small put, the big one needs the file to grow
+		ok = ok && database_del(&cdb, "k0");
+		size_t big_size = cdb.dbf.alloc_size / 4;
+		char* big = malloc(big_size);
+		memset(big, 'b', big_size - 1);
+		big[big_size - 1] = '\0';
+		signal(SIGXFSZ, SIG_IGN);
+		getrlimit(RLIMIT_FSIZE, &lim);
+		struct rlimit capped = {cdb.dbf.alloc_size, lim.rlim_max};
+		ok = ok && setrlimit(RLIMIT_FSIZE, &capped) == 0 && database_txn_begin(&cdb, &txn);
+		ok = ok && database_txn_put(&txn, "p", "1") && database_txn_put(&txn, "big", big);
+		ok = ok && database_txn_commit(&txn) && cdb.wal_pending;
+		ok = ok && check_val(&cdb, "p", "1") && check_val(&cdb, "big", NULL);
+		// the next commit finishes it first
+		ok = ok && setrlimit(RLIMIT_FSIZE, &lim) == 0 && database_txn_begin(&cdb, &txn);
+		ok = ok && database_txn_put(&txn, "q", "1") && database_txn_commit(&txn) && !cdb.wal_pending;
+		ok = ok && check_val(&cdb, "big", big) && check_val(&cdb, "q", "1");
+		database_close_and_remove(&cdb);
+		free(big);
+		_exit(ok ? 0 : 1);
+	}
+	CHECKIT(waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	CHECKIT(!file_exists("boof.wal"));
+}
+
+static void test_database_conditional(void) {
+	struct database db;
+	struct dbstats stats;
+	struct dbsnapshot snap;
+	char big[200];
+	char longer[400];
+	memset(big, 'x', sizeof(big) - 1);
+	big[sizeof(big) - 1] = '\0';
+	CHECKIT(database_open(&db, "boof", NULL));
+	CHECKIT(database_put(&db, "k", "1"));
+	CHECKIT(database_put(&db, "k", "2"));
+	CHECKIT(database_get_item_count(&db) == 1);
+	CHECKIT(!database_put_if_absent(&db, "k", "3"));
+	CHECKIT(database_put_if_absent(&db, "n", "3"));
+	CHECKIT(check_val(&db, "k", "2") && check_val(&db, "n", "3"));
+	CHECKIT(!database_cas(&db, "k", "1", "4"));
+	CHECKIT(database_cas(&db, "k", "2", "4"));
+	CHECKIT(!database_cas(&db, "c", "2", "4"));
+	CHECKIT(!database_cas(&db, "k", NULL, "5"));
+	CHECKIT(database_cas(&db, "c", NULL, "5"));
+	CHECKIT(check_val(&db, "k", "4") && check_val(&db, "c", "5"));
+	CHECKIT(database_append(&db, "k", "56"));
+	CHECKIT(database_append(&db, "a", "new"));
+	CHECKIT(check_val(&db, "k", "456") && check_val(&db, "a", "new"));
+	CHECKIT(database_del(&db, "n"));
+	CHECKIT(database_put_if_absent(&db, "n", "again"));
+	CHECKIT(database_get_item_count(&db) == 4);
+
+	// records of the same or a smaller size reuse their extent
+	CHECKIT(database_put(&db, "big", big));
+	database_stats_reset(&db);
+	big[0] = 'y';
+	CHECKIT(database_put(&db, "big", big));
+	CHECKIT(database_cas(&db, "big", big, big + 100));
+	database_stats(&db, &stats);
+	CHECKIT(stats.in_place == 2 && stats.file.grows == 0);
+	CHECKIT(check_val(&db, "big", big + 100));
+	// not while a snapshot may still read the old record
+	CHECKIT(database_snapshot(&db, &snap));
+	CHECKIT(database_put(&db, "big", big + 101));
+	database_stats(&db, &stats);
+	CHECKIT(stats.in_place == 2);
+	char* val = database_snapshot_get(&snap, "big");
+	CHECKIT(val != NULL && strcmp(val, big + 100) == 0);
+	free(val);
+	database_snapshot_release(&snap);
+	CHECKIT(database_append(&db, "big", big));
+	CHECKIT(database_get_item_count(&db) == 5);
+	database_close(&db);
+	CHECKIT(database_open(&db, "boof", NULL));
+	snprintf(longer, sizeof(longer), "%s%s", big + 101, big);
+	CHECKIT(check_val(&db, "big", longer));
+	CHECKIT(database_get_item_count(&db) == 5);
+	database_close_and_remove(&db);
+}
+
+static void sleep_ms(long ms) {
+	struct timespec ts = {ms / 1000, (ms % 1000) * 1000000};
+	nanosleep(&ts, NULL);
+}
+
+static void test_database_expiry(void) {
+	struct database db;
+	struct dbstats stats;
+	struct dbcfg cfg = {0, DBSTORE_MEM_MAP, 0, 0};
+	struct scan_tally tally = {0};
+	char keybuf[32];
+	char big[100];
+	memset(big, 'b', sizeof(big) - 1);
+	big[sizeof(big) - 1] = '\0';
+	// files without expiry refuse a ttl
+	CHECKIT(database_open(&db, "boof", NULL));
+	CHECKIT(!database_put_ttl(&db, "k", "v", 10));
+	CHECKIT(database_sweep(&db, 0) == 0);
+	database_close_and_remove(&db);
+
+	cfg.expiry = 1;
+	cfg.inline_size = 16;
+	cfg.ordered_index = 1;
+	CHECKIT(database_open(&db, "boof", &cfg));
+	for (int i = 0; i < 500; ++i) {
+		snprintf(keybuf, sizeof(keybuf), "k%d", i);
+		CHECKIT(database_put_ttl(&db, keybuf, i % 2 ? big : "v", i < 300 ? 1 : 0));
+	}
+	CHECKIT(database_put_ttl(&db, "later", big, 60000));
+	CHECKIT(database_put_ttl(&db, "plain", "v", 1));
+	CHECKIT(database_put(&db, "plain", "kept"));
+	sleep_ms(5);
+	CHECKIT(check_val(&db, "k0", NULL) && check_val(&db, "k1", NULL) && check_val(&db, "k299", NULL));
+	CHECKIT(check_val(&db, "k300", "v") && check_val(&db, "k301", big));
+	CHECKIT(check_val(&db, "later", big) && check_val(&db, "plain", "kept"));
+	CHECKIT(!database_del(&db, "k2"));
+	// an expired key counts as absent, and is counted once when put again
+	CHECKIT(database_put_if_absent(&db, "k0", "back"));
+	CHECKIT(check_val(&db, "k0", "back"));
+	CHECKIT(database_get_item_count(&db) == 502);
+	database_close(&db);
+
+	// expiry times survive a reopen, and the sweep reclaims the rest
+	CHECKIT(database_open(&db, "boof", NULL));
+	CHECKIT(check_val(&db, "k1", NULL) && check_val(&db, "later", big));
+	size_t swept = 0;
+	while (swept < 299) {
+		size_t n = database_sweep(&db, 1);
+		CHECKIT(n <= 299 - swept);
+		swept += n;
+		sleep_ms(1);
+	}
+	CHECKIT(database_sweep(&db, 0) == 0);
+	database_stats(&db, &stats);
+	CHECKIT(stats.swept == 299);
+	CHECKIT(database_get_item_count(&db) == 203);
+	CHECKIT(check_val(&db, "k0", "back") && check_val(&db, "k300", "v") && check_val(&db, "k1", NULL));
+	// swept records leave the ordered index too
+	CHECKIT(database_range(&db, NULL, NULL, scan_tally_cb, &tally) == 203);
+	database_close_and_remove(&db);
+
+	// an inline record running into the expiry time is damage to the analyzer
+	struct dbanalysis res;
+	cfg.ordered_index = 0;
+	CHECKIT(database_open(&db, "boof", &cfg));
+	CHECKIT(database_put(&db, "k", "v"));
+	int32_t* slot = database_find_slot(&db, "k", 2, 0);
+	CHECKIT(slot != NULL && _is_inline_slot(slot));
+	int32_t val_size = slot[2];
+	slot[2] = (int32_t)db.inline_cap - slot[1] + 4;
+	CHECKIT(database_analyze(&db, &res, 0) && res.bad_slots == 1);
+	slot[2] = val_size;
+	CHECKIT(database_analyze(&db, &res, 0) && res.bad_slots == 0);
+	database_close_and_remove(&db);
+}
+
+static void test_database_capacity(void) {
+	struct database db;
+	struct dbstats stats;
+	struct dbcfg cfg = {0, DBSTORE_MEM_MAP, 0, 0};
+	char keybuf[32];
+	char val[200];
+	memset(val, 'v', sizeof(val) - 1);
+	val[sizeof(val) - 1] = '\0';
+	cfg.capacity = 1 << 20;
+	CHECKIT(database_open(&db, "boof", &cfg));
+	CHECKIT(database_put(&db, "hot", val));
+	for (int i = 0; i < 20000; ++i) {
+		snprintf(keybuf, sizeof(keybuf), "k%d", i);
+		CHECKIT(database_put(&db, keybuf, val));
+		// a key that keeps being read stays in the cache
+		if (i % 100 == 0) {
+			CHECKIT(check_val(&db, "hot", val));
+		}
+	}
+	database_stats(&db, &stats);
+	CHECKIT(stats.evictions > 0);
+	CHECKIT(database_get_item_count(&db) == 20001 - (int64_t)stats.evictions);
+	CHECKIT(db.dbf.page_count * db.dbf.page_size <= cfg.capacity + (cfg.capacity / 4));
+	CHECKIT(check_val(&db, "hot", val) && check_val(&db, "k19999", val) && check_val(&db, "k0", NULL));
+	database_close_and_remove(&db);
+}
+
+static void test_database_bloom(void) {
+	struct database db;
+	struct dbstats stats;
+	struct dbbuilder b;
+	struct dbcfg cfg = {0, DBSTORE_MEM_MAP, 0, 0};
+	char keybuf[32];
+	cfg.bloom_bits = 65;
+	CHECKIT(!dbcfg_validate(&cfg));
+	cfg.bloom_bits = 10;
+	CHECKIT(database_open(&db, "boof", &cfg));
+	// the filter is rebuilt with every expansion on the way
+	for (int i = 0; i < 5000; ++i) {
+		snprintf(keybuf, sizeof(keybuf), "k%d", i);
+		CHECKIT(database_put(&db, keybuf, keybuf));
+	}
+	for (int i = 0; i < 5000; i += 2) {
+		snprintf(keybuf, sizeof(keybuf), "k%d", i);
+		CHECKIT(database_del(&db, keybuf));
+	}
+	database_close(&db);
+	CHECKIT(database_open(&db, "boof", NULL));
+	database_stats_reset(&db);
+	for (int i = 0; i < 5000; ++i) {
+		snprintf(keybuf, sizeof(keybuf), "k%d", i);
+		CHECKIT(check_val(&db, keybuf, i % 2 ? keybuf : NULL));
+		snprintf(keybuf, sizeof(keybuf), "miss%d", i);
+		CHECKIT(check_val(&db, keybuf, NULL));
+	}
+	database_stats(&db, &stats);
+	// deleted keys stay in the filter, keys never put mostly do not
+	CHECKIT(stats.bloom_skips >= 4800 && stats.bloom_skips < 7500);
+	database_close_and_remove(&db);
+
+	// a built file fills the filter too
+	CHECKIT(dbbuilder_init(&b, "boof", &cfg));
+	for (int i = 0; i < 3000; ++i) {
+		snprintf(keybuf, sizeof(keybuf), "k%d", i);
+		CHECKIT(dbbuilder_add(&b, keybuf, keybuf));
+	}
+	CHECKIT(dbbuilder_finish(&b, 2));
+	CHECKIT(database_open(&db, "boof", NULL));
+	for (int i = 0; i < 3000; ++i) {
+		snprintf(keybuf, sizeof(keybuf), "k%d", i);
+		CHECKIT(check_val(&db, keybuf, keybuf));
+	}
+	database_close_and_remove(&db);
+}
+
+static int32_t slot_block(struct database* db, const int32_t* slot) {
+	for (size_t i = 0; i < db->hash_pages.len; ++i) {
+		const char* page = dbfile_get_page(&db->dbf, db->hash_pages.pages[i]);
+		if ((const char*)slot >= page && (const char*)slot < page + db->dbf.page_size) {
+			return (int32_t)i;
+		}
+	}
+	return -1;
+}
+
+static void test_database_overflow_put(void) {
+	struct database db;
+	struct dbcfg cfg = {128, DBSTORE_IN_MEM};
+	char keybuf[32];
+	char other[32];
+	int done = 0;
+	CHECKIT(database_open(&db, NULL, &cfg));
+	for (int i = 0; i < 300; ++i) {
+		snprintf(keybuf, sizeof(keybuf), "key%d", i);
+		CHECKIT(database_put(&db, keybuf, "old"));
+	}
+	// a key that overflowed out of its home block, and one living there
+	for (int i = 0; i < 300 && !done; ++i) {
+		snprintf(keybuf, sizeof(keybuf), "key%d", i);
+		int32_t home = (int32_t)((hash_djb2(keybuf) % database_get_hash_len(&db)) / db.slots_per_block);
+		if (slot_block(&db, database_find_slot(&db, keybuf, strlen(keybuf) + 1, 0)) == home) {
+			continue;
+		}
+		for (int k = 0; k < 300 && !done; ++k) {
+			snprintf(other, sizeof(other), "key%d", k);
+			done = slot_block(&db, database_find_slot(&db, other, strlen(other) + 1, 0)) == home;
+		}
+	}
+	CHECKIT(done);
+	// the deleted slot in the home block must not take a second copy of the key
+	CHECKIT(database_del(&db, other));
+	CHECKIT(!database_put_if_absent(&db, keybuf, "dup"));
+	CHECKIT(!database_cas(&db, keybuf, NULL, "dup"));
+	CHECKIT(database_put(&db, keybuf, "new"));
+	CHECKIT(check_val(&db, keybuf, "new"));
+	CHECKIT(database_get_item_count(&db) == 299);
+	CHECKIT(database_del(&db, keybuf));
+	CHECKIT(check_val(&db, keybuf, NULL));
+	database_close_and_remove(&db);
+}
+
+static void test_database_get_batch(void) {
+	struct database db;
+	struct dbcfg cfg = {0, DBSTORE_MEM_MAP, 0, 0, 0, 0, 24};
+	char keybufs[200][32];
+	const char* keys[200];
+	char* vals[200];
+	for (int i = 0; i < 200; ++i) {
+		// short keys go inline, long ones to storage, odd ones are missing
+		if (i % 4 < 2) {
+			snprintf(keybufs[i], sizeof(keybufs[i]), "b%d", i);
+		} else {
+			snprintf(keybufs[i], sizeof(keybufs[i]), "batch-key-long-%d", i);
+		}
+		keys[i] = keybufs[i];
+	}
+	for (int pass = 0; pass < 2; ++pass) {
+		cfg.bloom_bits = pass ? 10 : 0;
+		CHECKIT(database_open(&db, "batf", &cfg));
+		for (int i = 0; i < 200; i += 2) {
+			CHECKIT(database_put(&db, keys[i], keys[i]));
+		}
+		CHECKIT(database_get_batch(&db, keys, 0, vals) == 0);
+		// windows are not a multiple of the batch size
+		CHECKIT(database_get_batch(&db, keys, 199, vals) == 100);
+		for (int i = 0; i < 199; ++i) {
+			CHECKIT(i % 2 ? vals[i] == NULL : strcmp(vals[i], keys[i]) == 0);
+			free(vals[i]);
+		}
+		database_close_and_remove(&db);
+	}
+}
+
 int main(int argc, char const *argv[])
 {
 	test_djb2_n();
@@ -425,6 +2007,8 @@ int main(int argc, char const *argv[])
 	test_dbfile_cmp();
 	test_dbfile_hash_null();
 	test_dbfile_grow();
+	test_dbfile_grow_chunk();
+	test_dbfile_map_budget();
 	test_database_open_close();
 	test_database_add_hash_block();
 	test_database_add_space();
@@ -437,8 +2021,40 @@ int main(int argc, char const *argv[])
 	test_database_hash_and_probe();
 	test_database_put_get_del();
 	test_database_put_get_reopen();
+	test_database_page_count_reopen();
 	test_database_load_factor();
 	test_database_expand();
+	test_database_expand_contiguous();
 	test_database_put_load_fact_expand();
+	test_database_load_policy();
+	test_database_presized();
+	test_database_reserve();
+	test_database_put_no_alloc();
+	test_database_inline();
+	test_database_ordered();
+	test_database_add_ordered_index();
+	test_dbcodec_lz();
+	test_database_codec();
+	test_crc32c();
+	test_database_checksums();
+	test_database_bad_storage_ptr();
+	test_dbhist();
+	test_database_stats();
+	test_database_analyze();
+	test_database_snapshot();
+	test_database_backup();
+	test_dbbuilder();
+	test_dbsharded();
+	test_database_shared();
+	test_database_txn();
+	test_database_conditional();
+	test_database_expiry();
+	test_database_capacity();
+	test_database_bloom();
+	test_database_get_batch();
+	test_database_overflow_put();
+	test_database_in_mem();
+	test_database_in_mem_save_load();
+	test_database_aio();
 	return _failures > 0 ? 3 : 0;
 }
\ No newline at end of file
@@ -0,0 +1,96 @@
+#include "kamoodb.h"
+
+// kamoo_analyze
+// Reports how the hash index of a database file is laid out, to help pick
+// a factor limit. The file is mapped read only and the hash blocks are
+// split across threads.
+//
+// usage: kamoo_analyze [-j threads] <file>
+
+static uint64_t micro_stamp(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000) + ((uint64_t)ts.tv_nsec / 1000);
+}
+
+static double percent(size_t part, size_t whole) {
+	return whole > 0 ? (100.0 * (double)part) / (double)whole : 0.0;
+}
+
+static size_t probe_percentile(const struct dbanalysis* res, double p) {
+	uint64_t want = (uint64_t)(p * (double)res->used + 0.5);
+	uint64_t seen = 0;
+	for (size_t i = 0; i < DBANALYZE_PROBE_BUCKETS; ++i) {
+		seen += res->probe_hist[i];
+		if (seen >= want && seen > 0) {
+			return i + 1;
+		}
+	}
+	return res->probe_max;
+}
+
+int main(int argc, char const *argv[])
+{
+	size_t n_threads = 0;
+	const char* path = NULL;
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			n_threads = strtoul(argv[++i], NULL, 10);
+		} else {
+			path = argv[i];
+		}
+	}
+	if (path == NULL) {
+		fprintf(stderr, "usage: %s [-j threads] <file>\n", argv[0]);
+		return 2;
+	}
+	struct dbview view;
+	struct dbanalysis res;
+	if (!dbview_open(&view, path)) {
+		fprintf(stderr, "%s: not a database file\n", path);
+		return 1;
+	}
+	uint64_t start = micro_stamp();
+	dbview_analyze(&view, &res, n_threads);
+	uint64_t elapsed = micro_stamp() - start;
+
+	printf("%s: %zu pages of %zu bytes, analyzed in %.3fs\n", path, view.page_count, view.page_size,
+	       (double)elapsed / 1000000.0);
+	printf("items %lld, max load %.3f\n", (long long)res.item_count, res.max_load);
+	printf("\nhash index\n");
+	printf("  blocks %zu, slots %zu, slot size %zu\n", res.blocks, res.slots, view.slot_size);
+	printf("  used %zu (load %.3f), tombstones %zu (%.1f%%), inline %zu\n", res.used,
+	       res.slots > 0 ? (double)res.used / res.slots : 0.0, res.tombstones, percent(res.tombstones, res.slots),
+	       res.inline_records);
+	printf("  per block used min %zu max %zu mean %.1f\n", res.block_min_used, res.block_max_used,
+	       res.blocks > 0 ? (double)res.used / res.blocks : 0.0);
+	printf("  block fill:");
+	for (size_t i = 0; i < DBANALYZE_FILL_BUCKETS; ++i) {
+		printf(" %zu%%:%zu", i * 10, res.fill_hist[i]);
+	}
+	printf("\n");
+	if (res.bad_slots > 0) {
+		printf("  bad slots %zu\n", res.bad_slots);
+	}
+	printf("\nprobe length of present keys\n");
+	printf("  mean %.2f, p50 %zu, p90 %zu, p99 %zu, max %zu\n", res.used > 0 ? (double)res.probe_sum / res.used : 0.0,
+	       probe_percentile(&res, 0.5), probe_percentile(&res, 0.9), probe_percentile(&res, 0.99), res.probe_max);
+	printf("  overflowed home block %zu (%.2f%%)\n", res.overflow, percent(res.overflow, res.used));
+	for (size_t i = 0; i < DBANALYZE_PROBE_BUCKETS; ++i) {
+		if (res.probe_hist[i] > 0) {
+			printf("  %s%zu: %llu\n", i + 1 == DBANALYZE_PROBE_BUCKETS ? ">=" : "", i + 1,
+			       (unsigned long long)res.probe_hist[i]);
+		}
+	}
+	printf("\nfree list\n");
+	printf("  extents %zu, bytes %llu, largest %zu, mean %.1f\n", res.free_extents,
+	       (unsigned long long)res.free_bytes, res.free_largest,
+	       res.free_extents > 0 ? (double)res.free_bytes / res.free_extents : 0.0);
+	for (size_t i = 0; i < DBANALYZE_FREE_BUCKETS; ++i) {
+		if (res.free_hist[i] > 0) {
+			printf("  [%llu, %llu): %zu\n", 1ULL << i, 1ULL << (i + 1), res.free_hist[i]);
+		}
+	}
+	dbview_close(&view);
+	return 0;
+}
@@ -0,0 +1,106 @@
+#include "kamoodb.h"
+
+// kamoo_build
+// Builds a database file from tab separated key value lines, one record
+// per line. Later lines win over earlier ones with the same key. Input
+// is read from stdin when no input file is given.
+//
+// usage: kamoo_build [-j threads] [-i inline size] [-c none|lz|deflate] [-o] <out file> [input]
+
+static uint64_t micro_stamp(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000) + ((uint64_t)ts.tv_nsec / 1000);
+}
+
+static int parse_codec(const char* name, enum dbcodec_type* out) {
+	if (strcmp(name, "none") == 0) {
+		*out = DBCODEC_NONE;
+	} else if (strcmp(name, "lz") == 0) {
+		*out = DBCODEC_LZ;
+	} else if (strcmp(name, "deflate") == 0) {
+		*out = DBCODEC_DEFLATE;
+	} else {
+		return 0;
+	}
+	return 1;
+}
+
+int main(int argc, char const *argv[])
+{
+	size_t n_threads = 0;
+	const char* out_path = NULL;
+	const char* in_path = NULL;
+	struct dbcfg cfg;
+	memset(&cfg, 0, sizeof(cfg));
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			n_threads = strtoul(argv[++i], NULL, 10);
+		} else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+			cfg.inline_size = strtoul(argv[++i], NULL, 10);
+		} else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+			if (!parse_codec(argv[++i], &cfg.codec)) {
+				fprintf(stderr, "unknown codec %s\n", argv[i]);
+				return 2;
+			}
+		} else if (strcmp(argv[i], "-o") == 0) {
+			cfg.ordered_index = 1;
+		} else if (out_path == NULL) {
+			out_path = argv[i];
+		} else {
+			in_path = argv[i];
+		}
+	}
+	if (out_path == NULL) {
+		fprintf(stderr, "usage: %s [-j threads] [-i inline size] [-c none|lz|deflate] [-o] <out file> [input]\n", argv[0]);
+		return 2;
+	}
+	FILE* in = in_path != NULL ? fopen(in_path, "r") : stdin;
+	if (in == NULL) {
+		fprintf(stderr, "%s: cannot open\n", in_path);
+		return 1;
+	}
+	struct dbbuilder b;
+	if (!dbbuilder_init(&b, out_path, &cfg)) {
+		fprintf(stderr, "invalid configuration\n");
+		return 2;
+	}
+	char* line = NULL;
+	size_t line_cap = 0;
+	ssize_t line_len = 0;
+	size_t skipped = 0;
+	size_t in_bytes = 0;
+	uint64_t start = micro_stamp();
+	while ((line_len = getline(&line, &line_cap, in)) != -1) {
+		in_bytes += line_len;
+		if (line_len > 0 && line[line_len - 1] == '\n') {
+			line[--line_len] = '\0';
+		}
+		char* tab = strchr(line, '\t');
+		if (tab == NULL || tab == line) {
+			++skipped;
+			continue;
+		}
+		*tab = '\0';
+		if (!dbbuilder_add(&b, line, tab + 1)) {
+			fprintf(stderr, "out of memory after %zu records\n", b.n_recs);
+			dbbuilder_deinit(&b);
+			return 1;
+		}
+	}
+	free(line);
+	if (in != stdin) {
+		fclose(in);
+	}
+	size_t n_recs = b.n_recs;
+	uint64_t loaded = micro_stamp();
+	if (!dbbuilder_finish(&b, n_threads)) {
+		fprintf(stderr, "%s: build failed\n", out_path);
+		return 1;
+	}
+	uint64_t built = micro_stamp();
+	printf("%zu records (%zu lines skipped), read in %.3fs, built in %.3fs, %.1fMB/s\n", n_recs, skipped,
+	       (double)(loaded - start) / 1000000.0, (double)(built - loaded) / 1000000.0,
+	       built > loaded ? (double)in_bytes / (double)(built - loaded) : 0.0);
+	return 0;
+}
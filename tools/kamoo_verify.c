@@ -0,0 +1,231 @@
+#include <pthread.h>
+#include "kamoodb.h"
+
+// kamoo_verify
+// Scrubs a database file without opening it for writing. Every page is read
+// in large chunks split across threads, pages with a checksum from the last
+// checkpoint are checked against it, and every hash slot is bounds checked.
+//
+// usage: kamoo_verify [-j threads] <file>
+// exits 0 if the file is sound, 1 if anything failed and 2 on bad usage
+
+#define VERIFY_CHUNK_SIZE (1024 * 1024)
+
+enum {
+	PAGE_HAS_CSUM = 1,
+	PAGE_IS_HASH = 2
+};
+
+struct verify_file {
+	int fd;
+	size_t page_size;
+	size_t page_count;
+	size_t slot_size;
+	// the slot bytes dbslot_valid checks, without a trailing expiry time
+	size_t check_size;
+	uint32_t* csums;
+	unsigned char* kinds;
+};
+
+struct verify_job {
+	struct verify_file* vf;
+	pthread_t thread;
+	size_t first;
+	size_t last;
+	size_t pages_read;
+	size_t csum_ok;
+	size_t csum_bad;
+	size_t bad_slots;
+	size_t io_errors;
+};
+
+static uint64_t micro_stamp(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000) + ((uint64_t)ts.tv_nsec / 1000);
+}
+
+static int read_page(struct verify_file* vf, size_t page, char* buf) {
+	return pread(vf->fd, buf, vf->page_size, page * vf->page_size) == (ssize_t)vf->page_size;
+}
+
+static void verify_page(struct verify_job* job, size_t page, const char* data) {
+	struct verify_file* vf = job->vf;
+	if (vf->kinds[page] & PAGE_HAS_CSUM) {
+		if (crc32c(0, data, vf->page_size) == vf->csums[page]) {
+			++job->csum_ok;
+		} else {
+			++job->csum_bad;
+			fprintf(stderr, "page %zu: checksum mismatch\n", page);
+		}
+	}
+	if (vf->kinds[page] & PAGE_IS_HASH) {
+		size_t per_block = (vf->page_size - HASH_BLOCK_HEADER_SIZE) / vf->slot_size;
+		for (size_t i = 0; i < per_block; ++i) {
+			int32_t slot[3];
+			memcpy(slot, data + HASH_BLOCK_HEADER_SIZE + (i * vf->slot_size), sizeof(slot));
+			if (!dbslot_valid(slot, vf->check_size, vf->page_size, vf->page_count)) {
+				++job->bad_slots;
+				fprintf(stderr, "page %zu slot %zu: bad storage pointer [%d, %d, %d]\n",
+				        page, i, slot[0], slot[1], slot[2]);
+			}
+		}
+	}
+}
+
+static void* verify_run(void* arg) {
+	struct verify_job* job = arg;
+	struct verify_file* vf = job->vf;
+	size_t chunk_pages = VERIFY_CHUNK_SIZE / vf->page_size;
+	chunk_pages = chunk_pages > 0 ? chunk_pages : 1;
+	char* buf = malloc(chunk_pages * vf->page_size);
+	for (size_t page = job->first; page < job->last; page += chunk_pages) {
+		size_t n = job->last - page > chunk_pages ? chunk_pages : job->last - page;
+		ssize_t got = pread(vf->fd, buf, n * vf->page_size, page * vf->page_size);
+		if (got != (ssize_t)(n * vf->page_size)) {
+			++job->io_errors;
+			fprintf(stderr, "pages %zu-%zu: read failed\n", page, page + n - 1);
+			continue;
+		}
+		for (size_t i = 0; i < n; ++i) {
+			verify_page(job, page + i, buf + (i * vf->page_size));
+		}
+		job->pages_read += n;
+	}
+	free(buf);
+	return NULL;
+}
+
+// Marks the pages listed in the checksum table, returns 0 if the chain is broken
+static int load_checksums(struct verify_file* vf, int32_t csum_iter) {
+	char* page = malloc(vf->page_size);
+	size_t seen = 0;
+	while (csum_iter > 0) {
+		if ((size_t)csum_iter >= vf->page_count || ++seen > vf->page_count || !read_page(vf, csum_iter, page)) {
+			free(page);
+			return 0;
+		}
+		int32_t* reader = (int32_t*)page;
+		int32_t* entry = reader + (CSUM_BLOCK_HEADER_SIZE / sizeof(int32_t));
+		for (int32_t i = 0; i < reader[1]; ++i, entry += 2) {
+			if (entry[0] > 0 && (size_t)entry[0] < vf->page_count) {
+				vf->csums[entry[0]] = (uint32_t)entry[1];
+				vf->kinds[entry[0]] |= PAGE_HAS_CSUM;
+			}
+		}
+		csum_iter = reader[0];
+	}
+	free(page);
+	return 1;
+}
+
+static int mark_hash_pages(struct verify_file* vf, int32_t hash_iter) {
+	size_t seen = 0;
+	while (hash_iter != -1) {
+		if (hash_iter <= 0 || (size_t)hash_iter >= vf->page_count || ++seen > vf->page_count) {
+			return 0;
+		}
+		vf->kinds[hash_iter] |= PAGE_IS_HASH;
+		if (pread(vf->fd, &hash_iter, sizeof(hash_iter), (size_t)hash_iter * vf->page_size) != sizeof(hash_iter)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int main(int argc, char const *argv[])
+{
+	size_t n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	const char* path = NULL;
+	int failed = 0;
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			n_threads = strtoul(argv[++i], NULL, 10);
+		} else {
+			path = argv[i];
+		}
+	}
+	if (path == NULL || n_threads == 0) {
+		fprintf(stderr, "usage: %s [-j threads] <file>\n", argv[0]);
+		return 2;
+	}
+	struct verify_file vf;
+	char head[DB_HEADER_CSUM_OFF + sizeof(uint32_t)];
+	vf.fd = open(path, O_RDONLY);
+	if (vf.fd == -1 || pread(vf.fd, head, sizeof(head), 0) != sizeof(head) || !_has_magic_seq(head)) {
+		fprintf(stderr, "%s: not a database file\n", path);
+		return 1;
+	}
+	// a damaged or truncated header must not get as far as the divisions below
+	int32_t page_size = *(int32_t*)(head + DB_HEADER_PAGE_SIZE_OFF);
+	if (page_size < (int32_t)sizeof(head) || (page_size & (page_size - 1)) != 0) {
+		fprintf(stderr, "%s: not a database file\n", path);
+		return 1;
+	}
+	vf.page_size = (size_t)page_size;
+	int64_t header_pages = *(int64_t*)(head + DB_HEADER_PAGE_COUNT_OFF);
+	size_t file_pages = file_size(path) / vf.page_size;
+	vf.page_count = header_pages > 0 && (size_t)header_pages <= file_pages ? (size_t)header_pages : file_pages;
+	if (vf.page_count == 0) {
+		fprintf(stderr, "%s: not a database file\n", path);
+		return 1;
+	}
+	vf.slot_size = *(int32_t*)(head + DB_HEADER_SLOT_SIZE_OFF);
+	vf.slot_size = vf.slot_size > 0 ? vf.slot_size : HASHSTORAGE_PTR_SIZE;
+	vf.csums = calloc(vf.page_count, sizeof(uint32_t));
+	vf.kinds = calloc(vf.page_count, 1);
+
+	char* header = malloc(vf.page_size);
+	read_page(&vf, 0, header);
+	int expiry = DB_HEADER_EXPIRY_OFF + sizeof(int32_t) <= vf.page_size && *(int32_t*)(header + DB_HEADER_EXPIRY_OFF) == 1;
+	vf.check_size = expiry && vf.slot_size > sizeof(uint64_t) ? vf.slot_size - sizeof(uint64_t) : vf.slot_size;
+	if (*(int32_t*)(header + DB_HEADER_CLEAN_OFF) == 1) {
+		if (dbheader_crc(header, vf.page_size) != *(uint32_t*)(header + DB_HEADER_CSUM_OFF)) {
+			fprintf(stderr, "header: checksum mismatch\n");
+			failed = 1;
+		} else if (!load_checksums(&vf, *(int32_t*)(header + DB_HEADER_CSUM_ROOT_OFF))) {
+			fprintf(stderr, "checksum table: broken chain\n");
+			failed = 1;
+		}
+	} else {
+		printf("%s was not closed cleanly, only checking storage pointers\n", path);
+	}
+	if (!mark_hash_pages(&vf, *(int32_t*)(header + sizeof(MAGIC_SEQ)))) {
+		fprintf(stderr, "hash index: broken chain\n");
+		failed = 1;
+	}
+	free(header);
+
+	n_threads = n_threads > vf.page_count ? vf.page_count : n_threads;
+	struct verify_job* jobs = calloc(n_threads, sizeof(struct verify_job));
+	size_t per_thread = (vf.page_count + n_threads - 1) / n_threads;
+	uint64_t start = micro_stamp();
+	for (size_t i = 0; i < n_threads; ++i) {
+		jobs[i].vf = &vf;
+		jobs[i].first = i * per_thread;
+		jobs[i].last = jobs[i].first + per_thread > vf.page_count ? vf.page_count : jobs[i].first + per_thread;
+		pthread_create(&jobs[i].thread, NULL, verify_run, &jobs[i]);
+	}
+	struct verify_job total;
+	memset(&total, 0, sizeof(total));
+	for (size_t i = 0; i < n_threads; ++i) {
+		pthread_join(jobs[i].thread, NULL);
+		total.pages_read += jobs[i].pages_read;
+		total.csum_ok += jobs[i].csum_ok;
+		total.csum_bad += jobs[i].csum_bad;
+		total.bad_slots += jobs[i].bad_slots;
+		total.io_errors += jobs[i].io_errors;
+	}
+	uint64_t elapsed = micro_stamp() - start;
+	double mb = (double)(total.pages_read * vf.page_size) / (1024.0 * 1024.0);
+	printf("%zu pages read with %zu threads, %.1f MB/s\n", total.pages_read, n_threads,
+	       elapsed > 0 ? mb / ((double)elapsed / 1000000.0) : 0.0);
+	printf("checksums: %zu ok, %zu bad\n", total.csum_ok, total.csum_bad);
+	printf("bad storage pointers: %zu, read errors: %zu\n", total.bad_slots, total.io_errors);
+	failed = failed || total.csum_bad > 0 || total.bad_slots > 0 || total.io_errors > 0;
+	free(jobs);
+	free(vf.csums);
+	free(vf.kinds);
+	close(vf.fd);
+	return failed ? 1 : 0;
+}